@@ -3,13 +3,15 @@ use pku::*;
 #[global_allocator]
 static GLOBAL: GlobalDlmalloc = GlobalDlmalloc;
 
+// The first key pkey_alloc hands out
+#[pku::domain(1)]
 fn func() {
     let _ = Box::new(5);
 }
 
 fn main() {
     let domain = Domain::create_domain(0);
-    pku::register_pku_call(func as *const (), domain);
+    assert_eq!(domain, func::DOMAIN);
     pku::pkucall!(func());
     println!("rdpkru = 0x{:x}", Domain::rdpkru());
 }
@@ -0,0 +1,150 @@
+//! Microbenchmarks of the isolation primitives, the Rust side of
+//! `pkuc/bench.c`, printing the same lines:
+//!
+//! ```text
+//! name    time: [min median max] ns/iter
+//! ```
+//!
+//! For wasm, build with `cargo build --release --benches --target
+//! wasm32-wasi` and run the bench module under Wasmtime, optionally with a
+//! filter argument. Natively, `cargo bench` times the same code with the
+//! hostcalls stubbed out, which leaves the allocator and the call sequence.
+
+use pku::{pkucall, Domain, DomainAlloc, DomainRange, GlobalDlmalloc};
+use std::alloc::{GlobalAlloc, Layout};
+use std::hint::black_box;
+use std::time::{Duration, Instant};
+
+#[global_allocator]
+static A: GlobalDlmalloc = GlobalDlmalloc;
+
+const SAMPLES: usize = 20;
+const SAMPLE_TIME: Duration = Duration::from_millis(10);
+const MAX_ITERS: u64 = 1 << 24;
+
+/// The domain the benchmarks switch into, created first so it gets key 1
+const DOMAIN: usize = 1;
+
+/// Time `f`, doubling the iterations of a sample until one takes long
+/// enough or `max_iters` is reached.
+fn bench(filter: &Option<String>, name: &str, max_iters: u64, mut f: impl FnMut(u64)) {
+    if filter
+        .as_ref()
+        .map_or(false, |filter| !name.contains(filter.as_str()))
+    {
+        return;
+    }
+
+    let mut iters = 1;
+    loop {
+        let start = Instant::now();
+        f(iters);
+        if start.elapsed() >= SAMPLE_TIME / 4 || iters * 2 > max_iters {
+            break;
+        }
+        iters *= 2;
+    }
+
+    let mut samples = [0.0; SAMPLES];
+    for sample in samples.iter_mut() {
+        let start = Instant::now();
+        f(iters);
+        *sample = start.elapsed().as_nanos() as f64 / iters as f64;
+    }
+    samples.sort_by(|a, b| a.partial_cmp(b).unwrap());
+    println!(
+        "{:<32} time: [{:.2} {:.2} {:.2}] ns/iter",
+        name,
+        samples[0],
+        samples[SAMPLES / 2],
+        samples[SAMPLES - 1]
+    );
+}
+
+#[pku::domain(DOMAIN)]
+#[inline(never)]
+fn nop(x: u64) -> u64 {
+    x
+}
+
+fn alloc_loop<A: GlobalAlloc>(alloc: &A, layout: Layout, iters: u64) {
+    for _ in 0..iters {
+        unsafe {
+            let ptr = black_box(alloc.alloc(layout));
+            alloc.dealloc(ptr, layout);
+        }
+    }
+}
+
+fn main() {
+    let filter = std::env::args().nth(1).filter(|arg| arg != "--bench");
+    let filter = &filter;
+
+    let _domain = Domain::create_domain(0);
+    #[cfg(target_arch = "wasm32")]
+    assert_eq!(_domain, DOMAIN, "the domain has to be created first");
+
+    bench(filter, "pkucall/round-trip", MAX_ITERS, |iters| {
+        for i in 0..iters {
+            black_box(pkucall!(nop(i)));
+        }
+    });
+
+    // The switch and the restore are one precomputed PKRU write each.
+    bench(filter, "wrpkru/toggle", MAX_ITERS, |iters| {
+        let prot = Domain::get_domain_prot(DOMAIN);
+        for _ in 0..iters {
+            Domain::switch_domain(DOMAIN, prot);
+            Domain::restore_domain(DOMAIN, 0, prot);
+        }
+    });
+
+    for size in [4096, 65536, 1 << 20] {
+        let layout = Layout::from_size_align(size, 65536).unwrap();
+        let addr = unsafe { std::alloc::alloc(layout) } as usize;
+        let ranges = [DOMAIN as u32, 0].map(|pkey| DomainRange {
+            addr,
+            len: size,
+            pkey,
+        });
+        bench(
+            filter,
+            &format!("protect/{}K", size / 1024),
+            MAX_ITERS,
+            |iters| {
+                for _ in 0..iters {
+                    Domain::domain_protect_ranges(&ranges[0..1]);
+                    Domain::domain_protect_ranges(&ranges[1..2]);
+                }
+            },
+        );
+        unsafe { std::alloc::dealloc(addr as *mut u8, layout) };
+    }
+
+    for size in [16, 64, 256, 1024, 4096, 65536] {
+        let layout = Layout::from_size_align(size, 8).unwrap();
+        bench(filter, &format!("malloc/root/{size}"), MAX_ITERS, |iters| {
+            alloc_loop(&GlobalDlmalloc, layout, iters)
+        });
+        bench(
+            filter,
+            &format!("malloc/domain/{size}"),
+            MAX_ITERS,
+            |iters| alloc_loop(&DomainAlloc::<DOMAIN>, layout, iters),
+        );
+    }
+
+    // Linear memory only grows, so this case stops at a few MiB.
+    #[cfg(target_arch = "wasm32")]
+    bench(filter, "grow/memory+tag", 64, |iters| {
+        for _ in 0..iters {
+            assert_ne!(Domain::memory_grow_in(DOMAIN, 1), usize::MAX);
+        }
+    });
+
+    bench(filter, "domain/create-free", MAX_ITERS, |iters| {
+        for _ in 0..iters {
+            Domain::free_domain(black_box(Domain::create_domain(0)));
+        }
+    });
+}
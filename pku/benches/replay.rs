@@ -0,0 +1,162 @@
+//! Replays an allocation trace against `GlobalDlmalloc`, the Rust side of
+//! `pkuc/replay.c`:
+//!
+//! ```text
+//! cargo bench --bench replay -- TRACE
+//! ```
+//!
+//! Traces come from `GlobalDlmalloc::trace_start`, or from pkuc's
+//! `PKU_TRACE`, in the same format. Each call runs in the domain it was
+//! recorded in, and frees in the domain that allocated, since memory always
+//! goes back to its own heap. Prints the throughput, the peak footprint and,
+//! where `/proc` is there, the process's VMAs.
+
+#[cfg(target_arch = "wasm32")]
+use pku::Domain;
+use pku::{
+    DomainScope, GlobalDlmalloc, TraceRecord, TRACE_CALLOC, TRACE_FREE, TRACE_MAGIC, TRACE_MALLOC,
+    TRACE_MOVED, TRACE_REALLOC,
+};
+use std::alloc::{GlobalAlloc, Layout};
+use std::collections::{HashMap, HashSet};
+use std::time::Instant;
+
+#[global_allocator]
+static A: GlobalDlmalloc = GlobalDlmalloc;
+
+fn load(path: &str) -> Vec<TraceRecord> {
+    let bytes = std::fs::read(path).unwrap_or_else(|e| panic!("{path}: {e}"));
+    assert!(
+        bytes.starts_with(TRACE_MAGIC),
+        "{path} is no allocation trace"
+    );
+    bytes[TRACE_MAGIC.len()..]
+        .chunks_exact(std::mem::size_of::<TraceRecord>())
+        .map(|r| TraceRecord {
+            id: u32::from_le_bytes([r[0], r[1], r[2], r[3]]),
+            size: u32::from_le_bytes([r[4], r[5], r[6], r[7]]),
+            op: r[8],
+            domain: r[9],
+            reserved: 0,
+        })
+        .collect()
+}
+
+/// The most allocations the trace holds at once, so the table of them can
+/// be sized up front and never allocates while a domain is entered
+fn peak_live(records: &[TraceRecord]) -> usize {
+    let mut live = HashSet::new();
+    let mut peak = 0;
+    let mut resized = 0;
+    for r in records {
+        match r.op {
+            TRACE_MALLOC | TRACE_CALLOC => {
+                live.insert(r.id);
+            }
+            TRACE_FREE => {
+                live.remove(&r.id);
+            }
+            TRACE_REALLOC => resized = r.id,
+            TRACE_MOVED => {
+                live.remove(&resized);
+                live.insert(r.id);
+            }
+            _ => {}
+        }
+        peak = peak.max(live.len());
+    }
+    peak
+}
+
+fn layout(size: u32) -> Layout {
+    Layout::from_size_align(size.max(1) as usize, 8).unwrap()
+}
+
+/// VMAs of the process, where /proc is there to count them
+fn vmas() -> Option<usize> {
+    let maps = std::fs::read_to_string("/proc/self/maps").ok()?;
+    Some(maps.lines().count())
+}
+
+fn main() {
+    let path = std::env::args()
+        .nth(1)
+        .filter(|arg| arg != "--bench")
+        .expect("usage: replay TRACE");
+    let records = load(&path);
+    let mut live: HashMap<u32, (*mut u8, Layout, usize)> =
+        HashMap::with_capacity(peak_live(&records));
+
+    // Create the domains up front, so that creating them is not timed.
+    #[cfg(target_arch = "wasm32")]
+    {
+        let domains = records.iter().map(|r| r.domain as usize).max().unwrap_or(0);
+        while Domain::create_domain(0) < domains {}
+    }
+
+    let base = GlobalDlmalloc::get_peak_memory_footprint();
+    let start = Instant::now();
+    let mut scope: Option<DomainScope> = None;
+    let mut current = 0;
+    let mut resized = 0;
+    for r in &records {
+        let domain = r.domain as usize;
+        if domain != current {
+            drop(scope.take());
+            if domain != 0 {
+                scope = Some(DomainScope::enter(domain));
+            }
+            current = domain;
+        }
+        unsafe {
+            match r.op {
+                TRACE_MALLOC => {
+                    let layout = layout(r.size);
+                    live.insert(r.id, (A.alloc(layout), layout, domain));
+                }
+                TRACE_CALLOC => {
+                    let layout = layout(r.size);
+                    live.insert(r.id, (A.alloc_zeroed(layout), layout, domain));
+                }
+                TRACE_FREE => {
+                    if let Some((ptr, layout, owner)) = live.remove(&r.id) {
+                        let _owner = (owner != domain).then(|| DomainScope::enter(owner));
+                        A.dealloc(ptr, layout);
+                    }
+                }
+                TRACE_REALLOC => {
+                    if let Some(entry) = live.get_mut(&r.id) {
+                        let _owner = (entry.2 != domain).then(|| DomainScope::enter(entry.2));
+                        entry.0 = A.realloc(entry.0, entry.1, r.size.max(1) as usize);
+                        entry.1 = layout(r.size);
+                    }
+                    resized = r.id;
+                }
+                TRACE_MOVED => {
+                    if let Some(entry) = live.remove(&resized) {
+                        live.insert(r.id, entry);
+                    }
+                }
+                _ => {}
+            }
+        }
+    }
+    drop(scope);
+    let elapsed = start.elapsed();
+
+    let seconds = elapsed.as_secs_f64();
+    println!(
+        "operations:     {} in {:.3} ms, {:.2} Mops/s",
+        records.len(),
+        seconds * 1e3,
+        records.len() as f64 / seconds / 1e6
+    );
+    println!(
+        "peak footprint: {} bytes",
+        GlobalDlmalloc::get_peak_memory_footprint() - base
+    );
+    println!("live:           {} allocations", live.len());
+    if let Some(vmas) = vmas() {
+        println!("mappings:       {vmas} VMAs in the process");
+    }
+}
@@ -20,6 +20,8 @@ pub struct Dlmalloc<A> {
     top: *mut Chunk,
     pub footprint: usize,
     max_footprint: usize,
+    footprint_limit: usize,
+    granularity: usize,
     seg: Segment,
     trim_check: usize,
     least_addr: *mut u8,
@@ -36,7 +38,9 @@ const TREEBIN_SHIFT: usize = 8;
 
 // TODO: runtime configurable? documentation?
 const DEFAULT_GRANULARITY: usize = 64 * 1024;
+const MIN_GRANULARITY: usize = 4 * 1024;
 const DEFAULT_TRIM_THRESHOLD: usize = 2 * 1024 * 1024;
+const DEFAULT_MMAP_THRESHOLD: usize = 256 * 1024;
 const MAX_RELEASE_CHECK_RATE: usize = 4095;
 
 #[repr(C)]
@@ -99,6 +103,8 @@ impl<A> Dlmalloc<A> {
             top: 0 as *mut _,
             footprint: 0,
             max_footprint: 0,
+            footprint_limit: 0,
+            granularity: DEFAULT_GRANULARITY,
             seg: Segment {
                 base: 0 as *mut _,
                 size: 0,
@@ -114,6 +120,50 @@ impl<A> Dlmalloc<A> {
 }
 
 impl<A: Allocator> Dlmalloc<A> {
+    /// The most bytes this heap has obtained from the system at once.
+    pub fn max_footprint(&self) -> usize {
+        self.max_footprint
+    }
+
+    /// The most bytes this heap may obtain from the system, or `usize::MAX`
+    /// if it is unlimited.
+    pub fn footprint_limit(&self) -> usize {
+        if self.footprint_limit == 0 {
+            usize::MAX
+        } else {
+            self.footprint_limit
+        }
+    }
+
+    /// Caps what this heap obtains from the system, like
+    /// `malloc_set_footprint_limit`. `usize::MAX` lifts the cap. Memory the
+    /// heap already holds is kept; it is only further growth which fails.
+    /// Returns the cap in effect, rounded to the granularity.
+    pub fn set_footprint_limit(&mut self, bytes: usize) -> usize {
+        self.footprint_limit = if bytes > usize::MAX - DEFAULT_GRANULARITY {
+            0
+        } else {
+            align_up(cmp::max(bytes, 1), DEFAULT_GRANULARITY)
+        };
+        self.footprint_limit()
+    }
+
+    /// The unit in which this heap obtains memory from the system
+    pub fn granularity(&self) -> usize {
+        self.granularity
+    }
+
+    /// Sets the unit in which this heap obtains memory from the system, a
+    /// power of two from 4 KiB to the default of 64 KiB. Segments already
+    /// obtained are kept. Returns the granularity in effect.
+    pub fn set_granularity(&mut self, bytes: usize) -> usize {
+        self.granularity = cmp::min(
+            cmp::max(bytes, MIN_GRANULARITY).next_power_of_two(),
+            DEFAULT_GRANULARITY,
+        );
+        self.granularity
+    }
+
     // TODO: can we get rid of this?
     pub fn malloc_alignment(&self) -> usize {
         mem::size_of::<usize>() * 2
@@ -356,12 +406,28 @@ impl<A: Allocator> Dlmalloc<A> {
     /// allocates system resources
     unsafe fn sys_alloc(&mut self, size: usize) -> *mut u8 {
         self.check_malloc_state();
+        // Large requests get a region of their own, which the system
+        // allocator can grow in place and release on its own.
+        if size >= DEFAULT_MMAP_THRESHOLD && self.topsize != 0 {
+            let mem = self.mmap_alloc(size);
+            if !mem.is_null() {
+                return mem;
+            }
+        }
+
         // keep in sync with max_request
         let asize = align_up(
             size + self.top_foot_size() + self.malloc_alignment(),
-            DEFAULT_GRANULARITY,
+            self.granularity,
         );
 
+        if self.footprint_limit != 0 {
+            let fp = self.footprint.wrapping_add(asize);
+            if fp <= self.footprint || fp > self.footprint_limit {
+                return ptr::null_mut();
+            }
+        }
+
         let (tbase, tsize, flags) = self.system_allocator.alloc(asize);
         if tbase.is_null() {
             return tbase;
@@ -370,25 +436,6 @@ impl<A: Allocator> Dlmalloc<A> {
         self.footprint += tsize;
         self.max_footprint = cmp::max(self.max_footprint, self.footprint);
 
-        // from dlmalloc mmap_alloc function
-        // Directly mmapped chunks are set up with an offset to the start of
-        // the mmapped region stored in the prev_foot field of the chunk. This
-        // allows reconstruction of the required argument to MUNMAP when freed,
-        // and also allows adjustment of the returned chunk to meet alignment
-        // requirements (especially in memalign).
-        // if tsize > DEFAULT_TRIM_THRESHOLD {
-        //     let offset = self.align_offset(tbase.offset(Chunk::mem_offset()));
-        //     let psize = asize - offset - self.mmap_foot_pad();
-        //     let p = Chunk::from_mem(tbase);
-        //     (*p).prev_foot = offset;
-        //     (*p).head = psize;
-        //     Chunk::set_foot(p, psize);
-        //     (*Chunk::plus_offset(p, psize)).head = Chunk::fencepost_head();
-        //     (*Chunk::plus_offset(p, psize + mem::size_of::<usize>())).head = 0;
-        //     self.check_mmapped_chunk(p);
-        //     return Chunk::to_mem(p);
-        // }
-
         if self.top.is_null() {
             if self.least_addr.is_null() || tbase < self.least_addr {
                 self.least_addr = tbase;
@@ -546,6 +593,41 @@ impl<A: Allocator> Dlmalloc<A> {
         }
     }
 
+    /// From dlmalloc's `mmap_alloc`. Directly mmapped chunks are set up with
+    /// an offset to the start of their region stored in the prev_foot field,
+    /// which gives the region back to `free`, `remap` and `free_part`.
+    unsafe fn mmap_alloc(&mut self, nb: usize) -> *mut u8 {
+        let mmsize =
+            self.mmap_align(nb + 6 * mem::size_of::<usize>() + self.malloc_alignment() - 1);
+        if mmsize <= nb {
+            return ptr::null_mut();
+        }
+        if self.footprint_limit != 0 {
+            let fp = self.footprint.wrapping_add(mmsize);
+            if fp <= self.footprint || fp > self.footprint_limit {
+                return ptr::null_mut();
+            }
+        }
+        let (mm, mmsize, _flags) = self.system_allocator.alloc(mmsize);
+        if mm.is_null() {
+            return mm;
+        }
+        let offset = self.align_offset(Chunk::to_mem(mm as *mut Chunk));
+        let psize = mmsize - offset - self.mmap_foot_pad();
+        let p = mm.offset(offset as isize) as *mut Chunk;
+        (*p).prev_foot = offset;
+        (*p).head = psize;
+        (*Chunk::plus_offset(p, psize)).head = Chunk::fencepost_head();
+        (*Chunk::plus_offset(p, psize + mem::size_of::<usize>())).head = 0;
+        if self.least_addr.is_null() || mm < self.least_addr {
+            self.least_addr = mm;
+        }
+        self.footprint += mmsize;
+        self.max_footprint = cmp::max(self.max_footprint, self.footprint);
+        self.check_mmapped_chunk(p);
+        Chunk::to_mem(p)
+    }
+
     unsafe fn mmap_resize(&mut self, oldp: *mut Chunk, nb: usize, can_move: bool) -> *mut Chunk {
         let oldsize = Chunk::size(oldp);
         // Can't shrink mmap regions below a small size
@@ -839,6 +921,24 @@ impl<A: Allocator> Dlmalloc<A> {
         self.check_malloc_state();
     }
 
+    /// Whether `mem` lies in one of this allocator's segments, which a
+    /// chunk mapped on its own does not
+    pub unsafe fn holds(&self, mem: *mut u8) -> bool {
+        !self.segment_holding(mem).is_null()
+    }
+
+    /// The last word of the region mapped for `mem`'s chunk alone, past its
+    /// fenceposts and unused by the allocator, or null if the chunk is in a
+    /// segment. A resize may leave any value in it.
+    pub unsafe fn mmap_spare(&self, mem: *mut u8) -> *mut usize {
+        let p = Chunk::from_mem(mem);
+        if !Chunk::mmapped(p) {
+            return ptr::null_mut();
+        }
+        let end = Chunk::size(p) + self.mmap_foot_pad();
+        (p as *mut u8).offset((end - mem::size_of::<usize>()) as isize) as *mut usize
+    }
+
     unsafe fn segment_holding(&self, ptr: *mut u8) -> *mut Segment {
         let mut sp = &self.seg as *const Segment as *mut Segment;
         while !sp.is_null() {
@@ -1271,7 +1371,7 @@ impl<A: Allocator> Dlmalloc<A> {
         if pad < self.max_request() && !self.top.is_null() {
             pad += self.top_foot_size();
             if self.topsize > pad {
-                let unit = DEFAULT_GRANULARITY;
+                let unit = self.granularity;
                 let extra = ((self.topsize - pad + unit - 1) / unit - 1) * unit;
                 let sp = self.segment_holding(self.top as *mut u8);
                 debug_assert!(!sp.is_null());
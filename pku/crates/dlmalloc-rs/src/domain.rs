@@ -1,4 +1,4 @@
-use core::convert::TryFrom;
+use core::sync::atomic::{AtomicUsize, Ordering};
 use GlobalDlmalloc;
 
 /// pkey access prot
@@ -8,25 +8,292 @@ pub const PKEY_DISABLE_WRITE: u32 = 2;
 
 // static mut DOMAINS: [u32; 16] = [0; 16];
 
+/// Typed imports of the host `pku` module. Each returns its result directly,
+/// or a negated errno on failure. Addresses are linear-memory offsets.
+#[cfg(target_arch = "wasm32")]
+pub(crate) mod hostcall {
+    #[link(wasm_import_module = "pku")]
+    extern "C" {
+        pub fn rdpkru() -> u32;
+        pub fn wrpkru(pkru: u32);
+        pub fn pkey_alloc(flags: u32, access_rights: u32) -> i32;
+        pub fn pkey_free(pkey: u32) -> i32;
+        pub fn pkey_mprotect(addr: usize, len: usize, prot: u32, pkey: u32) -> i32;
+        pub fn pkey_mprotect_ranges(ranges: *const super::DomainRange, count: usize) -> i32;
+        pub fn queue_register(ring: *mut super::DomainQueue, capacity: u32) -> i32;
+        pub fn queue_flush() -> i32;
+        pub fn memory_grow_tagged(pages: usize, pkey: u32) -> i32;
+        pub fn mmap(addr: usize, len: usize, prot: u32, flags: u32) -> i32;
+        pub fn stats(buf: *mut super::HostStats, len: usize) -> i32;
+    }
+}
+
+/// What isolation has cost the host, read by `Domain::host_stats`. Laid
+/// out as the host's record, so the fields are 64-bit on every target.
+#[repr(C)]
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct HostStats {
+    /// `pkey_mprotect` calls the host made
+    pub mprotect_calls: u64,
+    /// Bytes those calls covered
+    pub mprotect_bytes: u64,
+    /// Mappings made for guests
+    pub mmap_calls: u64,
+    /// Layouts tagged again after growing moved the memory
+    pub retags: u64,
+    /// PKRU writes from or to a word which is no domain's
+    pub other_switches: u64,
+    /// PKRU writes of the host from domain `i` to domain `j` at `[i][j]`
+    pub switches: [[u64; 16]; 16],
+}
+
+/// A range to be tagged by `Domain::domain_protect_ranges`
+#[repr(C)]
+#[derive(Debug, Clone, Copy)]
+pub struct DomainRange {
+    /// start address
+    pub addr: usize,
+    /// length in bytes
+    pub len: usize,
+    /// protection key
+    pub pkey: u32,
+}
+
+/// Number of entries in the deferred protection ring
+pub const QUEUE_CAPACITY: usize = 256;
+
+/// Command ring shared with the host. The guest appends at `head`, the host
+/// advances `tail` when it drains the ring at its next PKU hostcall.
+#[repr(C)]
+pub struct DomainQueue {
+    head: u32,
+    tail: u32,
+    entries: [DomainRange; QUEUE_CAPACITY],
+}
+
+// 0: unregistered, 1: registered, -1: host has no ring
+static mut QUEUE_STATE: i32 = 0;
+
+static mut QUEUE: DomainQueue = DomainQueue {
+    head: 0,
+    tail: 0,
+    entries: [DomainRange {
+        addr: 0,
+        len: 0,
+        pkey: 0,
+    }; QUEUE_CAPACITY],
+};
+
 /// Pkey syscall interface
 pub struct Domain {
     prot: [u32; 16],
     used: [u32; 16],
+    pkru: [u32; 16],
 }
 
 static mut DOMAINS: Domain = Domain::new();
 
+/// Every key but 0 closed, what the root domain runs with
+const PKRU_BASE: u32 = 0x5555_5554;
+/// The same in POR_EL0, which grants rather than denies: `RWX` on key 0
+const POR_BASE: u32 = 0b0111;
+/// Read and execute, but not write, in a POR_EL0 field
+const POR_RX: u32 = 0b0011;
+
+/// Guests see the host's own format: x86 PKRU has two bits per key which
+/// deny access and writes, AArch64 POR_EL0 four which grant read, execute
+/// and write. Key 0 tags the module's stack and data, so it is always open,
+/// and its field tells the two apart. 0 until read, then 1, or 2 for POR.
+static PKRU_FORMAT: AtomicUsize = AtomicUsize::new(0);
+
+/// The PKRU this module last wrote on this thread, 0 until the first switch.
+/// Compiled domain functions and the host put PKRU back before returning
+/// here, so it stays accurate.
+#[cfg_attr(target_feature = "atomics", thread_local)]
+static mut SHADOW_PKRU: u32 = 0;
+
 static mut MMAP: *mut u8 = 0 as *mut u8;
 
+const NEW_SWITCHES: AtomicUsize = AtomicUsize::new(0);
+
+/// Entries into each domain through `switch_domain`
+static SWITCHES: [AtomicUsize; 16] = [NEW_SWITCHES; 16];
+
 impl Domain {
     /// constructor
     pub const fn new() -> Domain {
         Domain {
             prot: [0; 16],
             used: [0; 16],
+            pkru: [0; 16],
+        }
+    }
+
+    /// Whether the host's words are POR_EL0 rather than PKRU
+    fn por_format() -> bool {
+        let mut format = PKRU_FORMAT.load(Ordering::Relaxed);
+        if format == 0 {
+            format = if Self::rdpkru() & 0b11 != 0 { 2 } else { 1 };
+            PKRU_FORMAT.store(format, Ordering::Relaxed);
+        }
+        format == 2
+    }
+
+    /// The full PKRU word of `domain` running with `prot` on its key: key 0
+    /// and the domain's key accessible, every other key closed.
+    fn domain_pkru(domain: usize, prot: u32) -> u32 {
+        let base = if Self::por_format() {
+            POR_BASE
+        } else {
+            PKRU_BASE
+        };
+        Self::open_key(base, domain as u32, prot)
+    }
+
+    /// Recompute the word of `domain` after its prot changed
+    fn update_domain_pkru(domain: usize) {
+        unsafe {
+            DOMAINS.pkru[domain] = Self::domain_pkru(domain, DOMAINS.prot[domain]);
+        }
+    }
+
+    /// The precomputed word of `domain`, computed on first use. No word is
+    /// 0, as key 0 is open in every one.
+    fn domain_word(domain: usize) -> u32 {
+        unsafe {
+            if DOMAINS.pkru[domain] == 0 {
+                Self::update_domain_pkru(domain);
+            }
+            DOMAINS.pkru[domain]
+        }
+    }
+
+    /// Write `pkru` unless it is what this module last wrote
+    fn switch_pkru(pkru: u32) {
+        unsafe {
+            if SHADOW_PKRU == pkru {
+                return;
+            }
+            Self::wrpkru(pkru);
+            SHADOW_PKRU = pkru;
+        }
+    }
+
+    /// Give this thread `prot` on `pkey`, which belongs to no domain, and
+    /// keep the rest of the current word. Key 0 stays open.
+    pub(crate) fn set_key_rights(pkey: u32, prot: u32) {
+        if pkey == 0 {
+            return;
+        }
+        Self::switch_pkru(Self::open_key(Self::current_pkru(), pkey, prot));
+    }
+
+    /// The word this thread runs with, as far as this module knows
+    pub fn current_pkru() -> u32 {
+        unsafe {
+            if SHADOW_PKRU == 0 {
+                Self::domain_word(GlobalDlmalloc::get_domain_id())
+            } else {
+                SHADOW_PKRU
+            }
+        }
+    }
+
+    /// `pkru` with `prot` on `pkey`
+    fn open_key(pkru: u32, pkey: u32, prot: u32) -> u32 {
+        if Self::por_format() {
+            let shift = pkey * 4;
+            let rights = if prot & PKEY_DISABLE_ACCESS != 0 {
+                0
+            } else if prot & PKEY_DISABLE_WRITE != 0 {
+                POR_RX
+            } else {
+                POR_BASE
+            };
+            return (pkru & !(0b1111 << shift)) | (rights << shift);
+        }
+        let shift = pkey * 2;
+        let closed = (PKEY_DISABLE_ACCESS | PKEY_DISABLE_WRITE) << shift;
+        (pkru & !closed) | ((prot & (PKEY_DISABLE_ACCESS | PKEY_DISABLE_WRITE)) << shift)
+    }
+
+    /// Whether `pkru` lets `pkey` be read
+    fn key_readable(pkru: u32, pkey: u32) -> bool {
+        if Self::por_format() {
+            pkru & (1 << (pkey * 4)) != 0
+        } else {
+            pkru & (PKEY_DISABLE_ACCESS << (pkey * 2)) == 0
+        }
+    }
+
+    /// Copy `len` bytes from `src` in `src_domain` to `dst` in `dst_domain`
+    /// without entering either domain, as `PKUMemcpy` does: on top of the
+    /// current word the source key is made readable if it is closed and the
+    /// destination key writable, for one `memory.copy`, and the word is
+    /// put back. The ranges may overlap.
+    ///
+    /// # Safety
+    ///
+    /// `src` must be valid for reads and `dst` for writes of `len` bytes,
+    /// and belong to the given domains.
+    pub unsafe fn copy(
+        dst_domain: usize,
+        dst: *mut u8,
+        src_domain: usize,
+        src: *const u8,
+        len: usize,
+    ) {
+        assert!(dst_domain < 16 && src_domain < 16);
+        if len == 0 {
+            return;
+        }
+        Self::flush_protect();
+        let pkru = Self::current_pkru();
+        let mut open = pkru;
+        if !Self::key_readable(pkru, src_domain as u32) {
+            open = Self::open_key(open, src_domain as u32, PKEY_DISABLE_WRITE);
+        }
+        Self::switch_pkru(Self::open_key(open, dst_domain as u32, 0));
+        core::ptr::copy(src, dst, len);
+        Self::switch_pkru(pkru);
+    }
+
+    /// pkey_alloc a key outside the domains and tag `addr..addr + len`
+    /// with it, `None` if the host has no key left
+    #[cfg(target_arch = "wasm32")]
+    pub(crate) fn exchange_key(addr: usize, len: usize) -> Option<u32> {
+        let pkey = unsafe { hostcall::pkey_alloc(0, 0) };
+        if pkey <= 0 {
+            return None;
+        }
+        Self::flush_protect();
+        if unsafe { hostcall::pkey_mprotect(addr, len, 3, pkey as u32) } < 0 {
+            unsafe { hostcall::pkey_free(pkey as u32) };
+            return None;
+        }
+        Some(pkey as u32)
+    }
+
+    /// pkey_alloc a key outside the domains
+    #[cfg(target_os = "linux")]
+    pub(crate) fn exchange_key(_addr: usize, _len: usize) -> Option<u32> {
+        Some(0)
+    }
+
+    /// Tag `addr..addr + len` with key 0 again and pkey_free `pkey`
+    #[cfg(target_arch = "wasm32")]
+    pub(crate) fn free_exchange_key(addr: usize, len: usize, pkey: u32) {
+        Self::flush_protect();
+        unsafe {
+            hostcall::pkey_mprotect(addr, len, 3, 0);
+            hostcall::pkey_free(pkey);
         }
     }
 
+    /// pkey_free a key outside the domains
+    #[cfg(target_os = "linux")]
+    pub(crate) fn free_exchange_key(_addr: usize, _len: usize, _pkey: u32) {}
+
     fn get_freed_domain() -> usize {
         unsafe {
             for i in 0..16 {
@@ -65,32 +332,25 @@ impl Domain {
     }
 
     /// Read pkru wasi
+    #[cfg(target_arch = "wasm32")]
     pub fn read_pkru() -> u32 {
-        let mut buf = [0x0F, 0x01, 0xEE, 0, 0, 0, 0, 0, 0, 0, 0, 0];
-        let result = wasicall!(&mut buf);
-        match result {
-            Ok(_) => {
-                let pkru = u32::from_be_bytes(
-                    <[u8; 4]>::try_from(&buf[3..7]).expect("u32::from_be_bytes fails"),
-                );
-                return pkru;
-            }
-            Err(_) => {
-                return 0;
-            }
-        }
+        unsafe { hostcall::rdpkru() }
     }
 
+    /// Read pkru wasi
+    #[cfg(target_os = "linux")]
+    pub fn read_pkru() -> u32 {
+        0
+    }
+
+    #[cfg(target_arch = "wasm32")]
     fn write_pkru(pkru: u32) {
-        let mut buf = [0x0F, 0x01, 0xEF, 0, 0, 0, 0, 0, 0, 0, 0, 0];
-        buf[3..7].copy_from_slice(&pkru.to_be_bytes());
-        let result = wasicall!(&mut buf);
-        match result {
-            Ok(_) => {}
-            Err(_) => {}
-        }
+        unsafe { hostcall::wrpkru(pkru) }
     }
 
+    #[cfg(target_os = "linux")]
+    fn write_pkru(_pkru: u32) {}
+
     /// Read pkru
     pub fn rdpkru() -> u32 {
         let ecx = 0;
@@ -102,40 +362,57 @@ impl Domain {
         return eax;
     }
 
-    fn set_pkey(pkey: usize, prot: u32) {
-        let pkey_shift = pkey * 2;
-        let mut new_pkru_bits = 0;
-
-        if prot & PKEY_DISABLE_ACCESS != 0 {
-            new_pkru_bits |= PKEY_DISABLE_ACCESS;
-        }
-        if prot & PKEY_DISABLE_WRITE != 0 {
-            new_pkru_bits |= PKEY_DISABLE_WRITE;
-        }
+    /// trampline to isolated, one PKRU write of the domain's precomputed
+    /// word, skipped when already current
+    pub fn switch_domain(domain: usize, prot: u32) {
+        Self::flush_protect();
+        let pkru = unsafe {
+            if prot == DOMAINS.prot[domain] {
+                Self::domain_word(domain)
+            } else {
+                Self::domain_pkru(domain, prot)
+            }
+        };
+        Self::switch_pkru(pkru);
+        GlobalDlmalloc::switch_domain(domain);
+        SWITCHES[domain].fetch_add(1, Ordering::Relaxed);
+    }
 
-        /* Shift the bits in to the correct place in PKRU for pkey: */
-        new_pkru_bits <<= pkey_shift;
+    /// Times `domain` was entered through `switch_domain`, by any thread
+    pub fn switch_count(domain: usize) -> usize {
+        SWITCHES[domain].load(Ordering::Relaxed)
+    }
 
-        /* Get old PKRU and mask off any old bits in place: */
-        let mut old_pkru = Self::rdpkru();
-        if old_pkru == 0 {
-            old_pkru = 0x55555554;
+    /// The host's isolation counters, `None` if the host has none. They
+    /// only count while the engine asks for them, for the whole process.
+    #[cfg(target_arch = "wasm32")]
+    pub fn host_stats() -> Option<HostStats> {
+        let mut stats = HostStats {
+            mprotect_calls: 0,
+            mprotect_bytes: 0,
+            mmap_calls: 0,
+            retags: 0,
+            other_switches: 0,
+            switches: [[0; 16]; 16],
+        };
+        let len = core::mem::size_of::<HostStats>();
+        if unsafe { hostcall::stats(&mut stats, len) } < 0 {
+            return None;
         }
-        old_pkru &= !((PKEY_DISABLE_ACCESS | PKEY_DISABLE_WRITE) << pkey_shift);
-
-        /* Write old part along with new part: */
-        Self::wrpkru(old_pkru | new_pkru_bits);
+        Some(stats)
     }
 
-    /// trampline to isolated
-    pub fn switch_domain(domain: usize, prot: u32) {
-        Self::set_pkey(domain, prot);
-        GlobalDlmalloc::switch_domain(domain);
+    /// The host's isolation counters, of which there are none natively
+    #[cfg(target_os = "linux")]
+    pub fn host_stats() -> Option<HostStats> {
+        None
     }
 
-    /// trampline to normal
-    pub fn restore_domain(source: usize, target: usize, prot: u32) {
-        Self::set_pkey(source, prot);
+    /// trampline to normal, back to the precomputed word of `target`. `prot`
+    /// is what `source`'s key is closed to, which that word already has.
+    pub fn restore_domain(_source: usize, target: usize, _prot: u32) {
+        Self::flush_protect();
+        Self::switch_pkru(Self::domain_word(target));
         GlobalDlmalloc::switch_domain(target);
     }
 
@@ -145,10 +422,102 @@ impl Domain {
     }
 
     /// pkey_mprotect
+    #[cfg(target_arch = "wasm32")]
     pub fn domain_protect(addr: usize, len: usize) {
         ProtectDomain!(addr, len);
     }
 
+    /// pkey_mprotect
+    #[cfg(target_os = "linux")]
+    pub fn domain_protect(_addr: usize, _len: usize) {
+        ProtectDomain!();
+    }
+
+    /// pkey_mprotect many ranges in one hostcall; adjacent ranges with the
+    /// same key are merged by the host
+    #[cfg(target_arch = "wasm32")]
+    pub fn domain_protect_ranges(ranges: &[DomainRange]) {
+        if unsafe { hostcall::pkey_mprotect_ranges(ranges.as_ptr(), ranges.len()) } < 0 {
+            panic!("domain_protect_ranges");
+        }
+    }
+
+    /// pkey_mprotect many ranges in one hostcall
+    #[cfg(target_os = "linux")]
+    pub fn domain_protect_ranges(_ranges: &[DomainRange]) {}
+
+    /// memory.grow, with the new pages tagged for the current domain in the
+    /// same hostcall. Returns the previous size in pages or `usize::MAX`.
+    #[cfg(target_arch = "wasm32")]
+    pub fn memory_grow(pages: usize) -> usize {
+        Self::memory_grow_in(GlobalDlmalloc::get_domain_id(), pages)
+    }
+
+    /// memory.grow, with the new pages tagged for `domain`
+    #[cfg(target_arch = "wasm32")]
+    pub fn memory_grow_in(domain: usize, pages: usize) -> usize {
+        let pkey = domain;
+        if pkey == 0 {
+            return core::arch::wasm32::memory_grow(0, pages);
+        }
+        match unsafe { hostcall::memory_grow_tagged(pages, pkey as u32) } {
+            -1 => usize::max_value(),
+            prev => prev as u32 as usize,
+        }
+    }
+
+    /// Queue a pkey_mprotect without a host transition. Queued ranges take
+    /// effect at the host's next PKU hostcall, and always before a switch.
+    /// The ring has a single producer, so with wasm threads this protects at
+    /// once.
+    #[cfg(target_arch = "wasm32")]
+    pub fn domain_protect_deferred(addr: usize, len: usize, pkey: u32) {
+        unsafe {
+            if cfg!(target_feature = "atomics") {
+                QUEUE_STATE = -1;
+            }
+            if QUEUE_STATE == 0 {
+                let ring = core::ptr::addr_of_mut!(QUEUE);
+                QUEUE_STATE = if hostcall::queue_register(ring, QUEUE_CAPACITY as u32) == 0 {
+                    1
+                } else {
+                    -1
+                };
+            }
+            if QUEUE_STATE < 0 {
+                let range = DomainRange { addr, len, pkey };
+                return Self::domain_protect_ranges(&[range]);
+            }
+            if QUEUE.head.wrapping_sub(QUEUE.tail) as usize >= QUEUE_CAPACITY {
+                Self::flush_protect();
+            }
+            let slot = QUEUE.head as usize % QUEUE_CAPACITY;
+            core::ptr::write_volatile(&mut QUEUE.entries[slot], DomainRange { addr, len, pkey });
+            core::ptr::write_volatile(&mut QUEUE.head, QUEUE.head.wrapping_add(1));
+        }
+    }
+
+    /// Queue a pkey_mprotect without a host transition
+    #[cfg(target_os = "linux")]
+    pub fn domain_protect_deferred(_addr: usize, _len: usize, _pkey: u32) {}
+
+    /// Apply all queued ranges now; no hostcall if nothing is queued
+    #[cfg(target_arch = "wasm32")]
+    pub fn flush_protect() {
+        unsafe {
+            if core::ptr::read_volatile(&QUEUE.tail) == QUEUE.head {
+                return;
+            }
+            if hostcall::queue_flush() < 0 {
+                panic!("flush_protect");
+            }
+        }
+    }
+
+    /// Apply all queued ranges now
+    #[cfg(target_os = "linux")]
+    pub fn flush_protect() {}
+
     /// mmap
     #[cfg(target_arch = "wasm32")]
     pub fn mmap(addr: usize, len: usize, prot: u8, flags: u8) -> *mut u8 {
@@ -1,8 +1,13 @@
 use alloc::vec::Vec;
+#[cfg(feature = "allocator-api")]
+use core::alloc::AllocError;
 use core::alloc::{GlobalAlloc, Layout};
 use core::ops::{Deref, DerefMut};
-use core::sync::atomic::{AtomicUsize, Ordering};
+#[cfg(feature = "allocator-api")]
+use core::ptr::NonNull;
+use core::sync::atomic::{AtomicBool, AtomicUsize, Ordering};
 
+use trace::{self, TRACE_CALLOC, TRACE_FREE, TRACE_MALLOC, TRACE_MOVED, TRACE_REALLOC, TRACING};
 use Dlmalloc;
 
 #[cfg(target_family = "wasm")]
@@ -14,27 +19,354 @@ pub use sys::enable_alloc_after_fork;
 ///
 /// This API requires the `global` feature is activated, and this type
 /// implements the `GlobalAlloc` trait in the standard library.
+///
+/// It allocates from the current domain's heap, but frees and resizes in
+/// the heap a pointer came from, so memory may leave the domain it was
+/// allocated in. That heap's key has to be accessible, as it has to be for
+/// using the memory.
 pub struct GlobalDlmalloc;
 
 unsafe impl GlobalAlloc for GlobalDlmalloc {
     #[inline]
     unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
-        <Dlmalloc>::malloc(&mut get(), layout.size(), layout.align())
+        heap_alloc(DOMAINID.load(Ordering::Relaxed), layout)
+    }
+
+    #[inline]
+    unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
+        heap_dealloc(owner_of(ptr), ptr, layout)
+    }
+
+    #[inline]
+    unsafe fn alloc_zeroed(&self, layout: Layout) -> *mut u8 {
+        heap_alloc_zeroed(DOMAINID.load(Ordering::Relaxed), layout)
+    }
+
+    #[inline]
+    unsafe fn realloc(&self, ptr: *mut u8, layout: Layout, new_size: usize) -> *mut u8 {
+        heap_realloc(owner_of(ptr), ptr, layout, new_size)
+    }
+}
+
+/// An allocator for the heap of domain `D`, whichever domain is current.
+/// Unlike `GlobalDlmalloc` it neither reads nor switches the global domain
+/// id, and memory is always freed back to `D`. The allocator writes its
+/// chunk headers into `D`'s memory, so `D`'s key has to be accessible, as
+/// it has to be for using the memory.
+///
+/// With the `allocator-api` feature (nightly) it also implements
+/// `core::alloc::Allocator`, so `Vec<T, DomainAlloc<2>>` lives in domain 2.
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct DomainAlloc<const D: usize>;
+
+impl<const D: usize> DomainAlloc<D> {
+    /// `D`, which fails to compile unless it names one of the domains
+    const ID: usize = {
+        assert!(D < NUM_DOMAINS, "DomainAlloc domain out of range");
+        D
+    };
+}
+
+unsafe impl<const D: usize> GlobalAlloc for DomainAlloc<D> {
+    #[inline]
+    unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
+        heap_alloc(Self::ID, layout)
     }
 
     #[inline]
     unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
-        <Dlmalloc>::free(&mut get(), ptr, layout.size(), layout.align())
+        heap_dealloc(Self::ID, ptr, layout)
     }
 
     #[inline]
     unsafe fn alloc_zeroed(&self, layout: Layout) -> *mut u8 {
-        <Dlmalloc>::calloc(&mut get(), layout.size(), layout.align())
+        heap_alloc_zeroed(Self::ID, layout)
     }
 
     #[inline]
     unsafe fn realloc(&self, ptr: *mut u8, layout: Layout, new_size: usize) -> *mut u8 {
-        <Dlmalloc>::realloc(&mut get(), ptr, layout.size(), layout.align(), new_size)
+        heap_realloc(Self::ID, ptr, layout, new_size)
+    }
+}
+
+#[cfg(feature = "allocator-api")]
+unsafe impl<const D: usize> core::alloc::Allocator for DomainAlloc<D> {
+    fn allocate(&self, layout: Layout) -> Result<NonNull<[u8]>, AllocError> {
+        if layout.size() == 0 {
+            return Ok(dangling(layout));
+        }
+        let ptr = unsafe { heap_alloc(Self::ID, layout) };
+        NonNull::new(ptr)
+            .map(|ptr| NonNull::slice_from_raw_parts(ptr, layout.size()))
+            .ok_or(AllocError)
+    }
+
+    fn allocate_zeroed(&self, layout: Layout) -> Result<NonNull<[u8]>, AllocError> {
+        if layout.size() == 0 {
+            return Ok(dangling(layout));
+        }
+        let ptr = unsafe { heap_alloc_zeroed(Self::ID, layout) };
+        NonNull::new(ptr)
+            .map(|ptr| NonNull::slice_from_raw_parts(ptr, layout.size()))
+            .ok_or(AllocError)
+    }
+
+    unsafe fn deallocate(&self, ptr: NonNull<u8>, layout: Layout) {
+        if layout.size() != 0 {
+            heap_dealloc(Self::ID, ptr.as_ptr(), layout)
+        }
+    }
+
+    // Through realloc, which grows large chunks in place
+    unsafe fn grow(
+        &self,
+        ptr: NonNull<u8>,
+        old: Layout,
+        new: Layout,
+    ) -> Result<NonNull<[u8]>, AllocError> {
+        if old.size() == 0 || new.align() != old.align() {
+            let ret = self.allocate(new)?;
+            core::ptr::copy_nonoverlapping(ptr.as_ptr(), ret.as_ptr() as *mut u8, old.size());
+            self.deallocate(ptr, old);
+            return Ok(ret);
+        }
+        let ptr = heap_realloc(Self::ID, ptr.as_ptr(), old, new.size());
+        NonNull::new(ptr)
+            .map(|ptr| NonNull::slice_from_raw_parts(ptr, new.size()))
+            .ok_or(AllocError)
+    }
+
+    unsafe fn shrink(
+        &self,
+        ptr: NonNull<u8>,
+        old: Layout,
+        new: Layout,
+    ) -> Result<NonNull<[u8]>, AllocError> {
+        if new.size() == 0 || new.align() != old.align() {
+            let ret = self.allocate(new)?;
+            core::ptr::copy_nonoverlapping(ptr.as_ptr(), ret.as_ptr() as *mut u8, new.size());
+            self.deallocate(ptr, old);
+            return Ok(ret);
+        }
+        let ptr = heap_realloc(Self::ID, ptr.as_ptr(), old, new.size());
+        NonNull::new(ptr)
+            .map(|ptr| NonNull::slice_from_raw_parts(ptr, new.size()))
+            .ok_or(AllocError)
+    }
+}
+
+#[cfg(feature = "allocator-api")]
+fn dangling(layout: Layout) -> NonNull<[u8]> {
+    let ptr = unsafe { NonNull::new_unchecked(layout.align() as *mut u8) };
+    NonNull::slice_from_raw_parts(ptr, 0)
+}
+
+unsafe fn heap_alloc(id: usize, layout: Layout) -> *mut u8 {
+    #[cfg(target_feature = "atomics")]
+    {
+        let ptr = cache_pop(id, &layout);
+        if !ptr.is_null() {
+            count_alloc(id, layout.size());
+            trace_call(TRACE_MALLOC, ptr, layout.size(), id);
+            return ptr;
+        }
+    }
+    let size = cache_size(layout.size(), layout.align());
+    let mut heap = get_in(id);
+    let ptr = heap.malloc(size, layout.align());
+    mark_owner(&heap, ptr);
+    drop(heap);
+    if ptr.is_null() {
+        out_of_budget(id, layout.size());
+    } else {
+        count_alloc(id, layout.size());
+    }
+    trace_call(TRACE_MALLOC, ptr, layout.size(), id);
+    ptr
+}
+
+/// The domain whose heap `ptr` came from. Chunks are looked up in the
+/// segments of the current domain's heap first, then in the others'; a
+/// chunk mapped on its own is in none and carries its domain instead, see
+/// `mark_owner`.
+unsafe fn owner_of(ptr: *mut u8) -> usize {
+    let id = DOMAINID.load(Ordering::Relaxed);
+    {
+        let heap = get_in(id);
+        let spare = heap.mmap_spare(ptr);
+        if !spare.is_null() {
+            return *spare;
+        }
+        if heap.holds(ptr) {
+            return id;
+        }
+    }
+    (0..NUM_DOMAINS)
+        .find(|&other| other != id && get_in(other).holds(ptr))
+        .unwrap_or(id)
+}
+
+/// Write the domain of the locked heap into a chunk it mapped on its own
+#[inline]
+unsafe fn mark_owner(heap: &Instance, ptr: *mut u8) {
+    if !ptr.is_null() {
+        let spare = heap.mmap_spare(ptr);
+        if !spare.is_null() {
+            *spare = heap.0;
+        }
+    }
+}
+
+/// Record a call if a trace is being recorded, see `trace_start`
+#[inline]
+fn trace_call(op: u8, ptr: *const u8, size: usize, id: usize) {
+    if TRACING.load(Ordering::Relaxed) {
+        trace::record(op, ptr, size, id);
+    }
+}
+
+unsafe fn heap_dealloc(id: usize, ptr: *mut u8, layout: Layout) {
+    trace_call(TRACE_FREE, ptr, 0, id);
+    count_free(id, layout.size());
+    #[cfg(target_feature = "atomics")]
+    {
+        if cache_push(id, ptr, &layout) {
+            return;
+        }
+    }
+    <Dlmalloc>::free(&mut get_in(id), ptr, layout.size(), layout.align());
+}
+
+unsafe fn heap_alloc_zeroed(id: usize, layout: Layout) -> *mut u8 {
+    #[cfg(target_feature = "atomics")]
+    {
+        let ptr = cache_pop(id, &layout);
+        if !ptr.is_null() {
+            core::ptr::write_bytes(ptr, 0, layout.size());
+            count_alloc(id, layout.size());
+            trace_call(TRACE_CALLOC, ptr, layout.size(), id);
+            return ptr;
+        }
+    }
+    let size = cache_size(layout.size(), layout.align());
+    let mut heap = get_in(id);
+    let ptr = heap.calloc(size, layout.align());
+    mark_owner(&heap, ptr);
+    drop(heap);
+    if ptr.is_null() {
+        out_of_budget(id, layout.size());
+    } else {
+        count_alloc(id, layout.size());
+    }
+    trace_call(TRACE_CALLOC, ptr, layout.size(), id);
+    ptr
+}
+
+unsafe fn heap_realloc(id: usize, ptr: *mut u8, layout: Layout, new_size: usize) -> *mut u8 {
+    let size = cache_size(new_size, layout.align());
+    let mut heap = get_in(id);
+    let ret = heap.realloc(ptr, layout.size(), layout.align(), size);
+    mark_owner(&heap, ret);
+    drop(heap);
+    if ret.is_null() {
+        out_of_budget(id, new_size);
+    } else {
+        count_free(id, layout.size());
+        count_alloc(id, new_size);
+        trace_call(TRACE_REALLOC, ptr, new_size, id);
+        if ret != ptr {
+            trace_call(TRACE_MOVED, ret, new_size, id);
+        }
+    }
+    ret
+}
+
+/// Requests up to this size are cached per thread
+const CACHE_MAX: usize = 128;
+
+/// Cached size classes are 16 bytes apart, the allocator's alignment
+const CACHE_CLASS: usize = 16;
+
+/// Blocks a thread keeps per size class and domain
+const CACHE_DEPTH: usize = 32;
+
+/// Blocks of cacheable requests are whole classes, so that any of them can
+/// serve any request of its class.
+#[inline]
+fn cache_size(size: usize, align: usize) -> usize {
+    if cfg!(target_feature = "atomics") && size != 0 && size <= CACHE_MAX && align <= CACHE_CLASS {
+        (size + CACHE_CLASS - 1) & !(CACHE_CLASS - 1)
+    } else {
+        size
+    }
+}
+
+/// A free list of blocks, linked through their first word
+#[derive(Clone, Copy)]
+struct CacheBin {
+    head: *mut u8,
+    count: usize,
+}
+
+#[cfg(target_feature = "atomics")]
+const NEW_BIN: CacheBin = CacheBin {
+    head: 0 as *mut u8,
+    count: 0,
+};
+
+#[cfg(target_feature = "atomics")]
+#[thread_local]
+static mut THREADCACHE: [[CacheBin; CACHE_MAX / CACHE_CLASS]; NUM_DOMAINS] =
+    [[NEW_BIN; CACHE_MAX / CACHE_CLASS]; NUM_DOMAINS];
+
+#[cfg(target_feature = "atomics")]
+#[inline]
+unsafe fn cache_bin(id: usize, layout: &Layout) -> Option<&'static mut CacheBin> {
+    let size = layout.size();
+    if size == 0 || size > CACHE_MAX || layout.align() > CACHE_CLASS {
+        return None;
+    }
+    Some(&mut THREADCACHE[id][(size - 1) / CACHE_CLASS])
+}
+
+#[cfg(target_feature = "atomics")]
+#[inline]
+unsafe fn cache_pop(id: usize, layout: &Layout) -> *mut u8 {
+    match cache_bin(id, layout) {
+        Some(bin) if !bin.head.is_null() => {
+            let ptr = bin.head;
+            bin.head = *(ptr as *mut *mut u8);
+            bin.count -= 1;
+            ptr
+        }
+        _ => core::ptr::null_mut(),
+    }
+}
+
+#[cfg(target_feature = "atomics")]
+#[inline]
+unsafe fn cache_push(id: usize, ptr: *mut u8, layout: &Layout) -> bool {
+    match cache_bin(id, layout) {
+        Some(bin) if bin.count < CACHE_DEPTH => {
+            *(ptr as *mut *mut u8) = bin.head;
+            bin.head = ptr;
+            bin.count += 1;
+            true
+        }
+        _ => false,
+    }
+}
+
+#[cfg(target_feature = "atomics")]
+unsafe fn cache_flush(id: usize) {
+    let mut heap = get_in(id);
+    for bin in THREADCACHE[id].iter_mut() {
+        while !bin.head.is_null() {
+            let ptr = bin.head;
+            bin.head = *(ptr as *mut *mut u8);
+            heap.free(ptr, 0, 1);
+        }
+        bin.count = 0;
     }
 }
 
@@ -46,14 +378,100 @@ impl GlobalDlmalloc {
 
     /// Modify a global domain id
     pub fn switch_domain(id: usize) {
+        check_domain(id);
         DOMAINID.store(id, Ordering::Relaxed);
     }
 
-    /// Get all memory footprint in allocator
+    /// The domain whose heap was last entered, the current domain unless a
+    /// `DomainAlloc` allocated. The system allocator tags what it obtains
+    /// for this domain.
+    pub fn heap_domain_id() -> usize {
+        HEAPDOMAIN.load(Ordering::Relaxed)
+    }
+
+    /// Cap the memory domain `id` may take from the system, see
+    /// `Dlmalloc::set_footprint_limit`. Allocations in the domain fail once
+    /// it is over budget. Returns the cap in effect.
+    pub fn set_memory_limit(id: usize, bytes: usize) -> usize {
+        check_domain(id);
+        unsafe { get_in(id).set_footprint_limit(bytes) }
+    }
+
+    /// Get the cap of domain `id`, or `usize::MAX` if it has none
+    pub fn memory_limit(id: usize) -> usize {
+        check_domain(id);
+        unsafe { get_in(id).footprint_limit() }
+    }
+
+    /// Set the unit in which domain `id` obtains memory, see
+    /// `Dlmalloc::set_granularity`. On wasm, segments smaller than the 64 KiB
+    /// page are sliced from a page shared by such domains.
+    /// Returns the unit in effect.
+    pub fn set_granularity(id: usize, bytes: usize) -> usize {
+        check_domain(id);
+        unsafe { get_in(id).set_granularity(bytes) }
+    }
+
+    /// Give every domain its own window of linear memory, `size` bytes from
+    /// `base + id * size`, that its heap grows in instead of interleaving
+    /// with the others. `base == 0` starts the windows at the current top
+    /// of memory; a nonzero `base` may instead point at windows a
+    /// `pkuwa.layout` section already tagged. Call at module start: fails
+    /// once any domain has grown memory, and for unaligned arguments.
+    #[cfg(target_arch = "wasm32")]
+    pub fn set_domain_windows(base: usize, size: usize) -> bool {
+        ::sys::set_domain_windows(base, size, 64 * 1024)
+    }
+
+    /// Call `handler` with the domain id and the requested size whenever an
+    /// allocation fails in a domain with a cap. The handler may lift the
+    /// cap or free memory, but the failed allocation is not retried.
+    pub fn set_memory_limit_handler(handler: Option<fn(usize, usize)>) {
+        unsafe {
+            MEMORYLIMITHANDLER = handler;
+        }
+    }
+
+    /// Get the allocation counters of every domain, indexed by domain id
+    pub fn heap_stats_vector() -> Vec<HeapStats> {
+        // Read before pushing, which allocates and takes a heap lock itself
+        let mut stats = [HeapStats::default(); NUM_DOMAINS];
+        for (id, heap) in stats.iter_mut().enumerate() {
+            let counters = &HEAPSTATS[id];
+            *heap = HeapStats {
+                in_use: counters[IN_USE].load(Ordering::Relaxed),
+                peak: counters[PEAK].load(Ordering::Relaxed),
+                allocations: counters[ALLOCATIONS].load(Ordering::Relaxed),
+                frees: counters[FREES].load(Ordering::Relaxed),
+                footprint: unsafe { get_in(id).footprint() },
+            };
+        }
+        stats.to_vec()
+    }
+
+    /// Give the blocks this thread caches for the current domain back to its
+    /// heap, e.g. before the thread exits. Only wasm threads builds cache.
+    pub fn flush_thread_cache() {
+        #[cfg(target_feature = "atomics")]
+        unsafe {
+            cache_flush(DOMAINID.load(Ordering::Relaxed));
+        }
+    }
+
+    /// The most bytes the heaps have held from the system, summed over
+    /// the domains
+    pub fn get_peak_memory_footprint() -> usize {
+        (0..NUM_DOMAINS)
+            .map(|id| unsafe { get_in(id).max_footprint() })
+            .sum()
+    }
+
+    /// Get all memory footprint in allocator, segments pooled for reuse
+    /// included; linear memory never shrinks, so none of it is returned
     #[cfg(target_arch = "wasm32")]
     pub fn get_memory_footprint() -> usize {
         unsafe {
-            let mut ret = Monitor::monitor_footprint() + DLMALLOC.0.footprint;
+            let mut ret = Monitor::monitor_footprint();
             for iter in DOMAINALLOC.iter() {
                 ret += iter.0.footprint;
             }
@@ -67,7 +485,6 @@ impl GlobalDlmalloc {
         let mut ret: Vec<usize> = Vec::new();
         unsafe {
             ret.push(Monitor::monitor_footprint());
-            ret.push(DLMALLOC.0.footprint);
             for iter in DOMAINALLOC.iter() {
                 ret.push(iter.0.footprint);
             }
@@ -76,100 +493,175 @@ impl GlobalDlmalloc {
     }
 }
 
-static mut DLMALLOC: Dlmalloc = Dlmalloc::new();
-static mut DOMAINALLOC: Vec<Dlmalloc> = Vec::new();
+/// Domains with an allocator of their own, one per protection key
+const NUM_DOMAINS: usize = 16;
+
+/// Panic on an id past the last protection key, where it enters the
+/// allocator. Past this point ids index the per-domain tables directly.
+fn check_domain(id: usize) {
+    assert!(id < NUM_DOMAINS, "domain {} out of range", id);
+}
+
+const NEW_DLMALLOC: Dlmalloc = Dlmalloc::new();
+
+/// The allocator of each domain, indexed by domain id; the root domain's
+/// is the first
+static mut DOMAINALLOC: [Dlmalloc; NUM_DOMAINS] = [NEW_DLMALLOC; NUM_DOMAINS];
+/// The current domain. PKRU is per thread, so with wasm threads this is too.
+#[cfg_attr(target_feature = "atomics", thread_local)]
 static DOMAINID: AtomicUsize = AtomicUsize::new(0);
 
-static mut ALLOCFLAG: bool = false;
-unsafe fn alloc_allocator(id: usize) {
-    while ALLOCFLAG == false && DOMAINALLOC.len() <= id {
-        ALLOCFLAG = true;
-        DOMAINALLOC.push(Dlmalloc::new());
-        ALLOCFLAG = false;
+/// Set by `get_in` on the thread holding that heap's lock
+#[cfg_attr(target_feature = "atomics", thread_local)]
+static HEAPDOMAIN: AtomicUsize = AtomicUsize::new(0);
+
+const NEW_LOCK: AtomicBool = AtomicBool::new(false);
+
+/// A spin lock per heap, so domains allocate in parallel. The global lock
+/// of `sys` is only taken for what heaps share, in the system allocator,
+/// and always after a heap lock.
+static HEAPLOCKS: [AtomicBool; NUM_DOMAINS] = [NEW_LOCK; NUM_DOMAINS];
+
+fn lock_heap(id: usize) {
+    let lock = &HEAPLOCKS[id];
+    while lock
+        .compare_exchange_weak(false, true, Ordering::Acquire, Ordering::Relaxed)
+        .is_err()
+    {
+        while lock.load(Ordering::Relaxed) {
+            core::hint::spin_loop();
+        }
+    }
+}
+
+fn unlock_heap(id: usize) {
+    HEAPLOCKS[id].store(false, Ordering::Release);
+}
+
+/// Take every heap lock, in order, e.g. around a fork
+pub(crate) fn lock_heaps() {
+    for id in 0..NUM_DOMAINS {
+        lock_heap(id);
+    }
+}
+
+pub(crate) fn unlock_heaps() {
+    for id in 0..NUM_DOMAINS {
+        unlock_heap(id);
+    }
+}
+
+static mut MEMORYLIMITHANDLER: Option<fn(usize, usize)> = None;
+
+/// Allocation counters of one domain, see
+/// `GlobalDlmalloc::heap_stats_vector`
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct HeapStats {
+    /// Bytes of live allocations, as requested
+    pub in_use: usize,
+    /// The most `in_use` has been
+    pub peak: usize,
+    /// Allocations made in the domain
+    pub allocations: usize,
+    /// Allocations freed again
+    pub frees: usize,
+    /// Bytes the domain's allocator holds from the system
+    pub footprint: usize,
+}
+
+// The counters of `HeapStats` but `footprint`, atomic as cached blocks
+// are counted without a lock
+const IN_USE: usize = 0;
+const PEAK: usize = 1;
+const ALLOCATIONS: usize = 2;
+const FREES: usize = 3;
+
+const NEW_COUNTER: AtomicUsize = AtomicUsize::new(0);
+const NEW_COUNTERS: [AtomicUsize; 4] = [NEW_COUNTER; 4];
+
+static HEAPSTATS: [[AtomicUsize; 4]; NUM_DOMAINS] = [NEW_COUNTERS; NUM_DOMAINS];
+
+fn count_alloc(id: usize, size: usize) {
+    let stats = &HEAPSTATS[id];
+    stats[ALLOCATIONS].fetch_add(1, Ordering::Relaxed);
+    let in_use = stats[IN_USE].fetch_add(size, Ordering::Relaxed) + size;
+    stats[PEAK].fetch_max(in_use, Ordering::Relaxed);
+}
+
+/// Memory is counted as freed in the domain whose allocator it is freed to.
+fn count_free(id: usize, size: usize) {
+    let stats = &HEAPSTATS[id];
+    stats[FREES].fetch_add(1, Ordering::Relaxed);
+    let _ = stats[IN_USE].fetch_update(Ordering::Relaxed, Ordering::Relaxed, |in_use| {
+        Some(in_use.saturating_sub(size))
+    });
+}
+
+/// Ids were checked on entry, see `check_domain`
+unsafe fn allocator(id: usize) -> &'static mut Dlmalloc {
+    &mut DOMAINALLOC[id]
+}
+
+/// Report a failed allocation of domain `id` to the handler. It runs without
+/// the global lock, so it may allocate itself.
+unsafe fn out_of_budget(id: usize, size: usize) {
+    if let Some(handler) = MEMORYLIMITHANDLER {
+        let limited = get_in(id).footprint_limit() != usize::MAX;
+        if limited {
+            handler(id, size);
+        }
     }
 }
 
-struct Instance;
+/// The allocator of one domain, held under its lock
+struct Instance(usize);
 
-unsafe fn get() -> Instance {
-    ::sys::acquire_global_lock();
-    Instance
+unsafe fn get_in(id: usize) -> Instance {
+    lock_heap(id);
+    HEAPDOMAIN.store(id, Ordering::Relaxed);
+    Instance(id)
 }
 
 impl Deref for Instance {
     type Target = Dlmalloc;
+    #[inline]
     fn deref(&self) -> &Dlmalloc {
-        unsafe {
-            let id = DOMAINID.load(Ordering::Relaxed);
-            if id == 0 {
-                return &DLMALLOC;
-            } else {
-                alloc_allocator(id - 1);
-                match DOMAINALLOC.get(id - 1) {
-                    Some(allocator) => return allocator,
-                    None => return &DLMALLOC,
-                }
-            }
-            // return &DLMALLOC;
-        }
+        unsafe { allocator(self.0) }
     }
 }
 
 impl DerefMut for Instance {
+    #[inline]
     fn deref_mut(&mut self) -> &mut Dlmalloc {
-        unsafe {
-            let id = DOMAINID.load(Ordering::Relaxed);
-            if id == 0 {
-                return &mut DLMALLOC;
-            } else {
-                alloc_allocator(id - 1);
-                match DOMAINALLOC.get_mut(id - 1) {
-                    Some(allocator) => return allocator,
-                    None => return &mut DLMALLOC,
-                }
-            }
-            // return &mut DLMALLOC;
-        }
+        unsafe { allocator(self.0) }
     }
 }
 
 impl Drop for Instance {
     fn drop(&mut self) {
-        ::sys::release_global_lock()
+        unlock_heap(self.0)
     }
 }
 
-macro_rules! wasicall {
-    ($e:expr) => {{
-        getrandom::getrandom($e)
-    }};
-    () => {};
-}
-
 macro_rules! CreateDomain {
     ($prot:expr) => {{
         // let mut ret = Self::get_freed_domain();
         // if ret != 0 {
         //     return ret;
         // }
-        let ret;
-        let mut buf = [0x01, 0x21, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0];
-        let result = wasicall!(&mut buf);
-        match result {
-            Ok(_) => ret = buf[2] as usize,
-            Err(_) => {
-                panic!("CreateDomain");
-            }
+        let pkey = unsafe { hostcall::pkey_alloc(0, 0) };
+        if pkey < 0 {
+            panic!("CreateDomain");
         }
+        let ret = pkey as usize;
         unsafe {
             DOMAINS.prot[ret] = $prot;
             DOMAINS.used[ret] = 1;
         }
+        Self::update_domain_pkru(ret);
         ret
     }};
-    () => {
-        wasicall!();
-    };
+    () => {};
 }
 
 macro_rules! FreeDomain {
@@ -178,17 +670,13 @@ macro_rules! FreeDomain {
         //     DOMAINS.prot[pkey] = 0;
         //     DOMAINS.used[pkey] = 2;
         // }
-        let mut buf = [0x01, 0x4B, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0];
-        buf[2..6].copy_from_slice(&$pkey.to_be_bytes());
-        let result = wasicall!(&mut buf);
-        match result {
-            Ok(_) => unsafe {
-                DOMAINS.prot[$pkey] = 0;
-            },
-            Err(_) => {
-                panic!("FreeDomain");
-            }
+        if unsafe { hostcall::pkey_free($pkey as u32) } < 0 {
+            panic!("FreeDomain");
         }
+        unsafe {
+            DOMAINS.prot[$pkey] = 0;
+        }
+        Self::update_domain_pkru($pkey);
     }};
     () => {};
 }
@@ -198,41 +686,21 @@ macro_rules! ProtectDomain {
         let pkey = GlobalDlmalloc::get_domain_id();
         if pkey != 0 {
             let prot = 3;
-            let mut buf = [0x01, 0x20, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0];
-            buf[2..6].copy_from_slice(&$addr.to_be_bytes());
-            buf[6..10].copy_from_slice(&$len.to_be_bytes());
-            buf[10] = prot as u8;
-            buf[11] = pkey as u8;
-            let result = wasicall!(&mut buf);
-            match result {
-                Ok(_) => {}
-                Err(_) => {
-                    panic!("domain_protect");
-                }
+            if unsafe { hostcall::pkey_mprotect($addr, $len, prot, pkey as u32) } < 0 {
+                panic!("domain_protect");
             }
         }
     }};
+    () => {};
 }
 
 macro_rules! mmapMemory {
     ($addr:expr, $len:expr, $prot:expr, $flags:expr) => {{
-        let mut buf = [0x01, 0x2B, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0];
-        buf[2..6].copy_from_slice(&$addr.to_be_bytes());
-        buf[6..10].copy_from_slice(&$len.to_be_bytes());
-        buf[10] = $prot;
-        buf[11] = $flags;
-        let result = wasicall!(&mut buf);
-        match result {
-            Ok(_) => {
-                let map_addr = u32::from_be_bytes(
-                    <[u8; 4]>::try_from(&buf[2..6]).expect("u32::from_be_bytes fails"),
-                );
-                map_addr as *mut u8
-            }
-            Err(_) => {
-                panic!("mmap");
-            }
+        let map_addr = unsafe { hostcall::mmap($addr, $len, $prot as u32, $flags as u32) };
+        if map_addr == -1 {
+            panic!("mmap");
         }
+        map_addr as u32 as *mut u8
     }};
     () => {};
 }
@@ -15,6 +15,8 @@
 #![no_std]
 #![deny(missing_docs)]
 #![cfg_attr(target_arch = "wasm64", feature(simd_wasm64))]
+#![cfg_attr(feature = "allocator-api", feature(allocator_api))]
+#![cfg_attr(target_feature = "atomics", feature(thread_local))]
 
 #[cfg(not(feature = "std"))]
 extern crate alloc;
@@ -26,9 +28,15 @@ use core::ptr;
 use sys::System;
 
 #[cfg(feature = "global")]
-pub use self::global::{enable_alloc_after_fork, GlobalDlmalloc};
+pub use self::global::{enable_alloc_after_fork, DomainAlloc, GlobalDlmalloc, HeapStats};
+#[cfg(feature = "global")]
+pub use self::ring::{DomainRing, RingRead, RingWrite};
+#[cfg(feature = "global")]
+pub use self::trace::{
+    TraceRecord, TRACE_CALLOC, TRACE_FREE, TRACE_MAGIC, TRACE_MALLOC, TRACE_MOVED, TRACE_REALLOC,
+};
 
-pub use self::domain::{Domain, PKEY_DISABLE_ACCESS, PKEY_DISABLE_WRITE};
+pub use self::domain::{Domain, DomainRange, HostStats, PKEY_DISABLE_ACCESS, PKEY_DISABLE_WRITE};
 
 #[cfg(target_family = "wasm")]
 pub use self::sys::Monitor;
@@ -39,6 +47,10 @@ mod dlmalloc;
 mod global;
 
 mod domain;
+#[cfg(feature = "global")]
+mod ring;
+#[cfg(feature = "global")]
+mod trace;
 
 /// In order for this crate to efficiently manage memory, it needs a way to communicate with the
 /// underlying platform. This `Allocator` trait provides an interface for this communication.
@@ -163,6 +175,65 @@ impl<A: Allocator> Dlmalloc<A> {
         self.0.free(ptr)
     }
 
+    /// Whether `ptr` was allocated from one of this allocator's segments,
+    /// rather than mapped on its own
+    #[cfg(feature = "global")]
+    #[inline]
+    pub(crate) unsafe fn holds(&self, ptr: *mut u8) -> bool {
+        self.0.holds(ptr)
+    }
+
+    /// A word of the region mapped for `ptr` alone that its owner may use,
+    /// or null if `ptr` was allocated from a segment
+    #[cfg(feature = "global")]
+    #[inline]
+    pub(crate) unsafe fn mmap_spare(&self, ptr: *mut u8) -> *mut usize {
+        self.0.mmap_spare(ptr)
+    }
+
+    /// Returns the number of bytes this allocator holds from the system.
+    #[inline]
+    pub fn footprint(&self) -> usize {
+        self.0.footprint
+    }
+
+    /// Returns the most bytes this allocator has held from the system.
+    #[inline]
+    pub fn max_footprint(&self) -> usize {
+        self.0.max_footprint()
+    }
+
+    /// Returns the cap set by `set_footprint_limit`, or `usize::MAX`.
+    #[inline]
+    pub fn footprint_limit(&self) -> usize {
+        self.0.footprint_limit()
+    }
+
+    /// Caps the bytes this allocator may obtain from the system. Once the
+    /// cap is reached, allocations which need more memory return null
+    /// instead of growing the heap. `usize::MAX` lifts the cap. Returns the
+    /// cap in effect, rounded up to the allocator's granularity.
+    #[inline]
+    pub fn set_footprint_limit(&mut self, bytes: usize) -> usize {
+        self.0.set_footprint_limit(bytes)
+    }
+
+    /// Returns the unit in which this allocator obtains memory from the
+    /// system.
+    #[inline]
+    pub fn granularity(&self) -> usize {
+        self.0.granularity()
+    }
+
+    /// Sets the unit in which this allocator obtains memory from the system,
+    /// rounded to a power of two from 4 KiB to 64 KiB. A small heap wastes
+    /// less with a small unit but grows in more steps. Returns the unit in
+    /// effect.
+    #[inline]
+    pub fn set_granularity(&mut self, bytes: usize) -> usize {
+        self.0.set_granularity(bytes)
+    }
+
     /// Reallocates `ptr`, a previous allocation with `old_size` and
     /// `old_align`, to have `new_size` and the same alignment as before.
     ///
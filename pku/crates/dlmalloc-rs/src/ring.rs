@@ -0,0 +1,197 @@
+//! A single-producer, single-consumer ring between two domains whose slots
+//! change hands by PKRU rights instead of copies.
+
+use core::alloc::{GlobalAlloc, Layout};
+use core::ops::{Deref, DerefMut};
+use core::slice;
+use core::sync::atomic::{AtomicBool, AtomicUsize, Ordering};
+
+use {Domain, DomainAlloc, GlobalDlmalloc, PKEY_DISABLE_ACCESS, PKEY_DISABLE_WRITE};
+
+/// Slots are aligned to this
+const RING_ALIGN: usize = 16;
+/// The slots are whole pages of the root heap, so only they change keys
+const RING_PAGE: usize = 4096;
+
+/// A ring handing fixed-size messages from `producer` to `consumer`. The
+/// slots live in root-heap pages tagged once with a key of their own, which
+/// no domain's PKRU word opens. `reserve` opens it for writing in the
+/// producer's PKRU until the slot is committed, `peek` for reading in the
+/// consumer's until it is released, so nothing is copied or re-tagged per
+/// message. The rights are the calling thread's and do not follow a switch
+/// into another domain.
+pub struct DomainRing {
+    producer: usize,
+    consumer: usize,
+    pkey: u32,
+    slots: *mut u8,
+    slot_size: usize,
+    count: usize,
+    head: AtomicUsize,
+    tail: AtomicUsize,
+    writing: AtomicBool,
+    reading: AtomicBool,
+}
+
+unsafe impl Send for DomainRing {}
+unsafe impl Sync for DomainRing {}
+
+impl DomainRing {
+    /// A ring of `count` slots of `slot_size` bytes, `None` if the memory or
+    /// a key for it cannot be had.
+    pub fn new(producer: usize, consumer: usize, slot_size: usize, count: usize) -> Option<Self> {
+        if slot_size == 0 || count == 0 {
+            return None;
+        }
+        let slot_size = slot_size.checked_add(RING_ALIGN - 1)? & !(RING_ALIGN - 1);
+        let len = slot_size.checked_mul(count)?.checked_add(RING_PAGE - 1)? & !(RING_PAGE - 1);
+        let layout = Layout::from_size_align(len, RING_PAGE).ok()?;
+        let slots = unsafe { DomainAlloc::<0>.alloc(layout) };
+        if slots.is_null() {
+            return None;
+        }
+        let pkey = match Domain::exchange_key(slots as usize, len) {
+            Some(pkey) => pkey,
+            None => {
+                unsafe { DomainAlloc::<0>.dealloc(slots, layout) };
+                return None;
+            }
+        };
+        // pkey_alloc may have left the key open to this thread.
+        Domain::set_key_rights(pkey, PKEY_DISABLE_ACCESS);
+        Some(DomainRing {
+            producer,
+            consumer,
+            pkey,
+            slots,
+            slot_size,
+            count,
+            head: AtomicUsize::new(0),
+            tail: AtomicUsize::new(0),
+            writing: AtomicBool::new(false),
+            reading: AtomicBool::new(false),
+        })
+    }
+
+    /// The size of a slot
+    pub fn slot_size(&self) -> usize {
+        self.slot_size
+    }
+
+    /// The producer's next free slot, writable until the guard is dropped,
+    /// which hands it to the consumer. `None` if the ring is full, the
+    /// producer holds a slot already or the current domain is not the
+    /// producer.
+    pub fn reserve(&self) -> Option<RingWrite<'_>> {
+        if GlobalDlmalloc::get_domain_id() != self.producer
+            || self.writing.swap(true, Ordering::Relaxed)
+        {
+            return None;
+        }
+        let head = self.head.load(Ordering::Relaxed);
+        if head.wrapping_sub(self.tail.load(Ordering::Acquire)) == self.count {
+            self.writing.store(false, Ordering::Relaxed);
+            return None;
+        }
+        Domain::set_key_rights(self.pkey, 0);
+        Some(RingWrite {
+            ring: self,
+            slot: self.slot(head),
+        })
+    }
+
+    /// The consumer's oldest slot, readable until the guard is dropped,
+    /// which gives it back to the producer. `None` if the ring is empty,
+    /// the consumer holds a slot already or the current domain is not the
+    /// consumer.
+    pub fn peek(&self) -> Option<RingRead<'_>> {
+        if GlobalDlmalloc::get_domain_id() != self.consumer
+            || self.reading.swap(true, Ordering::Relaxed)
+        {
+            return None;
+        }
+        let tail = self.tail.load(Ordering::Relaxed);
+        if self.head.load(Ordering::Acquire) == tail {
+            self.reading.store(false, Ordering::Relaxed);
+            return None;
+        }
+        Domain::set_key_rights(self.pkey, PKEY_DISABLE_WRITE);
+        Some(RingRead {
+            ring: self,
+            slot: self.slot(tail),
+        })
+    }
+
+    fn slot(&self, index: usize) -> *mut u8 {
+        unsafe { self.slots.add(index % self.count * self.slot_size) }
+    }
+
+    fn layout(&self) -> Layout {
+        let len = (self.slot_size * self.count + RING_PAGE - 1) & !(RING_PAGE - 1);
+        unsafe { Layout::from_size_align_unchecked(len, RING_PAGE) }
+    }
+}
+
+impl Drop for DomainRing {
+    fn drop(&mut self) {
+        let layout = self.layout();
+        Domain::free_exchange_key(self.slots as usize, layout.size(), self.pkey);
+        unsafe { DomainAlloc::<0>.dealloc(self.slots, layout) };
+    }
+}
+
+/// A slot reserved by the producer, see `DomainRing::reserve`
+pub struct RingWrite<'a> {
+    ring: &'a DomainRing,
+    slot: *mut u8,
+}
+
+impl Deref for RingWrite<'_> {
+    type Target = [u8];
+
+    fn deref(&self) -> &[u8] {
+        unsafe { slice::from_raw_parts(self.slot, self.ring.slot_size) }
+    }
+}
+
+impl DerefMut for RingWrite<'_> {
+    fn deref_mut(&mut self) -> &mut [u8] {
+        unsafe { slice::from_raw_parts_mut(self.slot, self.ring.slot_size) }
+    }
+}
+
+impl Drop for RingWrite<'_> {
+    fn drop(&mut self) {
+        Domain::set_key_rights(self.ring.pkey, PKEY_DISABLE_ACCESS);
+        let head = self.ring.head.load(Ordering::Relaxed);
+        self.ring
+            .head
+            .store(head.wrapping_add(1), Ordering::Release);
+        self.ring.writing.store(false, Ordering::Relaxed);
+    }
+}
+
+/// A slot peeked by the consumer, see `DomainRing::peek`
+pub struct RingRead<'a> {
+    ring: &'a DomainRing,
+    slot: *const u8,
+}
+
+impl Deref for RingRead<'_> {
+    type Target = [u8];
+
+    fn deref(&self) -> &[u8] {
+        unsafe { slice::from_raw_parts(self.slot, self.ring.slot_size) }
+    }
+}
+
+impl Drop for RingRead<'_> {
+    fn drop(&mut self) {
+        Domain::set_key_rights(self.ring.pkey, PKEY_DISABLE_ACCESS);
+        let tail = self.ring.tail.load(Ordering::Relaxed);
+        self.ring
+            .tail
+            .store(tail.wrapping_add(1), Ordering::Release);
+        self.ring.reading.store(false, Ordering::Relaxed);
+    }
+}
@@ -0,0 +1,195 @@
+//! Allocation traces of `GlobalDlmalloc` and `DomainAlloc`, in the format
+//! pkuc's `PKUTraceStart` records: `TRACE_MAGIC`, then a `TraceRecord` per
+//! call. A pointer's id is its address over 8, so an id names one
+//! allocation from its `alloc` to its `dealloc`. A `realloc` which moves is
+//! followed by a `TRACE_MOVED` record with the new id.
+
+#[cfg(all(unix, not(target_arch = "wasm32")))]
+extern crate libc;
+
+use core::sync::atomic::{AtomicBool, Ordering};
+
+use GlobalDlmalloc;
+
+/// First bytes of a trace
+pub const TRACE_MAGIC: &[u8; 8] = b"PKUTRC01";
+/// `TraceRecord::op` of an allocation
+pub const TRACE_MALLOC: u8 = 1;
+/// `TraceRecord::op` of a free
+pub const TRACE_FREE: u8 = 2;
+/// `TraceRecord::op` of a zeroed allocation
+pub const TRACE_CALLOC: u8 = 3;
+/// `TraceRecord::op` of a resize, by the old id
+pub const TRACE_REALLOC: u8 = 4;
+/// `TraceRecord::op` giving the new id of the resize before it
+pub const TRACE_MOVED: u8 = 5;
+
+/// One call of a trace, laid out as pkuc's `PKUTraceRecord`
+#[repr(C)]
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct TraceRecord {
+    /// The pointer's address over 8
+    pub id: u32,
+    /// Requested bytes, saturated at `u32::MAX`
+    pub size: u32,
+    /// `TRACE_*`
+    pub op: u8,
+    /// The heap's domain
+    pub domain: u8,
+    /// Zero
+    pub reserved: u16,
+}
+
+impl TraceRecord {
+    /// The id a trace gives `ptr`
+    pub fn id_of(ptr: *const u8) -> u32 {
+        (ptr as usize >> 3) as u32
+    }
+}
+
+/// Records are buffered and written a buffer at a time, with a plain
+/// `write` that does not allocate
+const TRACE_BUFFER: usize = 1024;
+
+pub(crate) static TRACING: AtomicBool = AtomicBool::new(false);
+static TRACELOCK: AtomicBool = AtomicBool::new(false);
+static mut TRACEFD: i32 = -1;
+static mut TRACEBUFFER: [TraceRecord; TRACE_BUFFER] = [TraceRecord {
+    id: 0,
+    size: 0,
+    op: 0,
+    domain: 0,
+    reserved: 0,
+}; TRACE_BUFFER];
+static mut TRACEUSED: usize = 0;
+
+fn lock_trace() {
+    while TRACELOCK
+        .compare_exchange_weak(false, true, Ordering::Acquire, Ordering::Relaxed)
+        .is_err()
+    {
+        core::hint::spin_loop();
+    }
+}
+
+fn unlock_trace() {
+    TRACELOCK.store(false, Ordering::Release);
+}
+
+#[cfg(target_arch = "wasm32")]
+mod wasi {
+    #[repr(C)]
+    pub struct Ciovec {
+        pub buf: *const u8,
+        pub len: usize,
+    }
+
+    #[link(wasm_import_module = "wasi_snapshot_preview1")]
+    extern "C" {
+        pub fn fd_write(fd: u32, iovs: *const Ciovec, iovs_len: usize, nwritten: *mut usize)
+            -> u16;
+    }
+}
+
+/// Write all of `bytes` to `fd`, false on an error
+#[cfg(target_arch = "wasm32")]
+fn write_all(fd: i32, mut bytes: &[u8]) -> bool {
+    while !bytes.is_empty() {
+        let iov = wasi::Ciovec {
+            buf: bytes.as_ptr(),
+            len: bytes.len(),
+        };
+        let mut written = 0;
+        if unsafe { wasi::fd_write(fd as u32, &iov, 1, &mut written) } != 0 {
+            return false;
+        }
+        bytes = &bytes[written..];
+    }
+    true
+}
+
+#[cfg(all(unix, not(target_arch = "wasm32")))]
+fn write_all(fd: i32, mut bytes: &[u8]) -> bool {
+    while !bytes.is_empty() {
+        let written = unsafe { libc::write(fd, bytes.as_ptr() as *const _, bytes.len()) };
+        if written < 0 {
+            return false;
+        }
+        bytes = &bytes[written as usize..];
+    }
+    true
+}
+
+#[cfg(not(any(target_arch = "wasm32", unix)))]
+fn write_all(_fd: i32, _bytes: &[u8]) -> bool {
+    false
+}
+
+/// Write out the buffer, under the trace lock
+unsafe fn flush() {
+    let bytes = core::slice::from_raw_parts(
+        core::ptr::addr_of!(TRACEBUFFER) as *const u8,
+        TRACEUSED * core::mem::size_of::<TraceRecord>(),
+    );
+    if !write_all(TRACEFD, bytes) {
+        TRACING.store(false, Ordering::Relaxed);
+    }
+    TRACEUSED = 0;
+}
+
+/// Append a record for `ptr`, unless the call failed
+pub(crate) fn record(op: u8, ptr: *const u8, size: usize, domain: usize) {
+    if ptr.is_null() {
+        return;
+    }
+    lock_trace();
+    unsafe {
+        if TRACEFD >= 0 {
+            TRACEBUFFER[TRACEUSED] = TraceRecord {
+                id: TraceRecord::id_of(ptr),
+                size: size.min(u32::MAX as usize) as u32,
+                op,
+                domain: domain as u8,
+                reserved: 0,
+            };
+            TRACEUSED += 1;
+            if TRACEUSED == TRACE_BUFFER {
+                flush();
+            }
+        }
+    }
+    unlock_trace();
+}
+
+impl GlobalDlmalloc {
+    /// Record every allocation to `fd`, e.g. a file's `as_raw_fd()`, until
+    /// `trace_stop`. The file has to stay open that long. Returns false if
+    /// writing to `fd` failed or the target cannot write files.
+    pub fn trace_start(fd: i32) -> bool {
+        Self::trace_stop();
+        lock_trace();
+        let ok = write_all(fd, TRACE_MAGIC);
+        if ok {
+            unsafe {
+                TRACEFD = fd;
+            }
+            TRACING.store(true, Ordering::Relaxed);
+        }
+        unlock_trace();
+        ok
+    }
+
+    /// Write out the records still buffered and stop recording. The file
+    /// is left open.
+    pub fn trace_stop() {
+        TRACING.store(false, Ordering::Relaxed);
+        lock_trace();
+        unsafe {
+            if TRACEFD >= 0 {
+                flush();
+                TRACEFD = -1;
+            }
+        }
+        unlock_trace();
+    }
+}
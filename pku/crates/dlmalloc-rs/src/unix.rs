@@ -108,12 +108,18 @@ pub unsafe fn enable_alloc_after_fork() {
     // where the handler attempts to acquire the global lock twice
     static mut FORK_PROTECTED: bool = false;
 
+    // the heap locks of the global allocator are taken first,
+    // in the same order as when allocating
     unsafe extern "C" fn _acquire_global_lock() {
+        #[cfg(feature = "global")]
+        ::global::lock_heaps();
         acquire_global_lock()
     }
 
     unsafe extern "C" fn _release_global_lock() {
-        release_global_lock()
+        release_global_lock();
+        #[cfg(feature = "global")]
+        ::global::unlock_heaps();
     }
 
     acquire_global_lock();
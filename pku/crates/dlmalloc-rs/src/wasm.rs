@@ -1,11 +1,9 @@
-#[cfg(target_arch = "wasm32")]
-use core::arch::wasm32 as wasm;
-#[cfg(target_arch = "wasm64")]
-use core::arch::wasm64 as wasm;
 use core::ptr;
 use Allocator;
 
 use Domain;
+use DomainRange;
+use GlobalDlmalloc;
 
 struct MonitorMemory {
     ptr: *mut u8,
@@ -105,18 +103,222 @@ impl Monitor {
         }
     }
 
+    /// unlink the first node of at least `size` bytes, first fit
+    pub fn take(&mut self, size: usize) -> (*mut u8, usize) {
+        if self.head == ptr::null_mut() {
+            return (ptr::null_mut(), 0);
+        }
+        unsafe {
+            let mut node = self.head;
+            while (*node).get_size() < size {
+                node = (*node).get_next();
+                if node == self.head {
+                    return (ptr::null_mut(), 0);
+                }
+            }
+            // delete unlinks the head, so make the fit the head first
+            self.head = node;
+            self.delete()
+        }
+    }
+
+    /// unlink the node starting at `ptr` if it has at least `size` bytes
+    pub fn take_at(&mut self, ptr: *mut u8, size: usize) -> (*mut u8, usize) {
+        if self.head == ptr::null_mut() {
+            return (ptr::null_mut(), 0);
+        }
+        unsafe {
+            let mut node = self.head;
+            while (*node).get_ptr() != ptr {
+                node = (*node).get_next();
+                if node == self.head {
+                    return (ptr::null_mut(), 0);
+                }
+            }
+            if (*node).get_size() < size {
+                return (ptr::null_mut(), 0);
+            }
+            self.head = node;
+            self.delete()
+        }
+    }
+
     /// member function of Monitor struct
     pub fn get_footprint(&self) -> usize {
         self.footprint
     }
 
-    /// non-member function for global Monitor struct
+    /// non-member function for the pools of all domains
     pub unsafe fn monitor_footprint() -> usize {
-        MONITOR.get_footprint()
+        MONITORS.iter().map(|m| m.get_footprint()).sum()
+    }
+}
+
+const NEW_MONITOR: Monitor = Monitor::new();
+
+/// Segments the allocators gave back, one pool per protection key. The
+/// nodes live in the segments, which only their own domain can access, so
+/// a segment is only reused by the domain that freed it and keeps its tag.
+static mut MONITORS: [Monitor; NUM_RESERVES] = [NEW_MONITOR; NUM_RESERVES];
+
+/// Linear memory a domain has grown but not handed to its allocator yet,
+/// in wasm pages
+struct Reserve {
+    next: usize,
+    end: usize,
+    chunk_pages: usize,
+}
+
+/// One reserve per protection key
+const NUM_RESERVES: usize = 16;
+
+/// The first chunk a domain grows, 256 KiB; each further one doubles
+const FIRST_CHUNK_PAGES: usize = 4;
+
+/// Chunks stop doubling at 16 MiB
+const MAX_CHUNK_PAGES: usize = 256;
+
+const NEW_RESERVE: Reserve = Reserve {
+    next: 0,
+    end: 0,
+    chunk_pages: FIRST_CHUNK_PAGES,
+};
+
+static mut RESERVES: [Reserve; NUM_RESERVES] = [NEW_RESERVE; NUM_RESERVES];
+
+/// In the window layout, domain n's reserve only ever grows inside window
+/// n, `pages` wasm pages from `base + n * pages`. A domain's segments then
+/// stay contiguous, and each window is tagged in a few ranges rather than
+/// one per chunk. `pages == 0` is the default, interleaved layout.
+struct Windows {
+    base: usize,
+    pages: usize,
+}
+
+static mut WINDOWS: Windows = Windows { base: 0, pages: 0 };
+
+/// Switch to the window layout, see `GlobalDlmalloc::set_domain_windows`
+pub fn set_domain_windows(base: usize, size: usize, page_size: usize) -> bool {
+    let _shared = SharedLock::take();
+    unsafe {
+        if WINDOWS.pages != 0 || RESERVES.iter().any(|r| r.end != 0) {
+            return false;
+        }
+        if base % page_size != 0 || size < page_size {
+            return false;
+        }
+        let base = if base == 0 {
+            core::arch::wasm32::memory_size(0)
+        } else {
+            base / page_size
+        };
+        let pages = size / page_size;
+        match pages
+            .checked_mul(NUM_RESERVES)
+            .and_then(|p| p.checked_add(base))
+        {
+            Some(end) if end <= usize::max_value() / page_size => {}
+            _ => return false,
+        }
+        WINDOWS.base = base;
+        WINDOWS.pages = pages;
+        for (id, reserve) in RESERVES.iter_mut().enumerate() {
+            reserve.next = base + id * pages;
+            reserve.end = reserve.next;
+        }
+        true
     }
 }
 
-static mut MONITOR: Monitor = Monitor::new();
+/// Extend the reserve of domain `id` inside its window so at least `pages`
+/// are left, by a whole chunk if the window has room. Pages that already
+/// exist, because memory has grown for a window above, are only tagged.
+fn grow_window(id: usize, reserve: &mut Reserve, pages: usize, page_size: usize) -> bool {
+    let (limit, top) = unsafe {
+        (
+            WINDOWS.base + (id + 1) * WINDOWS.pages,
+            core::arch::wasm32::memory_size(0),
+        )
+    };
+    if limit - reserve.next < pages {
+        return false;
+    }
+    let want = reserve.next + pages - reserve.end;
+    let chunk = core::cmp::max(want, reserve.chunk_pages);
+    let mut end = core::cmp::min(reserve.end + chunk, limit);
+    if end > top && core::arch::wasm32::memory_grow(0, end - top) == usize::max_value() {
+        end = reserve.end + want;
+        if end > top && core::arch::wasm32::memory_grow(0, end - top) == usize::max_value() {
+            return false;
+        }
+    }
+    if id != 0 {
+        Domain::domain_protect_ranges(&[DomainRange {
+            addr: reserve.end * page_size,
+            len: (end - reserve.end) * page_size,
+            pkey: id as u32,
+        }]);
+    }
+    reserve.end = end;
+    reserve.chunk_pages = core::cmp::min(reserve.chunk_pages * 2, MAX_CHUNK_PAGES);
+    true
+}
+
+/// The untagged page segments below a wasm page are sliced from, in bytes.
+/// Each slice is tagged for its domain on its own; the hardware tags at
+/// 4 KiB.
+struct Slices {
+    next: usize,
+    end: usize,
+}
+
+static mut SLICES: Slices = Slices { next: 0, end: 0 };
+
+/// Reserves and pools are per domain and only touched under that domain's
+/// heap lock; what domains share is guarded by the global lock.
+struct SharedLock;
+
+impl SharedLock {
+    fn take() -> SharedLock {
+        #[cfg(feature = "global")]
+        acquire_global_lock();
+        SharedLock
+    }
+}
+
+impl Drop for SharedLock {
+    fn drop(&mut self) {
+        #[cfg(feature = "global")]
+        release_global_lock();
+    }
+}
+
+/// Take `size` bytes, a multiple of 4 KiB, from the shared page, growing a
+/// new one if this one is used up
+fn alloc_slice(size: usize, page_size: usize) -> *mut u8 {
+    let _shared = SharedLock::take();
+    unsafe {
+        if SLICES.end - SLICES.next < size {
+            let prev = core::arch::wasm32::memory_grow(0, 1);
+            if prev == usize::max_value() {
+                return ptr::null_mut();
+            }
+            SLICES.next = prev * page_size;
+            SLICES.end = SLICES.next + page_size;
+        }
+        let base = SLICES.next;
+        SLICES.next += size;
+        let pkey = GlobalDlmalloc::heap_domain_id() as u32;
+        if pkey != 0 {
+            Domain::domain_protect_ranges(&[DomainRange {
+                addr: base,
+                len: size,
+                pkey,
+            }]);
+        }
+        base as *mut u8
+    }
+}
 
 /// System setting for Wasm
 pub struct System {
@@ -131,48 +333,137 @@ impl System {
 
 unsafe impl Allocator for System {
     fn alloc(&self, size: usize) -> (*mut u8, usize, u32) {
-        // unsafe {
-        //     let (ptr, psize) = MONITOR.delete();
-        //     if ptr != ptr::null_mut() && psize != 0 {
-        //         return (ptr, psize, 0);
-        //     }
-        // }
-        let pages = size / self.page_size();
-        let prev = wasm::memory_grow(0, pages);
-        if prev == usize::max_value() {
-            return (ptr::null_mut(), 0, 0);
-        }
-        Domain::domain_protect(prev * self.page_size(), pages * self.page_size());
+        let id = GlobalDlmalloc::heap_domain_id() & (NUM_RESERVES - 1);
+        // Linear memory never shrinks, so freed segments go first.
+        let (ptr, psize) = unsafe { MONITORS[id].take(size) };
+        if ptr != ptr::null_mut() {
+            return (ptr, psize, 0);
+        }
+        // Slices would land in whichever window is at the top
+        if size < self.page_size() && unsafe { WINDOWS.pages == 0 } {
+            let ptr = alloc_slice(size, self.page_size());
+            return (ptr, if ptr == ptr::null_mut() { 0 } else { size }, 0);
+        }
+        // Segments may be a multiple of a finer granularity
+        let pages = (size + self.page_size() - 1) / self.page_size();
+        let reserve = unsafe { &mut RESERVES[id] };
+        if reserve.end - reserve.next < pages && unsafe { WINDOWS.pages != 0 } {
+            let _shared = SharedLock::take();
+            if !grow_window(id, reserve, pages, self.page_size()) {
+                return (ptr::null_mut(), 0, 0);
+            }
+        } else if reserve.end - reserve.next < pages {
+            // Whole chunks keep a domain's segments contiguous and tagged by
+            // one grow; a chunk that fails falls back to exactly the request.
+            let chunk = core::cmp::max(pages, reserve.chunk_pages);
+            let _shared = SharedLock::take();
+            let mut prev = Domain::memory_grow_in(id, chunk);
+            let mut grown = chunk;
+            if prev == usize::max_value() && chunk > pages {
+                prev = Domain::memory_grow_in(id, pages);
+                grown = pages;
+            }
+            if prev == usize::max_value() {
+                return (ptr::null_mut(), 0, 0);
+            }
+            // What is left of the old chunk is only kept if the new one
+            // follows it.
+            if prev != reserve.end {
+                reserve.next = prev;
+            }
+            reserve.end = prev + grown;
+            reserve.chunk_pages = core::cmp::min(reserve.chunk_pages * 2, MAX_CHUNK_PAGES);
+        }
+        let base = reserve.next;
+        reserve.next += pages;
         (
-            (prev * self.page_size()) as *mut u8,
+            (base * self.page_size()) as *mut u8,
             pages * self.page_size(),
             0,
         )
     }
 
-    fn remap(&self, _ptr: *mut u8, _oldsize: usize, _newsize: usize, _can_move: bool) -> *mut u8 {
-        // TODO: I think this can be implemented near the end?
-        ptr::null_mut()
+    fn remap(&self, ptr: *mut u8, oldsize: usize, newsize: usize, _can_move: bool) -> *mut u8 {
+        // Only in place; dlmalloc copies when this fails anyway.
+        if newsize <= oldsize {
+            self.free_part(ptr, oldsize, newsize);
+            return ptr;
+        }
+        let id = GlobalDlmalloc::heap_domain_id() & (NUM_RESERVES - 1);
+        let end = ptr as usize + oldsize;
+        let extra = newsize - oldsize;
+        let reserve = unsafe { &mut RESERVES[id] };
+        if end == reserve.next * self.page_size() {
+            // The region runs into the domain's reserve, and the reserve into
+            // untouched memory if it ends at the top.
+            let pages = extra / self.page_size();
+            let left = reserve.end - reserve.next;
+            if left < pages && unsafe { WINDOWS.pages != 0 } {
+                let _shared = SharedLock::take();
+                if !grow_window(id, reserve, pages, self.page_size()) {
+                    return ptr::null_mut();
+                }
+            } else if left < pages {
+                // No other domain grows between the check and ours
+                let _shared = SharedLock::take();
+                if reserve.end != core::arch::wasm32::memory_size(0) {
+                    return ptr::null_mut();
+                }
+                let prev = Domain::memory_grow_in(id, pages - left);
+                if prev == usize::max_value() {
+                    return ptr::null_mut();
+                }
+                reserve.end += pages - left;
+            }
+            reserve.next += pages;
+            return ptr;
+        }
+        // Or into a segment the domain gave back; what is left of it stays
+        // in the pool.
+        unsafe {
+            let (next, nsize) = MONITORS[id].take_at(end as *mut u8, extra);
+            if next == ptr::null_mut() {
+                return ptr::null_mut();
+            }
+            if nsize > extra {
+                MONITORS[id].insert(next.offset(extra as isize), nsize - extra);
+            }
+        }
+        ptr
     }
 
-    fn free_part(&self, _ptr: *mut u8, _oldsize: usize, _newsize: usize) -> bool {
-        false
+    fn free_part(&self, ptr: *mut u8, oldsize: usize, newsize: usize) -> bool {
+        // The tail goes back to the reserve it came from, or to the pool
+        let id = GlobalDlmalloc::heap_domain_id() & (NUM_RESERVES - 1);
+        let reserve = unsafe { &mut RESERVES[id] };
+        let len = oldsize - newsize;
+        if ptr as usize + oldsize == reserve.next * self.page_size() && len % self.page_size() == 0
+        {
+            reserve.next -= len / self.page_size();
+        } else {
+            unsafe {
+                MONITORS[id].insert(ptr.offset(newsize as isize), len);
+            }
+        }
+        true
     }
 
-    fn free(&self, _ptr: *mut u8, _size: usize) -> bool {
-        false
-        // unsafe {
-        //     MONITOR.insert(ptr, size);
-        //     true
-        // }
+    fn free(&self, ptr: *mut u8, size: usize) -> bool {
+        // Segments are freed by their own allocator, so the current domain
+        // owns the segment and its pool.
+        unsafe {
+            MONITORS[GlobalDlmalloc::heap_domain_id() & (NUM_RESERVES - 1)].insert(ptr, size);
+        }
+        true
     }
 
     fn can_release_part(&self, _flags: u32) -> bool {
-        false
+        true
     }
 
     fn allocates_zeros(&self) -> bool {
-        true
+        // Reused segments are not
+        false
     }
 
     fn page_size(&self) -> usize {
@@ -180,14 +471,27 @@ unsafe impl Allocator for System {
     }
 }
 
+#[cfg(all(feature = "global", target_feature = "atomics"))]
+static LOCK: core::sync::atomic::AtomicI32 = core::sync::atomic::AtomicI32::new(0);
+
 #[cfg(feature = "global")]
 pub fn acquire_global_lock() {
-    // single threaded, no need!
+    // single threaded without atomics, no need!
+    #[cfg(target_feature = "atomics")]
+    while LOCK.swap(1, core::sync::atomic::Ordering::Acquire) != 0 {
+        unsafe {
+            core::arch::wasm32::memory_atomic_wait32(LOCK.as_ptr(), 1, -1);
+        }
+    }
 }
 
 #[cfg(feature = "global")]
 pub fn release_global_lock() {
-    // single threaded, no need!
+    #[cfg(target_feature = "atomics")]
+    unsafe {
+        LOCK.store(0, core::sync::atomic::Ordering::Release);
+        core::arch::wasm32::memory_atomic_notify(LOCK.as_ptr(), 1);
+    }
 }
 
 #[cfg(feature = "global")]
@@ -29,3 +29,138 @@ fn strings() {
 fn threads() {
     assert!(thread::spawn(|| panic!()).join().is_err());
 }
+
+#[test]
+#[cfg(feature = "global")]
+fn domain_alloc() {
+    use dlmalloc::{DomainAlloc, GlobalDlmalloc};
+    use std::alloc::{GlobalAlloc, Layout};
+
+    let layout = Layout::from_size_align(100, 8).unwrap();
+    let before = GlobalDlmalloc::heap_stats_vector()[5];
+    unsafe {
+        let ptr = DomainAlloc::<5>.alloc(layout);
+        assert!(!ptr.is_null());
+        assert_eq!(GlobalDlmalloc::get_domain_id(), 0);
+        let stats = GlobalDlmalloc::heap_stats_vector()[5];
+        assert_eq!(stats.allocations, before.allocations + 1);
+        assert_eq!(stats.in_use, before.in_use + 100);
+        DomainAlloc::<5>.dealloc(ptr, layout);
+    }
+    assert_eq!(GlobalDlmalloc::heap_stats_vector()[5].in_use, before.in_use);
+}
+
+#[test]
+#[cfg(feature = "global")]
+fn free_in_other_domain() {
+    use dlmalloc::{DomainAlloc, GlobalDlmalloc};
+    use std::alloc::{GlobalAlloc, Layout};
+
+    // Domain 0 is current, domain 8 is no other test's. The large block is
+    // mapped on its own rather than carved from a segment.
+    for &size in &[100, 1 << 20] {
+        let layout = Layout::from_size_align(size, 8).unwrap();
+        let before = GlobalDlmalloc::heap_stats_vector()[8];
+        unsafe {
+            let ptr = DomainAlloc::<8>.alloc(layout);
+            assert!(!ptr.is_null());
+            let ptr = GlobalDlmalloc.realloc(ptr, layout, size * 2);
+            assert!(!ptr.is_null());
+            let layout = Layout::from_size_align(size * 2, 8).unwrap();
+            assert_eq!(
+                GlobalDlmalloc::heap_stats_vector()[8].in_use,
+                before.in_use + size * 2
+            );
+            GlobalDlmalloc.dealloc(ptr, layout);
+        }
+        let stats = GlobalDlmalloc::heap_stats_vector()[8];
+        assert_eq!(stats.in_use, before.in_use);
+        assert_eq!(stats.frees, before.frees + 2);
+    }
+}
+
+#[test]
+#[cfg(feature = "global")]
+fn domain_threads() {
+    use dlmalloc::{DomainAlloc, GlobalDlmalloc};
+    use std::alloc::{GlobalAlloc, Layout};
+
+    fn churn<A: GlobalAlloc>(heap: A) {
+        let mut ptrs = Vec::new();
+        for i in 0..2_000 {
+            let layout = Layout::from_size_align(i % 200 + 1, 8).unwrap();
+            unsafe {
+                let ptr = heap.alloc(layout);
+                assert!(!ptr.is_null());
+                ptr.write_bytes(i as u8, layout.size());
+                ptrs.push((ptr, layout));
+                if i % 3 == 0 {
+                    let (ptr, layout) = ptrs.swap_remove(i % ptrs.len());
+                    heap.dealloc(ptr, layout);
+                }
+            }
+        }
+        for (ptr, layout) in ptrs {
+            unsafe { heap.dealloc(ptr, layout) };
+        }
+        GlobalDlmalloc::flush_thread_cache();
+    }
+
+    let threads = vec![
+        thread::spawn(|| churn(DomainAlloc::<6>)),
+        thread::spawn(|| churn(DomainAlloc::<6>)),
+        thread::spawn(|| churn(DomainAlloc::<7>)),
+        thread::spawn(|| churn(GlobalDlmalloc)),
+    ];
+    for t in threads {
+        t.join().unwrap();
+    }
+    let stats = GlobalDlmalloc::heap_stats_vector();
+    assert_eq!(stats[6].in_use, 0);
+    assert_eq!(stats[7].in_use, 0);
+}
+
+#[test]
+#[cfg(all(feature = "global", unix))]
+fn trace_records() {
+    use dlmalloc::{DomainAlloc, GlobalDlmalloc, TraceRecord, TRACE_FREE, TRACE_MAGIC};
+    use dlmalloc::{TRACE_MALLOC, TRACE_MOVED, TRACE_REALLOC};
+    use std::alloc::{GlobalAlloc, Layout};
+    use std::os::unix::io::AsRawFd;
+
+    let path = std::env::temp_dir().join(format!("dlmalloc-trace-{}", std::process::id()));
+    let file = std::fs::File::create(&path).unwrap();
+    let layout = Layout::from_size_align(24, 8).unwrap();
+    // Other tests allocate meanwhile, but not in domain 9.
+    assert!(GlobalDlmalloc::trace_start(file.as_raw_fd()));
+    let (ptr, moved) = unsafe {
+        let ptr = DomainAlloc::<9>.alloc(layout);
+        let moved = DomainAlloc::<9>.realloc(ptr, layout, 4096);
+        DomainAlloc::<9>.dealloc(moved, Layout::from_size_align(4096, 8).unwrap());
+        (ptr, moved)
+    };
+    GlobalDlmalloc::trace_stop();
+    drop(file);
+
+    let bytes = std::fs::read(&path).unwrap();
+    std::fs::remove_file(&path).unwrap();
+    assert_eq!(&bytes[..8], TRACE_MAGIC);
+    let ops: Vec<(u8, u32, u32)> = bytes[8..]
+        .chunks(std::mem::size_of::<TraceRecord>())
+        .map(|r| {
+            let word = |i: usize| u32::from_le_bytes([r[i], r[i + 1], r[i + 2], r[i + 3]]);
+            (r[8], r[9], word(0), word(4))
+        })
+        .filter(|&(_, domain, _, _)| domain == 9)
+        .map(|(op, _, id, size)| (op, id, size))
+        .collect();
+    let mut expected = vec![
+        (TRACE_MALLOC, TraceRecord::id_of(ptr), 24),
+        (TRACE_REALLOC, TraceRecord::id_of(ptr), 4096),
+    ];
+    if moved != ptr {
+        expected.push((TRACE_MOVED, TraceRecord::id_of(moved), 4096));
+    }
+    expected.push((TRACE_FREE, TraceRecord::id_of(moved), 0));
+    assert_eq!(ops, expected);
+}
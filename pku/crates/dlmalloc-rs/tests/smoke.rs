@@ -89,3 +89,58 @@ fn stress() {
         }
     }
 }
+
+#[test]
+fn footprint_limit() {
+    let mut a = Dlmalloc::new();
+    assert_eq!(a.footprint_limit(), usize::max_value());
+    let limit = a.set_footprint_limit(100_000);
+    assert!(limit >= 100_000);
+    unsafe {
+        let small = a.malloc(1000, 1);
+        assert!(!small.is_null());
+        assert!(a.malloc(limit, 1).is_null());
+        assert!(a.footprint() <= limit);
+        a.set_footprint_limit(usize::max_value());
+        let big = a.malloc(limit, 1);
+        assert!(!big.is_null());
+        a.free(big, limit, 1);
+        a.free(small, 1000, 1);
+    }
+}
+
+#[test]
+fn large_realloc() {
+    let mut a = Dlmalloc::new();
+    unsafe {
+        let small = a.malloc(100, 8);
+        let footprint = a.footprint();
+        let mut ptr = a.malloc(1 << 20, 8);
+        assert!(!ptr.is_null());
+        *ptr = 9;
+        for shift in 21..24 {
+            ptr = a.realloc(ptr, 1 << (shift - 1), 8, 1 << shift);
+            assert!(!ptr.is_null());
+            assert_eq!(*ptr, 9);
+            *ptr.offset((1 << shift) - 1) = 10;
+        }
+        // large chunks have regions of their own, freeing gives them back
+        a.free(ptr, 1 << 23, 8);
+        assert_eq!(a.footprint(), footprint);
+        a.free(small, 100, 8);
+    }
+}
+
+#[test]
+fn granularity() {
+    let mut a = Dlmalloc::new();
+    assert_eq!(a.granularity(), 64 * 1024);
+    assert_eq!(a.set_granularity(1000), 4096);
+    unsafe {
+        let ptr = a.malloc(100, 8);
+        assert!(!ptr.is_null());
+        assert_eq!(a.footprint(), 4096);
+        a.free(ptr, 100, 8);
+    }
+    assert_eq!(a.set_granularity(1 << 20), 64 * 1024);
+}
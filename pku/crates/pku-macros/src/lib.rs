@@ -0,0 +1,90 @@
+//! Attribute macros re-exported by the `pku` crate.
+
+use proc_macro::{Delimiter, Group, Ident, Literal, Punct, Spacing, Span, TokenStream, TokenTree};
+
+/// Bind a function to a domain at compile time.
+///
+/// ```ignore
+/// #[pku::domain(1)]
+/// fn parse(input: &[u8]) -> usize { ... }
+///
+/// let n = pkucall!(parse(data));
+/// ```
+///
+/// The function is kept as it is. Next to it, in the type namespace, comes a
+/// module of the same name holding the domain as a constant. Its argument is
+/// evaluated in the function's scope. `pkucall!(parse(..))` reads that
+/// constant, so the call is the switch, the direct call and the restore.
+#[proc_macro_attribute]
+pub fn domain(attr: TokenStream, item: TokenStream) -> TokenStream {
+    if attr.is_empty() {
+        return error(Span::call_site(), "expected a domain, `#[pku::domain(N)]`");
+    }
+    let (vis, name) = match signature(&item) {
+        Some(sig) => sig,
+        None => {
+            return error(
+                Span::call_site(),
+                "`#[pku::domain]` only applies to functions",
+            )
+        }
+    };
+    // The domain is evaluated where the function is, and only read by the
+    // module.
+    let module = format!(
+        "#[doc(hidden)] #[allow(non_upper_case_globals)] \
+         const __pku_domain_{name}: usize = ({attr}) as usize; \
+         #[doc(hidden)] #[allow(non_snake_case, dead_code)] {vis} mod {name} {{ \
+         pub const DOMAIN: usize = super::__pku_domain_{name}; }}"
+    );
+    let mut out = item;
+    out.extend(module.parse::<TokenStream>().unwrap());
+    out
+}
+
+/// The visibility and name of the function `item` declares, skipping its
+/// attributes and qualifiers.
+fn signature(item: &TokenStream) -> Option<(String, String)> {
+    let mut vis = String::new();
+    let mut tokens = item.clone().into_iter().peekable();
+    while let Some(token) = tokens.next() {
+        match token {
+            TokenTree::Punct(ref p) if p.as_char() == '#' => {
+                tokens.next();
+            }
+            TokenTree::Ident(ref i) if i.to_string() == "pub" => {
+                vis.push_str("pub");
+                if let Some(TokenTree::Group(g)) = tokens.peek() {
+                    if g.delimiter() == Delimiter::Parenthesis {
+                        vis.push_str(&g.to_string());
+                        tokens.next();
+                    }
+                }
+            }
+            TokenTree::Ident(ref i) if i.to_string() == "fn" => {
+                return match tokens.next() {
+                    Some(TokenTree::Ident(name)) => Some((vis, name.to_string())),
+                    _ => None,
+                };
+            }
+            TokenTree::Group(_) => return None,
+            _ => {}
+        }
+    }
+    None
+}
+
+fn error(span: Span, message: &str) -> TokenStream {
+    let mut call: TokenStream = [
+        TokenTree::Ident(Ident::new("compile_error", span)),
+        TokenTree::Punct(Punct::new('!', Spacing::Alone)),
+    ]
+    .into_iter()
+    .collect();
+    let arg = TokenTree::Literal(Literal::string(message));
+    call.extend([
+        TokenTree::Group(Group::new(Delimiter::Parenthesis, arg.into())),
+        TokenTree::Punct(Punct::new(';', Spacing::Alone)),
+    ]);
+    call
+}
@@ -1,22 +1,123 @@
-use std::cell::RefCell;
-
-pub use dlmalloc::{Domain, GlobalDlmalloc, PKEY_DISABLE_ACCESS, PKEY_DISABLE_WRITE};
-
+#![cfg_attr(feature = "allocator-api", feature(allocator_api))]
+
+pub use dlmalloc::{
+    Domain, DomainAlloc, DomainRange, DomainRing, GlobalDlmalloc, RingRead, RingWrite, TraceRecord,
+    PKEY_DISABLE_ACCESS, PKEY_DISABLE_WRITE, TRACE_CALLOC, TRACE_FREE, TRACE_MAGIC, TRACE_MALLOC,
+    TRACE_MOVED, TRACE_REALLOC,
+};
+pub use pku_macros::domain;
+
+/// A box in domain `D`'s heap, see `DomainAlloc`
+#[cfg(feature = "allocator-api")]
+pub type DomainBox<T, const D: usize> = Box<T, DomainAlloc<D>>;
+
+/// A vector in domain `D`'s heap, see `DomainAlloc`
+#[cfg(feature = "allocator-api")]
+pub type DomainVec<T, const D: usize> = Vec<T, DomainAlloc<D>>;
+
+/// Call a function bound to a domain by `#[pku::domain(N)]` inside that
+/// domain. The domain is a constant, so this is the switch, the direct call
+/// and the restore.
+///
+/// ```ignore
+/// #[pku::domain(1)]
+/// fn func() {}
+///
+/// pkucall!(func());
+/// ```
 #[macro_export]
 macro_rules! pkucall {
     ($func:ident( $( $arg:expr ),* )) => {
         {
-            let old_domain = GlobalDlmalloc::get_domain_id();
-            let new_domain = find_domain($func as *const ());
-            let prot = Domain::get_domain_prot(new_domain);
-            Domain::switch_domain(new_domain, prot);
+            let old_domain = $crate::GlobalDlmalloc::get_domain_id();
+            let new_domain = $func::DOMAIN;
+            let prot = $crate::Domain::get_domain_prot(new_domain);
+            $crate::Domain::switch_domain(new_domain, prot);
             let ret = $func( $( $arg ),* );
-            Domain::restore_domain(new_domain, old_domain, PKEY_DISABLE_ACCESS | PKEY_DISABLE_WRITE);
+            $crate::Domain::restore_domain(
+                new_domain,
+                old_domain,
+                $crate::PKEY_DISABLE_ACCESS | $crate::PKEY_DISABLE_WRITE,
+            );
             ret
         }
     };
 }
 
+/// Call a function bound to a domain by `#[pku::domain(N)]` on every
+/// argument of a slice, entering the domain once for the batch instead of
+/// once per call, see `call_batch`. Arguments are cloned into the call.
+///
+/// ```ignore
+/// let mut out = [0; 4];
+/// pkucall_batch!(func, &[1, 2, 3, 4], &mut out);
+/// ```
+#[macro_export]
+macro_rules! pkucall_batch {
+    ($func:ident, $args:expr, $results:expr) => {
+        $crate::call_batch($func::DOMAIN, $args, $results, |arg| $func(arg.clone()))
+    };
+}
+
+/// Run `f` on every element of `args` inside `domain`, entering it once,
+/// and store the results at the same indices of `results`. Stops at the
+/// shorter of the two. The results are plain data, so no value is dropped
+/// or freed inside the domain.
+pub fn call_batch<T, R: Copy, F: FnMut(&T) -> R>(
+    domain: usize,
+    args: &[T],
+    results: &mut [R],
+    mut f: F,
+) {
+    let _scope = DomainScope::enter(domain);
+    for (arg, result) in args.iter().zip(results.iter_mut()) {
+        *result = f(arg);
+    }
+}
+
+/// Run a block inside a domain, entering it once and restoring the caller's
+/// domain when the block is left, also through `return`, `?` or a panic.
+/// `pkucall!`s into the same domain inside the block find it current and
+/// skip both PKRU writes.
+///
+/// ```ignore
+/// let sum = pku_scope!(domain => {
+///     (0..10).map(|i| pkucall!(lookup(i))).sum::<u32>()
+/// });
+/// ```
+#[macro_export]
+macro_rules! pku_scope {
+    ($domain:expr => $body:block) => {{
+        let _scope = $crate::DomainScope::enter($domain);
+        $body
+    }};
+}
+
+/// Guard behind `pku_scope!`, keeping a domain entered until dropped.
+pub struct DomainScope {
+    domain: usize,
+    old_domain: usize,
+}
+
+impl DomainScope {
+    /// Enter `domain` with its registered protection.
+    pub fn enter(domain: usize) -> Self {
+        let old_domain = GlobalDlmalloc::get_domain_id();
+        Domain::switch_domain(domain, Domain::get_domain_prot(domain));
+        DomainScope { domain, old_domain }
+    }
+}
+
+impl Drop for DomainScope {
+    fn drop(&mut self) {
+        Domain::restore_domain(
+            self.domain,
+            self.old_domain,
+            PKEY_DISABLE_ACCESS | PKEY_DISABLE_WRITE,
+        );
+    }
+}
+
 // #[macro_export]
 // macro_rules! testcall {
 //     (@_@) => {
@@ -32,51 +133,6 @@ macro_rules! pkucall {
 //     };
 // }
 
-struct PKUCall {
-    func: *const (),
-    domain: usize,
-}
-
-thread_local!(static PKUREGISTCALL: RefCell<Vec<PKUCall>> = RefCell::new(Vec::new()));
-
-impl PKUCall {
-    pub fn new(func: *const (), domain: usize) -> Self {
-        PKUCall {
-            func: (func),
-            domain: (domain),
-        }
-    }
-
-    pub fn get_func(&self) -> *const () {
-        self.func
-    }
-
-    pub fn get_domain(&self) -> usize {
-        self.domain
-    }
-}
-
-pub fn register_pku_call(func: *const (), domain: usize) {
-    if domain != 0 {
-        PKUREGISTCALL.with(|pku| {
-            pku.borrow_mut().push(PKUCall::new(func, domain));
-        });
-    }
-}
-
-pub fn find_domain(func: *const ()) -> usize {
-    PKUREGISTCALL.with(|pku| {
-        let mut domain = 0;
-        for iter in pku.borrow().iter() {
-            if iter.get_func() as *const () == func {
-                domain = iter.get_domain();
-                break;
-            }
-        }
-        return domain;
-    })
-}
-
 #[cfg(target_arch = "wasm32")]
 pub fn get_memory_footprint() -> usize {
     GlobalDlmalloc::get_memory_footprint()
@@ -97,9 +153,13 @@ mod tests {
     #[global_allocator]
     static GLOBAL: GlobalDlmalloc = GlobalDlmalloc;
 
-    fn func(s: &mut String) {
+    // The current domain is process-wide, tests switching it must not overlap.
+    static DOMAIN_LOCK: std::sync::Mutex<()> = std::sync::Mutex::new(());
+
+    #[domain(3)]
+    fn func(x: usize) -> usize {
         let _ = Box::new(5);
-        s.push_str("func");
+        x + GlobalDlmalloc::get_domain_id()
     }
 
     fn rdpkru() -> i32 {
@@ -107,13 +167,66 @@ mod tests {
         return ecx;
     }
 
+    fn lookup_in_scope(domain: usize) -> Option<usize> {
+        pku_scope!(domain => {
+            if GlobalDlmalloc::get_domain_id() == domain {
+                return Some(domain);
+            }
+        });
+        None
+    }
+
+    #[test]
+    fn scope_restores_domain() {
+        let _lock = DOMAIN_LOCK.lock().unwrap();
+        assert_eq!(lookup_in_scope(3), Some(3));
+        assert_eq!(GlobalDlmalloc::get_domain_id(), 0);
+
+        let inner = pku_scope!(3 => { GlobalDlmalloc::get_domain_id() });
+        assert_eq!(inner, 3);
+        assert_eq!(GlobalDlmalloc::get_domain_id(), 0);
+    }
+
+    #[test]
+    fn ring_hands_slots_over() {
+        let _lock = DOMAIN_LOCK.lock().unwrap();
+        let ring = DomainRing::new(0, 3, 8, 2).unwrap();
+        for i in 0..2u8 {
+            let mut slot = ring.reserve().unwrap();
+            slot[0] = i;
+        }
+        assert!(ring.reserve().is_none());
+        // Only the consumer may peek.
+        assert!(ring.peek().is_none());
+        pku_scope!(3 => {
+            assert!(ring.reserve().is_none());
+            assert_eq!(ring.peek().unwrap()[0], 0);
+            let slot = ring.peek().unwrap();
+            assert_eq!(slot[0], 1);
+            assert!(ring.peek().is_none());
+        });
+        assert_eq!(ring.reserve().unwrap().len(), 16);
+    }
+
+    #[domain(3)]
+    fn square(x: usize) -> usize {
+        x * x + GlobalDlmalloc::get_domain_id()
+    }
+
+    #[test]
+    fn batch_enters_domain_once() {
+        let _lock = DOMAIN_LOCK.lock().unwrap();
+        let mut out = [0; 3];
+        pkucall_batch!(square, &[1, 2, 3], &mut out);
+        assert_eq!(out, [4, 7, 12]);
+        assert_eq!(GlobalDlmalloc::get_domain_id(), 0);
+    }
+
     #[test]
     fn it_works() {
-        let domain = Domain::create_domain(0);
-        register_pku_call(func as *const (), domain);
-        let mut s = String::new();
-        pkucall!(func(&mut s));
-        println!("{s}");
+        let _lock = DOMAIN_LOCK.lock().unwrap();
+        assert_eq!(pkucall!(func(1)), 4);
+        assert_eq!(GlobalDlmalloc::get_domain_id(), 0);
         println!("rdpkru = 0x{:x}", rdpkru());
     }
 }
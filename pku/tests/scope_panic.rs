@@ -0,0 +1,25 @@
+//! `pku_scope!` left through a panic. The panic is allocated in the scope's
+//! domain and freed once it is left, back to that domain's heap.
+
+use pku::{pku_scope, Domain, GlobalDlmalloc};
+use std::panic;
+use std::sync::atomic::{AtomicU32, Ordering};
+
+#[global_allocator]
+static GLOBAL: GlobalDlmalloc = GlobalDlmalloc;
+
+#[test]
+fn scope_restores_pkru_after_panic() {
+    let pkru = Domain::current_pkru();
+    let inside = AtomicU32::new(pkru);
+    let result = panic::catch_unwind(|| {
+        pku_scope!(3 => {
+            inside.store(Domain::current_pkru(), Ordering::Relaxed);
+            panic!("leaving the scope");
+        })
+    });
+    assert!(result.is_err());
+    assert_ne!(inside.load(Ordering::Relaxed), pkru);
+    assert_eq!(Domain::current_pkru(), pkru);
+    assert_eq!(GlobalDlmalloc::get_domain_id(), 0);
+}
@@ -1,6 +1,7 @@
 #include "PKUInternal.h"
 
-static unsigned int CURRENT_DID = 0;
+/* PKRU is per thread, so is the domain running on it */
+static __thread unsigned int CURRENT_DID = 0;
 
 unsigned int GetCurrentDid()
 {
@@ -11,4 +12,242 @@ int SetCurrentDid(unsigned int did)
 {
     CURRENT_DID = did;
     return 0;
-}
\ No newline at end of file
+}
+#ifndef __wasm__
+#include <errno.h>
+
+/* The native build has no `pku` host module to import from, so it goes to
+ * the kernel and the CPU directly where PKU is available. */
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#if defined(SYS_pkey_alloc) && defined(SYS_pkey_free) && defined(SYS_pkey_mprotect)
+#define PKU_NATIVE 1
+#endif
+#endif
+
+#ifdef PKU_NATIVE
+/* Layout of PKURange in pku.h */
+typedef struct NativeRange
+{
+    void* addr;
+    size_t length;
+    unsigned int pkey;
+} NativeRange;
+
+static int g_HasPKU = -1;
+
+/* CPUID.(EAX=7,ECX=0):ECX.OSPKE, i.e. PKU is there and CR4.PKE is set */
+static int HasPKU(void)
+{
+    if (g_HasPKU < 0)
+    {
+        unsigned int eax, ebx, ecx, edx;
+        g_HasPKU = __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && (ecx & (1u << 4));
+    }
+    return g_HasPKU;
+}
+
+static inline unsigned int NativeRdpkru(void)
+{
+    unsigned int eax, edx;
+    __asm__ volatile(".byte 0x0f,0x01,0xee" : "=a"(eax), "=d"(edx) : "c"(0));
+    return eax;
+}
+
+static inline void NativeWrpkru(unsigned int pkru)
+{
+    __asm__ volatile(".byte 0x0f,0x01,0xef" : : "a"(pkru), "c"(0), "d"(0) : "memory");
+}
+
+static int NativeSyscall(long ret)
+{
+    return ret < 0 ? -errno : (int)ret;
+}
+#endif
+
+unsigned int __pku_rdpkru(void)
+{
+#ifdef PKU_NATIVE
+    if (HasPKU())
+    {
+        return NativeRdpkru();
+    }
+#endif
+    return 0;
+}
+
+void __pku_wrpkru(unsigned int pkru)
+{
+#ifdef PKU_NATIVE
+    if (HasPKU())
+    {
+        NativeWrpkru(pkru);
+    }
+#endif
+}
+
+int __pku_pkey_alloc(unsigned int flags, unsigned int AccessRights)
+{
+#ifdef PKU_NATIVE
+    if (HasPKU())
+    {
+        return NativeSyscall(syscall(SYS_pkey_alloc, flags, AccessRights));
+    }
+#endif
+    return -ENOSYS;
+}
+
+int __pku_pkey_free(unsigned int pkey)
+{
+#ifdef PKU_NATIVE
+    if (HasPKU())
+    {
+        return NativeSyscall(syscall(SYS_pkey_free, pkey));
+    }
+#endif
+    return -ENOSYS;
+}
+
+int __pku_pkey_mprotect(void* addr, size_t len, unsigned int prot, unsigned int pkey)
+{
+#ifdef PKU_NATIVE
+    if (HasPKU())
+    {
+        // Callers tag allocator chunks, the kernel wants whole pages.
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        size_t start = (size_t)addr & ~(page - 1);
+        size_t end = ((size_t)addr + len + page - 1) & ~(page - 1);
+        return NativeSyscall(syscall(SYS_pkey_mprotect, (void*)start, end - start, prot, pkey));
+    }
+#endif
+    return -ENOSYS;
+}
+
+int __pku_pkey_mprotect_ranges(const void* ranges, size_t count)
+{
+#ifdef PKU_NATIVE
+    if (HasPKU())
+    {
+        // The guest already dropped and merged what it could, see
+        // DomainProtectRanges, so this is one pkey_mprotect per entry.
+        const NativeRange* range = ranges;
+        for (size_t i = 0; i < count; ++i)
+        {
+            int error = __pku_pkey_mprotect(range[i].addr, range[i].length, PROT_READ | PROT_WRITE, range[i].pkey);
+            if (error != 0)
+            {
+                return error;
+            }
+        }
+        return 0;
+    }
+#endif
+    return -ENOSYS;
+}
+
+int __pku_queue_register(void* ring, unsigned int capacity)
+{
+    // No host drains a ring natively; DomainProtectDeferred then falls back
+    // to DomainProtect.
+    return -ENOSYS;
+}
+
+int __pku_queue_flush(void)
+{
+    return -ENOSYS;
+}
+
+int __pku_stats_register(void* table, unsigned int count)
+{
+    // Natively the table is only read in process, see PKUDomainGetStats.
+    return -ENOSYS;
+}
+
+int __pku_stats(void* buf, size_t len)
+{
+    // No host counts on our behalf natively.
+    return -ENOSYS;
+}
+
+intptr_t __pku_mmap(void* addr, size_t len, int prot, int flags)
+{
+    return -1;
+}
+
+int __pku_huge_page_offset(void)
+{
+    // Addresses are the host's own.
+    return 0;
+}
+
+int __pku_map_huge(void* addr, size_t len, unsigned int pkey, unsigned int flags)
+{
+#ifdef PKU_NATIVE
+    size_t mask = ((size_t)2 << 20) - 1;
+    if (len == 0 || ((size_t)addr & mask) != 0 || (len & mask) != 0)
+    {
+        return -EINVAL;
+    }
+    if (flags & 1)
+    {
+        if (mmap(addr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_HUGETLB, -1, 0) ==
+            MAP_FAILED)
+        {
+            return -errno;
+        }
+    }
+    else if (madvise(addr, len, MADV_HUGEPAGE) != 0)
+    {
+        return -errno;
+    }
+    if (HasPKU())
+    {
+        return NativeSyscall(syscall(SYS_pkey_mprotect, addr, len, PROT_READ | PROT_WRITE, pkey));
+    }
+    return 0;
+#else
+    return -ENOSYS;
+#endif
+}
+
+int __pku_decommit(void* addr, size_t len)
+{
+#ifdef PKU_NATIVE
+    // Whole pages only, like the host.
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t start = ((size_t)addr + page - 1) & ~(page - 1);
+    size_t end = ((size_t)addr + len) & ~(page - 1);
+    if (start >= end)
+    {
+        return 0;
+    }
+    if (madvise((void*)start, end - start, MADV_DONTNEED) != 0)
+    {
+        return -errno;
+    }
+    if (HasPKU())
+    {
+        return NativeSyscall(syscall(SYS_pkey_mprotect, (void*)start, end - start, PROT_READ | PROT_WRITE, 0));
+    }
+    return 0;
+#else
+    return -ENOSYS;
+#endif
+}
+
+unsigned int __pkuwa_rdpkru(void)
+{
+    return __pku_rdpkru();
+}
+
+unsigned int __pkuwa_wrpkru(unsigned int pkru)
+{
+    __pku_wrpkru(pkru);
+    return pkru;
+}
+#endif
@@ -1,7 +1,10 @@
 #ifndef _PKU_INTERNAL_H_
 #define _PKU_INTERNAL_H_
 
-#define NUM_DOMAINS 16
+#include <stddef.h>
+#include <stdint.h>
+
+#define NUM_DOMAINS 128
 
 #ifdef __cplusplus
 extern "C"
@@ -11,6 +14,45 @@ extern "C"
 unsigned int GetCurrentDid();
 int SetCurrentDid(unsigned int did);
 
+/* Typed imports of the host `pku` module. Each returns its result directly,
+ * or a negated errno on failure. Addresses are linear-memory offsets. A
+ * memory64 guest imports `pku64` instead, whose addresses and lengths are
+ * 64-bit, as is PKURange. */
+#if defined(__wasm64__)
+#define PKU_HOSTCALL(name) __attribute__((import_module("pku64"), import_name(#name)))
+#elif defined(__wasm__)
+#define PKU_HOSTCALL(name) __attribute__((import_module("pku"), import_name(#name)))
+#else
+#define PKU_HOSTCALL(name)
+#endif
+
+PKU_HOSTCALL(rdpkru) unsigned int __pku_rdpkru(void);
+PKU_HOSTCALL(wrpkru) void __pku_wrpkru(unsigned int pkru);
+PKU_HOSTCALL(pkey_alloc) int __pku_pkey_alloc(unsigned int flags, unsigned int AccessRights);
+PKU_HOSTCALL(pkey_free) int __pku_pkey_free(unsigned int pkey);
+PKU_HOSTCALL(pkey_mprotect) int __pku_pkey_mprotect(void* addr, size_t len, unsigned int prot, unsigned int pkey);
+PKU_HOSTCALL(pkey_mprotect_ranges) int __pku_pkey_mprotect_ranges(const void* ranges, size_t count);
+PKU_HOSTCALL(queue_register) int __pku_queue_register(void* ring, unsigned int capacity);
+PKU_HOSTCALL(queue_flush) int __pku_queue_flush(void);
+PKU_HOSTCALL(mmap) intptr_t __pku_mmap(void* addr, size_t len, int prot, int flags);
+PKU_HOSTCALL(decommit) int __pku_decommit(void* addr, size_t len);
+PKU_HOSTCALL(stats_register) int __pku_stats_register(void* table, unsigned int count);
+PKU_HOSTCALL(huge_page_offset) int __pku_huge_page_offset(void);
+PKU_HOSTCALL(map_huge) int __pku_map_huge(void* addr, size_t len, unsigned int pkey, unsigned int flags);
+PKU_HOSTCALL(stats) int __pku_stats(void* buf, size_t len);
+
+/* Imports of the `pkuwa` module, which Wasmtime compiles to a bare RDPKRU or
+ * WRPKRU instead of a call, since clang cannot encode those operators.
+ * Unlike the hostcalls above, they don't drain the protection queue. */
+#ifdef __wasm__
+#define PKU_INTRINSIC(name) __attribute__((import_module("pkuwa"), import_name(#name)))
+#else
+#define PKU_INTRINSIC(name)
+#endif
+
+PKU_INTRINSIC(rdpkru) unsigned int __pkuwa_rdpkru(void);
+PKU_INTRINSIC(wrpkru) unsigned int __pkuwa_wrpkru(unsigned int pkru);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,302 @@
+/* Microbenchmarks of the isolation primitives, each on its own:
+ *     bench [FILTER]
+ * runs every case whose name contains FILTER and prints one line per case,
+ *     name    time: [min median max] ns/iter
+ * over BENCH_SAMPLES samples, each of as many iterations as take about
+ * BENCH_SAMPLE_NS. Built natively against libnativepku.a as `bench` and for
+ * wasm against libpku.a as `bench.wasm`, so a regression can be put down to
+ * the compiler, the hostcall layer or the allocator by comparing the two. */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "pku.h"
+#include "PKUInternal.h"
+
+#ifndef __wasm__
+#include <sys/mman.h>
+#endif
+
+#define BENCH_SAMPLES 20
+#define BENCH_SAMPLE_NS 10000000ull
+#define BENCH_MAX_ITERS (1ull << 24)
+
+typedef void (*BenchFunc)(void* arg, size_t iters);
+
+static const char* g_Filter = NULL;
+
+static unsigned long long Now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int CompareDouble(const void* a, const void* b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+/* Time fn, doubling the iterations of a sample until one takes long enough
+ * or max_iters is reached. Cases which use up something per iteration, like
+ * linear memory, pass a small max_iters. */
+static void Bench(const char* name, BenchFunc fn, void* arg, size_t max_iters)
+{
+    if (g_Filter != NULL && strstr(name, g_Filter) == NULL)
+    {
+        return;
+    }
+
+    // Warm up, and find the iterations of a sample.
+    size_t iters = 1;
+    for (;;)
+    {
+        unsigned long long start = Now();
+        fn(arg, iters);
+        unsigned long long elapsed = Now() - start;
+        if (elapsed >= BENCH_SAMPLE_NS / 4 || iters * 2 > max_iters)
+        {
+            break;
+        }
+        iters *= 2;
+    }
+
+    double samples[BENCH_SAMPLES];
+    for (int i = 0; i < BENCH_SAMPLES; ++i)
+    {
+        unsigned long long start = Now();
+        fn(arg, iters);
+        samples[i] = (double)(Now() - start) / iters;
+    }
+    qsort(samples, BENCH_SAMPLES, sizeof(double), CompareDouble);
+    printf("%-32s time: [%.2f %.2f %.2f] ns/iter\n", name, samples[0], samples[BENCH_SAMPLES / 2],
+           samples[BENCH_SAMPLES - 1]);
+}
+
+/* pkucall round trip into an empty callee */
+
+GENPKU(bench_nop);
+
+int bench_nop(void)
+{
+    return 0;
+}
+
+GENPKU_TYPED(int, bench_nop_typed, (int x), (x));
+
+int bench_nop_typed(int x)
+{
+    return x;
+}
+
+static void BenchPkucall(void* arg, size_t iters)
+{
+    for (size_t i = 0; i < iters; ++i)
+    {
+        PKUCALL(bench_nop());
+    }
+}
+
+static void BenchPkucallTyped(void* arg, size_t iters)
+{
+    volatile int sink = 0;
+    for (size_t i = 0; i < iters; ++i)
+    {
+        sink += pku_bench_nop_typed((int)i);
+    }
+}
+
+/* Bare PKRU writes, through the pkuwa intrinsic: the word a domain runs with
+ * and back, or the same word over and over */
+
+static void BenchWrpkruToggle(void* arg, size_t iters)
+{
+    unsigned int root = __pkuwa_rdpkru();
+    unsigned int domain = root & ~(3u << (2 * *(int*)arg));
+    for (size_t i = 0; i < iters; ++i)
+    {
+        __pkuwa_wrpkru(domain);
+        __pkuwa_wrpkru(root);
+    }
+}
+
+static void BenchWrpkruSame(void* arg, size_t iters)
+{
+    unsigned int root = __pkuwa_rdpkru();
+    for (size_t i = 0; i < iters; ++i)
+    {
+        __pkuwa_wrpkru(root);
+        __pkuwa_wrpkru(root);
+    }
+}
+
+/* Tagging a range with a domain's key and back with the root's */
+
+typedef struct ProtectArg
+{
+    void* addr;
+    size_t length;
+    int did;
+} ProtectArg;
+
+static void BenchDomainProtect(void* arg, size_t iters)
+{
+    ProtectArg* p = arg;
+    for (size_t i = 0; i < iters; ++i)
+    {
+        DomainProtect(p->addr, p->length, p->did);
+        DomainProtect(p->addr, p->length, 0);
+    }
+}
+
+/* PKUDomainFree refuses while other domains live, so every iteration keeps
+ * its domain: the case runs last, one domain per sample, and past the
+ * hardware keys it times creating parked domains */
+#define CREATE_MAX_ITERS 1
+
+static void BenchCreateDomain(void* arg, size_t iters)
+{
+    for (size_t i = 0; i < iters; ++i)
+    {
+        if (PKUCreateDomain(*(unsigned int*)arg) < 0)
+        {
+            perror("PKUCreateDomain");
+            return;
+        }
+    }
+}
+
+/* malloc and free of one size class, in the root domain's heap or, inside
+ * PKU_SCOPE so no switch is timed, in a domain's */
+
+typedef struct MallocArg
+{
+    size_t size;
+    int did;
+} MallocArg;
+
+static void MallocLoop(size_t size, size_t iters)
+{
+    for (size_t i = 0; i < iters; ++i)
+    {
+        void* volatile ptr = PKUMalloc(size);
+        PKUFree(ptr);
+    }
+}
+
+static void BenchMalloc(void* arg, size_t iters)
+{
+    MallocArg* m = arg;
+    if (m->did == 0)
+    {
+        MallocLoop(m->size, iters);
+        return;
+    }
+    PKU_SCOPE(m->did)
+    {
+        MallocLoop(m->size, iters);
+    }
+}
+
+/* Growing memory and tagging the new pages: linear memory in wasm, a fresh
+ * mapping natively, and the domain allocator's page runs in both */
+
+#define GROW_PAGES 1 /* wasm pages of 64 KiB */
+#define GROW_BYTES (GROW_PAGES * 65536)
+#define GROW_MAX_ITERS 64
+
+static void BenchGrow(void* arg, size_t iters)
+{
+    int did = *(int*)arg;
+    for (size_t i = 0; i < iters; ++i)
+    {
+#ifdef __wasm__
+        size_t old = __builtin_wasm_memory_grow(0, GROW_PAGES);
+        if (old == (size_t)-1)
+        {
+            perror("memory.grow");
+            return;
+        }
+        DomainProtect((void*)(old * 65536), GROW_BYTES, did);
+#else
+        void* ptr = mmap(NULL, GROW_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ptr == MAP_FAILED)
+        {
+            perror("mmap");
+            return;
+        }
+        DomainProtect(ptr, GROW_BYTES, did);
+        DomainProtect(ptr, GROW_BYTES, 0);
+        munmap(ptr, GROW_BYTES);
+#endif
+    }
+}
+
+static void BenchPagesAlloc(void* arg, size_t iters)
+{
+    PKU_SCOPE(*(int*)arg)
+    {
+        for (size_t i = 0; i < iters; ++i)
+        {
+            void* ptr = PKUPagesAlloc(GROW_BYTES);
+            PKUPagesFree(ptr, GROW_BYTES);
+        }
+    }
+}
+
+int main(int argc, char** argv)
+{
+    char name[64];
+    g_Filter = argc > 1 ? argv[1] : NULL;
+
+    if (PKUInit(0) != 0)
+    {
+        perror("PKUInit");
+        return 1;
+    }
+    int did = PKUCreateDomain(0);
+    if (did < 0 || PKU_CALL_REGISTER(did, bench_nop) < 0 || PKU_CALL_REGISTER(did, bench_nop_typed) < 0)
+    {
+        perror("bench setup");
+        return 1;
+    }
+
+    Bench("pkucall/round-trip", BenchPkucall, NULL, BENCH_MAX_ITERS);
+    Bench("pkucall/typed", BenchPkucallTyped, NULL, BENCH_MAX_ITERS);
+
+    Bench("wrpkru/toggle", BenchWrpkruToggle, &did, BENCH_MAX_ITERS);
+    Bench("wrpkru/same", BenchWrpkruSame, NULL, BENCH_MAX_ITERS);
+
+    static const size_t ProtectSizes[] = {4096, 65536, 1 << 20};
+    for (size_t i = 0; i < sizeof(ProtectSizes) / sizeof(ProtectSizes[0]); ++i)
+    {
+        ProtectArg p = {NaiveMmap(ProtectSizes[i]), ProtectSizes[i], did};
+        if (p.addr == NULL)
+        {
+            perror("NaiveMmap");
+            return 1;
+        }
+        snprintf(name, sizeof(name), "protect/%zuK", ProtectSizes[i] / 1024);
+        Bench(name, BenchDomainProtect, &p, BENCH_MAX_ITERS);
+        PKUPagesFree(p.addr, p.length);
+    }
+
+    static const size_t MallocSizes[] = {16, 64, 256, 1024, 4096, 65536};
+    for (int in_domain = 0; in_domain <= 1; ++in_domain)
+    {
+        for (size_t i = 0; i < sizeof(MallocSizes) / sizeof(MallocSizes[0]); ++i)
+        {
+            MallocArg m = {MallocSizes[i], in_domain ? did : 0};
+            snprintf(name, sizeof(name), "malloc/%s/%zu", in_domain ? "domain" : "root", MallocSizes[i]);
+            Bench(name, BenchMalloc, &m, BENCH_MAX_ITERS);
+        }
+    }
+
+    Bench("grow/memory+tag", BenchGrow, &did, GROW_MAX_ITERS);
+    Bench("grow/pages", BenchPagesAlloc, &did, BENCH_MAX_ITERS);
+
+    static unsigned int CreateFlags[] = {0, PKU_KEY_LAZY};
+    Bench("domain/create", BenchCreateDomain, &CreateFlags[0], CREATE_MAX_ITERS);
+    Bench("domain/create-lazy", BenchCreateDomain, &CreateFlags[1], CREATE_MAX_ITERS);
+    return 0;
+}
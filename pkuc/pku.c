@@ -1,6 +1,9 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <errno.h>
+#ifdef _REENTRANT
+#include <pthread.h>
+#endif
 #include "pku.h"
 
 size_t g_MallocNumber = 0;
@@ -8,30 +11,89 @@ size_t g_FreeNumber = 0;
 size_t g_ExtraMemory = 0;
 
 PKUKey keys[NUM_DOMAINS];
-PKUCall RegisteredPKUCalls[NUM_REGISTERED_PKUCALLS];
+/* Dense table indexed by call ID, grown by doubling */
+PKUCall *RegisteredPKUCalls = NULL;
+static int g_NumPKUCalls = 0;
+static int g_PKUCallCapacity = 0;
+
+/* Open-addressed map from entry point to call ID + 1, where 0 is a free
+ * slot. Its size is a power of two kept at least twice the call count. */
+static int *g_PKUCallIndex = NULL;
+static size_t g_PKUCallIndexSize = 0;
+
+/* PKRU word of every permitted (caller, callee) transition, 0 if the caller
+ * may not call into the callee. No transition opens every key, so 0 is never
+ * a real word. */
+static unsigned int g_CallGate[NUM_DOMAINS][NUM_DOMAINS];
+/* PKUDomainAllowCaller flags of every open gate, to rebuild its word */
+static unsigned char g_CallGateFlags[NUM_DOMAINS][NUM_DOMAINS];
+
+/* Domains other than its own which PKUDomainAssignPkey granted to a domain,
+ * PKU_GRANTED | the rights, or 0. Grants name domains rather than hardware
+ * keys, which move as domains are parked and made resident again. */
+#define PKU_GRANTED 0x4
+static unsigned char g_Grants[NUM_DOMAINS][NUM_DOMAINS];
+static unsigned int g_NumGrants[NUM_DOMAINS];
+
+/*
+ * Domain ids are virtual keys, so there can be more domains than hardware
+ * keys. keys[did].pkey is the hardware key did is resident in, or
+ * PKEY_INVALID while it is parked. The ranges of every parked domain are
+ * tagged with g_ParkKey, which no PKRU word opens; making a domain resident
+ * again takes the key of the least recently entered one and swaps the tags
+ * of both, see MakeResident.
+ */
+static vkey_t g_KeyOwner[PK_NUM_KEYS];
+static unsigned int g_OwnedKeys; // hardware keys taken with pkey_alloc
+static unsigned int g_ExchangeKeys; // owned keys held by a PKURing
+static int g_ParkKey = -1;
+/* Domains created with PKU_KEY_LAZY which were never resident. Their
+ * ranges are recorded, but keep the default key until the first entry
+ * tags them all in one pass, so assigning them costs no hostcall. */
+static bool g_Pending[NUM_DOMAINS];
+static unsigned long g_KeyClock;
+static unsigned long g_LastUse[NUM_DOMAINS];
+
+static void DetectPKRUFormat(void);
+static void UpdateDomainPKRU(int did);
+static void SetCallGate(int caller, int callee, unsigned int flags);
+static void ClearCallGates(int did);
+static void RevokeGrants(int did);
+static void UpdateCallGates(int did);
+static int TakeKey(void);
+static int LeastRecentlyUsed(unsigned long pin);
+static int EnsureParkKey(void);
+static void ParkDomain(int did);
+static int MakeResident(int did, unsigned long pin);
 
 __attribute__((constructor)) void PKUInitCtor()
 {
+    DetectPKRUFormat();
     keys[0].perm = 0;
     keys[0].pkey = 0;
     keys[0].used = 1;
+    for (int pkey = 1; pkey < PK_NUM_KEYS; ++pkey)
+    {
+        g_KeyOwner[pkey] = VKEY_INVALID;
+    }
+    for (int did = 0; did < NUM_DOMAINS; ++did)
+    {
+        UpdateDomainPKRU(did);
+    }
 }
 
 unsigned char g_initialized = 0;
 
+/* A tagged range; the table holds disjoint ranges sorted by address */
 typedef struct s_mprotect
 {
     void *addr;
     size_t len;
     int prot;
-    PKUKey pkey;
-    bool used;
-    const char *name;
-    int mmap_flags;
-    int mmap_fd;
+    unsigned int pkey;
 } s_mprotect;
 
-#define NUM_MPROTECT_RANGES 4096
+#define NUM_MPROTECT_RANGES 64
 
 typedef struct PKUData
 {
@@ -39,8 +101,9 @@ typedef struct PKUData
     size_t stacksize;
     void (*UserHandler)(void *);
     PKUKey domains[NUM_DOMAINS];
-    s_mprotect ranges[NUM_MPROTECT_RANGES];
-    size_t ranges_max_used;
+    s_mprotect *ranges;
+    size_t ranges_used;
+    size_t ranges_capacity;
 } PKUData;
 
 PKUData g_data = {
@@ -54,6 +117,29 @@ static bool inline DomainExists(int did)
     return (did >= 0 && did < NUM_DOMAINS && keys[did].used);
 }
 
+static bool inline DomainResident(int did)
+{
+    return did == 0 || keys[did].pkey != PKEY_INVALID;
+}
+
+/* The hardware key the ranges of domain vkey are tagged with */
+static inline unsigned int HardwareKey(unsigned int vkey)
+{
+    if (vkey == PKU_GUARD_KEY)
+    {
+        return (unsigned int)g_ParkKey;
+    }
+    if (!DomainExists((int)vkey))
+    {
+        return vkey;
+    }
+    if (DomainResident((int)vkey))
+    {
+        return keys[vkey].pkey;
+    }
+    return g_Pending[vkey] ? 0 : (unsigned int)g_ParkKey;
+}
+
 int DoInit(int flags)
 {
     if (g_data.initialized)
@@ -103,6 +189,14 @@ int PKUInit(int flags)
     }
     DoInitFinished = 1;
     g_initialized = 1;
+    // Let the host read the allocator's counters in place; hosts without
+    // the hostcall simply can't.
+    __pku_stats_register(PKUHeapStatsTable(), NUM_DOMAINS);
+    const char *trace = getenv("PKU_TRACE");
+    if (trace != NULL && PKUTraceStart(trace) != 0)
+    {
+        perror("PKUTraceStart");
+    }
     return ret;
 
 error:
@@ -146,9 +240,9 @@ int PKUDomainFree(int domain)
         }
     }
 
-    for (size_t rid = 0; rid < NUM_MPROTECT_RANGES; ++rid)
+    for (size_t rid = 0; rid < g_data.ranges_used; ++rid)
     {
-        if (g_data.ranges[rid].used)
+        if (g_data.ranges[rid].pkey == (unsigned int)domain && g_data.UserHandler != NULL)
         {
             g_data.UserHandler(g_data.ranges[rid].addr);
         }
@@ -158,6 +252,7 @@ int PKUDomainFree(int domain)
     dom->pkey = 0;
     dom->perm = 0;
     dom->used = 0;
+    ClearCallGates(domain);
 
     return 0;
 }
@@ -179,11 +274,11 @@ int PKUPkeyFree(int pkey)
 {
     int ret;
 
-    for (size_t rid = 0; rid < NUM_DOMAINS; ++rid)
+    for (size_t rid = 0; rid < g_data.ranges_used; ++rid)
     {
-        if (g_data.ranges[rid].used)
+        if (g_data.ranges[rid].pkey == (unsigned int)pkey)
         {
-            printf("range[%zu] addr %p len %zu (%s) still uses", rid, g_data.ranges[rid].addr, g_data.ranges[rid].len, g_data.ranges[rid].name);
+            printf("range[%zu] addr %p len %zu still uses pkey %d\n", rid, g_data.ranges[rid].addr, g_data.ranges[rid].len, pkey);
             errno = EPERM;
             return -1;
         }
@@ -214,293 +309,1843 @@ int PKUPkeyFree(int pkey)
     return ret;
 }
 
-int DomainProtect(void *addr, size_t length, unsigned int pkey)
+/* First range which ends above addr */
+static size_t RangeLowerBound(uintptr_t addr)
 {
-    unsigned char buf[12] = {0x01, 0x20};
-    size_t temp = (size_t)addr;
-    for (int i = 3; i >= 0; --i)
-    {
-        buf[i + 2] = temp & 0xff;
-        temp >>= 8;
-    }
-    temp = length;
-    for (int i = 3; i >= 0; --i)
+    size_t lo = 0, hi = g_data.ranges_used;
+    while (lo < hi)
     {
-        buf[i + 6] = temp & 0xff;
-        temp >>= 8;
+        size_t mid = lo + (hi - lo) / 2;
+        const s_mprotect *r = &g_data.ranges[mid];
+        if ((uintptr_t)r->addr + r->len <= addr)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
     }
-    buf[10] = 3;
-    buf[11] = pkey;
-    int error = WASICALL(buf, sizeof(buf));
-    if (error != 0)
+    return lo;
+}
+
+/* Replace ranges [first, last) with count ranges from with */
+static int RangeSplice(size_t first, size_t last, const s_mprotect *with, size_t count)
+{
+    size_t used = g_data.ranges_used - (last - first) + count;
+    if (used > g_data.ranges_capacity)
     {
-        perror("DomainProtect failed");
+        size_t capacity = g_data.ranges_capacity ? g_data.ranges_capacity : NUM_MPROTECT_RANGES;
+        while (capacity < used)
+        {
+            capacity *= 2;
+        }
+        // Not malloc: growing a domain's heap records its segment here.
+        s_mprotect *ranges = PKURootMalloc(capacity * sizeof(s_mprotect));
+        if (ranges == NULL)
+        {
+            return -ENOMEM;
+        }
+        __builtin_memcpy(ranges, g_data.ranges, g_data.ranges_used * sizeof(s_mprotect));
+        PKUFree(g_data.ranges);
+        g_data.ranges = ranges;
+        g_data.ranges_capacity = capacity;
     }
+    __builtin_memmove(&g_data.ranges[first + count], &g_data.ranges[last],
+                      (g_data.ranges_used - last) * sizeof(s_mprotect));
+    __builtin_memcpy(&g_data.ranges[first], with, count * sizeof(s_mprotect));
+    g_data.ranges_used = used;
     return 0;
 }
 
-int PKUCreateDomain(unsigned int flags)
+/*
+ * Record that [addr, addr + length) now carries pkey. Parts of older ranges
+ * outside of it are kept, neighbours with the same key and protection are
+ * merged, and key 0 just drops the range from the table.
+ */
+static int RangeAssign(void *addr, size_t length, int prot, unsigned int pkey)
 {
-    // PKU_KEY_* flags
-    unsigned char buf[12] = {0x01, 0x21};
-    int error = WASICALL(buf, sizeof(buf));
-    if (error != 0)
+    uintptr_t start = (uintptr_t)addr;
+    uintptr_t end = start + length;
+    if (length == 0)
     {
-        perror("PKUCreateDomain failed");
-        return -1;
+        return 0;
+    }
+
+    size_t first = RangeLowerBound(start);
+    size_t last = first;
+    while (last < g_data.ranges_used && (uintptr_t)g_data.ranges[last].addr < end)
+    {
+        last++;
     }
-    if (buf[2] >= 16)
+
+    // Pull in the neighbours so that pieces with the same key are merged.
+    if (first > 0 && (uintptr_t)g_data.ranges[first - 1].addr + g_data.ranges[first - 1].len == start)
     {
-        return 0;
+        first--;
     }
-    else
+    if (last < g_data.ranges_used && (uintptr_t)g_data.ranges[last].addr == end)
     {
-        keys[buf[2]].pkey = buf[2];
-        keys[buf[2]].used = 1;
-        return buf[2];
+        last++;
     }
-}
 
-int RegisterPKUCall(int did, pFunc entry)
-{
-    if (!DomainExists(did))
+    // Only the first two and last two ranges can stick out.
+    s_mprotect with[5];
+    size_t count = 0;
+    for (size_t rid = first; rid < last && (uintptr_t)g_data.ranges[rid].addr < start; ++rid)
     {
-        perror("Domain does not exist");
-        return -EINVAL;
+        with[count] = g_data.ranges[rid];
+        if ((uintptr_t)with[count].addr + with[count].len > start)
+        {
+            with[count].len = start - (uintptr_t)with[count].addr;
+        }
+        count++;
+    }
+    if (pkey != 0)
+    {
+        with[count++] = (s_mprotect){addr, length, prot, pkey};
+    }
+    for (size_t rid = first; rid < last; ++rid)
+    {
+        const s_mprotect *r = &g_data.ranges[rid];
+        uintptr_t r_end = (uintptr_t)r->addr + r->len;
+        if (r_end > end)
+        {
+            with[count] = *r;
+            if ((uintptr_t)r->addr < end)
+            {
+                with[count].addr = (void *)end;
+                with[count].len = r_end - end;
+            }
+            count++;
+        }
     }
 
-    int PKUCallID = 0;
-    for (; PKUCallID < NUM_REGISTERED_PKUCALLS; ++PKUCallID)
+    size_t merged = 0;
+    for (size_t i = 0; i < count; ++i)
     {
-        if (!RegisteredPKUCalls[PKUCallID].entry)
+        s_mprotect *prev = merged ? &with[merged - 1] : NULL;
+        if (prev != NULL && prev->pkey == with[i].pkey && prev->prot == with[i].prot &&
+            (uintptr_t)prev->addr + prev->len == (uintptr_t)with[i].addr)
+        {
+            prev->len += with[i].len;
+        }
+        else
         {
-            // We found an empty ecall slot
-            break;
+            with[merged++] = with[i];
         }
     }
 
-    // check for valid id
-    if (PKUCallID < 0 || PKUCallID >= NUM_REGISTERED_PKUCALLS)
+    // Keep the tagged bytes of each domain current for PKUHeapStats.
+    PKUHeapStats *stats = PKUHeapStatsTable();
+    size_t removed[NUM_DOMAINS] = {0};
+    for (size_t rid = first; rid < last; ++rid)
     {
-        perror("pku call id is out of range");
-        return -EACCES;
+        if (g_data.ranges[rid].pkey < NUM_DOMAINS)
+        {
+            removed[g_data.ranges[rid].pkey] += g_data.ranges[rid].len;
+        }
+    }
+    int ret = RangeSplice(first, last, with, merged);
+    if (ret == 0)
+    {
+        for (size_t did = 0; did < NUM_DOMAINS; ++did)
+        {
+            stats[did].tagged -= removed[did];
+        }
+        for (size_t i = 0; i < merged; ++i)
+        {
+            if (with[i].pkey < NUM_DOMAINS)
+            {
+                stats[with[i].pkey].tagged += with[i].len;
+            }
+        }
     }
+    return ret;
+}
 
-    if (RegisteredPKUCalls[PKUCallID].entry != 0)
+int PKURangeLookup(const void *addr, PKURange *range)
+{
+    size_t rid = RangeLowerBound((uintptr_t)addr);
+    if (rid == g_data.ranges_used || (uintptr_t)g_data.ranges[rid].addr > (uintptr_t)addr)
     {
-        perror("pku call id already used");
-        return -EACCES;
+        return -1;
+    }
+    if (range != NULL)
+    {
+        range->addr = g_data.ranges[rid].addr;
+        range->length = g_data.ranges[rid].len;
+        range->pkey = g_data.ranges[rid].pkey;
     }
+    return 0;
+}
 
-    // register ecall
-    RegisteredPKUCalls[PKUCallID].did = did;
-    RegisteredPKUCalls[PKUCallID].entry = entry;
-    return PKUCallID;
+/* Whether [addr, addr + length) already carries pkey, so tagging is a no-op */
+static bool RangeHasKey(const void *addr, size_t length, int prot, unsigned int pkey)
+{
+    uintptr_t start = (uintptr_t)addr;
+    size_t rid = RangeLowerBound(start);
+    if (pkey == 0)
+    {
+        return rid == g_data.ranges_used || (uintptr_t)g_data.ranges[rid].addr >= start + length;
+    }
+    // Neighbours with the same key are merged, so one range has to cover it.
+    return rid < g_data.ranges_used && g_data.ranges[rid].pkey == pkey && g_data.ranges[rid].prot == prot &&
+           (uintptr_t)g_data.ranges[rid].addr <= start &&
+           (uintptr_t)g_data.ranges[rid].addr + g_data.ranges[rid].len >= start + length;
 }
 
-int ReadPKRU()
+/* Whether every page of [addr, addr + length) still carries the default
+ * hardware key, being untagged or assigned to pending domains only */
+static bool RangeUntagged(const void *addr, size_t length)
 {
-    unsigned char buf[12] = {0x0F, 0x01, 0xEE};
-    int error = WASICALL(buf, sizeof(buf));
-    if (error != 0)
+    uintptr_t end = (uintptr_t)addr + length;
+    for (size_t rid = RangeLowerBound((uintptr_t)addr);
+         rid < g_data.ranges_used && (uintptr_t)g_data.ranges[rid].addr < end; ++rid)
     {
-        perror("ReadPKRU failed");
-        return -1;
+        if (g_data.ranges[rid].prot != 3 || HardwareKey(g_data.ranges[rid].pkey) != 0)
+        {
+            return false;
+        }
     }
+    return true;
+}
 
-    int pkru = 0;
-    for (int i = 3; i < 7; ++i)
+/* Record a range of a pending domain without a hostcall if its pages carry
+ * the default key already */
+static bool AssignPending(void *addr, size_t length, unsigned int pkey)
+{
+    if (pkey >= NUM_DOMAINS || !g_Pending[pkey] || !RangeUntagged(addr, length))
     {
-        pkru <<= 8;
-        pkru += buf[i];
+        return false;
     }
-    return pkru;
+    RangeAssign(addr, length, 3, pkey);
+    return true;
 }
 
-static int WritePKRU(unsigned int pkru)
+int DomainProtect(void *addr, size_t length, unsigned int pkey)
 {
-    unsigned char buf[12] = {0x0F, 0x01, 0xEF};
-    unsigned int temp = pkru;
-    for (int i = 3; i >= 0; --i)
+    if (RangeHasKey(addr, length, 3, pkey) || AssignPending(addr, length, pkey))
     {
-        buf[i + 3] = temp & 0xff;
-        temp >>= 8;
+        return 0;
     }
-    int error = WASICALL(buf, sizeof(buf));
+
+    int error = __pku_pkey_mprotect(addr, length, 3, HardwareKey(pkey));
     if (error != 0)
     {
-        perror("WritePkru failed");
-        return -1;
+        errno = -error;
+        perror("DomainProtect failed");
+        return 0;
+    }
+    RangeAssign(addr, length, 3, pkey);
+    return 0;
+}
+
+#define PKU_RANGE_BATCH 64
+
+int DomainProtectRanges(const PKURange *ranges, size_t count)
+{
+    // Drop ranges which already carry their key and glue adjacent ones with
+    // the same key, so the host splits as few mappings as possible.
+    PKURange batch[PKU_RANGE_BATCH];
+    size_t used = 0;
+    for (size_t i = 0; i <= count; ++i)
+    {
+        if (i < count && (RangeHasKey(ranges[i].addr, ranges[i].length, 3, ranges[i].pkey) ||
+                          AssignPending(ranges[i].addr, ranges[i].length, ranges[i].pkey)))
+        {
+            continue;
+        }
+        if (i < count && used > 0)
+        {
+            PKURange *prev = &batch[used - 1];
+            if (prev->pkey == HardwareKey(ranges[i].pkey) &&
+                (char *)prev->addr + prev->length == (char *)ranges[i].addr)
+            {
+                prev->length += ranges[i].length;
+                RangeAssign(ranges[i].addr, ranges[i].length, 3, ranges[i].pkey);
+                continue;
+            }
+        }
+        if (used == PKU_RANGE_BATCH || (i == count && used > 0))
+        {
+            int error = __pku_pkey_mprotect_ranges(batch, used);
+            if (error != 0)
+            {
+                errno = -error;
+                perror("DomainProtectRanges failed");
+                return -1;
+            }
+            used = 0;
+        }
+        if (i < count)
+        {
+            batch[used] = ranges[i];
+            batch[used++].pkey = HardwareKey(ranges[i].pkey);
+            // Recorded right away so that later ranges see the key change.
+            RangeAssign(ranges[i].addr, ranges[i].length, 3, ranges[i].pkey);
+        }
     }
     return 0;
 }
 
-static int __attribute__((noinline)) rdpkru()
+int DomainProtectGuarded(void *addr, size_t length, unsigned int pkey)
 {
-    volatile int ecx = 0;
-    return ecx;
+    // One batch, so the guard costs no call of its own.
+    PKURange ranges[2] = {
+        {addr, length - PAGESIZEPKU, pkey},
+        {(char *)addr + length - PAGESIZEPKU, PAGESIZEPKU, PKU_GUARD_KEY},
+    };
+    return DomainProtectRanges(ranges, 2);
 }
 
-static int __attribute__((noinline)) wrpkru(int pkru)
+int PKUDecommit(void *addr, size_t length)
 {
-    volatile int eax = pkru;
-    return eax;
+    int error = __pku_decommit(addr, length);
+    if (error != 0)
+    {
+        errno = -error;
+        return -1;
+    }
+    uintptr_t start = PAGE_ALIGN((uintptr_t)addr);
+    uintptr_t end = ((uintptr_t)addr + length) & ~(uintptr_t)(PAGESIZEPKU - 1);
+    if (start < end)
+    {
+        RangeAssign((void *)start, end - start, 3, 0);
+    }
+    return 0;
 }
 
-static int SetPkey(pkey_t pkey, unsigned int prot)
+/* Command ring shared with the host, see PkuQueue in the runtime */
+typedef struct PKUQueue
 {
-    int pkey_shift = pkey * 2;
-    int new_pkru_bits = 0;
+    volatile uint32_t head;
+    volatile uint32_t tail;
+    PKURange entries[PKU_QUEUE_CAPACITY];
+} PKUQueue;
+
+static PKUQueue g_Queue;
+static int g_QueueState = 0; // 0: unregistered, 1: registered, -1: unsupported
 
-    if (prot & PKEY_DISABLE_ACCESS)
+int DomainProtectDeferred(void *addr, size_t length, unsigned int pkey)
+{
+    if (g_QueueState == 0)
     {
-        new_pkru_bits |= PKEY_DISABLE_ACCESS;
+        g_QueueState = __pku_queue_register(&g_Queue, PKU_QUEUE_CAPACITY) == 0 ? 1 : -1;
     }
-    if (prot & PKEY_DISABLE_WRITE)
+    if (g_QueueState < 0)
     {
-        new_pkru_bits |= PKEY_DISABLE_WRITE;
+        return DomainProtect(addr, length, pkey);
     }
 
-    /* Shift the bits in to the correct place in PKRU for pkey: */
-    new_pkru_bits <<= pkey_shift;
+    if (RangeHasKey(addr, length, 3, pkey) || AssignPending(addr, length, pkey))
+    {
+        return 0;
+    }
+    // Extend the last command if it has not been drained yet and ends here.
+    if (g_Queue.head != g_Queue.tail)
+    {
+        PKURange *last = &g_Queue.entries[(g_Queue.head - 1) % PKU_QUEUE_CAPACITY];
+        if (last->pkey == HardwareKey(pkey) && (char *)last->addr + last->length == (char *)addr)
+        {
+            last->length += length;
+            RangeAssign(addr, length, 3, pkey);
+            return 0;
+        }
+    }
 
-    /* Get old PKRU and mask off any old bits in place: */
-    int old_pkru = rdpkru();
-    if (old_pkru == 0)
+    if (g_Queue.head - g_Queue.tail >= PKU_QUEUE_CAPACITY)
     {
-        old_pkru = 0x55555554;
+        PKUQueueFlush();
     }
-    old_pkru &= ~((PKEY_DISABLE_ACCESS | PKEY_DISABLE_WRITE) << pkey_shift);
+    PKURange *range = &g_Queue.entries[g_Queue.head % PKU_QUEUE_CAPACITY];
+    range->addr = addr;
+    range->length = length;
+    range->pkey = HardwareKey(pkey);
+    g_Queue.head++;
+    RangeAssign(addr, length, 3, pkey);
+    return 0;
+}
 
-    /* Write old part along with new part: */
-    wrpkru(old_pkru | new_pkru_bits);
+int PKUQueueFlush(void)
+{
+    if (g_Queue.head == g_Queue.tail)
+    {
+        return 0;
+    }
+    int error = __pku_queue_flush();
+    if (error != 0)
+    {
+        errno = -error;
+        perror("PKUQueueFlush failed");
+        return -1;
+    }
     return 0;
 }
 
-int PKUDomainAssignPkey(int did, int pkey, int flags, int AccessRights)
+/* An unused domain id, those no hardware key has first */
+static int FreeDomainId(void)
 {
-    // set pkey prot
-    if (!DomainExists(GetCurrentDid()))
+    for (int did = PK_NUM_KEYS; did < NUM_DOMAINS; ++did)
     {
-        perror("PKUDomainAssignPkey GetCurrentDid does not exist");
-        return -EINVAL;
+        if (!keys[did].used)
+        {
+            return did;
+        }
+    }
+    for (int did = 1; did < PK_NUM_KEYS; ++did)
+    {
+        if (!keys[did].used)
+        {
+            return did;
+        }
     }
+    return -1;
+}
 
-    if (!DomainExists(did))
+/* The first time keys run out, the least recently entered domain's key
+ * becomes the park key; its ranges carry it already. */
+static int ParkLeastRecentlyUsed(void)
+{
+    int victim = LeastRecentlyUsed(g_KeyClock + 1);
+    if (victim < 0)
     {
-        perror("PKUDomainAssignPkey target domain does not exist");
-        return -EINVAL;
+        errno = ENOSPC;
+        return -1;
     }
+    g_ParkKey = keys[victim].pkey;
+    ParkDomain(victim);
+    return 0;
+}
 
-    if (AccessRights & ~(unsigned int)(PKEY_DISABLE_ACCESS | PKEY_DISABLE_WRITE))
+int PKUCreateDomain(unsigned int flags)
+{
+    // PKU_KEY_* flags; a lazy domain takes no key until it is entered.
+    bool lazy = (flags & PKU_KEY_LAZY) != 0;
+    int pkey = lazy ? -ENOSPC : TakeKey();
+    if (pkey < 0 && pkey != -ENOSPC)
     {
-        perror("PKUDomainAssignPkey invalid AccessRights");
-        return -EINVAL;
+        errno = -pkey;
+        perror("PKUCreateDomain failed");
+        return -1;
+    }
+    // While hardware keys last a domain's id is its key, which compiled
+    // domain sections assume.
+    int did = (pkey > 0 && !keys[pkey].used) ? pkey : FreeDomainId();
+    if (did < 0)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    if (pkey < 0 && !lazy && g_ParkKey < 0 && ParkLeastRecentlyUsed() != 0)
+    {
+        return -1;
+    }
+    // Without a key, the domain starts out parked, or pending if lazy.
+    keys[did].pkey = pkey > 0 ? (pkey_t)pkey : PKEY_INVALID;
+    g_Pending[did] = lazy;
+    keys[did].perm = 0;
+    keys[did].used = 1;
+    if (pkey > 0)
+    {
+        g_KeyOwner[pkey] = did;
     }
+    g_LastUse[did] = ++g_KeyClock;
+    RevokeGrants(did);
+    ClearCallGates(did);
+    return did;
+}
 
-    SetPkey(keys[did].pkey, keys[did].perm);
-    return 0;
+static size_t HashEntry(pFunc entry)
+{
+    uintptr_t x = (uintptr_t)entry;
+    x ^= x >> 16;
+    x *= 0x45d9f3b;
+    x ^= x >> 16;
+    return x;
 }
 
-int PKUPkeyMprotect(void *addr, size_t len, int prot, int pkey)
+/* The slot of entry in the index, or the free slot it would go into */
+static size_t PKUCallSlot(pFunc entry)
 {
-    return PKUMprotect(addr, len, prot);
+    size_t mask = g_PKUCallIndexSize - 1;
+    size_t slot = HashEntry(entry) & mask;
+    while (g_PKUCallIndex[slot] && RegisteredPKUCalls[g_PKUCallIndex[slot] - 1].entry != entry)
+    {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
 }
 
-static size_t GS_MmapMemory = 0;
+static int GrowPKUCalls(void)
+{
+    if (g_NumPKUCalls == g_PKUCallCapacity)
+    {
+        int capacity = g_PKUCallCapacity ? g_PKUCallCapacity * 2 : NUM_REGISTERED_PKUCALLS;
+        // Not malloc: a gate registered from inside a domain must not land
+        // in that domain's heap, where it could be read and forged.
+        PKUCall *calls = PKURootMalloc(capacity * sizeof(PKUCall));
+        if (!calls)
+        {
+            return -ENOMEM;
+        }
+        for (int id = 0; id < g_NumPKUCalls; ++id)
+        {
+            calls[id] = RegisteredPKUCalls[id];
+        }
+        if (RegisteredPKUCalls)
+        {
+            PKUFree(RegisteredPKUCalls);
+        }
+        RegisteredPKUCalls = calls;
+        g_PKUCallCapacity = capacity;
+    }
 
-void *NaiveMmap(size_t bytes)
+    if ((size_t)(g_NumPKUCalls + 1) * 2 > g_PKUCallIndexSize)
+    {
+        size_t size = g_PKUCallIndexSize ? g_PKUCallIndexSize * 2 : 2 * NUM_REGISTERED_PKUCALLS;
+        int *index = PKURootMalloc(size * sizeof(int));
+        if (!index)
+        {
+            return -ENOMEM;
+        }
+        for (size_t slot = 0; slot < size; ++slot)
+        {
+            index[slot] = 0;
+        }
+        if (g_PKUCallIndex)
+        {
+            PKUFree(g_PKUCallIndex);
+        }
+        g_PKUCallIndex = index;
+        g_PKUCallIndexSize = size;
+        for (int id = 0; id < g_NumPKUCalls; ++id)
+        {
+            g_PKUCallIndex[PKUCallSlot(RegisteredPKUCalls[id].entry)] = id + 1;
+        }
+    }
+    return 0;
+}
+
+int LookupPKUCall(pFunc entry)
 {
-    bytes = PAGE_ALIGN(bytes);
-    GS_MmapMemory += bytes;
-    return PKUMalloc(bytes);
+    if (!g_PKUCallIndexSize)
+    {
+        return -1;
+    }
+    return g_PKUCallIndex[PKUCallSlot(entry)] - 1;
 }
 
-void *PKUMmap(void *addr, size_t length, int prot, int flags, int fd, int offset)
+int RegisterPKUCall(int did, pFunc entry)
 {
-    unsigned char buf[12] = {0x01, 0x2B};
-    size_t temp = (size_t)addr;
-    for (int i = 3; i >= 0; --i)
+    if (!DomainExists(did))
     {
-        buf[i + 2] = temp & 0xff;
-        temp >>= 8;
+        perror("Domain does not exist");
+        return -EINVAL;
     }
-    temp = length;
-    for (int i = 3; i >= 0; --i)
+
+    if (!entry)
     {
-        buf[i + 6] = temp & 0xff;
-        temp >>= 8;
+        perror("pku call entry is null");
+        return -EINVAL;
     }
-    buf[10] = prot;
-    buf[11] = flags;
-    int error = WASICALL(buf, sizeof(buf));
-    if (error != 0)
+
+    int PKUCallID = LookupPKUCall(entry);
+    if (PKUCallID >= 0)
     {
-        perror("PKUMmap failed");
+        if (RegisteredPKUCalls[PKUCallID].did != did)
+        {
+            perror("pku call entry registered for another domain");
+            return -EEXIST;
+        }
+        return PKUCallID;
     }
-    temp = 0;
-    for (int i = 2; i < 6; i++)
+
+    int error = GrowPKUCalls();
+    if (error != 0)
     {
-        temp <<= 8;
-        temp += buf[i];
+        perror("no more space for pku calls");
+        return error;
     }
-    size_t len = 0;
-    for (int i = 6; i < 10; i++)
+    PKUCallID = g_NumPKUCalls++;
+    g_PKUCallIndex[PKUCallSlot(entry)] = PKUCallID + 1;
+
+    // register ecall
+    RegisteredPKUCalls[PKUCallID].did = did;
+    RegisteredPKUCalls[PKUCallID].entry = entry;
+    if (!g_CallGate[did][did])
     {
-        len <<= 8;
-        len += buf[i];
+        SetCallGate(did, did, 0);
     }
-    if (len != length)
+    if (!g_CallGate[0][did])
     {
-        temp = 0;
-        printf("test\n");
+        SetCallGate(0, did, 0);
     }
-    GS_MmapMemory += len;
-    return (void *)temp;
+    return PKUCallID;
 }
 
-int PKUMunmap(void *addr, size_t len)
+int ReadPKRU()
 {
-    // munmap
-    return 0;
+    return __pku_rdpkru();
 }
 
-static void *MmapAddr = NULL;
+static inline int rdpkru()
+{
+    return __pkuwa_rdpkru();
+}
 
-int PKUMprotect(void *addr, size_t len, int prot)
+/* The first write goes through the host so that it settles the tags a pooled
+ * instance inherited and this one did not claim again; later ones are a bare
+ * WRPKRU. The flag lives in linear memory, so it is per instance, as the
+ * inherited tags are. */
+static bool g_PKRUSettled = false;
+
+static inline int wrpkru(int pkru)
 {
-    if (addr == NULL && MmapAddr == NULL)
-    {
-        MmapAddr = PKUMmap(NULL, len, prot, 0x2 | 0x20, -1, 0);
-    }
-    if (MmapAddr != NULL)
+    if (!g_PKRUSettled)
     {
-        DomainProtect(MmapAddr, len, 0);
+        g_PKRUSettled = true;
+        __pku_wrpkru(pkru);
+        return pkru;
     }
-    return 0;
+    return __pkuwa_wrpkru(pkru);
 }
 
-int EnableSectionGuardPage(int did)
+/* Guests see the host's own format: x86 PKRU has two bits per key which
+ * deny access and writes, AArch64 POR_EL0 four which grant read, execute and
+ * write. Key 0 tags the guest's stack and data, so it is always open, and
+ * its field tells the two apart. */
+#define POR_RX 0x3u
+#define POR_RWX 0x7u
+static bool g_PORFormat = false;
+
+static void DetectPKRUFormat(void)
 {
-    // Enable default in the runtime
-    return 0;
+    g_PORFormat = (rdpkru() & 0x3u) != 0;
 }
 
-int PKUSwitch(int PKUCallID)
+/* Every key but 0 closed, what the root domain runs with */
+static inline unsigned int PKRUBase(void)
 {
-    int did = RegisteredPKUCalls[PKUCallID].did;
-    SetPkey(keys[did].pkey, keys[did].perm);
+    return g_PORFormat ? POR_RWX : 0x55555554u;
+}
+
+/* Full PKRU word of each domain: key 0 and the domain's own key with its
+ * permissions, every other key closed. Kept in step with keys[] by
+ * UpdateDomainPKRU, so a switch never has to compute or read PKRU. */
+static unsigned int g_DomainPKRU[NUM_DOMAINS];
+
+/* The PKRU this thread last wrote. Compiled domain functions and the host
+ * put PKRU back before returning here, so it stays accurate. */
+static __thread unsigned int g_ShadowPKRU;
+static __thread bool g_ShadowValid = false;
+
+/* The field of pkey in a PKRU word */
+static inline unsigned int PKRUKeyField(pkey_t pkey)
+{
+    return g_PORFormat ? 0xfu << (pkey * 4) : 0x3u << (pkey * 2);
+}
+
+/* The value of pkey's field for the PKEY_DISABLE_* rights prot */
+static inline unsigned int PKRUKeyBits(pkey_t pkey, unsigned int prot)
+{
+    if (g_PORFormat)
+    {
+        unsigned int rights = (prot & PKEY_DISABLE_ACCESS) ? 0 : (prot & PKEY_DISABLE_WRITE) ? POR_RX : POR_RWX;
+        return rights << (pkey * 4);
+    }
+    return (prot & (PKEY_DISABLE_ACCESS | PKEY_DISABLE_WRITE)) << (pkey * 2);
+}
+
+/* Open pkey in pkru with the given rights */
+static inline unsigned int PKRUOpen(unsigned int pkru, pkey_t pkey, unsigned int prot)
+{
+    return (pkru & ~PKRUKeyField(pkey)) | PKRUKeyBits(pkey, prot);
+}
+
+/* Whether pkru lets pkey be read */
+static inline bool PKRUReadable(unsigned int pkru, pkey_t pkey)
+{
+    if (g_PORFormat)
+    {
+        return (pkru >> (pkey * 4)) & 0x1u;
+    }
+    return !((pkru >> (pkey * 2)) & PKEY_DISABLE_ACCESS);
+}
+
+static void UpdateDomainPKRU(int did)
+{
+    unsigned int pkru = PKRUBase();
+    // Granted domains which are parked stay closed until did is entered.
+    unsigned int grants = g_NumGrants[did];
+    for (int other = 1; grants != 0 && other < NUM_DOMAINS; ++other)
+    {
+        if (g_Grants[did][other])
+        {
+            grants--;
+            if (DomainResident(other))
+            {
+                pkru = PKRUOpen(pkru, keys[other].pkey, g_Grants[did][other] & ~PKU_GRANTED);
+            }
+        }
+    }
+    if (DomainResident(did))
+    {
+        pkru = PKRUOpen(pkru, keys[did].pkey, keys[did].perm);
+    }
+    g_DomainPKRU[did] = pkru;
+}
+
+/* Threads which have written PKRU through this library and not exited.
+ * Parking a domain only closes its key on the calling thread, so no key is
+ * taken from a domain while another thread might run with it open. Without
+ * thread support nothing is counted down, which only keeps keys in place. */
+static unsigned int g_LiveThreads = 0;
+static __thread bool g_ThreadCounted = false;
+
+#ifdef _REENTRANT
+static pthread_key_t g_ThreadExitKey;
+static pthread_once_t g_ThreadExitOnce = PTHREAD_ONCE_INIT;
+
+static void ThreadExit(void *arg)
+{
+    (void)arg;
+    __atomic_fetch_sub(&g_LiveThreads, 1, __ATOMIC_RELEASE);
+}
+
+static void CreateThreadExitKey(void)
+{
+    pthread_key_create(&g_ThreadExitKey, ThreadExit);
+}
+#endif
+
+static void CountThread(void)
+{
+    g_ThreadCounted = true;
+    __atomic_fetch_add(&g_LiveThreads, 1, __ATOMIC_ACQ_REL);
+#ifdef _REENTRANT
+    pthread_once(&g_ThreadExitOnce, CreateThreadExitKey);
+    pthread_setspecific(g_ThreadExitKey, &g_ThreadCounted);
+#endif
+}
+
+/* Write pkru unless this thread already runs with it */
+static inline void SwitchPKRU(unsigned int pkru)
+{
+    if (!g_ThreadCounted)
+    {
+        CountThread();
+    }
+    if (g_ShadowValid && g_ShadowPKRU == pkru)
+    {
+        return;
+    }
+    wrpkru(pkru);
+    g_ShadowPKRU = pkru;
+    g_ShadowValid = true;
+}
+
+static inline unsigned int CurrentPKRU(void)
+{
+    return g_ShadowValid ? g_ShadowPKRU : (unsigned int)rdpkru();
+}
+
+static void SetCallGate(int caller, int callee, unsigned int flags)
+{
+    unsigned int pkru = g_DomainPKRU[callee];
+    if ((flags & PKU_CALLER_GRANT) && DomainResident(caller))
+    {
+        pkru = PKRUOpen(pkru, keys[caller].pkey, keys[caller].perm);
+    }
+    g_CallGate[caller][callee] = pkru;
+    g_CallGateFlags[caller][callee] = flags;
+}
+
+/* Rebuild the open gates into or out of did after its word changed */
+static void UpdateCallGates(int did)
+{
+    for (int other = 0; other < NUM_DOMAINS; ++other)
+    {
+        if (g_CallGate[other][did])
+        {
+            SetCallGate(other, did, g_CallGateFlags[other][did]);
+        }
+        if (g_CallGate[did][other])
+        {
+            SetCallGate(did, other, g_CallGateFlags[did][other]);
+        }
+    }
+}
+
+/* Forget every gate into or out of did, whose key may be handed out again */
+static void ClearCallGates(int did)
+{
+    for (int other = 0; other < NUM_DOMAINS; ++other)
+    {
+        g_CallGate[other][did] = 0;
+        g_CallGate[did][other] = 0;
+    }
+}
+
+/* Drop what a previous holder of did granted or was granted */
+static void RevokeGrants(int did)
+{
+    for (int other = 0; other < NUM_DOMAINS; ++other)
+    {
+        g_Grants[did][other] = 0;
+        if (g_Grants[other][did])
+        {
+            g_Grants[other][did] = 0;
+            g_NumGrants[other]--;
+            UpdateDomainPKRU(other);
+            UpdateCallGates(other);
+        }
+    }
+    g_NumGrants[did] = 0;
+    UpdateDomainPKRU(did);
+}
+
+/* The rights did holds on the key of domain pkey, or -1 if it may not access
+ * it at all. Key 0 is everyone's and domain 0 created every other key. */
+static int DomainRights(int did, int pkey)
+{
+    if (pkey == 0 || did == 0)
+    {
+        return 0;
+    }
+    if (did == pkey)
+    {
+        return keys[did].perm;
+    }
+    if (g_Grants[did][pkey])
+    {
+        return g_Grants[did][pkey] & ~PKU_GRANTED;
+    }
+    return -1;
+}
+
+int PKUDomainAssignPkey(int did, int pkey, int flags, int AccessRights)
+{
+    // set pkey prot
+    if (!DomainExists(GetCurrentDid()))
+    {
+        perror("PKUDomainAssignPkey GetCurrentDid does not exist");
+        return -EINVAL;
+    }
+
+    if (!DomainExists(did))
+    {
+        perror("PKUDomainAssignPkey target domain does not exist");
+        return -EINVAL;
+    }
+
+    if (AccessRights & ~(unsigned int)(PKEY_DISABLE_ACCESS | PKEY_DISABLE_WRITE))
+    {
+        perror("PKUDomainAssignPkey invalid AccessRights");
+        return -EINVAL;
+    }
+
+    if (pkey < 0 || pkey >= NUM_DOMAINS || (pkey != 0 && !DomainExists(pkey)))
+    {
+        perror("PKUDomainAssignPkey invalid pkey");
+        return -EINVAL;
+    }
+
+    /* Rights can only be passed on, never widened */
+    int rights = DomainRights(GetCurrentDid(), pkey);
+    if (rights < 0 || (rights & ~AccessRights))
+    {
+        perror("PKUDomainAssignPkey rights exceed the current domain's");
+        return -EACCES;
+    }
+
+    if (pkey == 0)
+    {
+        /* Key 0 is open to every domain */
+    }
+    else if (did == pkey)
+    {
+        keys[did].perm = AccessRights;
+    }
+    else
+    {
+        /* e.g. PKEY_DISABLE_WRITE lets did read pkey's data in place */
+        if (!g_Grants[did][pkey])
+        {
+            g_NumGrants[did]++;
+        }
+        g_Grants[did][pkey] = PKU_GRANTED | (unsigned char)AccessRights;
+        if (did == (int)GetCurrentDid() && MakeResident(pkey, g_KeyClock + 1) != 0)
+        {
+            return -errno;
+        }
+    }
+    UpdateDomainPKRU(did);
+    UpdateCallGates(did);
+    if (did == (int)GetCurrentDid())
+    {
+        SwitchPKRU(g_DomainPKRU[did]);
+    }
+    return 0;
+}
+
+int PKUDomainAllowCaller(int CallerDid, unsigned int flags)
+{
+    int did = GetCurrentDid();
+    if (!DomainExists(did))
+    {
+        perror("PKUDomainAllowCaller GetCurrentDid does not exist");
+        errno = EACCES;
+        return -1;
+    }
+    if (!DomainExists(CallerDid) || (flags & ~(unsigned int)PKU_CALLER_GRANT))
+    {
+        errno = EINVAL;
+        perror("PKUDomainAllowCaller invalid caller or flags");
+        return -1;
+    }
+
+    SetCallGate(CallerDid, did, flags);
+    return 0;
+}
+
+int PKUPkeyMprotect(void *addr, size_t len, int prot, int pkey)
+{
+    return PKUMprotect(addr, len, prot);
+}
+
+static size_t GS_MmapMemory = 0;
+
+void *NaiveMmap(size_t bytes)
+{
+    bytes = PAGE_ALIGN(bytes);
+    void *ptr = PKUPagesAlloc(bytes);
+    if (ptr != NULL)
+    {
+        GS_MmapMemory += bytes;
+    }
+    return ptr;
+}
+
+void *PKUMmap(void *addr, size_t length, int prot, int flags, int fd, int offset)
+{
+    intptr_t ret = __pku_mmap(addr, length, prot, flags);
+    if (ret == -1)
+    {
+        perror("PKUMmap failed");
+        return NULL;
+    }
+    GS_MmapMemory += length;
+    return (void *)ret;
+}
+
+int PKUMunmap(void *addr, size_t len)
+{
+    if (PKUPagesFree(addr, len) != 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    GS_MmapMemory -= PAGE_ALIGN(len);
+    return 0;
+}
+
+static void *MmapAddr = NULL;
+
+int PKUMprotect(void *addr, size_t len, int prot)
+{
+    if (addr == NULL && MmapAddr == NULL)
+    {
+        MmapAddr = PKUMmap(NULL, len, prot, 0x2 | 0x20, -1, 0);
+    }
+    if (MmapAddr != NULL)
+    {
+        DomainProtect(MmapAddr, len, 0);
+    }
+    return 0;
+}
+
+int EnableSectionGuardPage(int did)
+{
+    if (did == 0 || !DomainExists(did))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (EnsureParkKey() != 0)
+    {
+        return -1;
+    }
+    PKUHeapSetGuard((unsigned int)did);
+    return 0;
+}
+
+int PKUGuardPages(void *addr, size_t len)
+{
+    if (EnsureParkKey() != 0)
+    {
+        return -1;
+    }
+    return DomainProtect(addr, len, PKU_GUARD_KEY);
+}
+
+/* Domain and exact PKRU each PKUSwitch of this thread came from, so the
+ * matching PKURestore returns with one write, without recomputing it.
+ * Frames past PKU_CALL_STACK_DEPTH are only counted, their restore falls
+ * back to the domain's own word. */
+typedef struct PKUCallFrame
+{
+    int did;
+    unsigned int pkru;
+} PKUCallFrame;
+
+static __thread PKUCallFrame g_CallStack[PKU_CALL_STACK_DEPTH];
+static __thread int g_CallDepth = 0;
+
+static inline void PushCallFrame(int did)
+{
+    if (g_CallDepth < PKU_CALL_STACK_DEPTH)
+    {
+        g_CallStack[g_CallDepth].did = did;
+        g_CallStack[g_CallDepth].pkru = g_ShadowValid ? g_ShadowPKRU : g_DomainPKRU[did];
+    }
+    g_CallDepth++;
+}
+
+/* Pop the frame a return to did matches, if it was recorded */
+static inline bool PopCallFrame(int did, unsigned int *pkru)
+{
+    if (g_CallDepth == 0)
+    {
+        return false;
+    }
+    int depth = g_CallDepth - 1;
+    if (depth >= PKU_CALL_STACK_DEPTH)
+    {
+        g_CallDepth = depth;
+        return false;
+    }
+    if (g_CallStack[depth].did != did)
+    {
+        /* PKURestore without a successful PKUSwitch */
+        return false;
+    }
+    g_CallDepth = depth;
+    *pkru = g_CallStack[depth].pkru;
+    return true;
+}
+
+/* Whether this thread may still run with hardware key pkey open, now or
+ * after a PKURestore. Such keys are never taken from their domain. */
+static bool KeyLive(pkey_t pkey)
+{
+    if (PKRUReadable(g_ShadowValid ? g_ShadowPKRU : (unsigned int)rdpkru(), pkey))
+    {
+        return true;
+    }
+    int depth = g_CallDepth < PKU_CALL_STACK_DEPTH ? g_CallDepth : PKU_CALL_STACK_DEPTH;
+    for (int i = 0; i < depth; ++i)
+    {
+        if (PKRUReadable(g_CallStack[i].pkru, pkey))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* A hardware key no domain is resident in, or a negated errno, ENOSPC once
+ * the host has none left */
+static int TakeKey(void)
+{
+    for (int pkey = 1; pkey < PK_NUM_KEYS; ++pkey)
+    {
+        if ((g_OwnedKeys & ~g_ExchangeKeys & (1u << pkey)) && pkey != g_ParkKey && g_KeyOwner[pkey] == VKEY_INVALID)
+        {
+            return pkey;
+        }
+    }
+    int pkey = __pku_pkey_alloc(0, 0);
+    // pkey_alloc opens the key in this thread's PKRU, behind the shadow.
+    g_ShadowValid = false;
+    if (pkey >= PK_NUM_KEYS)
+    {
+        __pku_pkey_free(pkey);
+        return -ENOSPC;
+    }
+    if (pkey > 0)
+    {
+        g_OwnedKeys |= 1u << pkey;
+    }
+    return pkey;
+}
+
+/* Guard pages are tagged with the park key, which no PKRU word opens. Take
+ * it early if no domain had to be parked yet, from a spare hardware key or,
+ * when there is none, by parking the least recently entered domain. */
+static int EnsureParkKey(void)
+{
+    if (g_ParkKey >= 0)
+    {
+        return 0;
+    }
+    int pkey = TakeKey();
+    if (pkey == -ENOSPC)
+    {
+        return ParkLeastRecentlyUsed();
+    }
+    if (pkey <= 0)
+    {
+        errno = pkey < 0 ? -pkey : ENOSPC;
+        return -1;
+    }
+    g_ParkKey = pkey;
+    // Closed to this thread as well, see TakeKey.
+    SwitchPKRU(PKRUOpen(CurrentPKRU(), (pkey_t)pkey, PKEY_DISABLE_ACCESS));
+    return 0;
+}
+
+/* The resident domain entered longest ago, other than the root domain, those
+ * used since pin and those whose key is live; -1 if there is none, or if
+ * another thread is live and may hold any key open */
+static int LeastRecentlyUsed(unsigned long pin)
+{
+    int victim = -1;
+    if (!g_ThreadCounted)
+    {
+        CountThread();
+    }
+    if (__atomic_load_n(&g_LiveThreads, __ATOMIC_ACQUIRE) > 1)
+    {
+        return victim;
+    }
+    for (int did = 1; did < NUM_DOMAINS; ++did)
+    {
+        if (!keys[did].used || !DomainResident(did) || g_LastUse[did] >= pin || KeyLive(keys[did].pkey))
+        {
+            continue;
+        }
+        if (victim < 0 || g_LastUse[did] < g_LastUse[victim])
+        {
+            victim = did;
+        }
+    }
+    return victim;
+}
+
+/* Move the ranges of did to hardware key pkey, a batch per hostcall */
+static int RetagDomain(int did, unsigned int pkey)
+{
+    // Queued commands still carry the old key.
+    if (PKUQueueFlush() != 0)
+    {
+        return -1;
+    }
+    PKURange batch[PKU_RANGE_BATCH];
+    size_t used = 0;
+    for (size_t rid = 0; rid <= g_data.ranges_used; ++rid)
+    {
+        if (rid < g_data.ranges_used && g_data.ranges[rid].pkey == (unsigned int)did)
+        {
+            batch[used++] = (PKURange){g_data.ranges[rid].addr, g_data.ranges[rid].len, pkey};
+        }
+        if (used == PKU_RANGE_BATCH || (rid == g_data.ranges_used && used > 0))
+        {
+            int error = __pku_pkey_mprotect_ranges(batch, used);
+            if (error != 0)
+            {
+                errno = -error;
+                perror("RetagDomain failed");
+                return -1;
+            }
+            used = 0;
+        }
+    }
+    return 0;
+}
+
+/* Rebuild every word which depends on did's key: its own, the gates into
+ * and out of it, and those of the domains granted its key */
+static void RefreshDomainPKRU(int did)
+{
+    UpdateDomainPKRU(did);
+    UpdateCallGates(did);
+    for (int other = 0; other < NUM_DOMAINS; ++other)
+    {
+        if (g_Grants[other][did])
+        {
+            UpdateDomainPKRU(other);
+            UpdateCallGates(other);
+        }
+    }
+}
+
+/* Give up did's key; its ranges have to be on the park key already */
+static void ParkDomain(int did)
+{
+    g_KeyOwner[keys[did].pkey] = VKEY_INVALID;
+    keys[did].pkey = PKEY_INVALID;
+    RefreshDomainPKRU(did);
+}
+
+/*
+ * Give did a hardware key. If none is free, the least recently entered
+ * domain not used since pin is parked, and its ranges and did's swap keys.
+ * A pending domain's ranges go from the default key to its own.
+ * Returns 0, or -1 with errno set, ENOSPC if every key is live.
+ */
+static int MakeResident(int did, unsigned long pin)
+{
+    g_LastUse[did] = ++g_KeyClock;
+    if (DomainResident(did))
+    {
+        return 0;
+    }
+    int pkey = TakeKey();
+    if (pkey == -ENOSPC)
+    {
+        // Lazy domains leave taking the park key to the first entry.
+        if (EnsureParkKey() != 0)
+        {
+            return -1;
+        }
+        int victim = LeastRecentlyUsed(pin);
+        if (victim < 0)
+        {
+            errno = ENOSPC;
+            return -1;
+        }
+        pkey = keys[victim].pkey;
+        if (RetagDomain(victim, (unsigned int)g_ParkKey) != 0)
+        {
+            return -1;
+        }
+        ParkDomain(victim);
+    }
+    else if (pkey < 0)
+    {
+        errno = -pkey;
+        return -1;
+    }
+    if (RetagDomain(did, (unsigned int)pkey) != 0)
+    {
+        return -1;
+    }
+    keys[did].pkey = (pkey_t)pkey;
+    g_KeyOwner[pkey] = did;
+    g_Pending[did] = false;
+    RefreshDomainPKRU(did);
+    return 0;
+}
+
+/* Enter did through the gate from the current domain */
+static int EnterDomain(int did)
+{
+    // The callee needs its key, and the domains it was granted theirs.
+    unsigned long pin = g_KeyClock + 1;
+    unsigned int grants = g_NumGrants[did];
+    for (int other = 1; grants != 0 && other < NUM_DOMAINS; ++other)
+    {
+        if (g_Grants[did][other])
+        {
+            grants--;
+            MakeResident(other, pin);
+        }
+    }
+    if (MakeResident(did, pin) != 0)
+    {
+        perror("PKUSwitch no key left for domain");
+        return -1;
+    }
+    unsigned int pkru = g_CallGate[GetCurrentDid()][did];
+    if (!pkru)
+    {
+        errno = EACCES;
+        perror("PKUSwitch caller may not enter domain");
+        return -1;
+    }
+    PushCallFrame(GetCurrentDid());
+    SwitchPKRU(pkru);
+    SetCurrentDid(did);
+    PKUHeapStatsTable()[did].switches++;
+    return 0;
+}
+
+int PKUSwitch(int PKUCallID)
+{
+    PKUQueueFlush();
+    if ((unsigned int)PKUCallID >= (unsigned int)g_NumPKUCalls)
+    {
+        errno = EINVAL;
+        perror("PKUSwitch pku call id is out of range");
+        return -1;
+    }
+    return EnterDomain(RegisteredPKUCalls[PKUCallID].did);
+}
+
+int PKURestore(int did)
+{
+    unsigned int pkru;
+    if (!PopCallFrame(did, &pkru))
+    {
+        MakeResident(did, g_KeyClock + 1);
+        pkru = g_DomainPKRU[did];
+    }
+    SwitchPKRU(pkru);
     SetCurrentDid(did);
     return 0;
 }
 
-int PKURestore(int did)
+void PKURecover(void)
+{
+    // The host wrote PKRU back to its value on entry, which the shadow
+    // cannot know. The frames of the abandoned calls are gone too.
+    g_ShadowValid = false;
+    g_CallDepth = 0;
+    SetCurrentDid(0);
+}
+
+PKUScope PKUScopeEnter(int did)
+{
+    PKUScope scope = {(int)GetCurrentDid(), 0, NULL};
+    if (!DomainExists(did))
+    {
+        errno = EINVAL;
+        perror("PKUScopeEnter domain does not exist");
+        return scope;
+    }
+    PKUQueueFlush();
+    scope.entered = EnterDomain(did) == 0;
+    return scope;
+}
+
+void PKUScopeExit(PKUScope *scope)
+{
+    if (scope->entered)
+    {
+        scope->entered = 0;
+        PKURestore(scope->did);
+    }
+}
+
+int PKUCallBatch(int did, PKUBatchFunc fn, void *const args[], size_t *results, size_t n)
+{
+    int PKUCallID = fn != NULL ? LookupPKUCall((pFunc)fn) : -1;
+    if (PKUCallID < 0 || RegisteredPKUCalls[PKUCallID].did != did)
+    {
+        errno = EINVAL;
+        perror("PKUCallBatch callee is not a pku call of the domain");
+        return -1;
+    }
+    PKUScope scope = PKUScopeStackEnter(PKUScopeEnter(did));
+    if (!scope.entered)
+    {
+        return -1;
+    }
+    for (size_t i = 0; i < n; ++i)
+    {
+        size_t ret = fn(args[i]);
+        if (results != NULL)
+        {
+            results[i] = ret;
+        }
+    }
+    PKUScopeStackExit(&scope);
+    return 0;
+}
+
+/* Stack pointer of each domain's own stack while it runs elsewhere, NULL
+ * for domains running on the root domain's stack, whose pointer is kept in
+ * slot 0; see PKUDomainSetStack */
+static void *g_DomainSP[NUM_DOMAINS];
+
+/* The domain whose stack did runs on */
+static inline int StackOwner(int did)
+{
+    return g_DomainSP[did] != NULL ? did : 0;
+}
+
+int PKUDomainSetStack(int did, size_t size)
+{
+    if (did == 0 || !DomainExists(did) || size == 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (g_DomainSP[did] != NULL)
+    {
+        errno = EEXIST;
+        return -1;
+    }
+    size = PAGE_ALIGN(size);
+    char *stack = PKUDomainAlloc(did, size, PAGESIZEPKU);
+    if (stack == NULL)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    // The stack grows down from its top.
+    g_DomainSP[did] = stack + size;
+    return 0;
+}
+
+void *PKUStackSwitch(int from, void *sp)
+{
+    int leaving = StackOwner(from);
+    int entering = StackOwner((int)GetCurrentDid());
+    if (leaving == entering)
+    {
+        return sp;
+    }
+    // Whatever calls back into the domain left nests below its live frames.
+    g_DomainSP[leaving] = sp;
+    return g_DomainSP[entering];
+}
+
+/* Chunks freed by another domain than their owner, which cannot reach the
+ * owner's chunk headers; see PKUFreeDeferred */
+static void *g_Quarantine[NUM_DOMAINS][PKU_QUARANTINE];
+static size_t g_NumQuarantined[NUM_DOMAINS];
+
+static void DrainQuarantine(unsigned int did)
+{
+    for (size_t i = 0; i < g_NumQuarantined[did]; ++i)
+    {
+        PKUFree(g_Quarantine[did][i]);
+    }
+    g_NumQuarantined[did] = 0;
+}
+
+void PKUFreeDeferred(unsigned int did, void *ptr)
+{
+    if (did >= NUM_DOMAINS)
+    {
+        return;
+    }
+    if (g_NumQuarantined[did] == PKU_QUARANTINE)
+    {
+        // Full: free the whole batch with the owner's key open, without
+        // going through a gate, then return to the current domain's word.
+        if (MakeResident(did, g_KeyClock + 1) != 0)
+        {
+            // Leaked rather than freed into a heap we cannot open
+            return;
+        }
+        unsigned int pkru = CurrentPKRU();
+        SwitchPKRU(g_DomainPKRU[did]);
+        DrainQuarantine(did);
+        SwitchPKRU(pkru);
+    }
+    g_Quarantine[did][g_NumQuarantined[did]++] = ptr;
+}
+
+void PKUQuarantineDrain(void)
 {
-    SetPkey(keys[GetCurrentDid()].pkey, PKEY_DISABLE_ACCESS | PKEY_DISABLE_WRITE);
+    unsigned int did = GetCurrentDid();
+    if (g_NumQuarantined[did] != 0)
+    {
+        DrainQuarantine(did);
+    }
+}
+
+void *PKUDomainAlloc(int did, size_t size, size_t alignment)
+{
+    unsigned int current = GetCurrentDid();
+    if ((unsigned int)did == current)
+    {
+        PKUQuarantineDrain();
+        return PKUAlignedAlloc(alignment, size);
+    }
+    if (!DomainExists(did))
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    // gm follows the current DID and the heap carries did's key, so borrow
+    // both for the allocation only.
+    if (MakeResident(did, g_KeyClock + 1) != 0)
+    {
+        return NULL;
+    }
+    unsigned int pkru = CurrentPKRU();
+    SwitchPKRU(g_DomainPKRU[did]);
     SetCurrentDid(did);
+    PKUQuarantineDrain();
+    void *ptr = PKUAlignedAlloc(alignment, size);
+    SetCurrentDid(current);
+    SwitchPKRU(pkru);
+    return ptr;
+}
+
+int PKUDomainSetMemoryLimit(int did, size_t bytes)
+{
+    if (did == 0 || !DomainExists(did))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    PKUHeapSetLimit((unsigned int)did, bytes);
+    return 0;
+}
+
+size_t PKUDomainMemoryUsage(int did)
+{
+    return DomainExists(did) ? PKUHeapUsage((unsigned int)did) : 0;
+}
+
+void PKUDomainSetMemoryLimitHandler(PKUMemoryLimitHandler handler)
+{
+    PKUHeapSetLimitHandler(handler);
+}
+
+int PKUDomainGetStats(int did, PKUHeapStats *stats)
+{
+    if (did < 0 || did >= NUM_DOMAINS)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    *stats = PKUHeapStatsTable()[did];
+    return 0;
+}
+
+int PKUGetHostStats(PKUHostStats *stats)
+{
+    int ret = __pku_stats(stats, sizeof(*stats));
+    if (ret < 0)
+    {
+        errno = -ret;
+        return -1;
+    }
+    return 0;
+}
+
+void PKUDomainRelease(int did, void *ptr)
+{
+    if (ptr == NULL)
+    {
+        return;
+    }
+    if ((unsigned int)did == GetCurrentDid() || !DomainExists(did))
+    {
+        PKUFree(ptr);
+        return;
+    }
+    if (MakeResident(did, g_KeyClock + 1) != 0)
+    {
+        perror("PKUDomainRelease no key left for domain");
+        return;
+    }
+    unsigned int pkru = CurrentPKRU();
+    SwitchPKRU(g_DomainPKRU[did]);
+    PKUFree(ptr);
+    SwitchPKRU(pkru);
+}
+
+int PKUMemcpy(int dst_did, void *dst, int src_did, const void *src, size_t n)
+{
+    if (!DomainExists(dst_did) || !DomainExists(src_did))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if (keys[dst_did].perm & (PKEY_DISABLE_ACCESS | PKEY_DISABLE_WRITE) ||
+        keys[src_did].perm & PKEY_DISABLE_ACCESS)
+    {
+        errno = EACCES;
+        return -1;
+    }
+    if (n == 0)
+    {
+        return 0;
+    }
+    // Neither key may be parked for the other.
+    unsigned long pin = g_KeyClock + 1;
+    if (MakeResident(dst_did, pin) != 0 || MakeResident(src_did, pin) != 0)
+    {
+        return -1;
+    }
+    // The current word stays open underneath, it covers the caller's stack,
+    // and the source is only made readable where it was closed.
+    unsigned int pkru = CurrentPKRU();
+    unsigned int open = pkru;
+    if (!PKRUReadable(pkru, keys[src_did].pkey))
+    {
+        open = PKRUOpen(open, keys[src_did].pkey, PKEY_DISABLE_WRITE);
+    }
+    SwitchPKRU(PKRUOpen(open, keys[dst_did].pkey, 0));
+    // memory.copy with bulk memory, the engine's own memmove.
+    __builtin_memmove(dst, src, n);
+    SwitchPKRU(pkru);
     return 0;
 }
 
+PKUArena *PKUArenaCreate(int did, size_t reserve)
+{
+    if (did != 0 && !DomainExists(did))
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    PKUArena *arena = PKURootMalloc(sizeof(PKUArena));
+    if (arena == NULL)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    // One allocation from the domain's heap, whose pages already carry its key.
+    reserve = PAGE_ALIGN(reserve);
+    char *base = PKUDomainAlloc(did, reserve, PAGESIZEPKU);
+    if (base == NULL)
+    {
+        PKUFree(arena);
+        errno = ENOMEM;
+        return NULL;
+    }
+    arena->did = did;
+    arena->base = base;
+    arena->cur = base;
+    arena->end = base + reserve;
+    return arena;
+}
+
+void *PKUArenaAlloc(PKUArena *arena, size_t size)
+{
+    size = (size + PKU_ARENA_ALIGN - 1) & ~(size_t)(PKU_ARENA_ALIGN - 1);
+    if (size > (size_t)(arena->end - arena->cur))
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    void *ptr = arena->cur;
+    arena->cur += size;
+    return ptr;
+}
+
+void PKUArenaReset(PKUArena *arena)
+{
+    arena->cur = arena->base;
+}
+
+void PKUArenaDestroy(PKUArena *arena)
+{
+    if (arena == NULL)
+    {
+        return;
+    }
+    PKUDomainRelease(arena->did, arena->base);
+    PKUFree(arena);
+}
+
+/* Give the current thread prot on the exchange key of ring */
+static inline void RingRights(PKURing *ring, unsigned int prot)
+{
+    SwitchPKRU(PKRUOpen(CurrentPKRU(), (pkey_t)ring->pkey, prot));
+}
+
+PKURing *PKURingCreate(int producer, int consumer, size_t slot_size, size_t count)
+{
+    if ((producer != 0 && !DomainExists(producer)) || (consumer != 0 && !DomainExists(consumer)) || slot_size == 0 ||
+        count == 0 || slot_size > SIZE_MAX / count - PKU_RING_ALIGN)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    slot_size = (slot_size + PKU_RING_ALIGN - 1) & ~(size_t)(PKU_RING_ALIGN - 1);
+    PKURing *ring = PKURootMalloc(sizeof(PKURing));
+    if (ring == NULL)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    int pkey = TakeKey();
+    if (pkey <= 0)
+    {
+        PKUFree(ring);
+        errno = pkey < 0 ? -pkey : ENOSPC;
+        return NULL;
+    }
+    // Root pages, so only the run itself changes keys, and only this once.
+    unsigned int did = GetCurrentDid();
+    SetCurrentDid(0);
+    char *slots = PKUPagesAlloc(slot_size * count);
+    SetCurrentDid(did);
+    if (slots == NULL)
+    {
+        PKUFree(ring);
+        errno = ENOMEM;
+        return NULL;
+    }
+    PKUQueueFlush();
+    int error = __pku_pkey_mprotect(slots, PAGE_ALIGN(slot_size * count), 3, (unsigned int)pkey);
+    if (error != 0)
+    {
+        PKUPagesFree(slots, slot_size * count);
+        PKUFree(ring);
+        errno = -error;
+        return NULL;
+    }
+    g_ExchangeKeys |= 1u << pkey;
+    ring->producer = producer;
+    ring->consumer = consumer;
+    ring->pkey = pkey;
+    ring->slots = slots;
+    ring->slot_size = slot_size;
+    ring->count = count;
+    ring->head = 0;
+    ring->tail = 0;
+    // pkey_alloc may have left the key open to this thread.
+    RingRights(ring, PKEY_DISABLE_ACCESS);
+    return ring;
+}
+
+void *PKURingReserve(PKURing *ring)
+{
+    if (GetCurrentDid() != (unsigned int)ring->producer)
+    {
+        errno = EPERM;
+        return NULL;
+    }
+    size_t head = ring->head;
+    if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == ring->count)
+    {
+        errno = EAGAIN;
+        return NULL;
+    }
+    RingRights(ring, 0);
+    return ring->slots + head % ring->count * ring->slot_size;
+}
+
+void PKURingCommit(PKURing *ring)
+{
+    RingRights(ring, PKEY_DISABLE_ACCESS);
+    __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+const void *PKURingPeek(PKURing *ring)
+{
+    if (GetCurrentDid() != (unsigned int)ring->consumer)
+    {
+        errno = EPERM;
+        return NULL;
+    }
+    size_t tail = ring->tail;
+    if (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail)
+    {
+        errno = EAGAIN;
+        return NULL;
+    }
+    RingRights(ring, PKEY_DISABLE_WRITE);
+    return ring->slots + tail % ring->count * ring->slot_size;
+}
+
+void PKURingRelease(PKURing *ring)
+{
+    RingRights(ring, PKEY_DISABLE_ACCESS);
+    __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+}
+
+void PKURingDestroy(PKURing *ring)
+{
+    if (ring == NULL)
+    {
+        return;
+    }
+    // Freeing the run decommits it, which tags it with key 0 again.
+    RingRights(ring, PKEY_DISABLE_ACCESS);
+    PKUPagesFree(ring->slots, ring->slot_size * ring->count);
+    g_ExchangeKeys &= ~(1u << ring->pkey);
+    PKUFree(ring);
+}
+
+/* Regions from PKUHugeAlloc, and the root allocations holding them */
+typedef struct HugeRegion
+{
+    char *base;
+    size_t length;
+    void *raw;
+} HugeRegion;
+
+static HugeRegion g_HugeRegions[PKU_HUGE_REGIONS];
+
+void *PKUHugeAlloc(int did, size_t length, int flags)
+{
+    if ((did != 0 && !DomainExists(did)) || length == 0 || (flags & ~PKU_HUGE_EXPLICIT) != 0)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    HugeRegion *region = NULL;
+    for (size_t i = 0; i < PKU_HUGE_REGIONS && region == NULL; ++i)
+    {
+        if (g_HugeRegions[i].base == NULL)
+        {
+            region = &g_HugeRegions[i];
+        }
+    }
+    if (region == NULL || length > SIZE_MAX - 2 * PKU_HUGE_PAGE)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    // Huge pages are aligned in the host's address space, which is
+    // huge_page_offset past an aligned linear-memory address.
+    int offset = __pku_huge_page_offset();
+    if (offset < 0)
+    {
+        errno = -offset;
+        return NULL;
+    }
+    length = (length + PKU_HUGE_PAGE - 1) & ~(size_t)(PKU_HUGE_PAGE - 1);
+    char *raw = PKURootMalloc(length + PKU_HUGE_PAGE);
+    if (raw == NULL)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    uintptr_t base = (uintptr_t)raw - (uintptr_t)offset;
+    base = ((base + PKU_HUGE_PAGE - 1) & ~(uintptr_t)(PKU_HUGE_PAGE - 1)) + (uintptr_t)offset;
+    if (base < (uintptr_t)raw)
+    {
+        base += PKU_HUGE_PAGE;
+    }
+
+    // The queue may still hold tags for these pages.
+    PKUQueueFlush();
+    int error = __pku_map_huge((void *)base, length, HardwareKey((unsigned int)did), (unsigned int)flags);
+    if (error != 0)
+    {
+        PKUFree(raw);
+        errno = -error;
+        return NULL;
+    }
+    RangeAssign((void *)base, length, 3, (unsigned int)did);
+    region->base = (char *)base;
+    region->length = length;
+    region->raw = raw;
+    return region->base;
+}
+
+void PKUHugeFree(void *ptr)
+{
+    if (ptr == NULL)
+    {
+        return;
+    }
+    for (size_t i = 0; i < PKU_HUGE_REGIONS; ++i)
+    {
+        HugeRegion *region = &g_HugeRegions[i];
+        if (region->base == ptr)
+        {
+            PKUDecommit(region->base, region->length);
+            PKUFree(region->raw);
+            region->base = NULL;
+            return;
+        }
+    }
+}
+
 // int PKUSwitch(int PKUCallID)
 // {
 //     PKUMprotect(NULL, 4096, 3);
@@ -517,4 +2162,108 @@ size_t GetMemorySize()
 {
     // printf("%zd, %zd, %zd\n", MemorySize(), GS_MmapMemory, g_MallocNumber);
     return MemorySize() + GS_MmapMemory + g_ExtraMemory;
+}
+
+size_t GetPeakMemorySize()
+{
+    // Whole-page mappings are never given back, so their total is a peak.
+    return MaxMemorySize() + GS_MmapMemory + g_ExtraMemory;
+}
+
+size_t PKUMappingCount(void)
+{
+    // Gaps between ranges carry key 0, as does memory past the last one.
+    size_t count = 1;
+    uintptr_t end = 0;
+    unsigned int pkey = 0;
+    for (size_t rid = 0; rid < g_data.ranges_used; ++rid)
+    {
+        const s_mprotect *range = &g_data.ranges[rid];
+        if ((uintptr_t)range->addr != end && pkey != 0)
+        {
+            pkey = 0;
+            count++;
+        }
+        if (range->pkey != pkey)
+        {
+            pkey = range->pkey;
+            count++;
+        }
+        end = (uintptr_t)range->addr + range->len;
+    }
+    return pkey != 0 ? count + 1 : count;
+}
+
+/* Records are buffered and written a buffer at a time, through stdio, whose
+ * own allocations do not go through the hooks */
+#define PKU_TRACE_BUFFER 1024
+
+int g_PKUTracing = 0;
+static FILE *g_TraceFile = NULL;
+static PKUTraceRecord g_TraceBuffer[PKU_TRACE_BUFFER];
+static size_t g_TraceUsed = 0;
+
+static void TraceFlush(void)
+{
+    if (g_TraceUsed != 0 && fwrite(g_TraceBuffer, sizeof(PKUTraceRecord), g_TraceUsed, g_TraceFile) != g_TraceUsed)
+    {
+        perror("PKUTrace write failed");
+    }
+    g_TraceUsed = 0;
+}
+
+static void TraceAtExit(void)
+{
+    PKUTraceStop();
+}
+
+int PKUTraceStart(const char *path)
+{
+    static bool registered = false;
+    PKUTraceStop();
+    g_TraceFile = fopen(path, "wb");
+    if (g_TraceFile == NULL)
+    {
+        return -1;
+    }
+    fwrite(PKU_TRACE_MAGIC, 1, sizeof(PKU_TRACE_MAGIC) - 1, g_TraceFile);
+    if (!registered)
+    {
+        registered = true;
+        atexit(TraceAtExit);
+    }
+    g_PKUTracing = 1;
+    return 0;
+}
+
+int PKUTraceStop(void)
+{
+    if (g_TraceFile == NULL)
+    {
+        return 0;
+    }
+    g_PKUTracing = 0;
+    TraceFlush();
+    int ret = fclose(g_TraceFile);
+    g_TraceFile = NULL;
+    return ret == 0 ? 0 : -1;
+}
+
+void PKUTrace(int op, const void *ptr, size_t size)
+{
+    // Failed allocations change nothing a replay has to follow.
+    if (ptr == NULL || g_TraceFile == NULL)
+    {
+        return;
+    }
+    PKUTraceRecord *record = &g_TraceBuffer[g_TraceUsed++];
+    record->id = PKU_TRACE_ID(ptr);
+    record->size = size > UINT32_MAX ? UINT32_MAX : (uint32_t)size;
+    record->op = (uint8_t)op;
+    record->did = (uint8_t)GetCurrentDid();
+    record->reserved = 0;
+    if (g_TraceUsed == PKU_TRACE_BUFFER)
+    {
+        TraceFlush();
+    }
 }
\ No newline at end of file
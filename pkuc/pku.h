@@ -26,8 +26,15 @@ typedef uint64_t pkru_config_t;
 #define PAGE_ALIGN(S)\
     (((S) + (PAGESIZEPKU - SIZE_T_ONE)) & ~(PAGESIZEPKU - SIZE_T_ONE))
 
-#define NUM_DOMAINS 16
-#define NUM_REGISTERED_PKUCALLS 64
+/* Domains are virtual keys multiplexed onto the PK_NUM_KEYS hardware keys,
+ * see PKUCreateDomain */
+#define NUM_DOMAINS 128
+#define NUM_REGISTERED_PKUCALLS 64 // initial capacity of the pkucall table
+#define PKU_CALL_STACK_DEPTH 64 // nested pkucalls whose PKRU is saved per thread
+#define PKU_QUEUE_CAPACITY 256
+
+/* Frees of a domain's chunks from other domains held back per domain */
+#define PKU_QUARANTINE 256
 
 #ifndef PKEY_DISABLE_ACCESS
 #define PKEY_DISABLE_ACCESS (0x1)
@@ -42,22 +49,37 @@ typedef void (*pFunc)(void);
 #define PKUCALL(...) ({ \
         int did = GetCurrentDid(); \
         pkucall_##__VA_ARGS__; \
+        void *_sp = PKUStackEnter(did); \
         size_t ret = __VA_ARGS__; \
+        PKUStackLeave(_sp); \
         PKURestore(did); \
         ret; \
     })
 
 #define PKU_CALL_REGISTER(did, name) ({ pkucall_id_##name = RegisterPKUCall(did, (pFunc)name); pkucall_id_##name; })
-#define WASICALL(ptr, size) {getentropy(ptr, size)}
 
 #define PK_DOMAIN_ROOT 1
 #define PK_DEFAULT_KEY 0
 
+/* PKUDomainAllowCaller: let the callee access the caller's key for the
+ * duration of the call, so arguments can be passed in the caller's buffers */
+#define PKU_CALLER_GRANT (0x1)
+
+/* PKUCreateDomain: reserve the domain id only, and give the domain its key
+ * the first time it is entered */
+#define PKU_KEY_LAZY (0x10)
+
+/* A domain id as a key: what ranges are tagged with and grants name,
+ * whichever hardware key the domain is resident in */
 typedef int vkey_t;
 #define VKEY_MAX INT_MAX
 #define VKEY_INVALID                -1
 #define PKEY_INVALID       ((pkey_t)-1)
 
+/* The key of guard pages: past every domain id, tagged with a hardware key
+ * which no PKRU word opens */
+#define PKU_GUARD_KEY NUM_DOMAINS
+
 #define GENPKU(name, ...) \
     static int pkucall_id_##name = 0; \
     \
@@ -66,6 +88,66 @@ typedef int vkey_t;
     } \
     \
 
+/* Run the following statement or block inside domain did, entering it once
+ * and restoring the caller's domain when the block is left, also through
+ * break, goto or return. Calls in the block into did need no transition of
+ * their own, pkucalls into it find it current and skip both writes, e.g.
+ *     PKU_SCOPE(did) { for (...) lookup(key[i]); }
+ * If did may not be entered, the block is skipped and errno is set. */
+#define PKU_SCOPE(did) \
+    for (PKUScope _pku_scope __attribute__((cleanup(PKUScopeStackExit))) = PKUScopeStackEnter(PKUScopeEnter(did)), \
+         *_pku_once = &_pku_scope; \
+         _pku_once && _pku_scope.entered; _pku_once = NULL)
+
+/* Place a static object in domain did's pages instead of root memory, e.g.
+ *     static const uint32_t table[1024] PKU_DOMAIN_DATA(2) = {...};
+ * clang names the data segment after the section, and the runtime tags it
+ * with the domain's key at instantiation, so nothing is copied into the
+ * domain's heap. did is a literal. Every object starts a page, and no other
+ * segment may share the section's last page, so size the objects in whole
+ * pages. The name section has to be kept: do not link with --strip-all. */
+#define PKU_DOMAIN_DATA(did) __attribute__((section(".pku.d" #did), aligned(PAGESIZEPKU)))
+
+/* Typed pkucall wrappers: pku_##name takes and returns exactly what name
+ * does, switching into its domain around the call, and can be inlined at
+ * the call site. params is the parenthesized parameter list and args the
+ * matching argument list, e.g.
+ *     GENPKU_TYPED(int, lookup, (const char *key, size_t len), (key, len))
+ * If the switch is refused, name is not called, errno is set and the
+ * result is zero. */
+#define GENPKU_TYPED(return_type, name, params, args) \
+    static int pkucall_id_##name = 0; \
+    return_type name params; \
+    \
+    static inline __attribute__((always_inline)) return_type pku_##name params { \
+        return_type _ret; \
+        __builtin_memset(&_ret, 0, sizeof(_ret)); \
+        int _did = GetCurrentDid(); \
+        if (PKUSwitch(pkucall_id_##name) == 0) { \
+            void *_sp = PKUStackEnter(_did); \
+            _ret = name args; \
+            PKUStackLeave(_sp); \
+            PKURestore(_did); \
+        } \
+        return _ret; \
+    } \
+    \
+
+#define GENPKU_TYPED_VOID(name, params, args) \
+    static int pkucall_id_##name = 0; \
+    void name params; \
+    \
+    static inline __attribute__((always_inline)) void pku_##name params { \
+        int _did = GetCurrentDid(); \
+        if (PKUSwitch(pkucall_id_##name) == 0) { \
+            void *_sp = PKUStackEnter(_did); \
+            name args; \
+            PKUStackLeave(_sp); \
+            PKURestore(_did); \
+        } \
+    } \
+    \
+
 #define GENMPK(name, return_type, ...) \
     static int pkucall_id_##name = 0; \
     \
@@ -85,6 +167,411 @@ extern size_t g_ExtraMemory;
 
 int DomainProtect(void* addr, size_t length, unsigned int pkey);
 
+/* A range to be tagged by @c DomainProtectRanges */
+typedef struct PKURange
+{
+    void* addr;
+    size_t length;
+    unsigned int pkey;
+} PKURange;
+
+/**
+ * @brief Protect many memory ranges in one host transition
+ *
+ * The host sorts @p ranges, merges adjacent ranges which carry the same
+ * key and issues one @c pkey_mprotect per merged run. Ranges which already
+ * carry their key are dropped beforehand, and if none is left there is no
+ * host transition at all.
+ *
+ * @param ranges
+ *        The ranges to protect, each with its own protection key.
+ * @param count
+ *        Number of entries in @p ranges.
+ * @return
+ *        0 on success, or -1 on error, and errno is set according to
+ *        @c pkey_mprotect in WASI.
+ */
+int DomainProtectRanges(const PKURange* ranges, size_t count);
+
+/**
+ * @brief Tag a range with @p pkey and its last page as a guard page, in a
+ *        single @c DomainProtectRanges call
+ *
+ * An overflow off the end of the range faults on the guard, whichever
+ * domain runs.
+ *
+ * @return
+ *        0 on success, or -1 on error, like @c DomainProtectRanges.
+ */
+int DomainProtectGuarded(void* addr, size_t length, unsigned int pkey);
+
+/**
+ * @brief Queue a protection change without a host transition
+ *
+ * The range is appended to a command ring in linear memory which the host
+ * drains at its next PKU hostcall, on @c memory.grow, or on
+ * @c PKUQueueFlush. Queued commands always take effect before the next
+ * @c PKUSwitch. Falls back to @c DomainProtect if the host has no ring.
+ * A range which already carries @p pkey is not queued, and one which
+ * continues the last queued range with the same key extends it.
+ *
+ * @return
+ *        0 on success, or -1 on error.
+ */
+int DomainProtectDeferred(void* addr, size_t length, unsigned int pkey);
+
+/**
+ * @brief Apply all queued protection changes now
+ *
+ * Returns immediately, without a hostcall, if nothing is queued.
+ *
+ * @return
+ *        0 on success, or -1 on error, and errno is set according to
+ *        @c pkey_mprotect in WASI.
+ */
+int PKUQueueFlush(void);
+
+/**
+ * @brief Find the tagged range containing an address
+ *
+ * Ranges tagged through @c DomainProtect, @c DomainProtectRanges and
+ * @c DomainProtectDeferred are kept in a table sorted by address, so the
+ * lookup is a binary search. A range tagged again over part of an older one
+ * splits it, and adjacent ranges with the same key are merged, so @p range
+ * is the whole run rather than a single allocation.
+ *
+ * @param addr
+ *        The address to look up.
+ * @param range
+ *        If not NULL, receives the start, length and key of the range.
+ * @return
+ *        0 if @p addr lies in a range tagged with a non-zero key, or -1.
+ */
+int PKURangeLookup(const void* addr, PKURange* range);
+
+/**
+ * @brief Free a chunk owned by another domain later
+ *
+ * A domain's chunks, and the headers next to them, carry its key, so a
+ * different domain cannot free them in place. They are held back until
+ * the owner next allocates, or freed as one batch under the owner's PKRU
+ * once @c PKU_QUARANTINE of them are waiting. Either way the memory stays
+ * tagged and goes back to the owner's heap, with no hostcall.
+ *
+ * @param did
+ *        The domain whose heap @p ptr came from.
+ * @param ptr
+ *        The chunk to free.
+ */
+void PKUFreeDeferred(unsigned int did, void* ptr);
+
+/* Free what other domains released of the current domain's chunks */
+void PKUQuarantineDrain(void);
+
+/**
+ * @brief Allocate from a given domain's heap
+ *
+ * The memory carries @p did's key. The current DID does not change; the
+ * domain's PKRU word is in effect only while the allocator runs, so the
+ * caller can use the memory only if it may access @p did's key, e.g. from
+ * inside @p did or as a caller granted by @c PKUDomainAllowCaller.
+ *
+ * @param did
+ *        The domain whose heap to allocate from.
+ * @param size
+ *        The number of bytes.
+ * @param alignment
+ *        A power of two.
+ * @return
+ *        The memory, or NULL with errno set.
+ */
+void* PKUDomainAlloc(int did, size_t size, size_t alignment);
+
+/* Free memory from @c PKUDomainAlloc, under @p did's PKRU word */
+void PKUDomainRelease(int did, void* ptr);
+
+/**
+ * @brief Copy memory from one domain to another
+ *
+ * Opens @p src_did's key for reading and @p dst_did's for writing on top
+ * of the current PKRU word, in a single write, copies with one
+ * @c memory.copy and puts the word back. Nothing passes through root
+ * memory and neither domain is entered, so the current DID and its heap
+ * stay as they are. The ranges may overlap.
+ *
+ * @param dst_did
+ *        The domain @p dst belongs to.
+ * @param dst
+ *        Where to copy to.
+ * @param src_did
+ *        The domain @p src belongs to.
+ * @param src
+ *        Where to copy from.
+ * @param n
+ *        The number of bytes.
+ * @return
+ *        0, or -1 with errno set: EINVAL for an unknown domain, EACCES if
+ *        @p dst_did is not writable or @p src_did not readable, ENOSPC if
+ *        no key is left to make both resident.
+ */
+int PKUMemcpy(int dst_did, void* dst, int src_did, const void* src, size_t n);
+
+/**
+ * @brief Cap the memory of a domain
+ *
+ * The budget covers everything the domain's allocations hold: its heap,
+ * slabs and page runs. Once it is spent, allocations in the domain fail
+ * with ENOMEM instead of growing the heap; memory already held is kept.
+ *
+ * @param did
+ *        The domain.
+ * @param bytes
+ *        The budget, or SIZE_MAX to lift it.
+ * @return
+ *        0 on success, or -1 with errno EINVAL if @p did is no domain or
+ *        the root domain, whose heap backs the others' page runs.
+ */
+int PKUDomainSetMemoryLimit(int did, size_t bytes);
+
+/* The bytes the allocations of @p did hold, counted against its budget */
+size_t PKUDomainMemoryUsage(int did);
+
+/**
+ * Call @p handler with the domain and the requested size whenever an
+ * allocation in a domain fails against its budget, before NULL is
+ * returned. NULL removes the handler.
+ */
+void PKUDomainSetMemoryLimitHandler(PKUMemoryLimitHandler handler);
+
+/**
+ * @brief Read the allocation counters of a domain
+ *
+ * The counters are kept as allocations happen, so reading them is a copy.
+ * The host sees the same table, see @c PkuHeapStats in the runtime. A
+ * freed domain keeps its counters, and a domain reusing its key continues
+ * them.
+ *
+ * @return
+ *        0 on success, or -1 with errno EINVAL if @p did is out of range.
+ */
+int PKUDomainGetStats(int did, PKUHeapStats* stats);
+
+/* What isolation has cost the host, laid out as @c PkuHostStats in the
+ * runtime. Switches are the host's PKRU writes by hardware domain, 0 to 15. */
+typedef struct PKUHostStats
+{
+    uint64_t mprotect_calls;
+    uint64_t mprotect_bytes;
+    uint64_t mmap_calls;
+    uint64_t retags;          /* layouts tagged again after a moving grow */
+    uint64_t other_switches;  /* from or to a word which is no domain's */
+    uint64_t switches[16][16];
+} PKUHostStats;
+
+/**
+ * @brief Read the host's isolation counters
+ *
+ * The host only counts while the engine asks it to, e.g. under
+ * `wasmtime run --pku-stats`, and counts for the whole process. Entries
+ * into each domain made here are counted in @c PKUHeapStats instead.
+ *
+ * @return
+ *        0 on success, or -1 with errno ENOSYS without a host.
+ */
+int PKUGetHostStats(PKUHostStats* stats);
+
+/* Allocation traces: while one is recorded, the malloc, free, calloc and
+ * realloc hooks append a PKUTraceRecord per call to a file, after
+ * PKU_TRACE_MAGIC. A pointer's id is its address over 8, so an id names
+ * one allocation from its malloc to its free. A realloc which moves is
+ * followed by a PKU_TRACE_MOVED record with the new id. posix_memalign and
+ * aligned_alloc are recorded as mallocs. `replay` drives the allocator from
+ * such a file, as does the pku crate's replay bench for the Rust one. */
+#define PKU_TRACE_MAGIC "PKUTRC01"
+#define PKU_TRACE_MALLOC 1
+#define PKU_TRACE_FREE 2
+#define PKU_TRACE_CALLOC 3
+#define PKU_TRACE_REALLOC 4
+#define PKU_TRACE_MOVED 5
+
+typedef struct PKUTraceRecord
+{
+    uint32_t id;
+    uint32_t size;   /* requested bytes, saturated at UINT32_MAX */
+    uint8_t op;      /* PKU_TRACE_* */
+    uint8_t did;     /* domain current at the call */
+    uint16_t reserved;
+} PKUTraceRecord;
+
+#define PKU_TRACE_ID(ptr) ((uint32_t)((uintptr_t)(ptr) >> 3))
+
+/* Whether a trace is being recorded, checked by the hooks before calling
+ * PKUTrace */
+extern int g_PKUTracing;
+
+/**
+ * @brief Record allocations to @p path
+ *
+ * PKUInit starts a trace by itself if the environment variable PKU_TRACE
+ * names a file, e.g. `wasmtime run --env PKU_TRACE=whitedb.trace`. The
+ * trace is written at exit at the latest.
+ *
+ * @return
+ *        0 on success, or -1 with errno set by @c fopen.
+ */
+int PKUTraceStart(const char* path);
+
+/* Write out and close the trace being recorded, if any */
+int PKUTraceStop(void);
+
+void PKUTrace(int op, const void* ptr, size_t size);
+
+/* Objects from @c PKUArenaAlloc are aligned to this */
+#define PKU_ARENA_ALIGN 16
+
+/* A bump allocator over pages of one domain, see @c PKUArenaCreate */
+typedef struct PKUArena
+{
+    int did;
+    char* base;
+    char* cur;
+    char* end;
+} PKUArena;
+
+/**
+ * @brief Create an arena in a domain
+ *
+ * The arena reserves @p reserve bytes, rounded up to whole pages, from
+ * @p did's heap once, so its pages carry the domain's key. It does not
+ * grow; @c PKUArenaAlloc fails once the reserve is used up.
+ *
+ * @param did
+ *        The domain the arena's memory belongs to.
+ * @param reserve
+ *        The capacity of the arena.
+ * @return
+ *        The arena, or NULL with errno set.
+ */
+PKUArena* PKUArenaCreate(int did, size_t reserve);
+
+/* Bump @p size bytes off @p arena, NULL with errno ENOMEM if it is full */
+void* PKUArenaAlloc(PKUArena* arena, size_t size);
+
+/* Release everything allocated from @p arena at once; nothing is re-tagged */
+void PKUArenaReset(PKUArena* arena);
+
+/* Reset @p arena and hand its pages back to the domain's heap */
+void PKUArenaDestroy(PKUArena* arena);
+
+/* Slots of a @c PKURing are aligned to this */
+#define PKU_RING_ALIGN 16
+
+/* A single-producer, single-consumer ring between two domains, see
+ * @c PKURingCreate */
+typedef struct PKURing
+{
+    int producer;
+    int consumer;
+    int pkey;
+    char* slots;
+    size_t slot_size;
+    size_t count;
+    volatile size_t head;
+    volatile size_t tail;
+} PKURing;
+
+/**
+ * @brief Create a ring handing slots from one domain to another
+ *
+ * The slots live in pages tagged once with an exchange key of their own,
+ * which no domain's PKRU word opens. @c PKURingReserve opens the key for
+ * writing in the producer's PKRU until @c PKURingCommit, @c PKURingPeek
+ * opens it for reading in the consumer's until @c PKURingRelease, so a
+ * message changes hands without being copied or re-tagged. The rights are
+ * the current thread's: they do not follow a switch into another domain,
+ * and come back when it returns.
+ *
+ * @param producer
+ *        The domain filling slots.
+ * @param consumer
+ *        The domain reading them.
+ * @param slot_size
+ *        The size of a message, rounded up to @c PKU_RING_ALIGN.
+ * @param count
+ *        The number of slots.
+ * @return
+ *        The ring, or NULL with errno set, ENOSPC if no key is left.
+ */
+PKURing* PKURingCreate(int producer, int consumer, size_t slot_size, size_t count);
+
+/* The producer's next free slot, open for writing until @c PKURingCommit;
+ * NULL with errno EAGAIN if the ring is full or EPERM outside the producer */
+void* PKURingReserve(PKURing* ring);
+
+/* Hand the reserved slot to the consumer and close it to the producer */
+void PKURingCommit(PKURing* ring);
+
+/* The consumer's oldest slot, open for reading until @c PKURingRelease;
+ * NULL with errno EAGAIN if the ring is empty or EPERM outside the consumer */
+const void* PKURingPeek(PKURing* ring);
+
+/* Close the peeked slot to the consumer and give it back to the producer */
+void PKURingRelease(PKURing* ring);
+
+/* Free @p ring; its pages go back to key 0 and its key to the pool */
+void PKURingDestroy(PKURing* ring);
+
+/* Size of the pages behind @c PKUHugeAlloc */
+#define PKU_HUGE_PAGE (2 * 1024 * 1024)
+
+/* For @c PKUHugeAlloc: explicit hugetlb pages instead of transparent ones */
+#define PKU_HUGE_EXPLICIT 1
+
+/* Huge regions live at once */
+#define PKU_HUGE_REGIONS 16
+
+/**
+ * @brief Allocate a huge-page region for a domain
+ *
+ * Reserves @p length bytes, rounded up to whole huge pages, from the root
+ * domain's heap at an address the host can back with 2 MiB pages. The
+ * host backs them and tags the region with @p did's key in a single
+ * @c pkey_mprotect, so a large domain heap costs a few TLB entries instead
+ * of one per 4 KiB page.
+ *
+ * Transparent huge pages keep the region's contents. With
+ * @c PKU_HUGE_EXPLICIT it is mapped from the hugetlb pool instead and
+ * reads as zeros.
+ *
+ * @param did
+ *        The domain the region belongs to.
+ * @param length
+ *        The size of the region.
+ * @param flags
+ *        0 or @c PKU_HUGE_EXPLICIT.
+ * @return
+ *        The region, or NULL with errno set: EINVAL, ENOMEM, or what the
+ *        host reported, e.g. EINVAL if transparent huge pages are off.
+ */
+void* PKUHugeAlloc(int did, size_t length, int flags);
+
+/* Decommit a region from @c PKUHugeAlloc and return it to the root heap */
+void PKUHugeFree(void* ptr);
+
+/**
+ * @brief Give pages back to the host
+ *
+ * The whole pages within the range are released with
+ * @c madvise(MADV_DONTNEED) and tagged with key 0 again. They read back as
+ * zeros.
+ *
+ * @return
+ *        0 on success, or -1 on error, and errno is set according to
+ *        @c madvise or @c pkey_mprotect.
+ */
+int PKUDecommit(void* addr, size_t length);
+
+/* Map whole pages for the current domain, see @c PKUPagesAlloc */
 void* NaiveMmap(size_t bytes);
 
 /**
@@ -117,10 +604,14 @@ void* PKUMmap(void* addr, size_t length, int prot, int flags, int fd, int offset
 }
 #endif
 
-static void* MallocHook(size_t bytes)
+static inline void* MallocHook(size_t bytes)
 {
     void* ptr = NULL;
     size_t size = bytes;
+    // Pages freed by a domain are re-tagged lazily; settle them before they
+    // can be handed out again.
+    PKUQueueFlush();
+    PKUQuarantineDrain();
     if(g_MallocNumber < 0)
     {
         #ifdef __WASI_MMAP__
@@ -143,14 +634,27 @@ static void* MallocHook(size_t bytes)
     {
         ptr = PKUMalloc(size);
     }
+    if(g_PKUTracing)
+    {
+        PKUTrace(PKU_TRACE_MALLOC, ptr, bytes);
+    }
     return ptr;
 }
 
-static void FreeHook(void* ptr)
+static inline void FreeHook(void* ptr)
 {
-    if(GetCurrentDid() != 0)
+    // The chunk goes back to the heap of the domain it came from, whose
+    // segments stay tagged, so there is nothing to re-tag here. Only its
+    // owner can reach it, though.
+    if(g_PKUTracing && ptr != NULL)
+    {
+        PKUTrace(PKU_TRACE_FREE, ptr, 0);
+    }
+    PKURange range;
+    if(ptr != NULL && PKURangeLookup(ptr, &range) == 0 && range.pkey != GetCurrentDid())
     {
-        DomainProtect(ptr, PAGESIZEPKU, 0);
+        PKUFreeDeferred(range.pkey, ptr);
+        return;
     }
     if(g_FreeNumber < 0)
     {
@@ -166,6 +670,59 @@ static void FreeHook(void* ptr)
     }
 }
 
+static inline void* CallocHook(size_t nmemb, size_t size)
+{
+    PKUQueueFlush();
+    PKUQuarantineDrain();
+    void* ptr = PKUCalloc(nmemb, size);
+    if(g_PKUTracing)
+    {
+        PKUTrace(PKU_TRACE_CALLOC, ptr, nmemb * size);
+    }
+    return ptr;
+}
+
+static inline void* ReallocHook(void* ptr, size_t size)
+{
+    PKUQueueFlush();
+    PKUQuarantineDrain();
+    void* ret = PKURealloc(ptr, size);
+    if(g_PKUTracing)
+    {
+        // Without a chunk to resize it is a malloc.
+        PKUTrace(ptr != NULL ? PKU_TRACE_REALLOC : PKU_TRACE_MALLOC, ptr != NULL ? ptr : ret, size);
+        if(ptr != NULL && ret != NULL && ret != ptr)
+        {
+            PKUTrace(PKU_TRACE_MOVED, ret, size);
+        }
+    }
+    return ret;
+}
+
+static inline int PosixMemalignHook(void** memptr, size_t alignment, size_t size)
+{
+    PKUQueueFlush();
+    PKUQuarantineDrain();
+    int ret = PKUPosixMemalign(memptr, alignment, size);
+    if(g_PKUTracing && ret == 0)
+    {
+        PKUTrace(PKU_TRACE_MALLOC, *memptr, size);
+    }
+    return ret;
+}
+
+static inline void* AlignedAllocHook(size_t alignment, size_t size)
+{
+    PKUQueueFlush();
+    PKUQuarantineDrain();
+    void* ptr = PKUAlignedAlloc(alignment, size);
+    if(g_PKUTracing)
+    {
+        PKUTrace(PKU_TRACE_MALLOC, ptr, size);
+    }
+    return ptr;
+}
+
 #ifdef __cplusplus
 extern "C"
 {
@@ -186,6 +743,13 @@ typedef struct PKUCall
     pFunc entry;   // PKU call entry point
 } PKUCall;
 
+typedef struct PKUScope
+{
+    int did;     // Domain to return to
+    int entered; // Whether the scope switched
+    void* sp;    // Stack pointer to return to, see PKUStackEnter
+} PKUScope;
+
 /**
  * @brief Initialize PKU
  *
@@ -220,6 +784,19 @@ int PKUDeinit(void);
  * This function creates a new protection domain with its own private
  * protection key.
  *
+ * Up to @c NUM_DOMAINS domains can exist, more than there are hardware
+ * keys. While the host has keys left, a domain's id is its hardware key.
+ * Beyond that, domains the thread is not running with are parked: their
+ * ranges are re-tagged with a key no domain opens, and their hardware key
+ * goes to the domain being entered. Entering a parked domain, or
+ * allocating in it, makes it resident again, taking the key of the domain
+ * entered least recently. Hot domains thus stay resident, and a cold one
+ * costs one batched re-tag of its ranges when it is next used. A parked
+ * key is only closed on the calling thread, so while more than one thread
+ * has switched domains, no domain is parked and running out of keys fails
+ * with @c ENOSPC instead. Code compiled for a fixed key, e.g. from a
+ * pkuwa.domains section, requires its domains to stay among the first 15.
+ *
  * @param flags
  *         0
  *            Protection key of new domain is guaranteed to be unique
@@ -236,6 +813,16 @@ int PKUDeinit(void);
  *            Only valid with @c PKU_KEY_INHERIT
  *         @c PKU_KEY_OWNER
  *            Only valid with @c PKU_KEY_INHERIT
+ *         @c PKU_KEY_LAZY
+ *            The domain is pending until it is first entered, through
+ *            @c PKUSwitch, @c PKU_SCOPE or an allocation in it. Creating
+ *            it takes no hardware key, and ranges assigned to it are only
+ *            recorded and keep the default key, so that other domains
+ *            can still reach them. The first entry takes a key and tags
+ *            all of them in one batched pass. For domains which many
+ *            runs never enter, e.g. optional plugins. Its id comes
+ *            from past the hardware keys where it can, so code compiled
+ *            for a fixed key cannot use such a domain.
  * @return
  *        The new domain id @c did, which is always positive,
  *        or -1 on error, and errno is set to:
@@ -243,6 +830,9 @@ int PKUDeinit(void);
  *            if @p flags are invalid.
  *        @c ENOMEM
  *            if there is no more space for new domains
+ *        @c ENOSPC
+ *            if the host has no hardware keys left and every domain
+ *            holding one is in use by the calling thread
  */
 int PKUCreateDomain(unsigned int flags);
 
@@ -338,6 +928,11 @@ int PKUPkeyFree(int pkey);
  * onto a @p pkey while keeping ownership via @c PKU_KEY_OWNER, or losing
  * ownership via @c PKU_KEY_COPY.
  *
+ * Assigning another domain's key with @c PKEY_DISABLE_WRITE shares that
+ * domain's memory read-only: @p did reads it in place, without switching.
+ * The grant is folded into @p did's precomputed PKRU word. Domain 0
+ * created every key and may assign any of them.
+ *
  * @param did
  *        The domain to assign the protection key to.
  * @param pkey
@@ -407,18 +1002,16 @@ int PKUPkeyMprotect(void* addr, size_t len, int prot, int pkey);
 /**
  * @brief Unmap a memory range
  *
- * This function unmaps a memory range via a call to @c munmap in WASI.
- * The memory has to be owned by @p did.
+ * Releases a whole mapping from @c NaiveMmap: its pages are decommitted and
+ * tagged with key 0, see @c PKUDecommit, and go back to the root domain's
+ * heap for any domain to reuse.
  *
- * @param did
- *        The domain from which the memory range shall be freed.
  * @param addr
- *        see @c munmap in WASI
+ *        The start of the mapping.
  * @param len
- *        see @c munmap in WASI
+ *        Its length, which has to cover the whole mapping.
  * @return
- *        0 on success, or -1 on error, and errno is set according to
- *        @c munmap in WASI
+ *        0 on success, or -1 with errno EINVAL if @p addr is no mapping.
  */
 int PKUMunmap(void* addr, size_t len);
 
@@ -455,17 +1048,29 @@ int PKUMprotect(void* addr, size_t len, int prot);
  * @param entry
  *        The entry point of the pkucall
  * @return
- *        the positive pkucall_id on success, or -1 on error, and errno is set to:
+ *        the positive pkucall_id on success, or a negated errno on error:
  *        @c EACCES
  *            if @p did is neither the current domain.
  *        @c EINVAL
- *            if @p entry does not point into the memory of @p did, or
- *            @p pkucall_id is invalid.
+ *            if @p did or @p entry is invalid.
+ *        @c EEXIST
+ *            if @p entry is already registered for another domain.
  *        @c ENOMEM
- *            if there is no more space for registering pkucalls
+ *            if the pkucall table cannot grow
+ *
+ * Registering an entry point again for the same domain returns its
+ * existing pkucall_id. The table grows as needed, ids stay dense.
  */
 int RegisterPKUCall(int did, pFunc entry);
 
+/**
+ * @brief Find the pkucall_id of a registered entry point.
+ *
+ * @return
+ *        the pkucall_id, or -1 if @p entry is not registered
+ */
+int LookupPKUCall(pFunc entry);
+
 /**
  * @brief Permit other domains to invoke pkucalls.
  *
@@ -477,32 +1082,204 @@ int RegisterPKUCall(int did, pFunc entry);
  * @param CallerDid
  *        The domain which is permitted to invoke pkucalls of @p did.
  * @param flags
- *        Optional flags for future use. Must be 0 in current implementations.
+ *        0, or @c PKU_CALLER_GRANT to keep the caller's key accessible
+ *        inside the pkucalls.
  * @return
  *        0 on success, or -1 on error, and errno is set to:
  *        @c EACCES
  *            if @p did is neither the current domain.
  *        @c EINVAL
  *            if @p CallerDid or @p flags are invalid.
- *        @c ENOMEM
- *            if there is no more space for new callers
+ *
+ * Pkucalls of a domain may always be invoked from the domain itself and
+ * from domain 0. The PKRU word of every permitted (caller, callee) pair is
+ * computed here, so @c PKUSwitch is a single table load and write.
  */
 int PKUDomainAllowCaller(int CallerDid, unsigned int flags);
 
+/**
+ * @brief End every later segment and page run of @p did's heap with a
+ *        guard page
+ *
+ * The guard is tagged with @c PKU_GUARD_KEY in the same host call which
+ * tags the rest with @p did, so it neither splits a mapping of its own
+ * nor costs a second transition, and no domain can reach it. Segments of
+ * a guarded heap are never merged, so an overflow faults instead of
+ * running into the next one.
+ *
+ * @return
+ *        0 on success, or -1 on error, and errno is set to:
+ *        @c EINVAL
+ *            if @p did is 0 or no domain.
+ *        @c ENOSPC
+ *            if no hardware key is left for guards.
+ */
 int EnableSectionGuardPage(int did);
 
+/**
+ * @brief Make the pages of [@p addr, @p addr + @p len) guard pages, which
+ *        no domain can access; @c PKUDecommit returns them to key 0
+ *
+ * @return
+ *        0 on success, or -1 on error, like @c EnableSectionGuardPage.
+ */
+int PKUGuardPages(void* addr, size_t len);
+
+/**
+ * @brief Enter the domain of the registered call @p PKUCallID, or return to
+ *        domain @p did. Each is one write of a precomputed PKRU word,
+ *        skipped when the thread already runs with it. @c PKUSwitch fails
+ *        with @c EACCES, leaving PKRU alone, unless the current domain was
+ *        permitted to call the target domain.
+ *
+ * @c PKUSwitch saves the caller's PKRU on a per-thread stack, and the
+ * matching @c PKURestore writes it back exactly, grants included.
+ */
 int PKUSwitch(int PKUCallID);
 int PKURestore(int did);
 
+/**
+ * @brief Return this thread to the root domain after a trap unwound out of
+ *        the module, so that the instance can be called again.
+ *
+ * The host restores PKRU when a trap leaves wasm, but the switches the
+ * trap cut short leave their frames behind. Export this and call it
+ * before reusing an instance that trapped. Domains, keys and the tags on
+ * memory are kept.
+ */
+void PKURecover(void);
+
+/**
+ * @brief Enter domain @p did until @c PKUScopeExit, see @c PKU_SCOPE.
+ *
+ * @return
+ *        the scope, whose @c entered is 0 if @p did does not exist or the
+ *        current domain may not enter it, with errno set.
+ */
+PKUScope PKUScopeEnter(int did);
+void PKUScopeExit(PKUScope *scope);
+
+/* A callee of @c PKUCallBatch, run once per argument */
+typedef size_t (*PKUBatchFunc)(void *arg);
+
+/**
+ * @brief Run @p fn inside domain @p did over @p n arguments, entering the
+ *        domain once for the whole batch instead of once per call.
+ *
+ * @p fn has to be registered for @p did with @c PKU_CALL_REGISTER, and the
+ * caller permitted to call into @p did, as for @c PKUSwitch.
+ *
+ * @p args and @p results are read and written from inside @p did, so they
+ * have to be reachable from it: in root memory, or in the caller's when
+ * @p did was allowed to be called with @c PKU_CALLER_GRANT.
+ *
+ * @param results
+ *        Receives fn(args[i]) at index i, or NULL to drop the results.
+ * @return
+ *        0 on success, or -1 with errno set, EINVAL if @p fn is not one of
+ *        @p did's pkucalls or as by @c PKUScopeEnter, in which case @p fn
+ *        was not called.
+ */
+int PKUCallBatch(int did, PKUBatchFunc fn, void *const args[], size_t *results, size_t n);
+
+/**
+ * @brief Give domain @p did a stack of its own
+ *
+ * The stack is @p size bytes of @p did's heap, rounded up to whole pages,
+ * so it carries the domain's key and no other domain can read or write it.
+ * Pkucalls into @p did and @c PKU_SCOPE blocks then move the shadow stack
+ * pointer onto it and back, and the domain can keep scratch buffers on the
+ * stack instead of allocating them. Domains without a stack of their own
+ * run on the root domain's. There is one stack per domain, so with wasm
+ * threads only one thread at a time may run in @p did. Natively the stack
+ * is the thread's and never switched.
+ *
+ * @return
+ *        0 on success, or -1 with errno EINVAL if @p did is 0 or does not
+ *        exist, EEXIST if it has a stack, or ENOMEM.
+ */
+int PKUDomainSetStack(int did, size_t size);
+
+/* The stack pointer the current domain runs on after a switch from
+ * domain @p from with stack pointer @p sp, see @c PKUStackEnter */
+void* PKUStackSwitch(int from, void* sp);
+
+#ifdef __wasm__
+static inline __attribute__((always_inline)) void* PKUStackPointer(void)
+{
+    void* sp;
+    __asm__ volatile(".globaltype __stack_pointer, i32\n\tglobal.get __stack_pointer\n\tlocal.set %0" : "=r"(sp));
+    return sp;
+}
+
+static inline __attribute__((always_inline)) void PKUSetStackPointer(void* sp)
+{
+    __asm__ volatile(".globaltype __stack_pointer, i32\n\tlocal.get %0\n\tglobal.set __stack_pointer" : : "r"(sp));
+}
+#endif
+
+/* Move onto the stack of the domain just entered from @p from, returning
+ * the stack pointer for @c PKUStackLeave. A function restores the stack
+ * pointer it was entered with on return, so the move has to be made in the
+ * caller of the domain's code itself; these are always inlined there. */
+static inline __attribute__((always_inline)) void* PKUStackEnter(int from)
+{
+#ifdef __wasm__
+    void* sp = PKUStackPointer();
+    PKUSetStackPointer(PKUStackSwitch(from, sp));
+    return sp;
+#else
+    (void)from;
+    return NULL;
+#endif
+}
+
+/* Return to the stack pointer @c PKUStackEnter saved */
+static inline __attribute__((always_inline)) void PKUStackLeave(void* sp)
+{
+#ifdef __wasm__
+    PKUSetStackPointer(sp);
+#else
+    (void)sp;
+#endif
+}
+
+static inline __attribute__((always_inline)) PKUScope PKUScopeStackEnter(PKUScope scope)
+{
+    scope.sp = scope.entered ? PKUStackEnter(scope.did) : NULL;
+    return scope;
+}
+
+static inline __attribute__((always_inline)) void PKUScopeStackExit(PKUScope* scope)
+{
+    if (scope->entered)
+    {
+        PKUStackLeave(scope->sp);
+    }
+    PKUScopeExit(scope);
+}
+
 int ReadPKRU();
 
 size_t GetMemorySize();
 
+/* The most GetMemorySize has been */
+size_t GetPeakMemorySize();
+
+/* The mappings the tagged ranges split memory into, an estimate of the
+ * VMAs they cost the host: a run of one key is one VMA */
+size_t PKUMappingCount(void);
+
 #ifdef __cplusplus
 }
 #endif
 
 #define malloc(bytes) MallocHook(bytes)
 #define free(ptr) FreeHook(ptr)
+#define calloc(nmemb, size) CallocHook(nmemb, size)
+#define realloc(ptr, size) ReallocHook(ptr, size)
+#define posix_memalign(memptr, alignment, size) PosixMemalignHook(memptr, alignment, size)
+#define aligned_alloc(alignment, size) AlignedAllocHook(alignment, size)
+#define malloc_usable_size(ptr) PKUMallocUsableSize(ptr)
 
 #endif
\ No newline at end of file
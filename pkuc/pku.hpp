@@ -0,0 +1,53 @@
+#ifndef _PKU_HPP_
+#define _PKU_HPP_
+
+#include <cstddef>
+#include <new>
+#if __has_include(<memory_resource>)
+#include <memory_resource>
+#else
+#include <experimental/memory_resource>
+#endif
+
+#include "pku.h"
+
+/*
+ * C++ support for pkuc, built into libpkuxx.a (libnativepkuxx.a natively).
+ * Linking it replaces the global operator new and delete with versions
+ * bound to the current domain, like the malloc and free hooks in pku.h.
+ */
+
+namespace pku
+{
+
+#if __has_include(<memory_resource>)
+namespace pmr = std::pmr;
+#else
+namespace pmr = std::experimental::pmr;
+#endif
+
+/**
+ * A memory resource allocating from one domain's heap, whichever domain
+ * is current, see @c PKUDomainAlloc. Containers using it keep their
+ * storage in that domain, e.g.
+ *     pku::domain_resource heap(did);
+ *     std::pmr::vector<int> v(&heap);
+ */
+class domain_resource : public pmr::memory_resource
+{
+public:
+    explicit domain_resource(int did) noexcept : m_did(did) {}
+
+    int domain() const noexcept { return m_did; }
+
+private:
+    void* do_allocate(std::size_t bytes, std::size_t alignment) override;
+    void do_deallocate(void* ptr, std::size_t bytes, std::size_t alignment) override;
+    bool do_is_equal(const pmr::memory_resource& other) const noexcept override;
+
+    int m_did;
+};
+
+} // namespace pku
+
+#endif
@@ -627,9 +627,9 @@ MAX_RELEASE_CHECK_RATE   default: 4095 unless not HAVE_MMAP
 // #ifndef MALLOC_ALIGNMENT
 // #define MALLOC_ALIGNMENT ((size_t)(2 * sizeof(void *)))
 // #endif  /* MALLOC_ALIGNMENT */
-#ifndef FOOTERS
-#define FOOTERS 0
-#endif  /* FOOTERS */
+// #ifndef FOOTERS
+// #define FOOTERS 0
+// #endif  /* FOOTERS */
 // #ifndef ABORT
 // #define ABORT  abort()
 // #endif  /* ABORT */
@@ -1028,47 +1028,336 @@ DLMALLOC_EXPORT size_t dlmalloc_footprint_limit();
 */
 DLMALLOC_EXPORT size_t dlmalloc_set_footprint_limit(size_t bytes);
 
-void* PKUMalloc(size_t size)
+/*
+  Small objects inside a domain come from slabs: SLAB_SIZE aligned runs of
+  the domain's heap, so already carrying its key, split into objects of one
+  size class from 16 to SLAB_MAX bytes. Freed objects go on a list per
+  domain and class, and slabs are never handed back to dlmalloc.
+*/
+#define SLAB_SIZE    (4 * PAGE_SIZE)
+#define SLAB_MAX     512
+#define SLAB_CLASSES 6
+#define SLAB_HEADER  16 /* keeps objects MALLOC_ALIGNMENT aligned */
+#define NUM_SLAB_INDEX 64
+
+typedef struct SlabHeader
+{
+    unsigned int did;
+    unsigned int cls;
+} SlabHeader;
+
+typedef struct SlabClass
+{
+    void* free; /* freed objects, linked through their first word */
+    char* bump; /* next object never handed out in the newest slab */
+    char* end;
+} SlabClass;
+
+static SlabClass g_Slabs[NUM_DOMAINS][SLAB_CLASSES];
+
+/* Open-addressed set of slab bases, so PKUFree can tell slab objects apart */
+static size_t* g_SlabIndex = NULL;
+static size_t g_SlabIndexSize = 0;
+static size_t g_NumSlabs = 0;
+
+static inline unsigned int SlabClassOf(size_t size)
+{
+    return size <= 16 ? 0 : (unsigned int)(sizeof(unsigned int) * 8 - __builtin_clz((unsigned int)(size - 1))) - 4;
+}
+
+static inline size_t SlabSlot(size_t base, size_t mask)
+{
+    return ((base / SLAB_SIZE) * 0x9e3779b1u) & mask;
+}
+
+static int SlabIndexInsert(size_t base)
 {
-    void* ptr = 0;
-    if(GetCurrentDid() != 0)
+    if ((g_NumSlabs + 1) * 2 > g_SlabIndexSize)
     {
-        size = PAGE_ALIGN(size);
-        // ptr = dlmalloc(size);
-        dlposix_memalign(ptr, PAGE_SIZE, size);
-        // DomainProtect(ptr, size, GetCurrentDid());
+        size_t size = g_SlabIndexSize ? g_SlabIndexSize * 2 : NUM_SLAB_INDEX;
+        size_t* index = PKURootMalloc(size * sizeof(size_t));
+        if (index == NULL)
+        {
+            return -1;
+        }
+        __builtin_memset(index, 0, size * sizeof(size_t));
+        for (size_t i = 0; i < g_SlabIndexSize; ++i)
+        {
+            if (g_SlabIndex[i] != 0)
+            {
+                size_t slot = SlabSlot(g_SlabIndex[i], size - 1);
+                while (index[slot] != 0)
+                {
+                    slot = (slot + 1) & (size - 1);
+                }
+                index[slot] = g_SlabIndex[i];
+            }
+        }
+        PKUFree(g_SlabIndex);
+        g_SlabIndex = index;
+        g_SlabIndexSize = size;
     }
-    else
+    size_t slot = SlabSlot(base, g_SlabIndexSize - 1);
+    while (g_SlabIndex[slot] != 0)
     {
-        ptr = dlmalloc(size);
+        slot = (slot + 1) & (g_SlabIndexSize - 1);
+    }
+    g_SlabIndex[slot] = base;
+    g_NumSlabs++;
+    return 0;
+}
+
+static inline int SlabIndexContains(size_t base)
+{
+    if (g_SlabIndex == NULL)
+    {
+        return 0;
+    }
+    size_t mask = g_SlabIndexSize - 1;
+    for (size_t slot = SlabSlot(base, mask); g_SlabIndex[slot] != 0; slot = (slot + 1) & mask)
+    {
+        if (g_SlabIndex[slot] == base)
+        {
+            return 1;
+        }
     }
+    return 0;
+}
+
+static void* SlabAlloc(unsigned int did, size_t size)
+{
+    unsigned int cls = SlabClassOf(size);
+    size_t object = (size_t)16 << cls;
+    SlabClass* c = &g_Slabs[did][cls];
+    void* ptr = c->free;
+    if (ptr != NULL)
+    {
+        c->free = *(void**)ptr;
+        return ptr;
+    }
+    if (c->bump + object > c->end)
+    {
+        // gm is the domain's heap here, so the slab carries its key.
+        char* base = dlmemalign(SLAB_SIZE, SLAB_SIZE);
+        if (base == NULL)
+        {
+            return NULL;
+        }
+        if (SlabIndexInsert((size_t)base) != 0)
+        {
+            dlfree(base);
+            return NULL;
+        }
+        ((SlabHeader*)base)->did = did;
+        ((SlabHeader*)base)->cls = cls;
+        c->bump = base + SLAB_HEADER;
+        c->end = base + SLAB_SIZE;
+    }
+    ptr = c->bump;
+    c->bump += object;
     return ptr;
 }
 
-void PKUFree(void* ptr)
+/* Put ptr back on its slab's free list, or return 0 if no slab holds it */
+static inline int SlabFree(void* ptr)
 {
-    dlfree(ptr);
+    size_t base = (size_t)ptr & ~(size_t)(SLAB_SIZE - 1);
+    if (!SlabIndexContains(base))
+    {
+        return 0;
+    }
+    SlabHeader* header = (SlabHeader*)base;
+    SlabClass* c = &g_Slabs[header->did][header->cls];
+    *(void**)ptr = c->free;
+    c->free = ptr;
+    return 1;
+}
+
+/* Page runs from PKUPagesAlloc, sorted by address */
+typedef struct PageRun
+{
+    size_t base;
+    size_t size;
+    size_t guard; /* trailing guard page, counted in size */
+    unsigned int did;
+} PageRun;
+
+#define NUM_PAGE_RUNS 16
+
+static PageRun* g_PageRuns = NULL;
+static size_t g_NumPageRuns = 0;
+static size_t g_PageRunsCapacity = 0;
+
+/* Page runs held by each domain, and its budget, 0 for none */
+static size_t g_DomainPages[NUM_DOMAINS];
+static size_t g_DomainLimit[NUM_DOMAINS];
+
+/* Domains whose segments and page runs end in a guard page */
+static unsigned char g_HeapGuard[NUM_DOMAINS];
+
+static inline size_t HeapGuardSize(unsigned int did)
+{
+    return did != 0 && g_HeapGuard[did] ? PAGE_SIZE : 0;
+}
+
+int DomainProtect(void* addr, size_t length, unsigned int pkey);
+int DomainProtectGuarded(void* addr, size_t length, unsigned int pkey);
+int PKUDecommit(void* addr, size_t length);
+static size_t MemoryLimitUsed(unsigned int did);
+static void UpdateHeapLimit(unsigned int did);
+static void MemoryLimitReached(unsigned int did, size_t size);
+
+/* Per-domain counters, see PKUHeapStats */
+static PKUHeapStats g_HeapStats[NUM_DOMAINS];
+static unsigned int OwnerOf(void* ptr);
+static void CountAlloc(unsigned int did, void* ptr);
+static void CountFree(unsigned int did, size_t usable);
+static void CountResize(unsigned int did, size_t usable, void* ptr);
+
+/* First run which starts at or above base */
+static size_t PageRunLowerBound(size_t base)
+{
+    size_t lo = 0, hi = g_NumPageRuns;
+    while (lo < hi)
+    {
+        size_t mid = lo + (hi - lo) / 2;
+        if (g_PageRuns[mid].base < base)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo;
 }
 
-// void *calloc(size_t nmemb, size_t size) {
-//     return dlcalloc(nmemb, size);
-// }
+void* PKUPagesAlloc(size_t size)
+{
+    size = PAGE_ALIGN(size);
+    if (g_NumPageRuns == g_PageRunsCapacity)
+    {
+        size_t capacity = g_PageRunsCapacity ? g_PageRunsCapacity * 2 : NUM_PAGE_RUNS;
+        PageRun* runs = PKURootMalloc(capacity * sizeof(PageRun));
+        if (runs == NULL)
+        {
+            return NULL;
+        }
+        if (g_PageRuns != NULL)
+        {
+            // Guarded, or the copy would let the compiler assume non-NULL.
+            __builtin_memcpy(runs, g_PageRuns, g_NumPageRuns * sizeof(PageRun));
+            PKUFree(g_PageRuns);
+        }
+        g_PageRuns = runs;
+        g_PageRunsCapacity = capacity;
+    }
 
-// void *realloc(void *ptr, size_t size) {
-//     return dlrealloc(ptr, size);
-// }
+    // The chunk headers around the run stay in root pages, so only the run
+    // itself changes keys.
+    unsigned int did = GetCurrentDid();
+    size_t guard = HeapGuardSize(did);
+    size += guard;
+    if (did != 0 && g_DomainLimit[did] != 0 && size > g_DomainLimit[did] - MemoryLimitUsed(did))
+    {
+        MemoryLimitReached(did, size);
+        return NULL;
+    }
+    SetCurrentDid(0);
+    char* ptr = dlmemalign(PAGE_SIZE, size);
+    SetCurrentDid(did);
+    if (ptr == NULL)
+    {
+        return NULL;
+    }
+    if (guard != 0)
+    {
+        DomainProtectGuarded(ptr, size, did);
+    }
+    else if (did != 0)
+    {
+        DomainProtect(ptr, size, did);
+    }
 
-// int posix_memalign(void **memptr, size_t alignment, size_t size) {
-//     return dlposix_memalign(memptr, alignment, size);
-// }
+    size_t i = PageRunLowerBound((size_t)ptr);
+    __builtin_memmove(&g_PageRuns[i + 1], &g_PageRuns[i], (g_NumPageRuns - i) * sizeof(PageRun));
+    g_PageRuns[i].base = (size_t)ptr;
+    g_PageRuns[i].size = size;
+    g_PageRuns[i].guard = guard;
+    g_PageRuns[i].did = did;
+    g_NumPageRuns++;
+    g_DomainPages[did] += size;
+    g_HeapStats[did].segments++;
+    UpdateHeapLimit(did);
+    return ptr;
+}
 
-// void* aligned_alloc(size_t alignment, size_t bytes) {
-//     return dlmemalign(alignment, bytes);
-// }
+int PKUPagesFree(void* ptr, size_t len)
+{
+    size_t i = PageRunLowerBound((size_t)ptr);
+    if (i == g_NumPageRuns || g_PageRuns[i].base != (size_t)ptr || len <= g_PageRuns[i].size - g_PageRuns[i].guard - PAGE_SIZE)
+    {
+        return -1;
+    }
+    PKUDecommit(ptr, g_PageRuns[i].size);
+    g_DomainPages[g_PageRuns[i].did] -= g_PageRuns[i].size;
+    g_HeapStats[g_PageRuns[i].did].segments--;
+    UpdateHeapLimit(g_PageRuns[i].did);
+    g_NumPageRuns--;
+    __builtin_memmove(&g_PageRuns[i], &g_PageRuns[i + 1], (g_NumPageRuns - i) * sizeof(PageRun));
+    dlfree(ptr);
+    return 0;
+}
 
-// size_t malloc_usable_size(void *ptr) {
-//     return dlmalloc_usable_size(ptr);
-// }
+void* PKUMalloc(size_t size)
+{
+    // gm is the current domain's heap, whose segments are tagged with the
+    // domain's key as they are obtained, see TagDomainSegment.
+    unsigned int did = GetCurrentDid();
+    void* ptr;
+    if (did != 0 && size <= SLAB_MAX)
+    {
+        ptr = SlabAlloc(did, size);
+    }
+    else if (did != 0 && size >= PKU_PAGES_MIN)
+    {
+        ptr = PKUPagesAlloc(size);
+    }
+    else
+    {
+        ptr = dlmalloc(size);
+    }
+    CountAlloc(did, ptr);
+    return ptr;
+}
+
+void* PKURootMalloc(size_t size)
+{
+    // gm follows the current domain, so step into the root domain's heap.
+    unsigned int did = GetCurrentDid();
+    SetCurrentDid(0);
+    void* ptr = dlmalloc(size);
+    SetCurrentDid(did);
+    CountAlloc(0, ptr);
+    return ptr;
+}
+
+void PKUFree(void* ptr)
+{
+    if (ptr == 0)
+    {
+        return;
+    }
+    unsigned int did = OwnerOf(ptr);
+    size_t usable = PKUMallocUsableSize(ptr);
+    if (!SlabFree(ptr) &&
+        (g_NumPageRuns == 0 || ((size_t)ptr & (PAGE_SIZE - 1)) != 0 || PKUPagesFree(ptr, MAX_SIZE_T) != 0))
+    {
+        dlfree(ptr);
+    }
+    CountFree(did, usable);
+}
 
 #if MALLOC_INSPECT_ALL
 /*
@@ -1826,6 +2115,9 @@ static FORCEINLINE int win32munmap(void* ptr, size_t size) {
 /* segment bit set in create_mspace_with_base */
 #define EXTERN_BIT            (8U)
 
+/* segment bit set when a guard page follows the segment */
+#define GUARD_BIT             (16U)
+
 
 /* --------------------------- Lock preliminaries ------------------------ */
 
@@ -2689,6 +2981,41 @@ static struct malloc_state _gm_[NUM_DOMAINS];
 #define gm                 (&_gm_[GetCurrentDid()])
 #define is_global(M)       ((M) == &_gm_[GetCurrentDid()])
 
+/* Tag the whole pages of a segment a domain's heap just obtained, so that
+   its chunks need no tagging of their own. With a guard on, the last page
+   becomes the guard and is cut off *size; returns GUARD_BIT then. */
+static flag_t TagDomainSegment(mstate m, char* base, size_t* size)
+{
+  size_t did = (size_t)(m - _gm_);
+  if (did == 0 || did >= NUM_DOMAINS)
+    return 0;
+  size_t start = PAGE_ALIGN((size_t)base);
+  size_t end = ((size_t)base + *size) & ~(PAGE_SIZE - SIZE_T_ONE);
+  if (HeapGuardSize((unsigned int)did) && start + PAGE_SIZE < end) {
+    DomainProtectGuarded((void*)start, end - start, (unsigned int)did);
+    *size = end - PAGE_SIZE - (size_t)base;
+    return GUARD_BIT;
+  }
+  if (start < end)
+    DomainProtect((void*)start, end - start, (unsigned int)did);
+  return 0;
+}
+
+/* The guard page each new segment of m's heap ends in, see TagDomainSegment */
+static size_t SegmentGuardSize(mstate m)
+{
+  if (m > _gm_ && m < _gm_ + NUM_DOMAINS)
+    return HeapGuardSize((unsigned int)(m - _gm_));
+  return 0;
+}
+
+/* Count a segment a domain's heap added, rather than extended */
+static void CountSegment(mstate m)
+{
+  if (m >= _gm_ && m < _gm_ + NUM_DOMAINS)
+    g_HeapStats[m - _gm_].segments++;
+}
+
 #endif /* !ONLY_MSPACES */
 
 #define is_initialized(M)  ((M)->top != 0)
@@ -3265,9 +3592,145 @@ static int change_mparam(int param_number, int value) {
   }
 }
 
+/*
+  A domain's budget covers its heap and its page runs. The heap's
+  footprint limit is what the runs leave of the budget, so sys_alloc
+  enforces it as the heap grows.
+*/
+
+static PKUMemoryLimitHandler g_MemoryLimitHandler = NULL;
+
+static size_t MemoryLimitUsed(unsigned int did)
+{
+    size_t used = _gm_[did].footprint + g_DomainPages[did];
+    return used < g_DomainLimit[did] ? used : g_DomainLimit[did];
+}
+
+static void UpdateHeapLimit(unsigned int did)
+{
+    size_t limit = g_DomainLimit[did];
+    if (limit == 0)
+    {
+        _gm_[did].footprint_limit = 0;
+    }
+    else
+    {
+        // A heap limit of 1 still counts as set, and stops all growth.
+        _gm_[did].footprint_limit = limit > g_DomainPages[did] ? limit - g_DomainPages[did] : 1;
+    }
+}
+
+static void MemoryLimitReached(unsigned int did, size_t size)
+{
+    if (g_DomainLimit[did] != 0 && g_MemoryLimitHandler != NULL)
+    {
+        g_MemoryLimitHandler((int)did, size);
+    }
+}
+
+size_t PKUHeapSetLimit(unsigned int did, size_t bytes)
+{
+    g_DomainLimit[did] = bytes == MAX_SIZE_T ? 0 : bytes;
+    if (bytes == 0)
+    {
+        // 0 as a budget means nothing more may be obtained, not no limit.
+        g_DomainLimit[did] = 1;
+    }
+    UpdateHeapLimit(did);
+    return g_DomainLimit[did] != 0 ? g_DomainLimit[did] : MAX_SIZE_T;
+}
+
+size_t PKUHeapUsage(unsigned int did)
+{
+    return _gm_[did].footprint + g_DomainPages[did];
+}
+
+void PKUHeapSetLimitHandler(PKUMemoryLimitHandler handler)
+{
+    g_MemoryLimitHandler = handler;
+}
+
+void PKUHeapSetGuard(unsigned int did)
+{
+    g_HeapGuard[did] = 1;
+}
+
+/* The domain whose heap ptr came from */
+static unsigned int OwnerOf(void* ptr)
+{
+    size_t base = (size_t)ptr & ~(size_t)(SLAB_SIZE - 1);
+    if (SlabIndexContains(base))
+    {
+        return ((SlabHeader*)base)->did;
+    }
+    if (g_NumPageRuns != 0 && ((size_t)ptr & (PAGE_SIZE - 1)) == 0)
+    {
+        size_t i = PageRunLowerBound((size_t)ptr);
+        if (i < g_NumPageRuns && g_PageRuns[i].base == (size_t)ptr)
+        {
+            return g_PageRuns[i].did;
+        }
+    }
+    return (unsigned int)(get_mstate_for(mem2chunk(ptr)) - _gm_);
+}
+
+static void CountAlloc(unsigned int did, void* ptr)
+{
+    if (ptr == 0)
+    {
+        return;
+    }
+    PKUHeapStats* stats = &g_HeapStats[did];
+    stats->allocations++;
+    stats->in_use += PKUMallocUsableSize(ptr);
+    if (stats->in_use > stats->peak)
+    {
+        stats->peak = stats->in_use;
+    }
+    stats->footprint = _gm_[did].footprint + g_DomainPages[did];
+}
+
+static void CountFree(unsigned int did, size_t usable)
+{
+    PKUHeapStats* stats = &g_HeapStats[did];
+    stats->frees++;
+    stats->in_use -= usable;
+    stats->footprint = _gm_[did].footprint + g_DomainPages[did];
+}
+
+static void CountResize(unsigned int did, size_t usable, void* ptr)
+{
+    PKUHeapStats* stats = &g_HeapStats[did];
+    stats->in_use += PKUMallocUsableSize(ptr) - usable;
+    if (stats->in_use > stats->peak)
+    {
+        stats->peak = stats->in_use;
+    }
+    stats->footprint = _gm_[did].footprint + g_DomainPages[did];
+}
+
+PKUHeapStats* PKUHeapStatsTable(void)
+{
+    return g_HeapStats;
+}
+
 size_t MemorySize()
 {
-    size_t ret = _gm_[0].footprint + _gm_[1].footprint;
+    size_t ret = 0;
+    for (int did = 0; did < NUM_DOMAINS; ++did)
+    {
+        ret += _gm_[did].footprint;
+    }
+    return ret;
+}
+
+size_t MaxMemorySize()
+{
+    size_t ret = 0;
+    for (int did = 0; did < NUM_DOMAINS; ++did)
+    {
+        ret += _gm_[did].max_footprint;
+    }
     return ret;
 }
 
@@ -3276,6 +3739,104 @@ void PKUMmapFree(void* ptr)
     _gm_[0].footprint += PAGE_SIZE;
 }
 
+/* Size of the slab object at ptr, or 0 if no slab holds it */
+static inline size_t SlabObjectSize(void* ptr)
+{
+    size_t base = (size_t)ptr & ~(size_t)(SLAB_SIZE - 1);
+    if (!SlabIndexContains(base))
+    {
+        return 0;
+    }
+    return (size_t)16 << ((SlabHeader*)base)->cls;
+}
+
+void* PKUCalloc(size_t nmemb, size_t size)
+{
+    size_t bytes = nmemb * size;
+    if (size != 0 && bytes / size != nmemb)
+    {
+        MALLOC_FAILURE_ACTION;
+        return 0;
+    }
+    void* ptr = PKUMalloc(bytes);
+    if (ptr != 0)
+    {
+        memset(ptr, 0, bytes);
+    }
+    return ptr;
+}
+
+void* PKURealloc(void* ptr, size_t size)
+{
+    if (ptr == 0)
+    {
+        return PKUMalloc(size);
+    }
+    size_t object = SlabObjectSize(ptr);
+    if (object == 0)
+    {
+        // The chunk's footer names its heap, so dlrealloc grows it in place
+        // there when the next chunk is free.
+        unsigned int did = OwnerOf(ptr);
+        size_t usable = dlmalloc_usable_size(ptr);
+        void* moved = dlrealloc(ptr, size);
+        if (moved != 0)
+        {
+            CountResize(did, usable, moved);
+        }
+        return moved;
+    }
+    if (size <= object)
+    {
+        return ptr;
+    }
+    void* grown = PKUMalloc(size);
+    if (grown != 0)
+    {
+        memcpy(grown, ptr, object);
+        PKUFree(ptr);
+    }
+    return grown;
+}
+
+int PKUPosixMemalign(void** memptr, size_t alignment, size_t size)
+{
+    if (alignment <= MALLOC_ALIGNMENT && alignment != 0 && (alignment & (alignment - 1)) == 0 &&
+        alignment % sizeof(void*) == 0)
+    {
+        void* ptr = PKUMalloc(size);
+        if (ptr == 0)
+        {
+            return ENOMEM;
+        }
+        *memptr = ptr;
+        return 0;
+    }
+    int ret = dlposix_memalign(memptr, alignment, size);
+    if (ret == 0)
+    {
+        CountAlloc(GetCurrentDid(), *memptr);
+    }
+    return ret;
+}
+
+void* PKUAlignedAlloc(size_t alignment, size_t size)
+{
+    if (alignment <= MALLOC_ALIGNMENT)
+    {
+        return PKUMalloc(size);
+    }
+    void* ptr = dlmemalign(alignment, size);
+    CountAlloc(GetCurrentDid(), ptr);
+    return ptr;
+}
+
+size_t PKUMallocUsableSize(void* ptr)
+{
+    size_t object = SlabObjectSize(ptr);
+    return object != 0 ? object : dlmalloc_usable_size(ptr);
+}
+
 #if DEBUG
 /* ------------------------- Debugging Support --------------------------- */
 
@@ -4103,8 +4664,12 @@ static void* sys_alloc(mstate m, size_t nb) {
   size_t tsize = 0;
   flag_t mmap_flag = 0;
   size_t asize; /* allocation size */
+  size_t guard = 0; /* trailing guard page */
 
   ensure_initialization();
+#if !ONLY_MSPACES
+  guard = SegmentGuardSize(m);
+#endif /* !ONLY_MSPACES */
 
   /* Directly map large chunks, but only if already initialized */
   if (use_mmap(m) && nb >= mparams.mmap_threshold && m->topsize != 0) {
@@ -4113,13 +4678,15 @@ static void* sys_alloc(mstate m, size_t nb) {
       return mem;
   }
 
-  asize = granularity_align(nb + SYS_ALLOC_PADDING);
+  asize = granularity_align(nb + SYS_ALLOC_PADDING + guard);
   if (asize <= nb)
     return 0; /* wraparound */
   if (m->footprint_limit != 0) {
     size_t fp = m->footprint + asize;
-    if (fp <= m->footprint || fp > m->footprint_limit)
+    if (fp <= m->footprint || fp > m->footprint_limit) {
+      MemoryLimitReached((unsigned int)(m - _gm_), asize);
       return 0;
+    }
   }
 
   /*
@@ -4144,7 +4711,8 @@ static void* sys_alloc(mstate m, size_t nb) {
    not on boundary, and round this up to a granularity unit.
   */
 
-  if (MORECORE_CONTIGUOUS && !use_noncontiguous(m)) {
+  /* A guard page ends each segment, so a guarded heap never extends one */
+  if (MORECORE_CONTIGUOUS && !use_noncontiguous(m) && guard == 0) {
     char* br = CMFAIL;
     size_t ssize = asize; /* sbrk call size */
     msegmentptr ss = (m->top == 0)? 0 : segment_holding(m, (char*)m->top);
@@ -4233,6 +4801,10 @@ static void* sys_alloc(mstate m, size_t nb) {
   }
 
   if (tbase != CMFAIL) {
+    flag_t guard_flag = 0;
+#if !ONLY_MSPACES
+    guard_flag = TagDomainSegment(m, tbase, &tsize);
+#endif /* !ONLY_MSPACES */
 
     if ((m->footprint += tsize) > m->max_footprint)
       m->max_footprint = m->footprint;
@@ -4242,11 +4814,12 @@ static void* sys_alloc(mstate m, size_t nb) {
         m->least_addr = tbase;
       m->seg.base = tbase;
       m->seg.size = tsize;
-      m->seg.sflags = mmap_flag;
+      m->seg.sflags = mmap_flag | guard_flag;
       m->magic = mparams.magic;
       m->release_checks = MAX_RELEASE_CHECK_RATE;
       init_bins(m);
 #if !ONLY_MSPACES
+      CountSegment(m);
       if (is_global(m))
         init_top(m, (mchunkptr)tbase, tsize - TOP_FOOT_SIZE);
       else
@@ -4269,6 +4842,7 @@ static void* sys_alloc(mstate m, size_t nb) {
           (sp->sflags & USE_MMAP_BIT) == mmap_flag &&
           segment_holds(sp, m->top)) { /* append */
         sp->size += tsize;
+        sp->sflags |= guard_flag;
         init_top(m, m->top, m->topsize + tsize);
       }
       else {
@@ -4285,8 +4859,12 @@ static void* sys_alloc(mstate m, size_t nb) {
           sp->size += tsize;
           return prepend_alloc(m, tbase, oldbase, nb);
         }
-        else
-          add_segment(m, tbase, tsize, mmap_flag);
+        else {
+          add_segment(m, tbase, tsize, mmap_flag | guard_flag);
+#if !ONLY_MSPACES
+          CountSegment(m);
+#endif /* !ONLY_MSPACES */
+        }
       }
     }
 
@@ -4333,7 +4911,7 @@ static size_t release_unused_segments(mstate m) {
         else {
           unlink_large_chunk(m, tp);
         }
-        if (CALL_MUNMAP(base, size) == 0) {
+        if (CALL_MUNMAP(base, size + (sp->sflags & GUARD_BIT ? PAGE_SIZE : 0)) == 0) {
           released += size;
           m->footprint -= size;
           /* unlink obsoleted record */
@@ -4372,7 +4950,7 @@ static int sys_trim(mstate m, size_t pad) {
       if (!is_extern_segment(sp)) {
         if (is_mmapped_segment(sp)) {
           if (HAVE_MMAP &&
-              sp->size >= extra &&
+              sp->size >= extra && !(sp->sflags & GUARD_BIT) &&
               !has_segment_link(m, sp)) { /* can't shrink if pinned */
             size_t newsize = sp->size - extra;
             (void)newsize; /* placate people compiling -Wunused-variable */
@@ -1,6 +1,7 @@
 #ifndef _PKU_MALLOC_H_
 #define _PKU_MALLOC_H_
 
+#include <stdint.h>
 #include "PKUInternal.h"
 
 // Define configuration macros for dlmalloc.
@@ -29,6 +30,10 @@
 // Align malloc regions to 16, to avoid unaligned SIMD accesses.
 #define MALLOC_ALIGNMENT 16
 
+// Each domain has a heap of its own; the footer of a chunk names it, so a
+// chunk goes back to the right heap whichever domain frees it.
+#define FOOTERS 1
+
 // Define USE_DL_PREFIX so that we leave dlmalloc's names prefixed with 'dl'.
 // We define them as "static", and we wrap them with public names below. This
 // serves two purposes:
@@ -60,24 +65,78 @@ extern "C"
 
 void* PKUMalloc(size_t size);
 
+/* Allocate from the root domain's heap whichever domain is current, for
+ * bookkeeping every domain reads, like the range table in pku.c */
+void* PKURootMalloc(size_t size);
+
 void PKUFree(void* ptr);
 
-void PKUMmapFree(void* ptr);
+/* Whole pages of their own for the current domain, carved from the root
+ * domain's heap and tagged with the domain's key. Freeing them, or any
+ * domain allocation of at least PKU_PAGES_MIN bytes, decommits the pages
+ * and hands them back to the root heap with key 0, so no domain keeps
+ * memory it no longer uses. PKUPagesFree returns -1 if ptr is not such a
+ * run or len does not cover it. */
+#define PKU_PAGES_MIN (64 * 1024)
 
-size_t MemorySize();
+void* PKUPagesAlloc(size_t size);
 
-#ifdef __cplusplus
-}
-#endif
+int PKUPagesFree(void* ptr, size_t len);
+
+/* Like their libc namesakes, from the current domain's heap. PKURealloc
+ * grows a chunk in place when its neighbour is free, and keeps a slab
+ * object while the new size still fits its size class. */
+void* PKUCalloc(size_t nmemb, size_t size);
+
+void* PKURealloc(void* ptr, size_t size);
+
+int PKUPosixMemalign(void** memptr, size_t alignment, size_t size);
+
+void* PKUAlignedAlloc(size_t alignment, size_t size);
+
+size_t PKUMallocUsableSize(void* ptr);
 
-// void *calloc(size_t nmemb, size_t size);
+/* Per-domain budgets behind PKUDomainSetMemoryLimit, over the domain's
+ * heap and page runs. PKUHeapSetLimit takes MAX_SIZE_T for no limit and
+ * returns the budget in effect. */
+typedef void (*PKUMemoryLimitHandler)(int did, size_t size);
 
-// void *realloc(void *ptr, size_t size);
+size_t PKUHeapSetLimit(unsigned int did, size_t bytes);
 
-// int posix_memalign(void **memptr, size_t alignment, size_t size);
+size_t PKUHeapUsage(unsigned int did);
 
-// void* aligned_alloc(size_t alignment, size_t bytes);
+void PKUHeapSetLimitHandler(PKUMemoryLimitHandler handler);
 
-// size_t malloc_usable_size(void *ptr);
+/* End the segments and page runs did's heap obtains from now on with a
+ * guard page, see EnableSectionGuardPage */
+void PKUHeapSetGuard(unsigned int did);
+
+/* Counters of one domain's allocations and entries, kept as they happen. The host
+ * reads the table of NUM_DOMAINS of them in place, as PkuHeapStats, so
+ * the fields are 64-bit on every target and their order is fixed. */
+typedef struct PKUHeapStats
+{
+    uint64_t in_use;      /* usable bytes of live allocations */
+    uint64_t peak;        /* the most in_use has been */
+    uint64_t allocations;
+    uint64_t frees;
+    uint64_t footprint;   /* heap and page runs, as of the last allocation or free */
+    uint64_t segments;    /* heap segments and page runs */
+    uint64_t tagged;      /* bytes carrying the domain's key */
+    uint64_t switches;    /* entries through the domain's call gate */
+} PKUHeapStats;
+
+PKUHeapStats* PKUHeapStatsTable(void);
+
+void PKUMmapFree(void* ptr);
+
+size_t MemorySize();
+
+/* The most MemorySize has been, summed over the domains' heaps */
+size_t MaxMemorySize();
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif
\ No newline at end of file
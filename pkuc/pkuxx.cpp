@@ -0,0 +1,79 @@
+#include "pku.hpp"
+
+namespace
+{
+
+[[noreturn]] void AllocationFailed()
+{
+#if __cpp_exceptions
+    throw std::bad_alloc();
+#else
+    abort();
+#endif
+}
+
+void* NewHook(std::size_t size)
+{
+    void* ptr = MallocHook(size != 0 ? size : 1);
+    if (ptr == nullptr)
+    {
+        AllocationFailed();
+    }
+    return ptr;
+}
+
+void* AlignedNewHook(std::size_t size, std::align_val_t alignment)
+{
+    void* ptr = AlignedAllocHook(static_cast<std::size_t>(alignment), size != 0 ? size : 1);
+    if (ptr == nullptr)
+    {
+        AllocationFailed();
+    }
+    return ptr;
+}
+
+} // namespace
+
+void* operator new(std::size_t size) { return NewHook(size); }
+void* operator new[](std::size_t size) { return NewHook(size); }
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept { return MallocHook(size != 0 ? size : 1); }
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept { return MallocHook(size != 0 ? size : 1); }
+void* operator new(std::size_t size, std::align_val_t alignment) { return AlignedNewHook(size, alignment); }
+void* operator new[](std::size_t size, std::align_val_t alignment) { return AlignedNewHook(size, alignment); }
+
+void operator delete(void* ptr) noexcept { FreeHook(ptr); }
+void operator delete[](void* ptr) noexcept { FreeHook(ptr); }
+void operator delete(void* ptr, std::size_t) noexcept { FreeHook(ptr); }
+void operator delete[](void* ptr, std::size_t) noexcept { FreeHook(ptr); }
+void operator delete(void* ptr, const std::nothrow_t&) noexcept { FreeHook(ptr); }
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept { FreeHook(ptr); }
+void operator delete(void* ptr, std::align_val_t) noexcept { FreeHook(ptr); }
+void operator delete[](void* ptr, std::align_val_t) noexcept { FreeHook(ptr); }
+void operator delete(void* ptr, std::size_t, std::align_val_t) noexcept { FreeHook(ptr); }
+void operator delete[](void* ptr, std::size_t, std::align_val_t) noexcept { FreeHook(ptr); }
+
+namespace pku
+{
+
+void* domain_resource::do_allocate(std::size_t bytes, std::size_t alignment)
+{
+    void* ptr = PKUDomainAlloc(m_did, bytes != 0 ? bytes : 1, alignment);
+    if (ptr == nullptr)
+    {
+        AllocationFailed();
+    }
+    return ptr;
+}
+
+void domain_resource::do_deallocate(void* ptr, std::size_t, std::size_t)
+{
+    PKUDomainRelease(m_did, ptr);
+}
+
+bool domain_resource::do_is_equal(const pmr::memory_resource& other) const noexcept
+{
+    const domain_resource* resource = dynamic_cast<const domain_resource*>(&other);
+    return resource != nullptr && resource->m_did == m_did;
+}
+
+} // namespace pku
@@ -0,0 +1,250 @@
+/* Replays an allocation trace, see PKUTraceStart:
+ *     replay TRACE
+ * drives the malloc and free hooks, and so PKUMalloc and PKUFree, with the
+ * calls of the trace, each in the domain it was made in, and prints the
+ * throughput, the peak footprint and the mappings the heap ends up in.
+ * Traces of whitedb and bzip2, recorded with PKU_TRACE, are the regression
+ * suite of the allocator. Built natively as `replay` and for wasm as
+ * `replay.wasm`. The trace and the id table come from libc's allocator,
+ * called as (malloc) to get past the hooks, so they don't count. */
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "pku.h"
+
+/* Open-addressed map from trace id to the pointer it names here, 0 being
+ * a free slot */
+typedef struct Slot
+{
+    uint32_t id;
+    void* ptr;
+} Slot;
+
+static Slot* g_Slots = NULL;
+static size_t g_NumSlots = 0;
+static size_t g_Live = 0;
+
+static size_t SlotOf(uint32_t id)
+{
+    size_t mask = g_NumSlots - 1;
+    size_t slot = (id * 0x9e3779b1u) & mask;
+    while (g_Slots[slot].id != 0 && g_Slots[slot].id != id)
+    {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+static void Insert(uint32_t id, void* ptr)
+{
+    if ((g_Live + 1) * 2 > g_NumSlots)
+    {
+        Slot* old = g_Slots;
+        size_t count = g_NumSlots;
+        g_NumSlots = count ? count * 2 : 1024;
+        g_Slots = (calloc)(g_NumSlots, sizeof(Slot));
+        if (g_Slots == NULL)
+        {
+            perror("replay");
+            exit(1);
+        }
+        for (size_t i = 0; i < count; ++i)
+        {
+            if (old[i].id != 0)
+            {
+                g_Slots[SlotOf(old[i].id)] = old[i];
+            }
+        }
+        (free)(old);
+    }
+    size_t slot = SlotOf(id);
+    g_Live += g_Slots[slot].id == 0;
+    g_Slots[slot].id = id;
+    g_Slots[slot].ptr = ptr;
+}
+
+/* Remove id and return its pointer, NULL if the trace never allocated it */
+static void* Remove(uint32_t id)
+{
+    if (g_NumSlots == 0)
+    {
+        return NULL;
+    }
+    size_t mask = g_NumSlots - 1;
+    size_t slot = SlotOf(id);
+    if (g_Slots[slot].id == 0)
+    {
+        return NULL;
+    }
+    void* ptr = g_Slots[slot].ptr;
+    // Shift the rest of the cluster back over the hole.
+    size_t hole = slot;
+    for (size_t next = (slot + 1) & mask; g_Slots[next].id != 0; next = (next + 1) & mask)
+    {
+        size_t home = (g_Slots[next].id * 0x9e3779b1u) & mask;
+        if (((next - home) & mask) >= ((next - hole) & mask))
+        {
+            g_Slots[hole] = g_Slots[next];
+            hole = next;
+        }
+    }
+    g_Slots[hole].id = 0;
+    g_Live--;
+    return ptr;
+}
+
+static void* Lookup(uint32_t id)
+{
+    return g_NumSlots != 0 ? g_Slots[SlotOf(id)].ptr : NULL;
+}
+
+/* Domains of the trace and what they were created as here */
+static int g_Domains[NUM_DOMAINS];
+
+static int replay_nop(void)
+{
+    return 0;
+}
+
+static int Domain(unsigned int did)
+{
+    if (did == 0 || g_Domains[did] != 0)
+    {
+        return g_Domains[did];
+    }
+    // A registered call opens the root domain's gate into the domain.
+    int created = PKUCreateDomain(0);
+    if (created < 0 || RegisterPKUCall(created, (pFunc)replay_nop) < 0)
+    {
+        perror("replay domain");
+        exit(1);
+    }
+    g_Domains[did] = created;
+    return created;
+}
+
+static PKUTraceRecord* Load(const char* path, size_t* count)
+{
+    FILE* file = fopen(path, "rb");
+    char magic[sizeof(PKU_TRACE_MAGIC) - 1];
+    if (file == NULL || fread(magic, 1, sizeof(magic), file) != sizeof(magic) ||
+        memcmp(magic, PKU_TRACE_MAGIC, sizeof(magic)) != 0)
+    {
+        fprintf(stderr, "replay: %s is no allocation trace\n", path);
+        exit(1);
+    }
+    size_t capacity = 1 << 16, used = 0;
+    PKUTraceRecord* records = (malloc)(capacity * sizeof(PKUTraceRecord));
+    for (;;)
+    {
+        if (records == NULL)
+        {
+            perror("replay");
+            exit(1);
+        }
+        used += fread(records + used, sizeof(PKUTraceRecord), capacity - used, file);
+        if (used < capacity)
+        {
+            break;
+        }
+        capacity *= 2;
+        records = (realloc)(records, capacity * sizeof(PKUTraceRecord));
+    }
+    fclose(file);
+    *count = used;
+    return records;
+}
+
+/* VMAs of the process, where /proc is there to count them, or 0 */
+static size_t CountVMAs(void)
+{
+    FILE* maps = fopen("/proc/self/maps", "r");
+    if (maps == NULL)
+    {
+        return 0;
+    }
+    size_t count = 0;
+    int c;
+    while ((c = fgetc(maps)) != EOF)
+    {
+        count += c == '\n';
+    }
+    fclose(maps);
+    return count;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc != 2)
+    {
+        fprintf(stderr, "usage: %s TRACE\n", argv[0]);
+        return 1;
+    }
+    size_t count;
+    PKUTraceRecord* records = Load(argv[1], &count);
+    if (PKUInit(0) != 0)
+    {
+        perror("PKUInit");
+        return 1;
+    }
+    // Create the domains up front, so that creating them is not timed.
+    for (size_t i = 0; i < count; ++i)
+    {
+        Domain(records[i].did);
+    }
+
+    size_t base = GetPeakMemorySize();
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    PKUScope scope = {0, 0, NULL};
+    unsigned int current = 0;
+    uint32_t resized = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        const PKUTraceRecord* r = &records[i];
+        if (r->did != current)
+        {
+            PKUScopeExit(&scope);
+            if (r->did != 0)
+            {
+                scope = PKUScopeEnter(Domain(r->did));
+            }
+            current = r->did;
+        }
+        switch (r->op)
+        {
+        case PKU_TRACE_MALLOC:
+            Insert(r->id, malloc(r->size));
+            break;
+        case PKU_TRACE_CALLOC:
+            Insert(r->id, calloc(1, r->size));
+            break;
+        case PKU_TRACE_FREE:
+            free(Remove(r->id));
+            break;
+        case PKU_TRACE_REALLOC:
+            Insert(r->id, realloc(Lookup(r->id), r->size));
+            resized = r->id;
+            break;
+        case PKU_TRACE_MOVED:
+            Insert(r->id, Remove(resized));
+            break;
+        }
+    }
+    PKUScopeExit(&scope);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("operations:     %zu in %.3f ms, %.2f Mops/s\n", count, seconds * 1e3, count / seconds / 1e6);
+    printf("peak footprint: %zu bytes\n", GetPeakMemorySize() - base);
+    printf("final footprint: %zu bytes, %zu allocations live\n", GetMemorySize(), g_Live);
+    printf("mappings:       %zu by key", PKUMappingCount());
+    size_t vmas = CountVMAs();
+    if (vmas != 0)
+    {
+        printf(", %zu VMAs in the process", vmas);
+    }
+    printf("\n");
+    return 0;
+}
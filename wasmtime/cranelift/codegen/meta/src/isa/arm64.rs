@@ -50,6 +50,13 @@ fn define_settings(_shared: &SettingGroup) -> SettingGroup {
         "",
         false,
     );
+    setting.add_bool(
+        "has_poe",
+        "Has Stage 1 Permission Overlay Extension (FEAT_S1POE) support; \
+         enables `rdmemkey` and `wrmemkey` on POR_EL0.",
+        "",
+        false,
+    );
 
     setting.build()
 }
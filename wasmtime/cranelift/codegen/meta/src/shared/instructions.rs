@@ -1935,11 +1935,17 @@ pub(crate) fn define(
             "rdmemkey",
             r#"
         Reading memory key value.
+
+        This reads PKRU, so it is ordered with respect to `wrmemkey`. `x`
+        and `y` are ignored; the registers the hardware requires to be zero
+        are zeroed regardless of them. On AArch64 the permission overlay
+        register POR_EL0 is read instead.
         "#,
             &formats.binary,
         )
         .operands_in(vec![x, y])
-        .operands_out(vec![a]),
+        .operands_out(vec![a])
+        .other_side_effects(true),
     );
 
     ig.push(
@@ -1947,11 +1953,33 @@ pub(crate) fn define(
             "wrmemkey",
             r#"
         Writing memory key value.
+
+        This writes `x` to PKRU, changing which memory is accessible. `y`
+        is ignored. The result is `x`. On AArch64 `x` is written to
+        POR_EL0, in that register's format.
         "#,
             &formats.binary,
         )
         .operands_in(vec![x, y])
-        .operands_out(vec![a]),
+        .operands_out(vec![a])
+        .other_side_effects(true),
+    );
+
+    let pkru = &Operand::new("pkru", &imm.imm64).with_doc("The PKRU word of the domain");
+
+    ig.push(
+        Inst::new(
+            "switch_domain",
+            r#"
+        Switch to a protection domain by writing its PKRU word.
+
+        The word is resolved at compile time, so unlike a `rdmemkey` and
+        `wrmemkey` pair this needs no read or mask arithmetic.
+        "#,
+            &formats.unary_imm,
+        )
+        .operands_in(vec![pkru])
+        .other_side_effects(true),
     );
 
     let I16or32 = &TypeVar::new(
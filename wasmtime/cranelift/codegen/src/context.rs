@@ -20,6 +20,7 @@ use crate::licm::do_licm;
 use crate::loop_analysis::LoopAnalysis;
 use crate::machinst::{CompiledCode, CompiledCodeStencil};
 use crate::nan_canonicalization::do_nan_canonicalization;
+use crate::redundant_pkru::do_redundant_pkru;
 use crate::remove_constant_phis::do_remove_constant_phis;
 use crate::result::{CodegenResult, CompileResult};
 use crate::settings::{FlagsOrIsa, OptLevel};
@@ -155,6 +156,7 @@ impl Context {
             self.compute_loop_analysis();
             self.licm(isa)?;
             self.simple_gvn(isa)?;
+            self.eliminate_redundant_pkru(isa)?;
         }
 
         self.compute_domtree();
@@ -326,6 +328,18 @@ impl Context {
         self.verify_if(isa)
     }
 
+    /// Remove PKRU writes of the value it already holds, hoisting loop
+    /// invariant ones first.
+    pub fn eliminate_redundant_pkru(&mut self, isa: &dyn TargetIsa) -> CodegenResult<()> {
+        do_redundant_pkru(
+            &mut self.func,
+            &mut self.cfg,
+            &mut self.domtree,
+            &mut self.loop_analysis,
+        );
+        self.verify_if(isa)
+    }
+
     /// Perform unreachable code elimination.
     pub fn eliminate_unreachable_code<'a, FOI>(&mut self, fisa: FOI) -> CodegenResult<()>
     where
@@ -324,6 +324,10 @@ pub struct ExtFuncData {
     /// See the documentation for [`RelocDistance`](crate::machinst::RelocDistance) for more details. A
     /// `colocated` flag value of `true` implies `RelocDistance::Near`.
     pub colocated: bool,
+    /// Is the function known to leave PKRU alone and to never access memory guarded by a
+    /// protection key? If so, a call to it neither depends on nor changes the PKRU value, and
+    /// PKRU writes around it may be removed.
+    pub pkru_transparent: bool,
 }
 
 impl ExtFuncData {
@@ -360,6 +364,9 @@ impl<'a> fmt::Display for DisplayableExtFuncData<'a> {
         if self.ext_func.colocated {
             write!(f, "colocated ")?;
         }
+        if self.ext_func.pkru_transparent {
+            write!(f, "pkru_transparent ")?;
+        }
         write!(
             f,
             "{} {}",
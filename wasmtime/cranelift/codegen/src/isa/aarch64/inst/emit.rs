@@ -2949,6 +2949,18 @@ impl MachInstEmit for Inst {
                 let rd = allocs.next_writable(rd);
                 sink.put4(0xd53b4200 | machreg_to_gpr(rd.to_reg()));
             }
+            &Inst::MovFromPOR { rd } => {
+                let rd = allocs.next_writable(rd);
+                sink.put4(0xd53ba280 | machreg_to_gpr(rd.to_reg()));
+            }
+            &Inst::MovToPOR { rn, word } => {
+                let rn = allocs.next(rn);
+                let start = sink.cur_offset();
+                sink.put4(0xd51ba280 | machreg_to_gpr(rn));
+                // isb
+                sink.put4(0xd5033fdf);
+                sink.add_memkey_write(start, word);
+            }
             &Inst::Extend {
                 rd,
                 rn,
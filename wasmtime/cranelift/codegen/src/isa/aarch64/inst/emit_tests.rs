@@ -2534,6 +2534,21 @@ fn test_aarch64_binemit() {
         "1B423BD5",
         "mrs x27, nzcv",
     ));
+    insns.push((
+        Inst::MovFromPOR {
+            rd: writable_xreg(3),
+        },
+        "83A23BD5",
+        "mrs x3, por_el0",
+    ));
+    insns.push((
+        Inst::MovToPOR {
+            rn: xreg(9),
+            word: None,
+        },
+        "89A21BD5DF3F03D5",
+        "msr por_el0, x9 ; isb",
+    ));
     insns.push((
         Inst::VecDup {
             rd: writable_vreg(24),
@@ -1005,10 +1005,10 @@ fn aarch64_get_operands<F: Fn(VReg) -> VReg>(inst: &Inst, collector: &mut Operan
             collector.reg_use(rn);
             collector.reg_use(rm);
         }
-        &Inst::MovToNZCV { rn } => {
+        &Inst::MovToNZCV { rn } | &Inst::MovToPOR { rn, .. } => {
             collector.reg_use(rn);
         }
-        &Inst::MovFromNZCV { rd } => {
+        &Inst::MovFromNZCV { rd } | &Inst::MovFromPOR { rd } => {
             collector.reg_def(rd);
         }
         &Inst::Extend { rd, rn, .. } => {
@@ -2581,6 +2581,14 @@ impl Inst {
                 let rd = pretty_print_reg(rd.to_reg(), allocs);
                 format!("mrs {}, nzcv", rd)
             }
+            &Inst::MovFromPOR { rd } => {
+                let rd = pretty_print_reg(rd.to_reg(), allocs);
+                format!("mrs {}, por_el0", rd)
+            }
+            &Inst::MovToPOR { rn, .. } => {
+                let rn = pretty_print_reg(rn, allocs);
+                format!("msr por_el0, {} ; isb", rn)
+            }
             &Inst::Extend {
                 rd,
                 rn,
@@ -96,6 +96,14 @@ impl Context for IsleContext<'_, '_, MInst, Flags, IsaFlags, 6> {
         }
     }
 
+    fn use_poe(&mut self, _: Inst) -> Option<()> {
+        if self.isa_flags.has_poe() {
+            Some(())
+        } else {
+            None
+        }
+    }
+
     fn imm_logic_from_u64(&mut self, ty: Type, n: u64) -> Option<ImmLogic> {
         ImmLogic::maybe_from_u64(n, ty)
     }
@@ -474,8 +474,11 @@ pub(crate) fn lower_insn_to_regs(
             )));
         }
 
-        Opcode::Rdmemkey | Opcode::Wrmemkey => {
-            panic!("Memory protection key not supported in arm arch!");
+        Opcode::Rdmemkey | Opcode::Wrmemkey | Opcode::SwitchDomain => {
+            return Err(CodegenError::Unsupported(format!(
+                "{} requires the has_poe setting",
+                op
+            )));
         }
     }
 
@@ -275,7 +275,7 @@ impl LowerBackend for S390xBackend {
                 panic!("ALU+imm and ALU+carry ops should not appear here!");
             }
 
-            Opcode::Rdmemkey | Opcode::Wrmemkey => {
+            Opcode::Rdmemkey | Opcode::Wrmemkey | Opcode::SwitchDomain => {
                 panic!("Memory protection key not supported in s390x arch!");
             }
         }
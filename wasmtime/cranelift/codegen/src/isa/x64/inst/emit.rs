@@ -3196,45 +3196,39 @@ pub(crate) fn emit(
             // Nothing.
         }
 
-        Inst::PKU {
-            op,
-            src1,
-            src2,
-            dst,
-        } => {
-            let src = allocs.next(src1.to_reg());
-            let edx = allocs.next(src2.to_reg());
-            let _ = allocs.next(dst.to_reg().to_reg());
-
-            let xorecx = Inst::alu_rmi_r(
-                OperandSize::Size32,
-                AluRmiROpcode::Xor,
-                RegMemImm::reg(regs::rcx()),
-                Writable::from_reg(regs::rcx()),
-            );
-            xorecx.emit(&[], sink, info, state);
+        Inst::Rdpkru { ecx, dst, dst_edx } => {
+            let ecx = allocs.next(ecx.to_reg());
+            debug_assert_eq!(ecx, regs::rcx());
+            let dst = allocs.next(dst.to_reg().to_reg());
+            debug_assert_eq!(dst, regs::rax());
+            let dst_edx = allocs.next(dst_edx.to_reg().to_reg());
+            debug_assert_eq!(dst_edx, regs::rdx());
 
-            let xoredx = Inst::alu_rmi_r(
-                OperandSize::Size32,
-                AluRmiROpcode::Xor,
-                RegMemImm::reg(edx),
-                Writable::from_reg(edx),
-            );
-            xoredx.emit(&[], sink, info, state);
+            // rdpkru = 0F 01 EE
+            sink.put1(0x0F);
+            sink.put1(0x01);
+            sink.put1(0xEE);
+        }
 
-            if let PkuOpcode::WRPKRU = op {
-                let size = OperandSize::Size32;
-                let src = Gpr::new(src).unwrap();
-                let dst = WritableGpr::from_writable_reg(Writable::from_reg(regs::rax())).unwrap();
-                Inst::MovRR { size, src, dst }.emit(&[], sink, info, state);
-            }
+        Inst::Wrpkru {
+            src,
+            ecx,
+            edx,
+            word,
+        } => {
+            let src = allocs.next(src.to_reg());
+            debug_assert_eq!(src, regs::rax());
+            let ecx = allocs.next(ecx.to_reg());
+            debug_assert_eq!(ecx, regs::rcx());
+            let edx = allocs.next(edx.to_reg());
+            debug_assert_eq!(edx, regs::rdx());
 
+            // wrpkru = 0F 01 EF
+            let start = sink.cur_offset();
             sink.put1(0x0F);
             sink.put1(0x01);
-            match op {
-                PkuOpcode::RDPKRU => sink.put1(0xEE),
-                PkuOpcode::WRPKRU => sink.put1(0xEF),
-            }
+            sink.put1(0xEF);
+            sink.add_memkey_write(start, *word);
         }
     }
 
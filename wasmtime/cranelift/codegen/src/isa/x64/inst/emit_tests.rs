@@ -4870,6 +4870,27 @@ fn test_x64_emit() {
         "sfence",
     ));
 
+    // PKU
+    insns.push((
+        Inst::Rdpkru {
+            ecx: Gpr::new(rcx).unwrap(),
+            dst: WritableGpr::from_writable_reg(w_rax).unwrap(),
+            dst_edx: WritableGpr::from_writable_reg(w_rdx).unwrap(),
+        },
+        "0F01EE",
+        "rdpkru  %ecx, %eax, %edx",
+    ));
+    insns.push((
+        Inst::Wrpkru {
+            src: Gpr::new(rax).unwrap(),
+            ecx: Gpr::new(rcx).unwrap(),
+            edx: Gpr::new(rdx).unwrap(),
+            word: None,
+        },
+        "0F01EF",
+        "wrpkru  %eax, %ecx, %edx",
+    ));
+
     // ========================================================
     // Misc instructions.
 
@@ -4921,6 +4942,7 @@ fn test_x64_emit() {
     isa_flag_builder.enable("has_avx512f").unwrap();
     isa_flag_builder.enable("has_avx512vbmi").unwrap();
     isa_flag_builder.enable("has_avx512vl").unwrap();
+    isa_flag_builder.enable("has_pkru").unwrap();
     let isa_flags = x64::settings::Flags::new(&flags, isa_flag_builder);
 
     let emit_info = EmitInfo::new(flags, isa_flags);
@@ -139,7 +139,7 @@ impl Inst {
 
             Inst::XmmRmRVex { op, .. } => op.available_from(),
 
-            Inst::PKU { op, .. } => op.available_from(),
+            Inst::Rdpkru { .. } | Inst::Wrpkru { .. } => smallvec![InstructionSet::PKU],
         }
     }
 }
@@ -1619,39 +1619,19 @@ impl PrettyPrint for Inst {
                 format!("dummy_use {}", reg)
             }
 
-            Inst::PKU {
-                op,
-                src1,
-                src2,
-                dst,
-            } => match op {
-                PkuOpcode::RDPKRU => {
-                    let ssrc1 = pretty_print_reg(src1.to_reg(), 8, allocs);
-                    let ssrc2 = pretty_print_reg(src2.to_reg(), 8, allocs);
-                    let sdst = pretty_print_reg(dst.to_reg().to_reg(), 8, allocs);
-                    format!(
-                        "{}, {}, {}, {}",
-                        op.to_string(),
-                        ssrc1,
-                        ssrc2,
-                        sdst
-                    );
-                    "rdpkru".to_string()
-                },
-                PkuOpcode::WRPKRU => {
-                    let ssrc1 = pretty_print_reg(src1.to_reg(), 8, allocs);
-                    let ssrc2 = pretty_print_reg(src2.to_reg(), 8, allocs);
-                    let sdst = pretty_print_reg(dst.to_reg().to_reg(), 8, allocs);
-                    format!(
-                        "{}, {}, {}, {}",
-                        op.to_string(),
-                        ssrc1,
-                        ssrc2,
-                        sdst
-                    );
-                    "wrpkru".to_string()
-                },
-            },
+            Inst::Rdpkru { ecx, dst, dst_edx } => {
+                let ecx = pretty_print_reg(ecx.to_reg(), 4, allocs);
+                let dst = pretty_print_reg(dst.to_reg().to_reg(), 4, allocs);
+                let dst_edx = pretty_print_reg(dst_edx.to_reg().to_reg(), 4, allocs);
+                format!("rdpkru  {}, {}, {}", ecx, dst, dst_edx)
+            }
+
+            Inst::Wrpkru { src, ecx, edx, .. } => {
+                let src = pretty_print_reg(src.to_reg(), 4, allocs);
+                let ecx = pretty_print_reg(ecx.to_reg(), 4, allocs);
+                let edx = pretty_print_reg(edx.to_reg(), 4, allocs);
+                format!("wrpkru  {}, {}, {}", src, ecx, edx)
+            }
         }
     }
 }
@@ -2143,23 +2123,17 @@ fn x64_get_operands<F: Fn(VReg) -> VReg>(inst: &Inst, collector: &mut OperandCol
             collector.reg_use(*reg);
         }
 
-        Inst::PKU {
-            op,
-            src1,
-            src2,
-            dst,
-        } => match op {
-            PkuOpcode::RDPKRU => {
-                collector.reg_fixed_use(src1.to_reg(), regs::rcx());
-                collector.reg_fixed_use(src2.to_reg(), regs::rdx());
-                collector.reg_fixed_def(dst.to_writable_reg(), regs::rax());
-            }
-            PkuOpcode::WRPKRU => {
-                collector.reg_fixed_use(src1.to_reg(), regs::rax());
-                collector.reg_fixed_use(src2.to_reg(), regs::rdx());
-                collector.reg_def(dst.to_writable_reg());
-            }
-        },
+        Inst::Rdpkru { ecx, dst, dst_edx } => {
+            collector.reg_fixed_use(ecx.to_reg(), regs::rcx());
+            collector.reg_fixed_def(dst.to_writable_reg(), regs::rax());
+            collector.reg_fixed_def(dst_edx.to_writable_reg(), regs::rdx());
+        }
+
+        Inst::Wrpkru { src, ecx, edx, .. } => {
+            collector.reg_fixed_use(src.to_reg(), regs::rax());
+            collector.reg_fixed_use(ecx.to_reg(), regs::rcx());
+            collector.reg_fixed_use(edx.to_reg(), regs::rdx());
+        }
     }
 }
 
@@ -472,7 +472,8 @@ fn lower_insn_to_regs(
         | Opcode::Uunarrow
         | Opcode::Nop
         | Opcode::Rdmemkey
-        | Opcode::Wrmemkey => {
+        | Opcode::Wrmemkey
+        | Opcode::SwitchDomain => {
             let ty = if outputs.len() > 0 {
                 Some(ctx.output_ty(insn, 0))
             } else {
@@ -252,8 +252,12 @@ impl Context for IsleContext<'_, '_, MInst, Flags, IsaFlags, 6> {
     }
 
     #[inline]
-    fn use_pkru(&mut self, _: Type) -> bool {
-        self.isa_flags.use_pkru()
+    fn use_pkru(&mut self, _: Inst) -> Option<()> {
+        if self.isa_flags.use_pkru() {
+            Some(())
+        } else {
+            None
+        }
     }
 
     #[inline]
@@ -88,7 +88,9 @@ pub mod verifier;
 pub mod write;
 
 pub use crate::entity::packed_option;
-pub use crate::machinst::buffer::{MachCallSite, MachReloc, MachSrcLoc, MachStackMap, MachTrap};
+pub use crate::machinst::buffer::{
+    MachCallSite, MachMemkeyWrite, MachReloc, MachSrcLoc, MachStackMap, MachTrap,
+};
 pub use crate::machinst::{CompiledCode, TextSectionBuilder};
 
 mod alias_analysis;
@@ -103,6 +105,7 @@ mod iterators;
 mod legalizer;
 mod licm;
 mod nan_canonicalization;
+mod redundant_pkru;
 mod remove_constant_phis;
 mod result;
 mod scoped_hash_map;
@@ -61,7 +61,7 @@ pub fn do_licm(
 
 /// Insert a pre-header before the header, modifying the function layout and CFG to reflect it.
 /// A jump instruction to the header is placed at the end of the pre-header.
-fn create_pre_header(
+pub(crate) fn create_pre_header(
     header: Block,
     func: &mut Function,
     cfg: &mut ControlFlowGraph,
@@ -103,7 +103,7 @@ fn create_pre_header(
 /// A loop header has a pre-header if there is only one predecessor that the header doesn't
 /// dominate.
 /// Returns the pre-header Block and the instruction jumping to the header.
-fn has_pre_header(
+pub(crate) fn has_pre_header(
     layout: &Layout,
     cfg: &ControlFlowGraph,
     domtree: &DominatorTree,
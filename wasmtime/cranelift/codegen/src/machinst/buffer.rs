@@ -210,6 +210,8 @@ pub struct MachBuffer<I: VCodeInst> {
     traps: SmallVec<[MachTrap; 16]>,
     /// Any call site records referring to this code.
     call_sites: SmallVec<[MachCallSite; 16]>,
+    /// Any memory-key register writes in this code.
+    memkey_writes: SmallVec<[MachMemkeyWrite; 4]>,
     /// Any source location mappings referring to this code.
     srclocs: SmallVec<[MachSrcLoc<Stencil>; 64]>,
     /// Any stack maps referring to this code.
@@ -273,6 +275,7 @@ impl MachBufferFinalized<Stencil> {
             relocs: self.relocs,
             traps: self.traps,
             call_sites: self.call_sites,
+            memkey_writes: self.memkey_writes,
             srclocs: self
                 .srclocs
                 .into_iter()
@@ -299,6 +302,8 @@ pub struct MachBufferFinalized<T: CompilePhase> {
     pub(crate) traps: SmallVec<[MachTrap; 16]>,
     /// Any call site records referring to this code.
     pub(crate) call_sites: SmallVec<[MachCallSite; 16]>,
+    /// Any memory-key register writes in this code.
+    pub(crate) memkey_writes: SmallVec<[MachMemkeyWrite; 4]>,
     /// Any source location mappings referring to this code.
     pub(crate) srclocs: SmallVec<[T::MachSrcLocType; 64]>,
     /// Any stack maps referring to this code.
@@ -366,6 +371,7 @@ impl<I: VCodeInst> MachBuffer<I> {
             relocs: SmallVec::new(),
             traps: SmallVec::new(),
             call_sites: SmallVec::new(),
+            memkey_writes: SmallVec::new(),
             srclocs: SmallVec::new(),
             stack_maps: SmallVec::new(),
             unwind_info: SmallVec::new(),
@@ -1289,6 +1295,7 @@ impl<I: VCodeInst> MachBuffer<I> {
             relocs: self.relocs,
             traps: self.traps,
             call_sites: self.call_sites,
+            memkey_writes: self.memkey_writes,
             srclocs,
             stack_maps: self.stack_maps,
             unwind_info: self.unwind_info,
@@ -1359,6 +1366,18 @@ impl<I: VCodeInst> MachBuffer<I> {
         });
     }
 
+    /// Record a write of the memory-key register (PKRU, POR_EL0) emitted
+    /// from `start` to the current offset. `word` is the value written when
+    /// it is a compile-time constant.
+    pub fn add_memkey_write(&mut self, start: CodeOffset, word: Option<u64>) {
+        debug_assert!(start <= self.cur_offset());
+        self.memkey_writes.push(MachMemkeyWrite {
+            offset: start,
+            offset_end: self.cur_offset(),
+            word,
+        });
+    }
+
     /// Add an unwind record at the current offset.
     pub fn add_unwind(&mut self, unwind: UnwindInst) {
         self.unwind_info.push((self.cur_offset(), unwind));
@@ -1469,6 +1488,11 @@ impl<T: CompilePhase> MachBufferFinalized<T> {
     pub fn call_sites(&self) -> &[MachCallSite] {
         &self.call_sites[..]
     }
+
+    /// Get the memory-key register writes in this code.
+    pub fn memkey_writes(&self) -> &[MachMemkeyWrite] {
+        &self.memkey_writes[..]
+    }
 }
 
 /// A constant that is deferred to the next constant-pool opportunity.
@@ -1533,6 +1557,19 @@ pub struct MachCallSite {
     pub opcode: Opcode,
 }
 
+/// A write of the memory-key register (PKRU on x86-64, POR_EL0 on AArch64)
+/// resulting from a compilation.
+#[derive(Clone, Debug, PartialEq)]
+#[cfg_attr(feature = "enable-serde", derive(serde::Serialize, serde::Deserialize))]
+pub struct MachMemkeyWrite {
+    /// The offset of the write's first byte, *relative to the containing section*.
+    pub offset: CodeOffset,
+    /// The offset just past the write's last byte.
+    pub offset_end: CodeOffset,
+    /// The word written, when it is a compile-time constant (`switch_domain`).
+    pub word: Option<u64>,
+}
+
 /// A source-location mapping resulting from a compilation.
 #[derive(PartialEq, Debug, Clone)]
 #[cfg_attr(feature = "enable-serde", derive(serde::Serialize, serde::Deserialize))]
@@ -2073,6 +2110,7 @@ mod test {
             1,
         );
         buf.put1(4);
+        buf.add_memkey_write(3, Some(0x5555_5550));
 
         let buf = buf.finish();
 
@@ -2102,5 +2140,12 @@ mod test {
                 .collect::<Vec<_>>(),
             vec![(2, Reloc::Abs4), (3, Reloc::Abs8)]
         );
+        assert_eq!(
+            buf.memkey_writes()
+                .iter()
+                .map(|write| (write.offset, write.offset_end, write.word))
+                .collect::<Vec<_>>(),
+            vec![(3, 4, Some(0x5555_5550))]
+        );
     }
 }
@@ -31,6 +31,7 @@ pub type InstOutput = SmallVec<[ValueRegs; 2]>;
 pub type InstOutputBuilder = Cell<InstOutput>;
 pub type BoxExternalName = Box<ExternalName>;
 pub type Range = (usize, usize);
+pub type OptionU64 = Option<u64>;
 
 /// Helper macro to define methods in `prelude.isle` within `impl Context for
 /// ...` for each backend. These methods are shared amongst all backends.
@@ -519,6 +520,16 @@ macro_rules! isle_prelude_methods {
             r.to_reg()
         }
 
+        #[inline]
+        fn u64_some(&mut self, x: u64) -> OptionU64 {
+            Some(x)
+        }
+
+        #[inline]
+        fn u64_none(&mut self) -> OptionU64 {
+            None
+        }
+
         #[inline]
         fn u64_from_imm64(&mut self, imm: Imm64) -> u64 {
             imm.bits() as u64
@@ -0,0 +1,432 @@
+//! Redundant PKRU write elimination.
+//!
+//! `wrmemkey` and `switch_domain` lower to a `wrpkru`, which costs tens of
+//! cycles and partially serializes the pipeline. This pass tracks the value
+//! PKRU is known to hold across the CFG and removes writes of the value it
+//! already holds, and forwards that value to `rdmemkey`. A write that starts
+//! every iteration of a loop is first copied into the loop's pre-header, after
+//! which the one in the loop is redundant.
+//!
+//! Within a function PKRU only changes through `wrmemkey` and `switch_domain`;
+//! a call may leave anything in it, unless the callee is `pkru_transparent`.
+//! Such a callee doesn't depend on PKRU either, so a write followed by nothing
+//! but calls to them before the next write is dead.
+
+use crate::cursor::{Cursor, FuncCursor};
+use crate::dominator_tree::DominatorTree;
+use crate::entity::{EntityRef, SecondaryMap};
+use crate::flowgraph::ControlFlowGraph;
+use crate::ir::{Block, Function, Inst, InstBuilder, InstructionData, Opcode, Value, ValueDef};
+use crate::licm::{create_pre_header, has_pre_header};
+use crate::loop_analysis::{Loop, LoopAnalysis};
+use crate::timing;
+use alloc::vec::Vec;
+
+/// What is known about PKRU at a program point.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+enum Known {
+    /// Not reached by the analysis yet.
+    Unvisited,
+    /// PKRU holds this value.
+    Value(Value),
+    /// PKRU holds this constant word.
+    Word(i64),
+    /// PKRU may hold anything.
+    Unknown,
+}
+
+/// Performs the pass on `func`.
+/// Changes the CFG and domtree in-place during the operation.
+pub fn do_redundant_pkru(
+    func: &mut Function,
+    cfg: &mut ControlFlowGraph,
+    domtree: &mut DominatorTree,
+    loop_analysis: &mut LoopAnalysis,
+) {
+    let _tt = timing::redundant_pkru();
+    debug_assert!(cfg.is_valid());
+    debug_assert!(domtree.is_valid());
+
+    let uses_pkru = func.layout.blocks().any(|block| {
+        func.layout
+            .block_insts(block)
+            .any(|inst| written(func, inst).is_some())
+    });
+    if !uses_pkru {
+        return;
+    }
+
+    remove_dead_writes(func);
+
+    // Earlier passes may have added pre-headers since the last analysis.
+    loop_analysis.compute(func, cfg, domtree);
+    if hoist_loop_writes(func, cfg, domtree, loop_analysis) {
+        cfg.compute(func);
+        domtree.compute(func, cfg);
+    }
+    remove_redundant(func, cfg, domtree);
+}
+
+/// Copy the write starting each loop into its pre-header, for loops which
+/// write nothing else to PKRU. Returns whether any was copied.
+fn hoist_loop_writes(
+    func: &mut Function,
+    cfg: &mut ControlFlowGraph,
+    domtree: &DominatorTree,
+    loop_analysis: &LoopAnalysis,
+) -> bool {
+    let used = used_values(func);
+    let mut changed = false;
+    for lp in loop_analysis.loops() {
+        let header = loop_analysis.loop_header(lp);
+        let write = match leading_write(func, header) {
+            Some(write) => write,
+            None => continue,
+        };
+        // The write in the loop can only go once nothing reads its result.
+        if func.dfg.inst_results(write).iter().any(|r| used[r.index()])
+            || !loop_writes_only(func, loop_analysis, lp, write)
+        {
+            continue;
+        }
+        // If the loop has a natural pre-header we use it, otherwise we create it.
+        let mut pos = match has_pre_header(&func.layout, cfg, domtree, header) {
+            None => {
+                let pre_header = create_pre_header(header, func, cfg, domtree);
+                FuncCursor::new(func).at_last_inst(pre_header)
+            }
+            Some((_, last_inst)) => FuncCursor::new(func).at_inst(last_inst),
+        };
+        let data = pos.func.dfg[write].clone();
+        let ctrl_typevar = pos.func.dfg.ctrl_typevar(write);
+        let copy = pos.func.dfg.make_inst(data);
+        pos.func.dfg.make_inst_results(copy, ctrl_typevar);
+        pos.insert_inst(copy);
+        changed = true;
+    }
+    changed
+}
+
+/// The write starting `block`, if nothing before it could observe PKRU.
+fn leading_write(func: &Function, block: Block) -> Option<Inst> {
+    for inst in func.layout.block_insts(block) {
+        if written(func, inst).is_some() {
+            return Some(inst);
+        }
+        let opcode = func.dfg[inst].opcode();
+        if opcode.can_load()
+            || opcode.can_store()
+            || opcode.can_trap()
+            || opcode.is_call()
+            || opcode.is_branch()
+            || opcode.is_terminator()
+            || opcode.other_side_effects()
+        {
+            return None;
+        }
+    }
+    None
+}
+
+/// Whether `write` only uses values defined outside of `lp`, and every
+/// other write in `lp` writes the same, with no calls in between.
+fn loop_writes_only(func: &Function, loop_analysis: &LoopAnalysis, lp: Loop, write: Inst) -> bool {
+    let outside = |v: Value| {
+        let block = match func.dfg.value_def(func.dfg.resolve_aliases(v)) {
+            ValueDef::Result(inst, _) => func.layout.inst_block(inst).unwrap(),
+            ValueDef::Param(block, _) => block,
+        };
+        !loop_analysis.is_in_loop(block, lp)
+    };
+    if !func.dfg.inst_args(write).iter().all(|&v| outside(v)) {
+        return false;
+    }
+    for block in func.layout.blocks() {
+        if !loop_analysis.is_in_loop(block, lp) {
+            continue;
+        }
+        for inst in func.layout.block_insts(block) {
+            let opcode = func.dfg[inst].opcode();
+            if opcode.is_call() && !transparent_call(func, inst) {
+                return false;
+            }
+            if written(func, inst).is_some() && !same_write(func, inst, write) {
+                return false;
+            }
+        }
+    }
+    true
+}
+
+/// Remove the writes whose value nothing can observe before the next write in
+/// the same block.
+fn remove_dead_writes(func: &mut Function) {
+    let used = used_values(func);
+    let mut pos = FuncCursor::new(func);
+    while let Some(_block) = pos.next_block() {
+        let mut pending = None;
+        while let Some(inst) = pos.next_inst() {
+            if written(pos.func, inst).is_some() {
+                // A fault would show what the earlier write left in PKRU.
+                let safe = cannot_fault(pos.func, inst);
+                if let Some(dead) = pending.take().filter(|_| safe) {
+                    pos.func.layout.remove_inst(dead);
+                }
+                let results = pos.func.dfg.inst_results(inst);
+                if safe && results.iter().all(|r| !used[r.index()]) {
+                    pending = Some(inst);
+                }
+            } else if observes(pos.func, inst) {
+                pending = None;
+            }
+        }
+    }
+}
+
+/// Whether `inst` may depend on the value of PKRU.
+fn observes(func: &Function, inst: Inst) -> bool {
+    let opcode = func.dfg[inst].opcode();
+    if opcode.is_call() {
+        return !transparent_call(func, inst);
+    }
+    opcode == Opcode::Rdmemkey
+        || opcode.can_load()
+        || opcode.can_store()
+        || opcode.can_trap()
+        || opcode.is_branch()
+        || opcode.is_terminator()
+        || opcode.other_side_effects()
+}
+
+/// Whether `inst` is a call to a function which neither depends on nor
+/// changes PKRU.
+fn transparent_call(func: &Function, inst: Inst) -> bool {
+    match func.dfg[inst] {
+        InstructionData::Call { func_ref, .. } => func.dfg.ext_funcs[func_ref].pkru_transparent,
+        _ => false,
+    }
+}
+
+/// Whether the write `inst` is known not to fault, so that removing it keeps
+/// faults in place.
+fn cannot_fault(func: &Function, inst: Inst) -> bool {
+    match func.dfg[inst].opcode() {
+        Opcode::Wrmemkey => constant(func, func.dfg.inst_args(inst)[1]) == Some(0),
+        _ => true,
+    }
+}
+
+/// Remove the writes of values PKRU already holds and forward known values
+/// to reads.
+fn remove_redundant(func: &mut Function, cfg: &ControlFlowGraph, domtree: &DominatorTree) {
+    let order: Vec<Block> = domtree.cfg_postorder().iter().rev().copied().collect();
+    let mut out = SecondaryMap::with_default(Known::Unvisited);
+    let mut changed = true;
+    while changed {
+        changed = false;
+        for &block in &order {
+            let mut state = block_entry(func, cfg, &out, block);
+            for inst in func.layout.block_insts(block) {
+                state = transfer(func, inst, state);
+            }
+            if out[block] != state {
+                out[block] = state;
+                changed = true;
+            }
+        }
+    }
+
+    let used = used_values(func);
+    for &block in &order {
+        let mut state = block_entry(func, cfg, &out, block);
+        let mut pos = FuncCursor::new(func).at_top(block);
+        while let Some(inst) = pos.next_inst() {
+            match pos.func.dfg[inst].opcode() {
+                Opcode::Wrmemkey | Opcode::SwitchDomain => {
+                    let results = pos.func.dfg.inst_results(inst);
+                    if results.iter().all(|r| !used[r.index()])
+                        && cannot_fault(pos.func, inst)
+                        && same_known(pos.func, state, transfer(pos.func, inst, state))
+                    {
+                        pos.remove_inst_and_step_back();
+                        continue;
+                    }
+                }
+                Opcode::Rdmemkey => {
+                    let result = pos.func.dfg.first_result(inst);
+                    let ty = pos.func.dfg.value_type(result);
+                    match state {
+                        Known::Value(known) => {
+                            let def = pos.func.dfg.value_def(known);
+                            if pos.func.dfg.value_type(known) == ty
+                                && domtree.dominates(def, inst, &pos.func.layout)
+                            {
+                                pos.func.dfg.detach_results(inst);
+                                pos.func.dfg.change_to_alias(result, known);
+                                pos.remove_inst_and_step_back();
+                                continue;
+                            }
+                        }
+                        Known::Word(word) => {
+                            pos.func.dfg.replace(inst).iconst(ty, word);
+                        }
+                        Known::Unvisited | Known::Unknown => {}
+                    }
+                }
+                _ => {}
+            }
+            state = transfer(pos.func, inst, state);
+        }
+    }
+}
+
+/// Which values are used as an argument anywhere in `func`.
+fn used_values(func: &Function) -> Vec<bool> {
+    let mut used = vec![false; func.dfg.num_values()];
+    for block in func.layout.blocks() {
+        for inst in func.layout.block_insts(block) {
+            for &arg in func.dfg.inst_args(inst) {
+                used[func.dfg.resolve_aliases(arg).index()] = true;
+            }
+        }
+    }
+    used
+}
+
+/// PKRU at the top of `block`, from what its predecessors leave in it.
+fn block_entry(
+    func: &Function,
+    cfg: &ControlFlowGraph,
+    out: &SecondaryMap<Block, Known>,
+    block: Block,
+) -> Known {
+    if func.layout.entry_block() == Some(block) {
+        return Known::Unknown;
+    }
+    cfg.pred_iter(block)
+        .fold(Known::Unvisited, |acc, pred| match (acc, out[pred.block]) {
+            (Known::Unvisited, other) | (other, Known::Unvisited) => other,
+            (a, b) if same_known(func, a, b) => a,
+            _ => Known::Unknown,
+        })
+}
+
+/// PKRU after `inst`, given it held `state` before.
+fn transfer(func: &Function, inst: Inst, state: Known) -> Known {
+    match written(func, inst) {
+        Some(known) => known,
+        None if func.dfg[inst].opcode() == Opcode::Rdmemkey => {
+            Known::Value(func.dfg.first_result(inst))
+        }
+        None if func.dfg[inst].opcode().is_call() && !transparent_call(func, inst) => {
+            Known::Unknown
+        }
+        None => state,
+    }
+}
+
+/// What `inst` leaves in PKRU, if it writes it.
+fn written(func: &Function, inst: Inst) -> Option<Known> {
+    match func.dfg[inst] {
+        InstructionData::Binary {
+            opcode: Opcode::Wrmemkey,
+            args,
+        } => Some(Known::Value(func.dfg.resolve_aliases(args[0]))),
+        InstructionData::UnaryImm {
+            opcode: Opcode::SwitchDomain,
+            imm,
+        } => Some(Known::Word(imm.into())),
+        _ => None,
+    }
+}
+
+/// Whether two writes are the same instruction with the same operands.
+fn same_write(func: &Function, a: Inst, b: Inst) -> bool {
+    match (&func.dfg[a], &func.dfg[b]) {
+        (
+            InstructionData::Binary {
+                opcode: Opcode::Wrmemkey,
+                ..
+            },
+            InstructionData::Binary {
+                opcode: Opcode::Wrmemkey,
+                ..
+            },
+        ) => same_args(func, a, b),
+        (
+            InstructionData::UnaryImm {
+                opcode: Opcode::SwitchDomain,
+                imm: i,
+            },
+            InstructionData::UnaryImm {
+                opcode: Opcode::SwitchDomain,
+                imm: j,
+            },
+        ) => i == j,
+        _ => false,
+    }
+}
+
+/// Whether two writes pass the same operands. The second one only has to be
+/// zero for `wrpkru` not to fault, but comparing it keeps faults in place.
+fn same_args(func: &Function, a: Inst, b: Inst) -> bool {
+    let (a, b) = (func.dfg.inst_args(a), func.dfg.inst_args(b));
+    a.len() == b.len() && a.iter().zip(b).all(|(&x, &y)| equivalent(func, x, y))
+}
+
+/// Whether two states are known to leave the same word in PKRU.
+fn same_known(func: &Function, a: Known, b: Known) -> bool {
+    match (a, b) {
+        (Known::Value(a), Known::Value(b)) => equivalent(func, a, b),
+        (Known::Word(a), Known::Word(b)) => a as u32 == b as u32,
+        (Known::Value(v), Known::Word(w)) | (Known::Word(w), Known::Value(v)) => {
+            match constant(func, v) {
+                Some(c) => c as u32 == w as u32,
+                None => false,
+            }
+        }
+        _ => false,
+    }
+}
+
+/// The integer constant `v` is defined as, if any.
+fn constant(func: &Function, v: Value) -> Option<i64> {
+    match func.dfg.value_def(func.dfg.resolve_aliases(v)) {
+        ValueDef::Result(inst, _) => match func.dfg[inst] {
+            InstructionData::UnaryImm {
+                opcode: Opcode::Iconst,
+                imm,
+            } => Some(imm.into()),
+            _ => None,
+        },
+        ValueDef::Param(..) => None,
+    }
+}
+
+/// Whether `a` and `b` are known to hold the same value: they are the same
+/// value or equal integer constants.
+fn equivalent(func: &Function, a: Value, b: Value) -> bool {
+    let (a, b) = (func.dfg.resolve_aliases(a), func.dfg.resolve_aliases(b));
+    if a == b {
+        return true;
+    }
+    if func.dfg.value_type(a) != func.dfg.value_type(b) {
+        return false;
+    }
+    match (func.dfg.value_def(a), func.dfg.value_def(b)) {
+        (ValueDef::Result(x, _), ValueDef::Result(y, _)) => match (&func.dfg[x], &func.dfg[y]) {
+            (
+                InstructionData::UnaryImm {
+                    opcode: Opcode::Iconst,
+                    imm: i,
+                },
+                InstructionData::UnaryImm {
+                    opcode: Opcode::Iconst,
+                    imm: j,
+                },
+            ) => i == j,
+            _ => false,
+        },
+        _ => false,
+    }
+}
@@ -61,6 +61,7 @@ define_passes! {
     dce: "Dead code elimination",
     gvn: "Global value numbering",
     licm: "Loop invariant code motion",
+    redundant_pkru: "Redundant PKRU write elimination",
     unreachable_code: "Remove unreachable blocks",
     remove_constant_phis: "Remove constant phi-nodes",
 
@@ -47,6 +47,7 @@ mod test_legalizer;
 mod test_licm;
 mod test_preopt;
 mod test_print_cfg;
+mod test_redundant_pkru;
 mod test_run;
 mod test_safepoint;
 mod test_simple_gvn;
@@ -122,6 +123,7 @@ fn new_subtest(parsed: &TestCommand) -> anyhow::Result<Box<dyn subtest::SubTest>
         "licm" => test_licm::subtest(parsed),
         "preopt" => test_preopt::subtest(parsed),
         "print-cfg" => test_print_cfg::subtest(parsed),
+        "redundant-pkru" => test_redundant_pkru::subtest(parsed),
         "run" => test_run::subtest(parsed),
         "safepoint" => test_safepoint::subtest(parsed),
         "simple-gvn" => test_simple_gvn::subtest(parsed),
@@ -0,0 +1,49 @@
+//! Test command for testing the redundant PKRU write elimination pass.
+//!
+//! The `redundant-pkru` test command runs each function through the redundant PKRU write
+//! elimination pass after ensuring that all instructions are legal for the target.
+//!
+//! The resulting function is sent to `filecheck`.
+
+use crate::subtest::{run_filecheck, Context, SubTest};
+use cranelift_codegen;
+use cranelift_codegen::ir::Function;
+use cranelift_reader::TestCommand;
+use std::borrow::Cow;
+
+struct TestRedundantPkru;
+
+pub fn subtest(parsed: &TestCommand) -> anyhow::Result<Box<dyn SubTest>> {
+    assert_eq!(parsed.command, "redundant-pkru");
+    if !parsed.options.is_empty() {
+        anyhow::bail!("No options allowed on {}", parsed);
+    }
+    Ok(Box::new(TestRedundantPkru))
+}
+
+impl SubTest for TestRedundantPkru {
+    fn name(&self) -> &'static str {
+        "redundant-pkru"
+    }
+
+    fn needs_isa(&self) -> bool {
+        true
+    }
+
+    fn is_mutating(&self) -> bool {
+        true
+    }
+
+    fn run(&self, func: Cow<Function>, context: &Context) -> anyhow::Result<()> {
+        let isa = context.isa.expect("redundant-pkru needs an ISA");
+        let mut comp_ctx = cranelift_codegen::Context::for_function(func.into_owned());
+
+        comp_ctx.flowgraph();
+        comp_ctx
+            .eliminate_redundant_pkru(isa)
+            .map_err(|e| crate::pretty_anyhow_error(&comp_ctx.func, Into::into(e)))?;
+
+        let text = comp_ctx.func.display().to_string();
+        run_filecheck(&text, context)
+    }
+}
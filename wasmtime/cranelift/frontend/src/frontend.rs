@@ -757,6 +757,7 @@ impl<'a> FunctionBuilder<'a> {
             name: ExternalName::LibCall(LibCall::Memcpy),
             signature,
             colocated: false,
+            pkru_transparent: false,
         });
 
         self.ins().call(libc_memcpy, &[dest, src, size]);
@@ -857,6 +858,7 @@ impl<'a> FunctionBuilder<'a> {
             name: ExternalName::LibCall(LibCall::Memset),
             signature,
             colocated: false,
+            pkru_transparent: false,
         });
 
         let ch = self.ins().uextend(types::I32, ch);
@@ -953,6 +955,7 @@ impl<'a> FunctionBuilder<'a> {
             name: ExternalName::LibCall(LibCall::Memmove),
             signature,
             colocated: false,
+            pkru_transparent: false,
         });
 
         self.ins().call(libc_memmove, &[dest, source, size]);
@@ -988,6 +991,7 @@ impl<'a> FunctionBuilder<'a> {
             name: ExternalName::LibCall(LibCall::Memcmp),
             signature,
             colocated: false,
+            pkru_transparent: false,
         });
 
         let call = self.ins().call(libc_memcmp, &[left, right, size]);
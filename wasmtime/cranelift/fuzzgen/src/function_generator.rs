@@ -1083,6 +1083,7 @@ where
                 name: ext_name,
                 signature: sig_ref,
                 colocated: self.u.arbitrary()?,
+                pkru_transparent: false,
             });
 
             self.resources.func_refs.push((sig, func_ref));
@@ -1193,7 +1193,7 @@ where
         Opcode::GetFramePointer => unimplemented!("GetFramePointer"),
         Opcode::GetStackPointer => unimplemented!("GetStackPointer"),
         Opcode::GetReturnAddress => unimplemented!("GetReturnAddress"),
-        Opcode::Rdmemkey | Opcode::Wrmemkey => {
+        Opcode::Rdmemkey | Opcode::Wrmemkey | Opcode::SwitchDomain => {
             unimplemented!("memory protection key");
         }
     })
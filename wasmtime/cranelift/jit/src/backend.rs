@@ -654,6 +654,7 @@ impl Module for JITModule {
             name: ir::ExternalName::user(user_name_ref),
             signature,
             colocated,
+            pkru_transparent: false,
         })
     }
 
@@ -587,6 +587,7 @@ pub trait Module {
             name: ir::ExternalName::user(user_name_ref),
             signature,
             colocated,
+            pkru_transparent: false,
         })
     }
 
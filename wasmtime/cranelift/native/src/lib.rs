@@ -70,6 +70,7 @@ pub fn builder_with_options(infer_native_flags: bool) -> Result<isa::Builder, &'
         isa_builder.set("has_ssse3", "false").unwrap();
         isa_builder.set("has_sse41", "false").unwrap();
         isa_builder.set("has_sse42", "false").unwrap();
+        isa_builder.set("has_pkru", "false").unwrap();
 
         if std::is_x86_feature_detected!("sse3") {
             isa_builder.enable("has_sse3").unwrap();
@@ -119,7 +120,16 @@ pub fn builder_with_options(infer_native_flags: bool) -> Result<isa::Builder, &'
         if std::is_x86_feature_detected!("lzcnt") {
             isa_builder.enable("has_lzcnt").unwrap();
         }
-        if std::is_x86_feature_detected!("xsaves") {
+        // There is no feature detection macro for PKU, and the CPU having
+        // it is not enough: the OS has to have enabled it too (OSPKE), or
+        // `rdpkru` and `wrpkru` fault.
+        #[cfg(target_arch = "x86")]
+        use std::arch::x86::{__cpuid_count, __get_cpuid_max};
+        #[cfg(target_arch = "x86_64")]
+        use std::arch::x86_64::{__cpuid_count, __get_cpuid_max};
+        const PKU_OSPKE: u32 = 1 << 3 | 1 << 4;
+        if unsafe { __get_cpuid_max(0).0 >= 7 && __cpuid_count(7, 0).ecx & PKU_OSPKE == PKU_OSPKE }
+        {
             isa_builder.enable("has_pkru").unwrap();
         }
     }
@@ -140,6 +150,15 @@ pub fn builder_with_options(infer_native_flags: bool) -> Result<isa::Builder, &'
             isa_builder.enable("has_pauth").unwrap();
         }
 
+        // There is no feature detection macro for the permission overlay yet.
+        #[cfg(target_os = "linux")]
+        {
+            const HWCAP2_POE: libc::c_ulong = 1 << 63;
+            if unsafe { libc::getauxval(libc::AT_HWCAP2) } & HWCAP2_POE != 0 {
+                isa_builder.enable("has_poe").unwrap();
+            }
+        }
+
         if cfg!(target_os = "macos") {
             // Pointer authentication is always available on Apple Silicon.
             isa_builder.enable("sign_return_address").unwrap();
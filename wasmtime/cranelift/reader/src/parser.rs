@@ -422,6 +422,7 @@ impl Context {
                 name: ExternalName::testcase(""),
                 signature: SigRef::reserved_value(),
                 colocated: false,
+                pkru_transparent: false,
             });
         }
         self.function.dfg.ext_funcs[fn_] = data;
@@ -1901,7 +1902,7 @@ impl<'a> Parser<'a> {
     //
     // Two variants:
     //
-    // function-decl ::= FuncRef(fnref) "=" ["colocated"]" name function-decl-sig
+    // function-decl ::= FuncRef(fnref) "=" ["colocated"] ["pkru_transparent"] name function-decl-sig
     // function-decl-sig ::= SigRef(sig) | signature
     //
     // The first variant allocates a new signature reference. The second references an existing
@@ -1916,7 +1917,10 @@ impl<'a> Parser<'a> {
         // function-decl ::= FuncRef(fnref) "=" * ["colocated"] name function-decl-sig
         let colocated = self.optional(Token::Identifier("colocated"));
 
-        // function-decl ::= FuncRef(fnref) "=" ["colocated"] * name function-decl-sig
+        // function-decl ::= FuncRef(fnref) "=" ["colocated"] * ["pkru_transparent"] name function-decl-sig
+        let pkru_transparent = self.optional(Token::Identifier("pkru_transparent"));
+
+        // function-decl ::= FuncRef(fnref) "=" ["colocated"] ["pkru_transparent"] * name function-decl-sig
         let name = self.parse_external_name()?;
 
         // function-decl ::= FuncRef(fnref) "=" ["colocated"] name * function-decl-sig
@@ -1932,6 +1936,7 @@ impl<'a> Parser<'a> {
                     name,
                     signature: sigref,
                     colocated,
+                    pkru_transparent,
                 }
             }
             Some(Token::SigRef(sig_src)) => {
@@ -1947,6 +1952,7 @@ impl<'a> Parser<'a> {
                     name,
                     signature: sig,
                     colocated,
+                    pkru_transparent,
                 }
             }
             _ => return err!(self.loc, "expected 'function' or sig«n» in function decl"),
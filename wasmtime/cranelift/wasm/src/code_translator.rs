@@ -2028,6 +2028,10 @@ pub fn translate_operator<FE: FuncEnvironment + ?Sized>(
             let (arg1, arg2) = state.pop2();
             state.push1(builder.ins().wrmemkey(arg1, arg2));
         }
+        Operator::SwitchDomain { domain } => {
+            let pkru = environ.domain_pkru(*domain)?;
+            builder.ins().switch_domain(i64::from(pkru));
+        }
     };
     Ok(())
 }
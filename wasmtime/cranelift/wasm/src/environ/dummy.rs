@@ -345,6 +345,7 @@ impl<'dummy_environment> FuncEnvironment for DummyFuncEnvironment<'dummy_environ
             name,
             signature,
             colocated: false,
+            pkru_transparent: false,
         }))
     }
 
@@ -499,6 +499,18 @@ pub trait FuncEnvironment: TargetEnvironment {
     /// Returns the target ISA's condition to check for unsigned addition
     /// overflowing.
     fn unsigned_add_overflow_condition(&self) -> ir::condcodes::IntCC;
+
+    /// Returns the PKRU word `switch_domain` writes to enter `domain`.
+    ///
+    /// By default domain 0 has access to every key and domain `n` to keys 0
+    /// and `n` only.
+    fn domain_pkru(&self, domain: u32) -> WasmResult<u32> {
+        match domain {
+            0 => Ok(0),
+            1..=15 => Ok(0x5555_5554 & !(0b11 << (2 * domain))),
+            _ => Err(wasm_unsupported!("protection domain {}", domain)),
+        }
+    }
 }
 
 /// An object satisfying the `ModuleEnvironment` trait can be passed as argument to the
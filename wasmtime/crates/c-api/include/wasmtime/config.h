@@ -82,6 +82,28 @@ enum wasmtime_profiling_strategy_enum { // ProfilingStrategy
   WASMTIME_PROFILING_STRATEGY_VTUNE,
 };
 
+/**
+ * \brief Whether protection-key isolation is carried out.
+ *
+ * See #wasmtime_pku_mode_enum for possible values.
+ */
+typedef uint8_t wasmtime_pku_mode_t;
+
+/**
+ * \brief Whether protection-key isolation is carried out.
+ *
+ * The default is #WASMTIME_PKU_MODE_AUTO.
+ */
+enum wasmtime_pku_mode_enum { // PkuMode
+  /// Isolation is compiled away and modules run as if they had no domains.
+  WASMTIME_PKU_MODE_OFF,
+  /// Isolation is always carried out. Creating an engine fails on hosts
+  /// without protection keys.
+  WASMTIME_PKU_MODE_ON,
+  /// Isolation is on where the host has protection keys, and off elsewhere.
+  WASMTIME_PKU_MODE_AUTO,
+};
+
 #define WASMTIME_CONFIG_PROP(ret, name, ty) \
     WASM_API_EXTERN ret wasmtime_config_##name##_set(wasm_config_t*, ty);
 
@@ -261,6 +283,27 @@ WASMTIME_CONFIG_PROP(void, static_memory_guard_size, uint64_t)
  */
 WASMTIME_CONFIG_PROP(void, dynamic_memory_guard_size, uint64_t)
 
+/**
+ * \brief Configures whether memories are reserved up front so that PKU
+ * domains never have to be re-applied after a `memory.grow`.
+ *
+ * This setting is `false` by default.
+ *
+ * For more information see the Rust documentation at
+ * https://bytecodealliance.github.io/wasmtime/api/wasmtime/struct.Config.html#method.pku_non_moving_memories.
+ */
+WASMTIME_CONFIG_PROP(void, pku_non_moving_memories, bool)
+
+/**
+ * \brief Configures whether protection-key isolation is carried out.
+ *
+ * This setting is #WASMTIME_PKU_MODE_AUTO by default.
+ *
+ * For more information see the Rust documentation at
+ * https://bytecodealliance.github.io/wasmtime/api/wasmtime/struct.Config.html#method.pku_mode.
+ */
+WASMTIME_CONFIG_PROP(void, pku_mode, wasmtime_pku_mode_t)
+
 /**
  * \brief Enables Wasmtime's cache and loads configuration from the specified
  * path.
@@ -116,6 +116,33 @@ WASM_API_EXTERN wasmtime_error_t *wasmtime_memory_grow(
     uint64_t *prev_size
 );
 
+/**
+ * \brief Tags `len` bytes at `offset` of the specified memory with `domain`.
+ *
+ * \param store the store that owns `memory`
+ * \param memory the memory to tag
+ * \param offset the start of the range, aligned to host pages
+ * \param len the length of the range, aligned to host pages
+ * \param domain the domain to tag the range with: `0` for the default one,
+ *        a live domain of `store`, or a domain its modules lay out
+ *
+ * The range becomes accessible only while the PKRU grants the domain's key,
+ * and is restored automatically if growing moves the memory. Only the first
+ * memory of an instance can be tagged. An error is returned if the range is
+ * out of bounds or misaligned, or if tagging fails; otherwise `NULL` is
+ * returned.
+ *
+ * For more information see the Rust documentation at
+ * https://bytecodealliance.github.io/wasmtime/api/wasmtime/struct.Memory.html#method.protect_domain.
+ */
+WASM_API_EXTERN wasmtime_error_t *wasmtime_memory_domain_protect(
+    wasmtime_context_t *store,
+    const wasmtime_memory_t *memory,
+    size_t offset,
+    size_t len,
+    wasmtime_domain_t domain
+);
+
 #ifdef __cplusplus
 }  // extern "C"
 #endif
@@ -177,6 +177,51 @@ WASM_API_EXTERN wasmtime_error_t *wasmtime_context_set_wasi(wasmtime_context_t *
  */
 WASM_API_EXTERN void wasmtime_context_set_epoch_deadline(wasmtime_context_t *context, uint64_t ticks_beyond_current);
 
+/**
+ * \brief A protection-key domain, identified by its key.
+ *
+ * Domains are created with #wasmtime_context_domain_create and memory is
+ * tagged with them through #wasmtime_memory_domain_protect. The key `0` is
+ * the default domain all memory belongs to until tagged otherwise.
+ */
+typedef uint32_t wasmtime_domain_t;
+
+/**
+ * \brief Protection-key usage of a store, see #wasmtime_context_domain_stats.
+ */
+typedef struct wasmtime_domain_stats {
+  /// Domains created by the store which are still alive.
+  size_t domains;
+  /// Tagged ranges across the store's memories, after merging neighbours.
+  size_t ranges;
+  /// Bytes tagged with anything but the default key and protection.
+  size_t tagged_bytes;
+} wasmtime_domain_stats_t;
+
+/**
+ * \brief Allocates a new protection-key domain owned by this context's store.
+ *
+ * If the host doesn't support protection keys or has none left an error is
+ * returned. Otherwise `domain` is filled in and NULL is returned. The key is
+ * freed when the store is deleted, or earlier with
+ * #wasmtime_context_domain_free.
+ */
+WASM_API_EXTERN wasmtime_error_t *wasmtime_context_domain_create(wasmtime_context_t *context, wasmtime_domain_t *domain);
+
+/**
+ * \brief Frees a domain created by #wasmtime_context_domain_create.
+ *
+ * Memory still tagged with the domain should be returned to the default domain
+ * first. An error is returned if `domain` isn't a live domain of this store.
+ */
+WASM_API_EXTERN wasmtime_error_t *wasmtime_context_domain_free(wasmtime_context_t *context, wasmtime_domain_t domain);
+
+/**
+ * \brief Fills in `stats` with the protection-key usage of this context's
+ * store.
+ */
+WASM_API_EXTERN void wasmtime_context_domain_stats(const wasmtime_context_t *context, wasmtime_domain_stats_t *stats);
+
 #ifdef __cplusplus
 }  // extern "C"
 #endif
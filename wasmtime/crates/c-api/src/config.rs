@@ -5,7 +5,7 @@
 use crate::{handle_result, wasmtime_error_t};
 use std::ffi::CStr;
 use std::os::raw::c_char;
-use wasmtime::{Config, OptLevel, ProfilingStrategy, Strategy};
+use wasmtime::{Config, OptLevel, PkuMode, ProfilingStrategy, Strategy};
 
 #[repr(C)]
 #[derive(Clone)]
@@ -38,6 +38,14 @@ pub enum wasmtime_profiling_strategy_t {
     WASMTIME_PROFILING_STRATEGY_VTUNE,
 }
 
+#[repr(u8)]
+#[derive(Clone)]
+pub enum wasmtime_pku_mode_t {
+    WASMTIME_PKU_MODE_OFF,
+    WASMTIME_PKU_MODE_ON,
+    WASMTIME_PKU_MODE_AUTO,
+}
+
 #[no_mangle]
 pub extern "C" fn wasm_config_new() -> Box<wasm_config_t> {
     Box::new(wasm_config_t {
@@ -187,3 +195,18 @@ pub extern "C" fn wasmtime_config_static_memory_guard_size_set(c: &mut wasm_conf
 pub extern "C" fn wasmtime_config_dynamic_memory_guard_size_set(c: &mut wasm_config_t, size: u64) {
     c.config.dynamic_memory_guard_size(size);
 }
+
+#[no_mangle]
+pub extern "C" fn wasmtime_config_pku_non_moving_memories_set(c: &mut wasm_config_t, enable: bool) {
+    c.config.pku_non_moving_memories(enable);
+}
+
+#[no_mangle]
+pub extern "C" fn wasmtime_config_pku_mode_set(c: &mut wasm_config_t, mode: wasmtime_pku_mode_t) {
+    use wasmtime_pku_mode_t::*;
+    c.config.pku_mode(match mode {
+        WASMTIME_PKU_MODE_OFF => PkuMode::Off,
+        WASMTIME_PKU_MODE_ON => PkuMode::On,
+        WASMTIME_PKU_MODE_AUTO => PkuMode::Auto,
+    });
+}
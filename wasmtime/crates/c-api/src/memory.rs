@@ -3,7 +3,7 @@ use crate::{
     CStoreContextMut,
 };
 use std::convert::TryFrom;
-use wasmtime::{Extern, Memory};
+use wasmtime::{Domain, Extern, Memory};
 
 #[derive(Clone)]
 #[repr(transparent)]
@@ -127,3 +127,25 @@ pub extern "C" fn wasmtime_memory_grow(
 ) -> Option<Box<wasmtime_error_t>> {
     handle_result(mem.grow(store, delta), |prev| *prev_size = prev)
 }
+
+#[no_mangle]
+pub extern "C" fn wasmtime_memory_domain_protect(
+    store: CStoreContextMut<'_>,
+    mem: &Memory,
+    offset: usize,
+    len: usize,
+    domain: u32,
+) -> Option<Box<wasmtime_error_t>> {
+    // The header requires `domain` to come from the store, see
+    // `Domain::from_pkey`.
+    let domain = unsafe { Domain::from_pkey(domain) };
+    let result = match offset.checked_add(len) {
+        Some(end) => mem.protect_domain(store, offset..end, domain),
+        None => Err(anyhow::anyhow!(
+            "range at {} of {} bytes overflows",
+            offset,
+            len
+        )),
+    };
+    handle_result(result, |()| {})
+}
@@ -2,7 +2,7 @@ use crate::{wasm_engine_t, wasmtime_error_t, wasmtime_val_t, ForeignData};
 use std::cell::UnsafeCell;
 use std::ffi::c_void;
 use std::sync::Arc;
-use wasmtime::{AsContext, AsContextMut, Store, StoreContext, StoreContextMut, Val};
+use wasmtime::{AsContext, AsContextMut, Domain, Store, StoreContext, StoreContextMut, Val};
 
 /// This representation of a `Store` is used to implement the `wasm.h` API.
 ///
@@ -167,3 +167,41 @@ pub extern "C" fn wasmtime_context_set_epoch_deadline(
 ) {
     store.set_epoch_deadline(ticks_beyond_current);
 }
+
+#[repr(C)]
+pub struct wasmtime_domain_stats_t {
+    pub domains: usize,
+    pub ranges: usize,
+    pub tagged_bytes: usize,
+}
+
+#[no_mangle]
+pub extern "C" fn wasmtime_context_domain_create(
+    mut store: CStoreContextMut<'_>,
+    domain: &mut u32,
+) -> Option<Box<wasmtime_error_t>> {
+    crate::handle_result(store.create_domain(), |d| *domain = d.pkey())
+}
+
+#[no_mangle]
+pub extern "C" fn wasmtime_context_domain_free(
+    mut store: CStoreContextMut<'_>,
+    domain: u32,
+) -> Option<Box<wasmtime_error_t>> {
+    // Only a live domain of the store is freed, others are an error.
+    let domain = unsafe { Domain::from_pkey(domain) };
+    crate::handle_result(store.free_domain(domain), |()| {})
+}
+
+#[no_mangle]
+pub extern "C" fn wasmtime_context_domain_stats(
+    store: CStoreContext<'_>,
+    stats: &mut wasmtime_domain_stats_t,
+) {
+    let s = store.domain_stats();
+    *stats = wasmtime_domain_stats_t {
+        domains: s.domains,
+        ranges: s.ranges,
+        tagged_bytes: s.tagged_bytes,
+    };
+}
@@ -182,6 +182,26 @@ pub struct CommonOptions {
     #[clap(long)]
     pub static_memory_forced: bool,
 
+    /// Reserve the maximum of every wasm memory up front so that growing
+    /// never moves it and never drops its protection-key tags.
+    #[clap(long)]
+    pub pku_non_moving_memories: bool,
+
+    /// Account the time wasm runs in each protection domain, at the cost
+    /// of a host call per domain switch
+    #[clap(long)]
+    pub pku_domain_time: bool,
+
+    /// Whether protection-key isolation is carried out
+    /// Supported modes: on, off, or auto (where the host has keys); default is "auto"
+    #[clap(
+        long,
+        value_name = "MODE",
+        parse(try_from_str = parse_pku_mode),
+        verbatim_doc_comment,
+    )]
+    pub pku_mode: Option<wasmtime::PkuMode>,
+
     /// Byte size of the guard region after static memories are allocated.
     #[clap(long, value_name = "SIZE")]
     pub static_memory_guard_size: Option<u64>,
@@ -305,6 +325,11 @@ impl CommonOptions {
         }
 
         config.static_memory_forced(self.static_memory_forced);
+        config.pku_non_moving_memories(self.pku_non_moving_memories);
+        config.pku_domain_time(self.pku_domain_time);
+        if let Some(mode) = self.pku_mode {
+            config.pku_mode(mode);
+        }
 
         if let Some(size) = self.static_memory_guard_size {
             config.static_memory_guard_size(size);
@@ -399,6 +424,15 @@ fn parse_opt_level(opt_level: &str) -> Result<wasmtime::OptLevel> {
     }
 }
 
+fn parse_pku_mode(mode: &str) -> Result<wasmtime::PkuMode> {
+    match mode {
+        "on" => Ok(wasmtime::PkuMode::On),
+        "off" => Ok(wasmtime::PkuMode::Off),
+        "auto" => Ok(wasmtime::PkuMode::Auto),
+        other => bail!("unknown PKU mode `{}`, only on,off,auto accepted", other),
+    }
+}
+
 #[derive(Default, Clone, Copy)]
 #[cfg_attr(test, derive(Debug, PartialEq))]
 pub struct WasmFeatures {
@@ -13,7 +13,7 @@ use cranelift_codegen::ir::{
 use cranelift_codegen::isa::TargetIsa;
 use cranelift_codegen::print_errors::pretty_error;
 use cranelift_codegen::Context;
-use cranelift_codegen::{settings, MachReloc, MachTrap};
+use cranelift_codegen::{settings, MachMemkeyWrite, MachReloc, MachTrap};
 use cranelift_codegen::{CompiledCode, MachSrcLoc, MachStackMap};
 use cranelift_entity::{EntityRef, PrimaryMap};
 use cranelift_frontend::FunctionBuilder;
@@ -31,10 +31,10 @@ use std::convert::TryFrom;
 use std::mem;
 use std::sync::{Arc, Mutex};
 use wasmtime_environ::{
-    AddressMapSection, CacheStore, CompileError, FilePos, FlagValue, FunctionBodyData,
-    FunctionInfo, InstructionAddressMap, Module, ModuleTranslation, ModuleTypes, PtrSize,
-    StackMapInformation, Trampoline, TrapCode, TrapEncodingBuilder, TrapInformation, Tunables,
-    VMOffsets,
+    AddressMapSection, CacheStore, CompileError, DomainSwitch, FilePos, FlagValue,
+    FunctionBodyData, FunctionInfo, InstructionAddressMap, Module, ModuleTranslation, ModuleTypes,
+    PtrSize, StackMapInformation, Trampoline, TrapCode, TrapEncodingBuilder, TrapInformation,
+    Tunables, VMOffsets,
 };
 
 #[cfg(feature = "component-model")]
@@ -211,6 +211,11 @@ impl wasmtime_environ::Compiler for Compiler {
         }
 
         let mut func_env = FuncEnvironment::new(isa, translation, types, tunables);
+        func_env.domain = translation
+            .module
+            .function_domains
+            .get(&func_index)
+            .copied();
 
         // The `stack_limit` global value below is the implementation of stack
         // overflow checks in Wasmtime.
@@ -290,6 +295,8 @@ impl wasmtime_environ::Compiler for Compiler {
             .collect::<Vec<_>>();
 
         let stack_maps = mach_stack_maps_to_stack_maps(compiled_code.buffer.stack_maps());
+        let domain_switches =
+            mach_memkey_writes_to_domain_switches(isa, compiled_code.buffer.memkey_writes());
 
         let unwind_info = if isa.flags().unwind_info() {
             context
@@ -335,6 +342,7 @@ impl wasmtime_environ::Compiler for Compiler {
                 start: 0,
                 length,
                 alignment,
+                domain_switches,
             },
             address_map: address_transform,
         }))
@@ -1068,3 +1076,27 @@ fn mach_stack_maps_to_stack_maps(mach_stack_maps: &[MachStackMap]) -> Vec<StackM
     stack_maps.sort_unstable_by_key(|info| info.code_offset);
     stack_maps
 }
+
+/// Converts Cranelift's memory-key writes to `DomainSwitch`es, mapping the
+/// constant words `switch_domain` writes back to their domains.
+fn mach_memkey_writes_to_domain_switches(
+    isa: &dyn TargetIsa,
+    writes: &[MachMemkeyWrite],
+) -> Vec<DomainSwitch> {
+    let domain_word = match isa.triple().architecture {
+        target_lexicon::Architecture::Aarch64(_) => wasmtime_environ::domain_por,
+        _ => wasmtime_environ::domain_pkru,
+    };
+    let mut switches = writes
+        .iter()
+        .map(|write| DomainSwitch {
+            offset: write.offset,
+            length: write.offset_end - write.offset,
+            domain: write.word.and_then(|word| {
+                (0..16).find(|&domain| domain_word(domain).map(u64::from) == Some(word))
+            }),
+        })
+        .collect::<Vec<_>>();
+    switches.sort_unstable_by_key(|switch| switch.offset);
+    switches
+}
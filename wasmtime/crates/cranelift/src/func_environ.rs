@@ -16,8 +16,8 @@ use std::convert::TryFrom;
 use std::mem;
 use wasmparser::Operator;
 use wasmtime_environ::{
-    BuiltinFunctionIndex, MemoryPlan, MemoryStyle, Module, ModuleTranslation, ModuleTypes, PtrSize,
-    TableStyle, Tunables, VMOffsets, WASM_PAGE_SIZE,
+    BuiltinFunctionIndex, MemoryPlan, MemoryStyle, Module, ModuleTranslation, ModuleTypes,
+    PkruIntrinsic, PtrSize, TableStyle, Tunables, VMOffsets, WASM_PAGE_SIZE,
 };
 use wasmtime_environ::{FUNCREF_INIT_BIT, FUNCREF_MASK};
 
@@ -147,6 +147,17 @@ pub struct FuncEnvironment<'module_environment> {
     epoch_ptr_var: cranelift_frontend::Variable,
 
     fuel_consumed: i64,
+
+    /// The domain `pkuwa.domains` assigns to the function being translated.
+    pub(crate) domain: Option<u32>,
+
+    /// The caller's PKRU and whether the prologue changed it, so that every
+    /// return can switch back.
+    caller_pkru: Option<(ir::Value, ir::Value)>,
+
+    /// Whether the operator being translated wrote PKRU through the
+    /// `pkuwa.wrpkru` intrinsic, which may have moved the epoch deadline.
+    pkru_written: bool,
 }
 
 impl<'module_environment> FuncEnvironment<'module_environment> {
@@ -182,6 +193,10 @@ impl<'module_environment> FuncEnvironment<'module_environment> {
             // Start with at least one fuel being consumed because even empty
             // functions should consume at least some fuel.
             fuel_consumed: 1,
+
+            domain: None,
+            caller_pkru: None,
+            pkru_written: false,
         }
     }
 
@@ -527,6 +542,82 @@ impl<'module_environment> FuncEnvironment<'module_environment> {
         )
     }
 
+    /// Switches PKRU into `domain` on function entry, remembering the
+    /// caller's value for `domain_function_exit`. Calls from the same domain
+    /// find PKRU already set and skip the `wrpkru`.
+    fn domain_function_entry(
+        &mut self,
+        builder: &mut FunctionBuilder,
+        domain: u32,
+    ) -> WasmResult<()> {
+        let pkru = cranelift_wasm::FuncEnvironment::domain_pkru(self, domain)?;
+        let switch_block = builder.create_block();
+        let continuation_block = builder.create_block();
+
+        let zero = builder.ins().iconst(I32, 0);
+        let caller_pkru = builder.ins().rdmemkey(zero, zero);
+        let changed = builder
+            .ins()
+            .icmp_imm(IntCC::NotEqual, caller_pkru, i64::from(pkru));
+        builder.ins().brnz(changed, switch_block, &[]);
+        builder.ins().jump(continuation_block, &[]);
+        builder.seal_block(switch_block);
+
+        builder.switch_to_block(switch_block);
+        builder.ins().switch_domain(i64::from(pkru));
+        if self.tunables.pku_domain_time {
+            let pkru = builder.ins().iconst(I32, i64::from(pkru));
+            self.domain_switch_call(&mut builder.cursor(), pkru);
+        }
+        builder.ins().jump(continuation_block, &[]);
+        builder.seal_block(continuation_block);
+
+        builder.switch_to_block(continuation_block);
+        self.caller_pkru = Some((caller_pkru, changed));
+        Ok(())
+    }
+
+    /// Restores the caller's PKRU ahead of a return if the prologue changed
+    /// it. Values defined in the entry block dominate every return, so the
+    /// saved PKRU needs no variable.
+    fn domain_function_exit(&mut self, builder: &mut FunctionBuilder) {
+        let (caller_pkru, changed) = match self.caller_pkru {
+            Some(saved) => saved,
+            None => return,
+        };
+        let restore_block = builder.create_block();
+        let continuation_block = builder.create_block();
+
+        builder.ins().brnz(changed, restore_block, &[]);
+        builder.ins().jump(continuation_block, &[]);
+        builder.seal_block(restore_block);
+
+        builder.switch_to_block(restore_block);
+        let zero = builder.ins().iconst(I32, 0);
+        builder.ins().wrmemkey(caller_pkru, zero);
+        if self.tunables.pku_domain_time {
+            self.domain_switch_call(&mut builder.cursor(), caller_pkru);
+        }
+        builder.ins().jump(continuation_block, &[]);
+        builder.seal_block(continuation_block);
+
+        builder.switch_to_block(continuation_block);
+    }
+
+    /// Tells the store that PKRU now holds `pkru`, so that it can account
+    /// the time each domain runs for and arm the domain's epoch deadline.
+    /// Function entries load the deadline after this; the caller's cached
+    /// deadline stays valid across a return, as deadlines don't move once
+    /// armed.
+    fn domain_switch_call(&mut self, pos: &mut FuncCursor<'_>, pkru: ir::Value) {
+        let sig = self.builtin_function_signatures.pku_domain_switch(pos.func);
+        let (vmctx, func) = self.translate_load_builtin_function_address(
+            pos,
+            BuiltinFunctionIndex::pku_domain_switch(),
+        );
+        pos.ins().call_indirect(sig, func, &[vmctx, pkru]);
+    }
+
     /// Checks the amount of remaining, and if we've run out of fuel we call
     /// the out-of-fuel function.
     fn fuel_check(&mut self, builder: &mut FunctionBuilder) {
@@ -1529,6 +1620,13 @@ impl<'module_environment> cranelift_wasm::FuncEnvironment for FuncEnvironment<'m
             // the `VMContext` as relative jumps (hence no relocations) or
             // they're libcalls with absolute relocations.
             colocated: self.module.defined_func_index(index).is_some(),
+
+            // Calls to functions which never touch linear memory don't need
+            // the domain switches around them.
+            pkru_transparent: self
+                .module
+                .defined_func_index(index)
+                .map_or(false, |index| self.translation.memory_free[index]),
         }))
     }
 
@@ -1636,6 +1734,21 @@ impl<'module_environment> cranelift_wasm::FuncEnvironment for FuncEnvironment<'m
         callee: ir::FuncRef,
         call_args: &[ir::Value],
     ) -> WasmResult<ir::Inst> {
+        // PKRU intrinsics become the instruction itself, whose single result
+        // stands in for the call's.
+        if let Some(intrinsic) = self.translation.pkru_intrinsics.get(&callee_index) {
+            let zero = pos.ins().iconst(I32, 0);
+            let value = match intrinsic {
+                PkruIntrinsic::Rdpkru => pos.ins().rdmemkey(zero, zero),
+                PkruIntrinsic::Wrpkru => pos.ins().wrmemkey(call_args[0], zero),
+            };
+            if self.tunables.pku_domain_time && *intrinsic == PkruIntrinsic::Wrpkru {
+                self.domain_switch_call(&mut pos, call_args[0]);
+                self.pkru_written = true;
+            }
+            return Ok(pos.func.dfg.value_def(value).unwrap_inst());
+        }
+
         let mut real_call_args = Vec::with_capacity(call_args.len() + 2);
         let caller_vmctx = pos.func.special_param(ArgumentPurpose::VMContext).unwrap();
 
@@ -2048,6 +2161,11 @@ impl<'module_environment> cranelift_wasm::FuncEnvironment for FuncEnvironment<'m
         if self.tunables.consume_fuel {
             self.fuel_before_op(op, builder, state.reachable());
         }
+        if let Operator::Return = op {
+            if state.reachable() {
+                self.domain_function_exit(builder);
+            }
+        }
         Ok(())
     }
 
@@ -2060,6 +2178,10 @@ impl<'module_environment> cranelift_wasm::FuncEnvironment for FuncEnvironment<'m
         if self.tunables.consume_fuel && state.reachable() {
             self.fuel_after_op(op, builder);
         }
+        // The switch may have armed an earlier deadline than the one held.
+        if mem::take(&mut self.pkru_written) && self.tunables.epoch_interruption {
+            self.epoch_load_deadline_into_var(builder);
+        }
         Ok(())
     }
 
@@ -2068,6 +2190,10 @@ impl<'module_environment> cranelift_wasm::FuncEnvironment for FuncEnvironment<'m
         builder: &mut FunctionBuilder,
         _state: &FuncTranslationState,
     ) -> WasmResult<()> {
+        // Enter this function's domain before anything else runs in it.
+        if let Some(domain) = self.domain {
+            self.domain_function_entry(builder, domain)?;
+        }
         // If the `vmruntime_limits_ptr` variable will get used then we initialize
         // it here.
         if self.tunables.consume_fuel || self.tunables.epoch_interruption {
@@ -2092,9 +2218,20 @@ impl<'module_environment> cranelift_wasm::FuncEnvironment for FuncEnvironment<'m
         if self.tunables.consume_fuel && state.reachable() {
             self.fuel_function_exit(builder);
         }
+        if state.reachable() {
+            self.domain_function_exit(builder);
+        }
         Ok(())
     }
 
+    fn domain_pkru(&self, domain: u32) -> WasmResult<u32> {
+        let word = match self.isa.triple().architecture {
+            target_lexicon::Architecture::Aarch64(_) => wasmtime_environ::domain_por(domain),
+            _ => wasmtime_environ::domain_pkru(domain),
+        };
+        word.ok_or_else(|| WasmError::Unsupported(format!("protection domain {}", domain)))
+    }
+
     fn unsigned_add_overflow_condition(&self) -> ir::condcodes::IntCC {
         self.isa.unsigned_add_overflow_condition()
     }
@@ -51,6 +51,8 @@ macro_rules! foreach_builtin_function {
             out_of_gas(vmctx: vmctx);
             /// Invoked when we reach a new epoch.
             new_epoch(vmctx: vmctx) -> i64;
+            /// Invoked after compiled code writes PKRU, with the new word.
+            pku_domain_switch(vmctx: vmctx, pkru: i32);
         }
     };
 }
@@ -31,6 +31,23 @@ pub struct FunctionInfo {
 
     /// The alignment requirements of this function, in bytes.
     pub alignment: u32,
+
+    /// The PKRU writes in this function's code, in code order.
+    pub domain_switches: Vec<DomainSwitch>,
+}
+
+/// A write of PKRU (POR_EL0 on AArch64) compiled into a function, kept so
+/// profilers can attribute its cost apart from the function around it.
+#[derive(Serialize, Deserialize, Debug, Clone, Copy, PartialEq, Eq)]
+pub struct DomainSwitch {
+    /// Offset of the write from the start of the function.
+    pub offset: u32,
+    /// Length of the write's code, in bytes.
+    pub length: u32,
+    /// The domain entered, for the constant writes of `switch_domain` and
+    /// domain function prologues. `None` for writes of a runtime value, such
+    /// as restoring the caller's PKRU on return or the `wrpkru` intrinsic.
+    pub domain: Option<u32>,
 }
 
 /// Information about a compiled trampoline which the host can call to enter
@@ -1796,13 +1796,35 @@ impl Compiler<'_, '_> {
             Trap::ListByteLengthOverflow,
         );
 
+        // Lists of plain numbers, or of records and tuples of them, are the
+        // same bytes in both memories, so the host copies them in bulk rather
+        // than this adapter translating an element at a time. This keeps
+        // large byte buffers cheap to pass between components.
+        let bulk = src_size > 0
+            && src_size == dst_size
+            && src_align == dst_align
+            && self.is_plain_data(src_element_ty, dst_element_ty);
+        if bulk {
+            let transcode = self.module.import_transcoder(Transcoder {
+                from_memory: src_opts.memory.unwrap(),
+                from_memory64: src_opts.memory64,
+                to_memory: dst_opts.memory.unwrap(),
+                to_memory64: dst_opts.memory64,
+                op: Transcode::Copy(FE::Latin1),
+            });
+            self.instruction(LocalGet(src_mem.addr.idx));
+            self.instruction(LocalGet(src_byte_len.idx));
+            self.instruction(LocalGet(dst_mem.addr.idx));
+            self.instruction(Call(transcode.as_u32()));
+        }
+
         self.free_temp_local(src_byte_len);
         self.free_temp_local(dst_byte_len);
 
         // This is the main body of the loop to actually translate list types.
         // Note that if both element sizes are 0 then this won't actually do
         // anything so the loop is removed entirely.
-        if src_size > 0 || dst_size > 0 {
+        if !bulk && (src_size > 0 || dst_size > 0) {
             // This block encompasses the entire loop and is use to exit before even
             // entering the loop if the list size is zero.
             self.instruction(Block(BlockType::Empty));
@@ -1886,6 +1908,41 @@ impl Compiler<'_, '_> {
         self.free_temp_local(dst_mem.addr);
     }
 
+    /// Whether values of `src` translate to `dst` unchanged, byte for byte:
+    /// numbers of the same type, and records and tuples made only of them.
+    /// Types with invalid bit patterns, such as `bool` or `char`, and those
+    /// holding pointers are never plain.
+    fn is_plain_data(&self, src: &InterfaceType, dst: &InterfaceType) -> bool {
+        use InterfaceType as I;
+        match (src, dst) {
+            (I::U8, I::U8)
+            | (I::S8, I::S8)
+            | (I::U16, I::U16)
+            | (I::S16, I::S16)
+            | (I::U32, I::U32)
+            | (I::S32, I::S32)
+            | (I::U64, I::U64)
+            | (I::S64, I::S64)
+            | (I::Float32, I::Float32)
+            | (I::Float64, I::Float64) => true,
+            (I::Record(s), I::Record(d)) => {
+                let (s, d) = (&self.types[*s].fields, &self.types[*d].fields);
+                s.len() == d.len()
+                    && s.iter()
+                        .zip(d.iter())
+                        .all(|(s, d)| s.name == d.name && self.is_plain_data(&s.ty, &d.ty))
+            }
+            (I::Tuple(s), I::Tuple(d)) => {
+                let (s, d) = (&self.types[*s].types, &self.types[*d].types);
+                s.len() == d.len()
+                    && s.iter()
+                        .zip(d.iter())
+                        .all(|(s, d)| self.is_plain_data(s, d))
+            }
+            _ => false,
+        }
+    }
+
     fn calculate_list_byte_len(
         &mut self,
         opts: &Options,
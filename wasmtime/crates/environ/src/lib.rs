@@ -26,6 +26,7 @@
 mod address_map;
 mod builtin;
 mod compilation;
+mod memory_free;
 mod module;
 mod module_environ;
 mod module_types;
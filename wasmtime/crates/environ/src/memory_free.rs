@@ -0,0 +1,234 @@
+//! Finding the functions of a module which never access linear memory.
+//!
+//! A call to such a function doesn't depend on PKRU, so the compiler may skip
+//! the domain switch around it. Whether a function qualifies depends on its
+//! callees, so this is done once for the whole module before any function is
+//! compiled.
+
+use crate::{DefinedFuncIndex, FuncIndex, FunctionBodyData, Module, PrimaryMap};
+use wasmparser::Operator;
+
+/// Returns, for every defined function, whether neither it nor anything it
+/// may call accesses linear memory or PKRU.
+///
+/// Calls to imports and indirect calls may reach anything, so they count as
+/// accesses. Bodies which fail to parse are left to the validator and also
+/// count as accessing memory.
+pub(crate) fn memory_free_functions(
+    module: &Module,
+    bodies: &PrimaryMap<DefinedFuncIndex, FunctionBodyData<'_>>,
+) -> PrimaryMap<DefinedFuncIndex, bool> {
+    let mut callees = PrimaryMap::<DefinedFuncIndex, Vec<DefinedFuncIndex>>::new();
+    let mut free = PrimaryMap::<DefinedFuncIndex, bool>::new();
+    for (_, data) in bodies {
+        let (f, c) = match direct_callees(module, data) {
+            Some(c) => (true, c),
+            None => (false, Vec::new()),
+        };
+        free.push(f);
+        callees.push(c);
+    }
+
+    // Functions only lose the property, so iterate until nothing changes.
+    // Recursion between memory-free functions keeps them memory-free.
+    let mut changed = true;
+    while changed {
+        changed = false;
+        for (index, calls) in callees.iter() {
+            if free[index] && calls.iter().any(|c| !free[*c]) {
+                free[index] = false;
+                changed = true;
+            }
+        }
+    }
+    free
+}
+
+/// The defined functions `data` calls, or `None` if it accesses memory
+/// itself or calls something other than a defined function.
+fn direct_callees(module: &Module, data: &FunctionBodyData<'_>) -> Option<Vec<DefinedFuncIndex>> {
+    let mut callees = Vec::new();
+    let mut reader = data.body.get_operators_reader().ok()?;
+    while !reader.eof() {
+        match reader.read().ok()? {
+            Operator::Call { function_index } | Operator::ReturnCall { function_index } => {
+                let index = module.defined_func_index(FuncIndex::from_u32(function_index))?;
+                callees.push(index);
+            }
+            op if accesses_memory(&op) => return None,
+            _ => {}
+        }
+    }
+    Some(callees)
+}
+
+/// Whether `op` may access linear memory or PKRU, or reach code which does.
+fn accesses_memory(op: &Operator) -> bool {
+    match op {
+        Operator::I32Load { .. }
+        | Operator::I64Load { .. }
+        | Operator::F32Load { .. }
+        | Operator::F64Load { .. }
+        | Operator::I32Load8S { .. }
+        | Operator::I32Load8U { .. }
+        | Operator::I32Load16S { .. }
+        | Operator::I32Load16U { .. }
+        | Operator::I64Load8S { .. }
+        | Operator::I64Load8U { .. }
+        | Operator::I64Load16S { .. }
+        | Operator::I64Load16U { .. }
+        | Operator::I64Load32S { .. }
+        | Operator::I64Load32U { .. }
+        | Operator::I32Store { .. }
+        | Operator::I64Store { .. }
+        | Operator::F32Store { .. }
+        | Operator::F64Store { .. }
+        | Operator::I32Store8 { .. }
+        | Operator::I32Store16 { .. }
+        | Operator::I64Store8 { .. }
+        | Operator::I64Store16 { .. }
+        | Operator::I64Store32 { .. }
+        | Operator::MemoryAtomicNotify { .. }
+        | Operator::MemoryAtomicWait32 { .. }
+        | Operator::MemoryAtomicWait64 { .. }
+        | Operator::I32AtomicLoad { .. }
+        | Operator::I64AtomicLoad { .. }
+        | Operator::I32AtomicLoad8U { .. }
+        | Operator::I32AtomicLoad16U { .. }
+        | Operator::I64AtomicLoad8U { .. }
+        | Operator::I64AtomicLoad16U { .. }
+        | Operator::I64AtomicLoad32U { .. }
+        | Operator::I32AtomicStore { .. }
+        | Operator::I64AtomicStore { .. }
+        | Operator::I32AtomicStore8 { .. }
+        | Operator::I32AtomicStore16 { .. }
+        | Operator::I64AtomicStore8 { .. }
+        | Operator::I64AtomicStore16 { .. }
+        | Operator::I64AtomicStore32 { .. }
+        | Operator::I32AtomicRmwAdd { .. }
+        | Operator::I64AtomicRmwAdd { .. }
+        | Operator::I32AtomicRmw8AddU { .. }
+        | Operator::I32AtomicRmw16AddU { .. }
+        | Operator::I64AtomicRmw8AddU { .. }
+        | Operator::I64AtomicRmw16AddU { .. }
+        | Operator::I64AtomicRmw32AddU { .. }
+        | Operator::I32AtomicRmwSub { .. }
+        | Operator::I64AtomicRmwSub { .. }
+        | Operator::I32AtomicRmw8SubU { .. }
+        | Operator::I32AtomicRmw16SubU { .. }
+        | Operator::I64AtomicRmw8SubU { .. }
+        | Operator::I64AtomicRmw16SubU { .. }
+        | Operator::I64AtomicRmw32SubU { .. }
+        | Operator::I32AtomicRmwAnd { .. }
+        | Operator::I64AtomicRmwAnd { .. }
+        | Operator::I32AtomicRmw8AndU { .. }
+        | Operator::I32AtomicRmw16AndU { .. }
+        | Operator::I64AtomicRmw8AndU { .. }
+        | Operator::I64AtomicRmw16AndU { .. }
+        | Operator::I64AtomicRmw32AndU { .. }
+        | Operator::I32AtomicRmwOr { .. }
+        | Operator::I64AtomicRmwOr { .. }
+        | Operator::I32AtomicRmw8OrU { .. }
+        | Operator::I32AtomicRmw16OrU { .. }
+        | Operator::I64AtomicRmw8OrU { .. }
+        | Operator::I64AtomicRmw16OrU { .. }
+        | Operator::I64AtomicRmw32OrU { .. }
+        | Operator::I32AtomicRmwXor { .. }
+        | Operator::I64AtomicRmwXor { .. }
+        | Operator::I32AtomicRmw8XorU { .. }
+        | Operator::I32AtomicRmw16XorU { .. }
+        | Operator::I64AtomicRmw8XorU { .. }
+        | Operator::I64AtomicRmw16XorU { .. }
+        | Operator::I64AtomicRmw32XorU { .. }
+        | Operator::I32AtomicRmwXchg { .. }
+        | Operator::I64AtomicRmwXchg { .. }
+        | Operator::I32AtomicRmw8XchgU { .. }
+        | Operator::I32AtomicRmw16XchgU { .. }
+        | Operator::I64AtomicRmw8XchgU { .. }
+        | Operator::I64AtomicRmw16XchgU { .. }
+        | Operator::I64AtomicRmw32XchgU { .. }
+        | Operator::I32AtomicRmwCmpxchg { .. }
+        | Operator::I64AtomicRmwCmpxchg { .. }
+        | Operator::I32AtomicRmw8CmpxchgU { .. }
+        | Operator::I32AtomicRmw16CmpxchgU { .. }
+        | Operator::I64AtomicRmw8CmpxchgU { .. }
+        | Operator::I64AtomicRmw16CmpxchgU { .. }
+        | Operator::I64AtomicRmw32CmpxchgU { .. }
+        | Operator::V128Load { .. }
+        | Operator::V128Load8x8S { .. }
+        | Operator::V128Load8x8U { .. }
+        | Operator::V128Load16x4S { .. }
+        | Operator::V128Load16x4U { .. }
+        | Operator::V128Load32x2S { .. }
+        | Operator::V128Load32x2U { .. }
+        | Operator::V128Load8Splat { .. }
+        | Operator::V128Load16Splat { .. }
+        | Operator::V128Load32Splat { .. }
+        | Operator::V128Load64Splat { .. }
+        | Operator::V128Load32Zero { .. }
+        | Operator::V128Load64Zero { .. }
+        | Operator::V128Store { .. }
+        | Operator::V128Load8Lane { .. }
+        | Operator::V128Load16Lane { .. }
+        | Operator::V128Load32Lane { .. }
+        | Operator::V128Load64Lane { .. }
+        | Operator::V128Store8Lane { .. }
+        | Operator::V128Store16Lane { .. }
+        | Operator::V128Store32Lane { .. }
+        | Operator::V128Store64Lane { .. }
+        | Operator::MemorySize { .. }
+        | Operator::MemoryGrow { .. }
+        | Operator::MemoryInit { .. }
+        | Operator::MemoryCopy { .. }
+        | Operator::MemoryFill { .. }
+        | Operator::CallIndirect { .. }
+        | Operator::ReturnCallIndirect { .. }
+        | Operator::Rdpkru
+        | Operator::Wrpkru
+        | Operator::SwitchDomain { .. } => true,
+        _ => false,
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use crate::{ModuleEnvironment, ModuleTypesBuilder, Tunables};
+    use wasmparser::{Parser, Validator};
+
+    #[test]
+    fn memory_access_is_transitive() {
+        let wasm = wat::parse_str(
+            r#"
+            (module
+                (import "" "" (func $import))
+                (memory 1)
+                (func $add (param i32) (result i32)
+                    local.get 0
+                    call $inc)
+                (func $inc (param i32) (result i32)
+                    local.get 0
+                    i32.const 1
+                    i32.add)
+                (func $load (result i32)
+                    i32.const 0
+                    i32.load)
+                (func $calls_load (result i32)
+                    call $load)
+                (func $calls_import
+                    call $import)
+                (func $recurse (param i32) (result i32)
+                    local.get 0
+                    call $recurse))
+            "#,
+        )
+        .unwrap();
+        let tunables = Tunables::default();
+        let mut validator = Validator::new();
+        let mut types = ModuleTypesBuilder::default();
+        let translation = ModuleEnvironment::new(&tunables, &mut validator, &mut types)
+            .translate(Parser::new(0), &wasm)
+            .unwrap();
+        let free: Vec<bool> = translation.memory_free.values().copied().collect();
+        assert_eq!(free, [true, true, false, false, false, true]);
+    }
+}
@@ -58,6 +58,18 @@ impl MemoryStyle {
             );
         }
 
+        // With protection keys in use a move would have to re-tag every
+        // domain, so reserve the whole maximum up front instead when it fits.
+        if tunables.pku_non_moving_memories
+            && memory.minimum <= maximum
+            && maximum <= crate::WASM32_MAX_PAGES
+        {
+            return (
+                Self::Static { bound: maximum },
+                tunables.static_memory_offset_guard_size,
+            );
+        }
+
         // Otherwise, make it dynamic.
         (
             Self::Dynamic {
@@ -827,6 +839,121 @@ pub struct Module {
 
     /// WebAssembly global variables.
     pub globals: PrimaryMap<GlobalIndex, Global>,
+
+    /// Ranges of the first linear memory which the `pkuwa.layout` section
+    /// assigns to domains, tagged on instantiation. Sorted by offset, with
+    /// touching ranges of the same domain merged, so that neither loading
+    /// a precompiled module nor instantiating it has to sort.
+    pub domain_layout: Vec<DomainRange>,
+
+    /// The PKRU word of every domain `pkuwa.layout` declares, as given by
+    /// `domain_pkru`. Their keys are claimed on instantiation.
+    pub domain_pkru: BTreeMap<u32, u32>,
+
+    /// Memories the `pkuwa.memories` section dedicates to one domain each.
+    /// The whole reservation of such a memory is tagged with the domain's
+    /// key on instantiation, so growing it in place needs no tagging.
+    pub memory_domains: BTreeMap<MemoryIndex, u32>,
+
+    /// Domains assigned to functions by the `pkuwa.domains` and
+    /// `pkuwa.layout` sections. Compiled code switches PKRU to a function's
+    /// domain on entry and back to the caller's on return, and the host
+    /// switches before calling a domain export.
+    pub function_domains: BTreeMap<FuncIndex, u32>,
+}
+
+/// The PKRU word code of `domain` runs with: domain 0 may access every key
+/// and domain `n` only keys 0 and `n`. Returns `None` for domains which have
+/// no protection key.
+pub fn domain_pkru(domain: u32) -> Option<u32> {
+    match domain {
+        0 => Some(0),
+        1..=15 => Some(0x5555_5554 & !(0b11 << (2 * domain))),
+        _ => None,
+    }
+}
+
+/// The POR_EL0 word code of `domain` runs with on AArch64, where the
+/// permission overlay takes PKRU's place: every key is `RWX` for domain 0,
+/// and only keys 0 and `n` for domain `n`. Linux only provides 8 keys there.
+pub fn domain_por(domain: u32) -> Option<u32> {
+    const RWX: u32 = 0b0111;
+    match domain {
+        0 => Some(0x7777_7777),
+        1..=7 => Some(RWX | RWX << (4 * domain)),
+        _ => None,
+    }
+}
+
+/// A range of the first linear memory owned by a protection domain. Domain
+/// `n` is tagged with protection key `n`, matching the PKRU words compiled
+/// into the domain's functions.
+#[derive(Debug, Copy, Clone, PartialEq, Eq, Serialize, Deserialize)]
+pub struct DomainRange {
+    /// The owning domain.
+    pub domain: u32,
+    /// Byte offset of the range.
+    pub offset: u32,
+    /// Length of the range in bytes.
+    pub len: u32,
+}
+
+/// Encodes `layout` as a whole `pkuwa.layout` custom section, which assigns
+/// no functions. Appended to a snapshot of an initialized module's memory,
+/// it makes instantiation tag the domains the guest set up in one pass, so
+/// the guest does not have to set them up again.
+pub fn encode_domain_layout(layout: &[DomainRange]) -> Vec<u8> {
+    let mut domains = BTreeMap::<u32, Vec<&DomainRange>>::new();
+    for range in layout {
+        domains.entry(range.domain).or_default().push(range);
+    }
+    let mut payload = Vec::new();
+    write_leb(&mut payload, domains.len() as u32);
+    for (domain, ranges) in domains {
+        write_leb(&mut payload, domain);
+        write_leb(&mut payload, ranges.len() as u32);
+        for range in ranges {
+            write_leb(&mut payload, range.offset);
+            write_leb(&mut payload, range.len);
+        }
+        write_leb(&mut payload, 0);
+    }
+    encode_custom_section("pkuwa.layout", &payload)
+}
+
+/// Encodes `assignment`, pairs of function indices and the domains they run
+/// in, as a whole `pkuwa.domains` custom section.
+pub fn encode_function_domains(assignment: &BTreeMap<FuncIndex, u32>) -> Vec<u8> {
+    let mut payload = Vec::new();
+    write_leb(&mut payload, assignment.len() as u32);
+    for (index, domain) in assignment {
+        write_leb(&mut payload, index.as_u32());
+        write_leb(&mut payload, *domain);
+    }
+    encode_custom_section("pkuwa.domains", &payload)
+}
+
+fn encode_custom_section(name: &str, data: &[u8]) -> Vec<u8> {
+    let mut payload = Vec::new();
+    write_leb(&mut payload, name.len() as u32);
+    payload.extend_from_slice(name.as_bytes());
+    payload.extend_from_slice(data);
+    let mut section = vec![0];
+    write_leb(&mut section, payload.len() as u32);
+    section.extend(payload);
+    section
+}
+
+fn write_leb(out: &mut Vec<u8>, mut value: u32) {
+    loop {
+        let byte = (value & 0x7f) as u8;
+        value >>= 7;
+        if value == 0 {
+            out.push(byte);
+            return;
+        }
+        out.push(byte | 0x80);
+    }
 }
 
 /// Initialization routines for creating an instance, encompassing imports,
@@ -1,11 +1,12 @@
 use crate::module::{
-    AnyfuncIndex, Initializer, MemoryInitialization, MemoryInitializer, MemoryPlan, Module,
-    ModuleType, TableInitializer, TablePlan,
+    domain_pkru, AnyfuncIndex, DomainRange, Initializer, MemoryInitialization, MemoryInitializer,
+    MemoryPlan, Module, ModuleType, TableInitializer, TablePlan,
 };
 use crate::{
     DataIndex, DefinedFuncIndex, ElemIndex, EntityIndex, EntityType, FuncIndex, Global,
     GlobalIndex, GlobalInit, MemoryIndex, ModuleTypesBuilder, PrimaryMap, SignatureIndex,
     TableIndex, TableInitialization, Tunables, TypeIndex, WasmError, WasmFuncType, WasmResult,
+    WasmType,
 };
 use cranelift_entity::packed_option::ReservedValue;
 use std::borrow::Cow;
@@ -14,9 +15,9 @@ use std::convert::{TryFrom, TryInto};
 use std::path::PathBuf;
 use std::sync::Arc;
 use wasmparser::{
-    CustomSectionReader, DataKind, ElementItem, ElementKind, Encoding, ExternalKind, FuncValidator,
-    FunctionBody, NameSectionReader, Naming, Operator, Parser, Payload, Type, TypeRef, Validator,
-    ValidatorResources,
+    BinaryReader, CustomSectionReader, DataKind, ElementItem, ElementKind, Encoding, ExternalKind,
+    FuncValidator, FunctionBody, NameSectionReader, Naming, Operator, Parser, Payload, Type,
+    TypeRef, Validator, ValidatorResources,
 };
 
 /// Object containing the standalone environment information.
@@ -80,9 +81,37 @@ pub struct ModuleTranslation<'data> {
     /// Total size of all passive data pushed into `passive_data` so far.
     total_passive_data: u32,
 
+    /// The `(offset, len)` of every data segment in the first memory, `None`
+    /// for segments which are passive, in another memory or based on a
+    /// global.
+    data_segments: Vec<Option<(u64, u64)>>,
+
+    /// Data segments the name section calls `.pku.d<domain>`, with their
+    /// domain and name, placed in the domain's pages at instantiation.
+    data_domains: Vec<(u32, u32, &'data str)>,
+
     /// When we're parsing the code section this will be incremented so we know
     /// which function is currently being defined.
     code_index: u32,
+
+    /// For each defined function, whether neither it nor anything it may call
+    /// accesses linear memory, so calls to it don't depend on PKRU.
+    pub memory_free: PrimaryMap<DefinedFuncIndex, bool>,
+
+    /// Imports from the `pkuwa` module which compile to inline PKRU accesses
+    /// rather than calls.
+    pub pkru_intrinsics: HashMap<FuncIndex, PkruIntrinsic>,
+}
+
+/// A function imported from the `pkuwa` module which Cranelift lowers to the
+/// instruction itself, so guests built with compilers that can't encode the
+/// `rdpkru`/`wrpkru` operators still avoid a host transition.
+#[derive(Debug, Copy, Clone, PartialEq, Eq)]
+pub enum PkruIntrinsic {
+    /// `rdpkru() -> i32`, which returns PKRU.
+    Rdpkru,
+    /// `wrpkru(pkru: i32) -> i32`, which writes `pkru` to PKRU and returns it.
+    Wrpkru,
 }
 
 /// Contains function data: byte code and its offset in the module.
@@ -206,6 +235,76 @@ impl<'a, 'data> ModuleEnvironment<'a, 'data> {
                     .collect();
                 self.result.exported_signatures.sort_unstable();
                 self.result.exported_signatures.dedup();
+
+                self.result.memory_free = crate::memory_free::memory_free_functions(
+                    &self.result.module,
+                    &self.result.function_body_inputs,
+                );
+
+                // The domain sections may precede the function and memory
+                // sections, so they are only checked once everything is known.
+                // Imported functions run wherever their own module puts them,
+                // so they cannot be assigned a domain here.
+                let module = &self.result.module;
+                let functions = module.functions.len();
+                if let Some(index) = module
+                    .function_domains
+                    .keys()
+                    .find(|index| index.as_u32() as usize >= functions)
+                {
+                    return Err(WasmError::InvalidWebAssembly {
+                        message: format!("domain assigned to unknown function {}", index.as_u32()),
+                        offset,
+                    });
+                }
+                if let Some(index) = module
+                    .function_domains
+                    .keys()
+                    .find(|index| module.is_imported_function(**index))
+                {
+                    return Err(WasmError::InvalidWebAssembly {
+                        message: format!("domain assigned to imported function {}", index.as_u32()),
+                        offset,
+                    });
+                }
+                self.place_data_domains(offset)?;
+                let module = &self.result.module;
+                if !module.domain_layout.is_empty()
+                    && (module.memory_plans.is_empty() || module.num_imported_memories > 0)
+                {
+                    return Err(WasmError::Unsupported(
+                        "domain ranges require the first memory to be defined by the module"
+                            .to_string(),
+                    ));
+                }
+                if let Some(index) = module.memory_domains.keys().find(|index| {
+                    match module.memory_plans.get(**index) {
+                        Some(plan) => {
+                            plan.memory.shared
+                                || (index.as_u32() as usize) < module.num_imported_memories
+                        }
+                        None => true,
+                    }
+                }) {
+                    return Err(WasmError::InvalidWebAssembly {
+                        message: format!(
+                            "domain assigned to memory {} which is not a private memory of the module",
+                            index.as_u32()
+                        ),
+                        offset,
+                    });
+                }
+                self.finish_domain_layout(offset)?;
+
+                // Without isolation the sections are only validated, so a
+                // module behaves the same whether or not the host has keys.
+                if !self.tunables.pku_isolation {
+                    let module = &mut self.result.module;
+                    module.domain_layout.clear();
+                    module.domain_pkru.clear();
+                    module.memory_domains.clear();
+                    module.function_domains.clear();
+                }
             }
 
             Payload::TypeSection(types) => {
@@ -255,6 +354,12 @@ impl<'a, 'data> ModuleEnvironment<'a, 'data> {
                         // doesn't get past validation
                         TypeRef::Tag(_) => unreachable!(),
                     };
+                    if let (EntityType::Function(sig), "pkuwa") = (&ty, import.module) {
+                        let index = FuncIndex::from_u32(self.result.module.functions.len() as u32);
+                        if let Some(intrinsic) = self.pkru_intrinsic(import.name, *sig)? {
+                            self.result.pkru_intrinsics.insert(index, intrinsic);
+                        }
+                    }
                     self.declare_import(import.module, import.name, ty);
                 }
             }
@@ -590,6 +695,12 @@ impl<'a, 'data> ModuleEnvironment<'a, 'data> {
                                     )));
                                 }
                             };
+                            self.result
+                                .data_segments
+                                .push(match (memory_index.as_u32(), base) {
+                                    (0, None) => Some((old_offset, data.len() as u64)),
+                                    _ => None,
+                                });
                             if index == 0 && old_offset > PAGE_SIZE.try_into().unwrap() {
                                 let offset = old_offset - PAGE_SIZE as u64;
                                 let range = mk_guard_range(&mut self.result.total_data)?;
@@ -615,6 +726,7 @@ impl<'a, 'data> ModuleEnvironment<'a, 'data> {
                             }
                         }
                         DataKind::Passive => {
+                            self.result.data_segments.push(None);
                             let data_index = DataIndex::from_u32(index as u32);
                             let range = mk_range(&mut self.result.total_passive_data)?;
                             self.result.passive_data.push(data);
@@ -646,6 +758,18 @@ impl<'a, 'data> ModuleEnvironment<'a, 'data> {
                 }
             }
 
+            Payload::CustomSection(s) if s.name() == "pkuwa.domains" => {
+                self.domains_section(&s)?;
+            }
+
+            Payload::CustomSection(s) if s.name() == "pkuwa.layout" => {
+                self.layout_section(&s)?;
+            }
+
+            Payload::CustomSection(s) if s.name() == "pkuwa.memories" => {
+                self.memories_section(&s)?;
+            }
+
             Payload::CustomSection(s)
                 if s.name() == "webidl-bindings" || s.name() == "wasm-interface-types" =>
             {
@@ -752,6 +876,28 @@ and for re-adding support for interface types you can see this issue:
         });
     }
 
+    /// Recognizes `field` of the `pkuwa` module as a PKRU intrinsic. Other
+    /// fields are ordinary imports.
+    fn pkru_intrinsic(
+        &self,
+        field: &str,
+        sig: SignatureIndex,
+    ) -> WasmResult<Option<PkruIntrinsic>> {
+        let (intrinsic, params) = match field {
+            "rdpkru" => (PkruIntrinsic::Rdpkru, &[][..]),
+            "wrpkru" => (PkruIntrinsic::Wrpkru, &[WasmType::I32][..]),
+            _ => return Ok(None),
+        };
+        let ty = &self.types[sig];
+        if ty.params() != params || ty.returns() != [WasmType::I32] {
+            return Err(WasmError::Unsupported(format!(
+                "pkuwa::{} imported with signature {:?}",
+                field, ty
+            )));
+        }
+        Ok(Some(intrinsic))
+    }
+
     fn push_type(&mut self, ty: EntityType) -> EntityIndex {
         match ty {
             EntityType::Function(ty) => EntityIndex::Function(self.result.module.push_function(ty)),
@@ -788,6 +934,233 @@ and for re-adding support for interface types you can see this issue:
         Ok(())
     }
 
+    /// Parses the `pkuwa.domains` section: a count followed by that many
+    /// `(function index, domain)` pairs, all LEB128-encoded `u32`s.
+    ///
+    /// Unlike the name section a malformed section is an error, since
+    /// ignoring it would silently run functions outside their domain.
+    fn domains_section(&mut self, section: &CustomSectionReader<'data>) -> WasmResult<()> {
+        let mut reader = BinaryReader::new_with_offset(section.data(), section.data_offset());
+        for _ in 0..reader.read_var_u32()? {
+            let offset = reader.original_position();
+            let index = FuncIndex::from_u32(reader.read_var_u32()?);
+            let domain = reader.read_var_u32()?;
+            self.assign_domain(index, domain, offset)?;
+        }
+        Self::finish_pkuwa_section(&reader, section.name())
+    }
+
+    /// Parses the `pkuwa.layout` section, which describes every domain up
+    /// front so instantiation can set them all up in one pass. It holds a
+    /// count of domains, each encoded as
+    ///
+    /// * the domain, between 0 and 15,
+    /// * a count of `(offset, len)` ranges of the first memory it owns,
+    ///   both multiples of the 4 KiB page keys are tagged in,
+    /// * a count of the indices of the functions which run in it,
+    ///
+    /// again all LEB128-encoded `u32`s. Functions are assigned exactly as by
+    /// `pkuwa.domains`, and the two sections may be combined.
+    fn layout_section(&mut self, section: &CustomSectionReader<'data>) -> WasmResult<()> {
+        const PAGE_SIZE: u32 = 4096;
+        let mut reader = BinaryReader::new_with_offset(section.data(), section.data_offset());
+        for _ in 0..reader.read_var_u32()? {
+            let offset = reader.original_position();
+            let domain = reader.read_var_u32()?;
+            let pkru = match domain_pkru(domain) {
+                Some(pkru) => pkru,
+                None => {
+                    return Err(WasmError::InvalidWebAssembly {
+                        message: format!("protection domain {} out of range", domain),
+                        offset,
+                    })
+                }
+            };
+            self.result.module.domain_pkru.insert(domain, pkru);
+            for _ in 0..reader.read_var_u32()? {
+                let offset = reader.original_position();
+                let range = DomainRange {
+                    domain,
+                    offset: reader.read_var_u32()?,
+                    len: reader.read_var_u32()?,
+                };
+                if range.offset.checked_add(range.len).is_none() {
+                    return Err(WasmError::InvalidWebAssembly {
+                        message: "domain range overflows".to_string(),
+                        offset,
+                    });
+                }
+                // The kernel tags whole pages, so an unaligned end would
+                // hand the rest of its page to this domain too.
+                if range.offset % PAGE_SIZE != 0 || range.len % PAGE_SIZE != 0 {
+                    return Err(WasmError::InvalidWebAssembly {
+                        message: format!(
+                            "domain range {:#x}..{:#x} is not page aligned",
+                            range.offset,
+                            range.offset + range.len
+                        ),
+                        offset,
+                    });
+                }
+                self.result.module.domain_layout.push(range);
+            }
+            for _ in 0..reader.read_var_u32()? {
+                let offset = reader.original_position();
+                let index = FuncIndex::from_u32(reader.read_var_u32()?);
+                self.assign_domain(index, domain, offset)?;
+            }
+        }
+        Self::finish_pkuwa_section(&reader, section.name())
+    }
+
+    /// Parses the `pkuwa.memories` section, which dedicates whole linear
+    /// memories to domains instead of carving them out of the first one. It
+    /// holds a count of `(memory index, domain)` pairs, LEB128-encoded
+    /// `u32`s. A domain may own several memories, but each memory belongs to
+    /// exactly one domain, and the first memory always stays in domain 0.
+    fn memories_section(&mut self, section: &CustomSectionReader<'data>) -> WasmResult<()> {
+        let mut reader = BinaryReader::new_with_offset(section.data(), section.data_offset());
+        for _ in 0..reader.read_var_u32()? {
+            let offset = reader.original_position();
+            let index = MemoryIndex::from_u32(reader.read_var_u32()?);
+            let domain = reader.read_var_u32()?;
+            let pkru = match domain_pkru(domain) {
+                Some(pkru) if domain != 0 && index.as_u32() != 0 => pkru,
+                _ => {
+                    return Err(WasmError::InvalidWebAssembly {
+                        message: format!(
+                            "memory {} cannot be dedicated to domain {}",
+                            index.as_u32(),
+                            domain
+                        ),
+                        offset,
+                    })
+                }
+            };
+            let module = &mut self.result.module;
+            if module.memory_domains.insert(index, domain).is_some() {
+                return Err(WasmError::InvalidWebAssembly {
+                    message: format!("memory {} assigned to more than one domain", index.as_u32()),
+                    offset,
+                });
+            }
+            module.domain_pkru.insert(domain, pkru);
+        }
+        Self::finish_pkuwa_section(&reader, section.name())
+    }
+
+    /// Adds the data segments named `.pku.d<domain>`, as clang names those
+    /// of `__attribute__((section(".pku.d<domain>")))` data, to the domain
+    /// layout, so they are tagged where they were initialized rather than
+    /// copied into the domain's heap. A segment has to start on a page, and
+    /// as its last page is tagged whole, no other segment may start in it.
+    fn place_data_domains(&mut self, offset: usize) -> WasmResult<()> {
+        const PAGE_SIZE: u64 = 4096;
+        for (index, domain, name) in std::mem::take(&mut self.result.data_domains) {
+            let segment = self.result.data_segments.get(index as usize).copied();
+            let (start, len) = match (segment.flatten(), domain_pkru(domain)) {
+                (Some(segment), Some(pkru)) if domain != 0 => {
+                    self.result.module.domain_pkru.insert(domain, pkru);
+                    segment
+                }
+                _ => {
+                    return Err(WasmError::InvalidWebAssembly {
+                        message: format!(
+                            "data segment {} cannot be placed in domain {}",
+                            name, domain
+                        ),
+                        offset,
+                    })
+                }
+            };
+            let end = match start.checked_add(len) {
+                Some(end) if end <= u64::from(u32::MAX) => (end + PAGE_SIZE - 1) & !(PAGE_SIZE - 1),
+                _ => u64::MAX,
+            };
+            let shared = self
+                .result
+                .data_segments
+                .iter()
+                .flatten()
+                .any(|&(other, len)| {
+                    len != 0 && other != start && other < end && other.saturating_add(len) > start
+                });
+            if start % PAGE_SIZE != 0 || shared || end > u64::from(u32::MAX) {
+                return Err(WasmError::InvalidWebAssembly {
+                    message: format!(
+                        "data segment {} at {:#x} does not have pages of its own",
+                        name, start
+                    ),
+                    offset,
+                });
+            }
+            self.result.module.domain_layout.push(DomainRange {
+                domain,
+                offset: start as u32,
+                len: (end - start) as u32,
+            });
+        }
+        Ok(())
+    }
+
+    /// Sorts the domain layout and merges touching ranges of one domain.
+    /// Ranges of different domains must not overlap, as then the page's
+    /// owner would depend on the order the ranges are tagged in.
+    fn finish_domain_layout(&mut self, offset: usize) -> WasmResult<()> {
+        let layout = &mut self.result.module.domain_layout;
+        layout.retain(|r| r.len != 0);
+        layout.sort_by_key(|r| r.offset);
+        let mut merged: Vec<DomainRange> = Vec::with_capacity(layout.len());
+        for r in layout.drain(..) {
+            match merged.last_mut() {
+                Some(last) if last.offset + last.len >= r.offset && last.domain == r.domain => {
+                    last.len = last.len.max(r.offset + r.len - last.offset);
+                }
+                Some(last) if last.offset + last.len > r.offset => {
+                    return Err(WasmError::InvalidWebAssembly {
+                        message: format!(
+                            "domains {} and {} overlap at offset {:#x}",
+                            last.domain, r.domain, r.offset
+                        ),
+                        offset,
+                    });
+                }
+                _ => merged.push(r),
+            }
+        }
+        *layout = merged;
+        Ok(())
+    }
+
+    fn assign_domain(&mut self, index: FuncIndex, domain: u32, offset: usize) -> WasmResult<()> {
+        if self
+            .result
+            .module
+            .function_domains
+            .insert(index, domain)
+            .is_some()
+        {
+            return Err(WasmError::InvalidWebAssembly {
+                message: format!(
+                    "function {} assigned to more than one domain",
+                    index.as_u32()
+                ),
+                offset,
+            });
+        }
+        Ok(())
+    }
+
+    fn finish_pkuwa_section(reader: &BinaryReader<'_>, name: &str) -> WasmResult<()> {
+        if !reader.eof() {
+            return Err(WasmError::InvalidWebAssembly {
+                message: format!("trailing bytes in {} section", name),
+                offset: reader.original_position(),
+            });
+        }
+        Ok(())
+    }
+
     /// Parses the Name section of the wasm module.
     fn name_section(&mut self, names: NameSectionReader<'data>) -> WasmResult<()> {
         for subsection in names {
@@ -814,6 +1187,18 @@ and for re-adding support for interface types you can see this issue:
                             .insert(index, name);
                     }
                 }
+                wasmparser::Name::Data(d) => {
+                    let mut names = d.get_map()?;
+                    for _ in 0..names.get_count() {
+                        let Naming { index, name } = names.read()?;
+                        let domain = name
+                            .strip_prefix(".pku.d")
+                            .and_then(|domain| domain.parse::<u32>().ok());
+                        if let Some(domain) = domain {
+                            self.result.data_domains.push((index, domain, name));
+                        }
+                    }
+                }
                 wasmparser::Name::Module(module) => {
                     let name = module.get_name()?;
                     self.result.module.name = Some(name.to_string());
@@ -853,7 +1238,6 @@ and for re-adding support for interface types you can see this issue:
                 | wasmparser::Name::Global(_)
                 | wasmparser::Name::Memory(_)
                 | wasmparser::Name::Element(_)
-                | wasmparser::Name::Data(_)
                 | wasmparser::Name::Unknown { .. } => {}
             }
         }
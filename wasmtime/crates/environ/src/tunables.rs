@@ -34,6 +34,19 @@ pub struct Tunables {
     /// Whether or not to treat the static memory bound as the maximum for unbounded heaps.
     pub static_memory_bound_is_maximum: bool,
 
+    /// Whether or not memories whose maximum fits in the 32-bit address space
+    /// get a static reservation of that maximum, so that growing never moves
+    /// them and never drops their protection-key tags.
+    pub pku_non_moving_memories: bool,
+
+    /// Whether or not compiled code reports its PKRU writes to the store, so
+    /// that the time each domain runs for is accounted and can be limited.
+    pub pku_domain_time: bool,
+
+    /// Whether or not the `pkuwa` sections take effect. Without isolation
+    /// they are only validated, and nothing is tagged or switched to.
+    pub pku_isolation: bool,
+
     /// Whether or not linear memory allocations will have a guard region at the
     /// beginning of the allocation in addition to the end.
     pub guard_before_linear_memory: bool,
@@ -88,6 +101,9 @@ impl Default for Tunables {
             consume_fuel: false,
             epoch_interruption: false,
             static_memory_bound_is_maximum: false,
+            pku_non_moving_memories: false,
+            pku_domain_time: false,
+            pku_isolation: true,
             guard_before_linear_memory: true,
             generate_address_map: true,
             debug_adapter_modules: false,
@@ -4,6 +4,9 @@ use std::io;
 use std::marker::PhantomData;
 use std::panic::{self, AssertUnwindSafe};
 
+mod pkru;
+mod pkru_probe;
+
 cfg_if::cfg_if! {
     if #[cfg(windows)] {
         mod windows;
@@ -50,6 +53,8 @@ pub struct Fiber<'a, Resume, Yield, Return> {
     stack: FiberStack,
     inner: imp::Fiber,
     done: Cell<bool>,
+    /// The PKRU the fiber last ran with, `None` until it first runs.
+    pkru: Cell<Option<u32>>,
     _phantom: PhantomData<&'a (Resume, Yield, Return)>,
 }
 
@@ -82,6 +87,7 @@ impl<'a, Resume, Yield, Return> Fiber<'a, Resume, Yield, Return> {
             stack,
             inner,
             done: Cell::new(false),
+            pkru: Cell::new(None),
             _phantom: PhantomData,
         })
     }
@@ -94,6 +100,11 @@ impl<'a, Resume, Yield, Return> Fiber<'a, Resume, Yield, Return> {
     /// Returns `true` if the fiber finished or `false` if the fiber was
     /// suspended in the middle of execution.
     ///
+    /// The fiber runs with its own protection key rights: it starts with
+    /// the caller's PKRU, resumes with the value it suspended with, and the
+    /// caller's value is back in place once this returns. The register is
+    /// only written when the two differ.
+    ///
     /// # Panics
     ///
     /// Panics if the current thread is already executing a fiber or if this
@@ -104,7 +115,20 @@ impl<'a, Resume, Yield, Return> Fiber<'a, Resume, Yield, Return> {
     pub fn resume(&self, val: Resume) -> Result<Return, Yield> {
         assert!(!self.done.replace(true), "cannot resume a finished fiber");
         let result = Cell::new(RunResult::Resuming(val));
+        let outer = pkru::read();
+        if let (Some(outer), Some(inner)) = (outer, self.pkru.get()) {
+            if inner != outer {
+                unsafe { pkru::write(inner) };
+            }
+        }
         self.inner.resume(&self.stack.0, &result);
+        if let Some(outer) = outer {
+            let inner = pkru::read();
+            self.pkru.set(inner);
+            if inner != Some(outer) {
+                unsafe { pkru::write(outer) };
+            }
+        }
         match result.into_inner() {
             RunResult::Resuming(_) | RunResult::Executing => unreachable!(),
             RunResult::Yield(y) => {
@@ -279,6 +303,34 @@ mod tests {
         }
     }
 
+    #[test]
+    fn pkru_kept_per_fiber() {
+        let outer = match crate::pkru::read() {
+            Some(pkru) => pkru,
+            // The host has no protection keys.
+            None => return,
+        };
+        // Flip write access to the last key, which nothing in this process
+        // uses: key 15 of PKRU, or key 7 of POR_EL0.
+        let last_write = if cfg!(target_arch = "aarch64") {
+            30
+        } else {
+            31
+        };
+        let closed = outer ^ 1 << last_write;
+        let fiber = Fiber::<(), (), ()>::new(FiberStack::new(1024 * 1024).unwrap(), move |_, s| {
+            assert_eq!(crate::pkru::read(), Some(outer));
+            unsafe { crate::pkru::write(closed) };
+            s.suspend(());
+            assert_eq!(crate::pkru::read(), Some(closed));
+        })
+        .unwrap();
+        assert!(fiber.resume(()).is_err());
+        assert_eq!(crate::pkru::read(), Some(outer));
+        assert!(fiber.resume(()).is_ok());
+        assert_eq!(crate::pkru::read(), Some(outer));
+    }
+
     #[test]
     fn suspend_and_resume_values() {
         let fiber = Fiber::new(FiberStack::new(1024 * 1024).unwrap(), move |first, s| {
@@ -0,0 +1,64 @@
+//! Per-fiber protection key rights.
+//!
+//! PKRU is thread state, so a fiber suspending inside a protection domain
+//! would otherwise hand its rights to whatever the thread runs next. Each
+//! fiber keeps its own value instead, which `Fiber::resume` swaps in and
+//! back out once the fiber suspends or returns. On AArch64 the permission
+//! overlay register POR_EL0 takes PKRU's place.
+
+use crate::pkru_probe::supported;
+
+/// The current thread's PKRU, or `None` if the host has none.
+pub fn read() -> Option<u32> {
+    if supported() {
+        Some(unsafe { rdpkru() })
+    } else {
+        None
+    }
+}
+
+/// Set the current thread's PKRU, after `read` returned a value.
+///
+/// # Unsafety
+///
+/// Closing a key makes every access to memory tagged with it fault, so the
+/// caller must only write values it read before or knows to be safe.
+pub unsafe fn write(pkru: u32) {
+    wrpkru(pkru)
+}
+
+cfg_if::cfg_if! {
+    if #[cfg(target_arch = "x86_64")] {
+        use std::arch::asm;
+
+        unsafe fn rdpkru() -> u32 {
+            let pkru: u32;
+            asm!(".byte 0x0f,0x01,0xee", out("eax") pkru, in("ecx") 0, out("edx") _);
+            pkru
+        }
+
+        unsafe fn wrpkru(pkru: u32) {
+            asm!(".byte 0x0f,0x01,0xef", in("eax") pkru, in("ecx") 0, in("edx") 0);
+        }
+    } else if #[cfg(all(target_arch = "aarch64", target_os = "linux"))] {
+        use std::arch::asm;
+
+        /// Linux only hands out 8 keys, whose permissions fit in the low
+        /// 32 bits of POR_EL0.
+        unsafe fn rdpkru() -> u32 {
+            let por: u64;
+            asm!("mrs {}, S3_3_C10_C2_4", out(reg) por);
+            por as u32
+        }
+
+        unsafe fn wrpkru(pkru: u32) {
+            asm!("msr S3_3_C10_C2_4, {}", "isb", in(reg) u64::from(pkru));
+        }
+    } else {
+        unsafe fn rdpkru() -> u32 {
+            0
+        }
+
+        unsafe fn wrpkru(_pkru: u32) {}
+    }
+}
@@ -0,0 +1,45 @@
+//! Probe for protection keys.
+//!
+//! Both this crate, which switches PKRU per fiber, and `wasmtime-runtime`
+//! need it, and the runtime only depends on this crate for its `async`
+//! feature, so it includes this file with `#[path]` instead. It may only use
+//! what both crates depend on.
+
+use std::sync::atomic::{AtomicU8, Ordering};
+
+/// 0 until probed, then 1 without protection keys and 2 with them.
+static SUPPORTED: AtomicU8 = AtomicU8::new(0);
+
+/// Whether the OS has enabled protection keys on this host, without which
+/// reading or writing PKRU faults. Probed once and cached.
+pub fn supported() -> bool {
+    match SUPPORTED.load(Ordering::Relaxed) {
+        0 => {
+            let supported = probe();
+            SUPPORTED.store(if supported { 2 } else { 1 }, Ordering::Relaxed);
+            supported
+        }
+        state => state == 2,
+    }
+}
+
+cfg_if::cfg_if! {
+    if #[cfg(target_arch = "x86_64")] {
+        /// CPUID.(EAX=7,ECX=0):ECX.PKU[bit 3] for the CPU's support and
+        /// OSPKE[bit 4] for the OS having enabled it.
+        fn probe() -> bool {
+            use std::arch::x86_64::{__cpuid_count, __get_cpuid_max};
+            const PKU_OSPKE: u32 = 1 << 3 | 1 << 4;
+            unsafe { __get_cpuid_max(0).0 >= 7 && __cpuid_count(7, 0).ecx & PKU_OSPKE == PKU_OSPKE }
+        }
+    } else if #[cfg(all(target_arch = "aarch64", target_os = "linux"))] {
+        /// HWCAP2_POE, the permission overlay POR_EL0 belongs to.
+        fn probe() -> bool {
+            rustix::param::linux_hwcap().1 & (1 << 63) != 0
+        }
+    } else {
+        fn probe() -> bool {
+            false
+        }
+    }
+}
@@ -61,3 +61,31 @@ fn debug_name(module: &CompiledModule, index: DefinedFuncIndex) -> String {
         .unwrap();
     debug_name
 }
+
+/// The PKRU writes compiled into function `index`, whose code starts at
+/// `addr`, as `(name, address, length)` symbols. A write entering a known
+/// domain is named `pku_switch_<domain>` and one of a runtime value, such as
+/// the restore on return, `pku_switch`.
+///
+/// Agents report these after the function itself: profilers resolve an
+/// address to the most recently loaded code covering it, so samples on the
+/// switches are attributed apart from the function body.
+#[allow(dead_code)]
+fn domain_switches(
+    module: &CompiledModule,
+    index: DefinedFuncIndex,
+    addr: *const u8,
+) -> impl Iterator<Item = (String, *const u8, usize)> + '_ {
+    module
+        .func_info(index)
+        .domain_switches
+        .iter()
+        .map(move |switch| {
+            let name = match switch.domain {
+                Some(domain) => format!("pku_switch_{}", domain),
+                None => "pku_switch".to_string(),
+            };
+            let addr = addr.wrapping_add(switch.offset as usize);
+            (name, addr, switch.length as usize)
+        })
+}
@@ -10,6 +10,10 @@
 //!     Report
 //!         sudo perf report -i perf.jit.data -F+period,srcline
 //! Note: For descriptive results, the WASM file being executed should contain dwarf debug data
+//!
+//! PKRU writes compiled into functions are loaded as symbols of their own,
+//! `pku_switch_<domain>` for entering a domain and `pku_switch` for restoring
+//! a saved value, so `perf report` lists switch cost apart from the functions.
 
 use crate::{CompiledModule, ProfilingAgent};
 use anyhow::Result;
@@ -101,6 +105,16 @@ impl State {
                     println!("Jitdump: write_code_load_failed_record failed: {:?}\n", err);
                 }
             }
+
+            for (name, addr, len) in super::domain_switches(module, idx, addr) {
+                let timestamp = self.jitdump_file.get_time_stamp();
+                if let Err(err) = self
+                    .jitdump_file
+                    .dump_code_load_record(&name, addr, len, timestamp, pid, tid)
+                {
+                    println!("Jitdump: write_code_load_failed_record failed: {:?}\n", err);
+                }
+            }
         }
 
         // Note: these are the trampolines into exported functions.
@@ -102,6 +102,10 @@ impl State {
                 addr
             );
             self.notify_code(&module_name, &method_name, addr, len);
+
+            for (name, addr, len) in super::domain_switches(module, idx, addr) {
+                self.notify_code(&module_name, &name, addr, len);
+            }
         }
 
         // Note: these are the trampolines into exported functions.
@@ -27,6 +27,10 @@ pub struct ExportFunction {
     /// Note that exported functions cannot be a null funcref, so this is a
     /// non-null pointer.
     pub anyfunc: NonNull<VMCallerCheckedAnyfunc>,
+
+    /// The PKRU word of the function's domain, if its module assigned it
+    /// one. Calls from the host switch to it around the call.
+    pub pkru: Option<u32>,
 }
 
 // It's part of the contract of using `ExportFunction` that synchronization
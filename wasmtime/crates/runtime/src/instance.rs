@@ -5,6 +5,7 @@
 use crate::export::Export;
 use crate::externref::VMExternRefActivationsTable;
 use crate::memory::{Memory, RuntimeMemoryCreator};
+use crate::pku::{PkeyRange, Pku, PkuState};
 use crate::table::{Table, TableElement, TableElementType};
 use crate::vmcontext::{
     VMBuiltinFunctionsArray, VMCallerCheckedAnyfunc, VMContext, VMFunctionImport,
@@ -90,6 +91,9 @@ pub(crate) struct Instance {
     /// allocation, but some host-defined objects will store their state here.
     host_state: Box<dyn Any + Send + Sync>,
 
+    /// Protection-key state of this instance's linear memory.
+    pku: PkuState,
+
     /// Additional context used by compiled wasm code. This field is last, and
     /// represents a dynamically-sized array that extends beyond the nominal
     /// end of the struct (similar to a flexible array member).
@@ -127,6 +131,7 @@ impl Instance {
                 dropped_elements,
                 dropped_data,
                 host_state: req.host_state,
+                pku: PkuState::default(),
                 vmctx: VMContext {
                     _marker: std::marker::PhantomPinned,
                 },
@@ -310,7 +315,12 @@ impl Instance {
     fn get_exported_func(&mut self, index: FuncIndex) -> ExportFunction {
         let anyfunc = self.get_caller_checked_anyfunc(index).unwrap();
         let anyfunc = NonNull::new(anyfunc as *const VMCallerCheckedAnyfunc as *mut _).unwrap();
-        ExportFunction { anyfunc }
+        let pkru = self
+            .module()
+            .function_domains
+            .get(&index)
+            .and_then(|domain| Pku::domain_word(*domain));
+        ExportFunction { anyfunc, pkru }
     }
 
     fn get_exported_table(&mut self, index: TableIndex) -> ExportTable {
@@ -389,6 +399,17 @@ impl Instance {
         index
     }
 
+    /// Reset the tags a pooled slot's previous instance left and this one
+    /// did not claim again, see `PkuState::settle`. Called before the host
+    /// enters one of the instance's domains.
+    pub(crate) fn settle_domains(&mut self) {
+        if self.pku.is_settled() {
+            return;
+        }
+        let vm = self.get_memory(MemoryIndex::new(0));
+        unsafe { self.pku.settle(&vm) };
+    }
+
     /// Grow memory by the specified amount of pages.
     ///
     /// Returns `None` if memory can't be grown by the specified amount
@@ -399,30 +420,128 @@ impl Instance {
         index: MemoryIndex,
         delta: u64,
     ) -> Result<Option<usize>, Error> {
-        let (idx, instance) = if let Some(idx) = self.module().defined_memory_index(index) {
-            (idx, self)
+        self.memory_grow_with(index, |memory, store| unsafe {
+            memory.grow(delta, Some(store))
+        })
+    }
+
+    /// Grow memory by the specified amount of pages and tag the new pages
+    /// with `pkey` in the same operation.
+    ///
+    /// Returns the same as `memory_grow`, or an error if tagging failed.
+    pub(crate) fn memory_grow_tagged(
+        &mut self,
+        index: MemoryIndex,
+        delta: u64,
+        prot: u32,
+        pkey: u32,
+    ) -> Result<Option<usize>, Error> {
+        let result = self.memory_grow_with(index, |memory, store| unsafe {
+            memory.grow_tagged(delta, prot, pkey, Some(store))
+        });
+        if let (Ok(Some(old)), 0) = (&result, index.index()) {
+            let new = self.get_memory(index).current_length();
+            self.pku.record(PkeyRange {
+                offset: *old,
+                len: new - *old,
+                prot,
+                pkey,
+            });
+        }
+        result
+    }
+
+    fn memory_grow_with(
+        &mut self,
+        index: MemoryIndex,
+        grow: impl FnOnce(&mut Memory, &mut dyn Store) -> Result<Option<usize>, Error>,
+    ) -> Result<Option<usize>, Error> {
+        // Growing is a natural host boundary, so apply any protection
+        // commands the guest has queued against its first memory before that
+        // memory may move, and let retired pages be scrubbed before new
+        // ones are made accessible or the old ones unmapped.
+        let pku_base = if index.index() == 0 && self.pku.is_active() {
+            self.pku.await_retired(0, usize::MAX);
+            let vmmemory = self.get_memory(index);
+            unsafe { self.pku.drain_queue(&vmmemory) };
+            Some(vmmemory.base)
         } else {
-            let import = self.imported_memory(index);
-            unsafe {
-                let foreign_instance = (*import.vmctx).instance_mut();
-                (import.index, foreign_instance)
-            }
+            None
         };
-        let store = unsafe { &mut *instance.store() };
-        let memory = &mut instance.memories[idx];
 
-        let result = unsafe { memory.grow(delta, Some(store)) };
+        let result = {
+            let (idx, instance) = if let Some(idx) = self.module().defined_memory_index(index) {
+                (idx, &mut *self)
+            } else {
+                let import = self.imported_memory(index);
+                unsafe {
+                    let foreign_instance = (*import.vmctx).instance_mut();
+                    (import.index, foreign_instance)
+                }
+            };
+            let store = unsafe { &mut *instance.store() };
+            let module = instance.module();
+            let domain = module
+                .memory_domains
+                .get(&module.memory_index(idx))
+                .copied();
+            let memory = &mut instance.memories[idx];
+            let reserved = domain.map(|_| (memory.vmmemory().base, memory.reserved_byte_size()));
+
+            let result = grow(memory, store);
+
+            // Update the state used by a non-shared Wasm memory in case the base
+            // pointer and/or the length changed.
+            if memory.as_shared_memory().is_none() {
+                let vmmemory = memory.vmmemory();
+                instance.set_memory(idx, vmmemory);
+            }
+
+            // A domain's memory keeps its key when it grows within its
+            // reservation; a moved or extended reservation is tagged anew.
+            match (domain, reserved, result) {
+                (Some(pkey), Some((base, reserved)), Ok(Some(old))) => {
+                    let vmmemory = instance.memories[idx].vmmemory();
+                    if vmmemory.base != base || vmmemory.current_length() > reserved {
+                        let ret = instance.tag_domain_memory(idx, pkey);
+                        if ret != 0 {
+                            return Err(anyhow::anyhow!(
+                                "failed to tag grown memory with pkey {}: {}",
+                                pkey,
+                                std::io::Error::from_raw_os_error(-ret)
+                            ));
+                        }
+                    }
+                    Ok(Some(old))
+                }
+                (_, _, result) => result,
+            }
+        };
 
-        // Update the state used by a non-shared Wasm memory in case the base
-        // pointer and/or the length changed.
-        if memory.as_shared_memory().is_none() {
-            let vmmemory = memory.vmmemory();
-            instance.set_memory(idx, vmmemory);
+        // A moving grow hands out fresh pages under the default key, so
+        // restore the recorded layout at the new base.
+        if let (Some(old_base), Ok(Some(_))) = (pku_base, &result) {
+            let vmmemory = self.get_memory(index);
+            if vmmemory.base != old_base {
+                unsafe { self.pku.reapply(&vmmemory) };
+            }
         }
 
         result
     }
 
+    /// Tag the whole reservation of defined memory `index` with `pkey`, for a
+    /// memory `pkuwa.memories` dedicates to a domain. Returns 0, or a
+    /// negated errno.
+    pub(crate) fn tag_domain_memory(&mut self, index: DefinedMemoryIndex, pkey: u32) -> i32 {
+        let memory = &mut self.memories[index];
+        let reserved = memory.reserved_byte_size();
+        let vmmemory = memory.vmmemory();
+        unsafe {
+            Pku::pkey_mprotect_reservation(vmmemory.base, vmmemory.current_length(), reserved, pkey)
+        }
+    }
+
     pub(crate) fn table_element_type(&mut self, table_index: TableIndex) -> TableElementType {
         unsafe { (*self.get_table(table_index)).element_type() }
     }
@@ -1127,6 +1246,30 @@ impl InstanceHandle {
         self.instance().host_state()
     }
 
+    /// Return the protection-key state of this instance.
+    pub fn pku_state(&mut self) -> &mut PkuState {
+        &mut self.instance_mut().pku
+    }
+
+    /// Grow memory `index` by `delta` pages, keeping this instance's
+    /// protection-key layout in place if the memory moves.
+    pub fn memory_grow(&mut self, index: MemoryIndex, delta: u64) -> Result<Option<usize>, Error> {
+        self.instance_mut().memory_grow(index, delta)
+    }
+
+    /// Grow memory `index` by `delta` pages and tag the new pages with
+    /// `pkey`, see `Memory::grow_tagged`.
+    pub fn memory_grow_tagged(
+        &mut self,
+        index: MemoryIndex,
+        delta: u64,
+        prot: u32,
+        pkey: u32,
+    ) -> Result<Option<usize>, Error> {
+        self.instance_mut()
+            .memory_grow_tagged(index, delta, prot, pkey)
+    }
+
     /// Get a memory defined locally within this module.
     pub fn get_defined_memory(&mut self, index: DefinedMemoryIndex) -> *mut Memory {
         self.instance_mut().get_defined_memory(index)
@@ -1,6 +1,7 @@
 use crate::imports::Imports;
 use crate::instance::{Instance, InstanceHandle, RuntimeMemoryCreator};
 use crate::memory::{DefaultMemoryCreator, Memory};
+use crate::pku::{PkeyRange, Pku};
 use crate::table::Table;
 use crate::ModuleRuntimeInfo;
 use crate::Store;
@@ -12,9 +13,9 @@ use std::ptr;
 use std::sync::Arc;
 use thiserror::Error;
 use wasmtime_environ::{
-    DefinedMemoryIndex, DefinedTableIndex, HostPtr, InitMemory, MemoryInitialization,
-    MemoryInitializer, Module, PrimaryMap, TableInitialization, TableInitializer, TrapCode,
-    VMOffsets, WasmType, WASM_PAGE_SIZE,
+    DefinedMemoryIndex, DefinedTableIndex, EntityRef, HostPtr, InitMemory, MemoryIndex,
+    MemoryInitialization, MemoryInitializer, Module, PrimaryMap, TableInitialization,
+    TableInitializer, TrapCode, VMOffsets, WasmType, WASM_PAGE_SIZE,
 };
 
 #[cfg(feature = "pooling-allocator")]
@@ -422,6 +423,71 @@ fn initialize_instance(
     // Initialize the memories
     initialize_memories(instance, &module)?;
 
+    initialize_domains(instance, module)?;
+
+    Ok(())
+}
+
+/// Claims the keys of the domains laid out by `pkuwa.layout` and
+/// `pkuwa.memories`, tags the ranges of the first memory and the whole of
+/// each dedicated memory. The layout was sorted and merged when the module
+/// was compiled, so each range costs exactly one `pkey_mprotect`.
+fn initialize_domains(instance: &mut Instance, module: &Module) -> Result<(), InstantiationError> {
+    // Keys named only by `pkuwa.domains` are switched to by the compiled
+    // prologues just the same, so they are claimed even without a layout.
+    for domain in module.domain_pkru.keys() {
+        let ret = Pku::reserve_pkey(*domain);
+        if ret != 0 {
+            return Err(InstantiationError::Resource(anyhow::anyhow!(
+                "failed to claim protection key {}: {}",
+                domain,
+                std::io::Error::from_raw_os_error(-ret)
+            )));
+        }
+    }
+    if module.domain_layout.is_empty() && module.memory_domains.is_empty() {
+        return Ok(());
+    }
+
+    for (index, domain) in module.memory_domains.iter() {
+        let defined = module.defined_memory_index(*index).unwrap();
+        let ret = instance.tag_domain_memory(defined, *domain);
+        if ret != 0 {
+            return Err(InstantiationError::Resource(anyhow::anyhow!(
+                "failed to tag memory {} with protection key {}: {}",
+                index.as_u32(),
+                domain,
+                std::io::Error::from_raw_os_error(-ret)
+            )));
+        }
+    }
+    if module.domain_layout.is_empty() {
+        return Ok(());
+    }
+
+    let vm = instance.get_memory(MemoryIndex::new(0));
+    let prot = (libc::PROT_READ | libc::PROT_WRITE) as u32;
+    let ranges = module
+        .domain_layout
+        .iter()
+        .map(|r| PkeyRange {
+            offset: r.offset as usize,
+            len: r.len as usize,
+            prot,
+            pkey: r.domain,
+        })
+        .collect::<Vec<_>>();
+    if ranges.last().unwrap().end() > vm.current_length() {
+        return Err(InstantiationError::Trap(TrapCode::HeapOutOfBounds));
+    }
+
+    let ret = unsafe { instance.pku.protect_ranges(&vm, &ranges) };
+    if ret != 0 {
+        return Err(InstantiationError::Resource(anyhow::anyhow!(
+            "failed to tag domain ranges: {}",
+            std::io::Error::from_raw_os_error(-ret)
+        )));
+    }
     Ok(())
 }
 
@@ -540,6 +606,9 @@ pub unsafe fn allocate_single_memory_instance(
 /// See [`InstanceAllocator::deallocate()`] for more details.
 pub unsafe fn deallocate(handle: &InstanceHandle) {
     let layout = Instance::alloc_layout(&handle.instance().offsets);
+    // Memories are unmapped before the PKU state drops, so the scrubber
+    // must be done with their pages first.
+    (*handle.instance).pku.await_retired(0, usize::MAX);
     ptr::drop_in_place(handle.instance);
     alloc::dealloc(handle.instance.cast(), layout);
 }
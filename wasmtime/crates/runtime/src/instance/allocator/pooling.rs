@@ -12,7 +12,7 @@ use super::{
     InstantiationError,
 };
 use crate::{instance::Instance, Memory, Mmap, Table};
-use crate::{MemoryImageSlot, ModuleRuntimeInfo, Store};
+use crate::{CompiledModuleId, DomainMap, MemoryImageSlot, ModuleRuntimeInfo, PkuState, Store};
 use anyhow::{anyhow, bail, Context, Result};
 use libc::c_void;
 use std::convert::TryFrom;
@@ -253,6 +253,8 @@ impl InstancePool {
         req: InstanceAllocationRequest,
     ) -> Result<InstanceHandle, InstantiationError> {
         let module = req.runtime_info.module();
+        let module_id = req.runtime_info.unique_id();
+        let owns_memory = module.num_imported_memories == 0;
 
         // Before doing anything else ensure that our instance slot is actually
         // big enough to hold the `Instance` and `VMContext` for this instance.
@@ -293,6 +295,24 @@ impl InstancePool {
             tables,
         );
 
+        // The slot's first memory may still carry the protection keys its
+        // previous instance applied. A new instance of the same module will
+        // most likely request the same layout again, so let it inherit the
+        // tags and only pay for the difference; anything else starts clean.
+        let instance = &mut *instance_ptr;
+        if let Some((previous_id, layout)) = self.memories.take_pkey_layout(instance_index) {
+            if let Some(memory) = instance.memories.get_mut(DefinedMemoryIndex::from_u32(0)) {
+                let vm = memory.vmmemory();
+                if owns_memory && previous_id.is_some() && previous_id == module_id {
+                    instance.pku.inherit(&vm, layout);
+                } else {
+                    let mut previous = PkuState::default();
+                    previous.inherit(&vm, layout);
+                    previous.settle(&vm);
+                }
+            }
+        }
+
         Ok(InstanceHandle {
             instance: instance_ptr,
         })
@@ -333,11 +353,27 @@ impl InstancePool {
         assert!(index < self.max_instances);
 
         let instance = unsafe { &mut *handle.instance };
+        let layout = instance.pku.take_layout();
+        // Dedicated domain memories go back to the default key, their slots
+        // may serve any memory next.
+        let module = instance.module().clone();
+        for index in module.memory_domains.keys() {
+            let defined = module.defined_memory_index(*index).unwrap();
+            instance.tag_domain_memory(defined, 0);
+        }
+        let module_id = instance.runtime_info.unique_id();
+        let owns_memory = instance.module().num_imported_memories == 0;
 
         // Deallocate any resources used by the instance
-        self.deallocate_memories(index, &mut instance.memories);
+        let mappings_kept = self.deallocate_memories(index, &mut instance.memories);
         self.deallocate_tables(index, &mut instance.tables);
 
+        // Remember which keys the slot's pages still carry, see
+        // `initialize_instance`.
+        if mappings_kept && owns_memory && !layout.is_empty() {
+            self.memories.return_pkey_layout(index, module_id, layout);
+        }
+
         // We've now done all of the pooling-allocator-specific
         // teardown, so we can drop the Instance and let destructors
         // take care of any other fields (host state, globals, etc.).
@@ -437,12 +473,15 @@ impl InstancePool {
         Ok(())
     }
 
+    /// Returns whether every memory kept its mapping, and with it the
+    /// protection keys on its pages.
     fn deallocate_memories(
         &self,
         instance_index: usize,
         memories: &mut PrimaryMap<DefinedMemoryIndex, Memory>,
-    ) {
+    ) -> bool {
         // Decommit any linear memories that were used.
+        let mut mappings_kept = true;
         let memories = mem::take(memories);
         for ((def_mem_idx, mut memory), base) in
             memories.into_iter().zip(self.memories.get(instance_index))
@@ -457,12 +496,15 @@ impl InstancePool {
                 if image.clear_and_remain_ready().is_ok() {
                     self.memories
                         .return_memory_image_slot(instance_index, def_mem_idx, image);
+                } else {
+                    mappings_kept = false;
                 }
             } else {
                 // Otherwise, decommit the memory pages.
                 decommit_memory_pages(base, size).expect("failed to decommit linear memory pages");
             }
         }
+        mappings_kept
     }
 
     fn allocate_tables(
@@ -645,6 +687,9 @@ struct MemoryPool {
     // dynamically transfer ownership of a slot to a Memory when in
     // use.
     image_slots: Vec<Mutex<Option<MemoryImageSlot>>>,
+    // The protection keys left on each instance slot's first memory by its
+    // last instance, along with the module that instance ran.
+    pkey_layouts: Vec<Mutex<Option<(Option<CompiledModuleId>, DomainMap)>>>,
     // The size, in bytes, of each linear memory's reservation plus the guard
     // region allocated for it.
     memory_reservation_size: usize,
@@ -736,9 +781,14 @@ impl MemoryPool {
             .take(num_image_slots)
             .collect();
 
+        let pkey_layouts: Vec<_> = std::iter::repeat_with(|| Mutex::new(None))
+            .take(max_instances)
+            .collect();
+
         let pool = Self {
             mapping,
             image_slots,
+            pkey_layouts,
             memory_reservation_size: memory_size,
             initial_memory_offset,
             max_memories,
@@ -793,6 +843,25 @@ impl MemoryPool {
         let idx = instance_index * self.max_memories + (memory_index.as_u32() as usize);
         *self.image_slots[idx].lock().unwrap() = Some(slot);
     }
+
+    /// Take the protection-key layout left on the slot's first memory.
+    fn take_pkey_layout(
+        &self,
+        instance_index: usize,
+    ) -> Option<(Option<CompiledModuleId>, DomainMap)> {
+        self.pkey_layouts[instance_index].lock().unwrap().take()
+    }
+
+    /// Record the layout left on the slot's first memory by an instance of
+    /// `module_id`.
+    fn return_pkey_layout(
+        &self,
+        instance_index: usize,
+        module_id: Option<CompiledModuleId>,
+        layout: DomainMap,
+    ) {
+        *self.pkey_layouts[instance_index].lock().unwrap() = Some((module_id, layout));
+    }
 }
 
 impl Drop for MemoryPool {
@@ -65,10 +65,10 @@ pub use crate::memory::{
 pub use crate::mmap::Mmap;
 pub use crate::mmap_vec::MmapVec;
 pub use crate::table::{Table, TableElement};
-pub use crate::trampolines::prepare_host_to_wasm_trampoline;
+pub use crate::trampolines::{prepare_host_to_wasm_trampoline, DomainEntry};
 pub use crate::traphandlers::{
     catch_traps, init_traps, raise_lib_trap, raise_user_trap, resume_panic, tls_eager_initialize,
-    Backtrace, SignalHandler, TlsRestore, Trap, TrapReason,
+    Backtrace, PkuProfiler, PkuSample, PkuSwitch, SignalHandler, TlsRestore, Trap, TrapReason,
 };
 pub use crate::vmcontext::{
     VMCallerCheckedAnyfunc, VMContext, VMFunctionBody, VMFunctionImport, VMGlobalDefinition,
@@ -76,7 +76,10 @@ pub use crate::vmcontext::{
     VMOpaqueContext, VMRuntimeLimits, VMSharedSignatureIndex, VMTableDefinition, VMTableImport,
     VMTrampoline, ValRaw,
 };
-pub use crate::pku::Pku;
+pub use crate::pku::{
+    DomainClock, DomainMap, PkeyLease, PkeyRange, Pku, PkuCounters, PkuHeapStats, PkuHostStats,
+    PkuQueue, PkuState,
+};
 
 mod module_id;
 pub use module_id::{CompiledModuleId, CompiledModuleIdAllocator};
@@ -158,6 +161,9 @@ pub unsafe trait Store {
     /// number. Cannot fail; cooperative epoch-based yielding is
     /// completely semantically transparent. Returns the new deadline.
     fn new_epoch(&mut self) -> Result<u64, Error>;
+    /// Callback invoked after compiled code wrote `pkru`, when modules are
+    /// compiled to account the time domains run for.
+    fn pku_domain_switch(&mut self, pkru: u32);
 }
 
 /// Functionality required by this crate for a particular module. This
@@ -512,3 +512,8 @@ unsafe fn out_of_gas(vmctx: *mut VMContext) -> Result<()> {
 unsafe fn new_epoch(vmctx: *mut VMContext) -> Result<u64> {
     (*(*vmctx).instance().store()).new_epoch()
 }
+
+// Hook for when compiled code has switched domains.
+unsafe fn pku_domain_switch(vmctx: *mut VMContext, pkru: u32) {
+    (*(*vmctx).instance().store()).pku_domain_switch(pkru)
+}
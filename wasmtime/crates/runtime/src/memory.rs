@@ -3,6 +3,7 @@
 //! `RuntimeLinearMemory` is to WebAssembly linear memories what `Table` is to WebAssembly tables.
 
 use crate::mmap::Mmap;
+use crate::pku::Pku;
 use crate::vmcontext::VMMemoryDefinition;
 use crate::MemoryImage;
 use crate::MemoryImageSlot;
@@ -150,6 +151,14 @@ pub trait RuntimeLinearMemory: Send + Sync {
     /// `RuntimeMemoryCreator::new_memory()`.
     fn needs_init(&self) -> bool;
 
+    /// Returns the number of bytes from the base that stay mapped at this
+    /// address however far the memory grows in place, guard pages included.
+    /// Protection keys applied to all of them carry over to the pages such a
+    /// grow makes accessible.
+    fn reserved_byte_size(&self) -> usize {
+        self.byte_size()
+    }
+
     /// For the pooling allocator, we must be able to downcast this trait to its
     /// underlying structure.
     fn as_any_mut(&mut self) -> &mut dyn std::any::Any;
@@ -336,6 +345,10 @@ impl RuntimeLinearMemory for MmapMemory {
         self.memory_image.is_none()
     }
 
+    fn reserved_byte_size(&self) -> usize {
+        self.mmap.len() - self.pre_guard_size
+    }
+
     fn as_any_mut(&mut self) -> &mut dyn std::any::Any {
         self
     }
@@ -441,6 +454,10 @@ impl RuntimeLinearMemory for StaticMemory {
         }
     }
 
+    fn reserved_byte_size(&self) -> usize {
+        self.base.len()
+    }
+
     fn needs_init(&self) -> bool {
         if let Some(slot) = &self.memory_image {
             !slot.has_image()
@@ -597,6 +614,10 @@ impl RuntimeLinearMemory for SharedMemory {
         self.0.read().unwrap().memory.needs_init()
     }
 
+    fn reserved_byte_size(&self) -> usize {
+        self.0.read().unwrap().memory.reserved_byte_size()
+    }
+
     fn as_any_mut(&mut self) -> &mut dyn std::any::Any {
         self
     }
@@ -745,6 +766,12 @@ impl Memory {
         self.0.byte_size()
     }
 
+    /// Returns the number of bytes reserved at the memory's base, see
+    /// `RuntimeLinearMemory::reserved_byte_size`.
+    pub fn reserved_byte_size(&self) -> usize {
+        self.0.reserved_byte_size()
+    }
+
     /// Returns the maximum number of pages the memory can grow to at runtime.
     ///
     /// Returns `None` if the memory is unbounded.
@@ -789,6 +816,42 @@ impl Memory {
             .map(|opt| opt.map(|(old, _new)| old))
     }
 
+    /// Grow memory by the specified amount of wasm pages and tag the new
+    /// pages with `pkey` before returning.
+    ///
+    /// This is `grow` followed by `pkey_mprotect` of the added bytes with no
+    /// guest code able to run in between, so the new pages are never
+    /// observable under the default key. Returns the same as `grow`, or an
+    /// error if the pages could not be tagged.
+    ///
+    /// # Safety
+    ///
+    /// Same as `grow`.
+    pub unsafe fn grow_tagged(
+        &mut self,
+        delta_pages: u64,
+        prot: u32,
+        pkey: u32,
+        store: Option<&mut dyn Store>,
+    ) -> Result<Option<usize>, Error> {
+        let (old, new) = match self.0.grow(delta_pages, store)? {
+            Some(sizes) => sizes,
+            None => return Ok(None),
+        };
+        if new > old {
+            let base = self.0.vmmemory().base;
+            let err = Pku::pkey_mprotect_raw(base.add(old), new - old, prot, pkey);
+            if err != 0 {
+                bail!(
+                    "failed to tag grown memory with pkey {}: {}",
+                    pkey,
+                    std::io::Error::from_raw_os_error(-err)
+                );
+            }
+        }
+        Ok(Some(old))
+    }
+
     /// Return a `VMMemoryDefinition` for exposing the memory to compiled wasm code.
     pub fn vmmemory(&mut self) -> VMMemoryDefinition {
         self.0.vmmemory()
@@ -1,13 +1,1433 @@
 //! Memory isolation of pku
 
 use crate::vmcontext::VMMemoryDefinition;
-use libc::{self, SYS_pkey_alloc, SYS_pkey_mprotect};
+use libc::{self, SYS_pkey_alloc, SYS_pkey_free, SYS_pkey_mprotect};
+#[cfg(any(target_arch = "x86_64", target_arch = "aarch64"))]
 use std::arch::asm;
+use std::cell::Cell;
+use std::collections::BTreeMap;
+use std::sync::atomic::{AtomicU32, AtomicU64, Ordering};
+use std::sync::mpsc::{self, Sender};
+use std::sync::{Arc, Condvar, Mutex};
+
+// Shared with `wasmtime-fiber`, which the runtime only depends on for async.
+#[path = "../../fiber/src/pkru_probe.rs"]
+mod probe;
+
+/// Process-wide pool of protection keys, handed out as [`PkeyLease`]s.
+///
+/// Keys are taken from the kernel one at a time as leases need them and
+/// given back once their last lease is dropped, so the process keeps no
+/// more keys than it uses. Once the kernel has none left, new leases share the pooled key with the
+/// fewest holders, so one process can serve far more isolated stores and
+/// instances than it has keys. Holders of a key must never be active on
+/// the same thread at once, which [`PkeyLease::enter`] checks.
+struct PkeyBroker {
+    /// Keys taken from the kernel for leases.
+    owned: u16,
+    /// Keys claimed by `Pku::reserve_pkey`, shared by every instance in the
+    /// process and never leased.
+    reserved: u16,
+    /// Live leases of each key.
+    holders: [u32; 16],
+    /// Identity of the next lease.
+    next_id: u64,
+}
+
+static BROKER: Mutex<PkeyBroker> = Mutex::new(PkeyBroker {
+    owned: 0,
+    reserved: 0,
+    holders: [0; 16],
+    next_id: 1,
+});
+
+thread_local! {
+    /// The lease active on each key on this thread, and how often it was
+    /// entered.
+    static ACTIVE: Cell<[(u64, u32); 16]> = Cell::new([(0, 0); 16]);
+}
+
+impl PkeyBroker {
+    /// Pick a key outside `exclude` for a new lease: a fresh one from the
+    /// kernel, else the least shared key already leased.
+    fn lease(&mut self, exclude: u16) -> Result<u32, i32> {
+        let pkey = match self.alloc(exclude) {
+            Ok(pkey) => pkey,
+            Err(err) => {
+                let allowed = self.owned & !exclude;
+                match (1..16)
+                    .rev()
+                    .filter(|k| allowed & (1 << k) != 0)
+                    .min_by_key(|k| self.holders[*k as usize])
+                {
+                    Some(pkey) => pkey,
+                    None => return Err(err),
+                }
+            }
+        };
+        self.holders[pkey as usize] += 1;
+        Ok(pkey)
+    }
+
+    /// Take keys from the kernel until one lies outside `exclude`, and give
+    /// back the ones that didn't.
+    fn alloc(&mut self, exclude: u16) -> Result<u32, i32> {
+        let mut skipped = 0u16;
+        let pkey = loop {
+            let key = Pku::pkey_alloc(0, 0);
+            if key < 0 {
+                break Err(key);
+            }
+            if exclude & (1 << key) != 0 {
+                skipped |= 1 << key;
+                continue;
+            }
+            self.owned |= 1 << key;
+            break Ok(key as u32);
+        };
+        for key in (0..16).filter(|k| skipped & (1 << k) != 0) {
+            Pku::pkey_free(key);
+        }
+        pkey
+    }
+
+    /// Drop one lease of `pkey`, and give the key back to the kernel with
+    /// its last.
+    fn release(&mut self, pkey: u32) {
+        self.holders[pkey as usize] -= 1;
+        if self.holders[pkey as usize] == 0 && self.owned & (1 << pkey) != 0 {
+            self.owned &= !(1 << pkey);
+            Pku::pkey_free(pkey);
+        }
+    }
+}
+
+/// A protection key leased from the process-wide broker, returned to the
+/// pool when dropped.
+///
+/// The key may be shared with leases of other stores or instances. It is
+/// only valid to open while this lease is [entered](PkeyLease::enter) on the
+/// current thread.
+#[derive(Debug)]
+pub struct PkeyLease {
+    pkey: u32,
+    id: u64,
+}
+
+impl PkeyLease {
+    /// Lease a key outside `exclude`, a mask of keys, and outside the keys
+    /// leases are active on on this thread. Returns a negated errno,
+    /// `ENOSPC` once every usable key is excluded.
+    pub fn new(exclude: u16) -> Result<PkeyLease, i32> {
+        let mut broker = BROKER.lock().unwrap();
+        let pkey = broker.lease(exclude | Self::active_keys() | 1)?;
+        let id = broker.next_id;
+        broker.next_id += 1;
+        Ok(PkeyLease { pkey, id })
+    }
+
+    /// The leased key.
+    pub fn pkey(&self) -> u32 {
+        self.pkey
+    }
+
+    /// The mask of keys some lease is entered on on this thread.
+    pub fn active_keys() -> u16 {
+        ACTIVE.with(|active| {
+            let active = active.get();
+            (0..16)
+                .filter(|k| active[*k].1 != 0)
+                .fold(0, |m, k| m | 1 << k)
+        })
+    }
+
+    /// Mark the lease active on this thread; entering again nests. Returns
+    /// false, changing nothing, while another lease of the same key is
+    /// active on this thread.
+    pub fn enter(&self) -> bool {
+        ACTIVE.with(|active| {
+            let mut keys = active.get();
+            let slot = &mut keys[self.pkey as usize];
+            if slot.1 != 0 && slot.0 != self.id {
+                return false;
+            }
+            *slot = (self.id, slot.1 + 1);
+            active.set(keys);
+            true
+        })
+    }
+
+    /// Undo one `enter`.
+    pub fn exit(&self) {
+        ACTIVE.with(|active| {
+            let mut keys = active.get();
+            let slot = &mut keys[self.pkey as usize];
+            if slot.0 == self.id && slot.1 != 0 {
+                slot.1 -= 1;
+                active.set(keys);
+            }
+        })
+    }
+
+    /// Move the lease to another key outside `exclude`, returning the old
+    /// key. Memory tagged with the old key has to be re-tagged by the
+    /// caller, see [`PkuState::rekey`]. The lease must not be entered.
+    pub fn rekey(&mut self, exclude: u16) -> Result<u32, i32> {
+        let mut broker = BROKER.lock().unwrap();
+        let pkey = broker.lease(exclude | Self::active_keys() | 1 | 1 << self.pkey)?;
+        broker.release(self.pkey);
+        Ok(std::mem::replace(&mut self.pkey, pkey))
+    }
+}
+
+impl Drop for PkeyLease {
+    fn drop(&mut self) {
+        self.exit();
+        BROKER.lock().unwrap().release(self.pkey);
+    }
+}
+
+/// Completion flag of one batch of pages handed to the scrubber.
+#[derive(Debug, Default)]
+struct Scrub {
+    done: Mutex<bool>,
+    finished: Condvar,
+}
+
+impl Scrub {
+    fn wait(&self) {
+        let mut done = self.done.lock().unwrap();
+        while !*done {
+            done = self.finished.wait(done).unwrap();
+        }
+    }
+
+    fn is_done(&self) -> bool {
+        *self.done.lock().unwrap()
+    }
+}
+
+/// Pages of a retired key for the scrubber: host address, length and
+/// `PROT_*` flags of each range, and the lease that keeps the key out of
+/// the pool until they no longer carry it.
+struct ScrubJob {
+    ranges: Vec<(usize, usize, u32)>,
+    lease: Option<Arc<PkeyLease>>,
+    scrub: Arc<Scrub>,
+}
+
+impl ScrubJob {
+    /// Hand the pages back to the kernel, tag them with the default key and
+    /// only then let go of the lease. Failures leave nothing to undo, the
+    /// key is never opened for these pages again.
+    fn run(self) {
+        for (addr, len, prot) in self.ranges {
+            unsafe {
+                libc::madvise(addr as *mut libc::c_void, len, libc::MADV_DONTNEED);
+                Pku::pkey_mprotect_raw(addr as *mut u8, len, prot, 0);
+            }
+        }
+        drop(self.lease);
+        *self.scrub.done.lock().unwrap() = true;
+        self.scrub.finished.notify_all();
+    }
+}
+
+/// The background thread retired keys are scrubbed on, started with the
+/// first job.
+static SCRUBBER: Mutex<Option<Sender<ScrubJob>>> = Mutex::new(None);
+
+/// Queue `job` for the scrubber, or run it right away if no thread can be
+/// started.
+fn scrub_later(job: ScrubJob) {
+    let mut scrubber = SCRUBBER.lock().unwrap();
+    if scrubber.is_none() {
+        let (tx, rx) = mpsc::channel::<ScrubJob>();
+        let spawned = std::thread::Builder::new()
+            .name("pku-scrubber".into())
+            .spawn(move || rx.into_iter().for_each(ScrubJob::run));
+        if spawned.is_ok() {
+            *scrubber = Some(tx);
+        }
+    }
+    let job = match scrubber.as_ref() {
+        Some(tx) => match tx.send(job) {
+            Ok(()) => return,
+            Err(mpsc::SendError(job)) => job,
+        },
+        None => job,
+    };
+    drop(scrubber);
+    job.run();
+}
 
 /// A simple struct of pku
 #[derive(Debug)]
 pub struct Pku {}
 
+/// A range of linear memory to be tagged with a protection key.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct PkeyRange {
+    /// Offset of the range from the memory base.
+    pub offset: usize,
+    /// Length of the range in bytes.
+    pub len: usize,
+    /// `PROT_*` flags to apply along with the key.
+    pub prot: u32,
+    /// The protection key.
+    pub pkey: u32,
+}
+
+impl PkeyRange {
+    /// Size of a range descriptor in guest memory: three little-endian `u32`s
+    /// holding the address, length and key.
+    pub const DESCRIPTOR_SIZE: usize = 12;
+
+    /// One past the last byte of the range.
+    pub fn end(&self) -> usize {
+        self.offset + self.len
+    }
+
+    /// Whether this is what a freshly mapped accessible page already has,
+    /// read-write under the default key.
+    pub fn is_default(&self) -> bool {
+        self.pkey == 0 && self.prot == (libc::PROT_READ | libc::PROT_WRITE) as u32
+    }
+
+    /// Size of a range descriptor of a memory64 guest: little-endian `u64`
+    /// address and length, then the `u32` key and four bytes of padding, as
+    /// `PKURange` is laid out on wasm64.
+    pub const DESCRIPTOR64_SIZE: usize = 24;
+
+    /// Decode a guest range descriptor, tagging the range read-write.
+    pub fn from_descriptor(d: &[u8]) -> PkeyRange {
+        let word = |i: usize| u32::from_le_bytes(d[i * 4..i * 4 + 4].try_into().unwrap());
+        PkeyRange {
+            offset: word(0) as usize,
+            len: word(1) as usize,
+            prot: (libc::PROT_READ | libc::PROT_WRITE) as u32,
+            pkey: word(2),
+        }
+    }
+
+    /// Decode a range descriptor of a memory64 guest, tagging the range
+    /// read-write. Returns `None` if it does not fit the host's addresses.
+    pub fn from_descriptor64(d: &[u8]) -> Option<PkeyRange> {
+        let word = |i: usize| u64::from_le_bytes(d[i * 8..i * 8 + 8].try_into().unwrap());
+        Some(PkeyRange {
+            offset: usize::try_from(word(0)).ok()?,
+            len: usize::try_from(word(1)).ok()?,
+            prot: (libc::PROT_READ | libc::PROT_WRITE) as u32,
+            pkey: u32::from_le_bytes(d[16..20].try_into().unwrap()),
+        })
+    }
+
+    /// Size of the descriptors of a guest, a memory64 one if `wide`.
+    pub fn descriptor_size(wide: bool) -> usize {
+        if wide {
+            Self::DESCRIPTOR64_SIZE
+        } else {
+            Self::DESCRIPTOR_SIZE
+        }
+    }
+
+    /// Decode a descriptor of [`PkeyRange::descriptor_size`] bytes.
+    pub fn from_guest(d: &[u8], wide: bool) -> Option<PkeyRange> {
+        if wide {
+            Self::from_descriptor64(d)
+        } else {
+            Some(Self::from_descriptor(d))
+        }
+    }
+}
+
+/// Non-overlapping key assignments over one linear memory, sorted by offset.
+///
+/// A later `insert` wins over whatever it overlaps, and neighbours with the
+/// same protection and key are merged, so iterating yields the minimal set
+/// of `pkey_mprotect` calls that reproduces the layout.
+#[derive(Debug, Default, Clone)]
+pub struct DomainMap {
+    ranges: BTreeMap<usize, PkeyRange>,
+}
+
+impl DomainMap {
+    /// Create an empty map.
+    pub fn new() -> Self {
+        Self::default()
+    }
+
+    /// Assign `range`, splitting or dropping the ranges it overlaps.
+    pub fn insert(&mut self, mut range: PkeyRange) {
+        if range.len == 0 {
+            return;
+        }
+        self.remove(range.offset, range.len);
+        let same = |a: &PkeyRange, b: &PkeyRange| a.prot == b.prot && a.pkey == b.pkey;
+        if let Some((_, left)) = self.ranges.range(..range.offset).next_back() {
+            if left.end() == range.offset && same(left, &range) {
+                let left = *left;
+                self.ranges.remove(&left.offset);
+                range.len += left.len;
+                range.offset = left.offset;
+            }
+        }
+        if let Some(right) = self.ranges.get(&range.end()).copied() {
+            if same(&right, &range) {
+                self.ranges.remove(&right.offset);
+                range.len += right.len;
+            }
+        }
+        self.ranges.insert(range.offset, range);
+    }
+
+    /// Forget any assignment to `offset..offset + len`, splitting the ranges
+    /// that straddle either end.
+    pub fn remove(&mut self, offset: usize, len: usize) {
+        let end = offset + len;
+        let overlapping: Vec<PkeyRange> = self
+            .ranges
+            .range(..end)
+            .rev()
+            .take_while(|(_, r)| r.end() > offset)
+            .map(|(_, r)| *r)
+            .collect();
+        for r in overlapping {
+            self.ranges.remove(&r.offset);
+            if r.offset < offset {
+                let left = PkeyRange {
+                    len: offset - r.offset,
+                    ..r
+                };
+                self.ranges.insert(left.offset, left);
+            }
+            if r.end() > end {
+                let right = PkeyRange {
+                    offset: end,
+                    len: r.end() - end,
+                    ..r
+                };
+                self.ranges.insert(right.offset, right);
+            }
+        }
+    }
+
+    /// The parts of `range` not already assigned its protection and key, in
+    /// address order.
+    pub fn uncovered(&self, range: &PkeyRange) -> Vec<PkeyRange> {
+        let mut parts = Vec::new();
+        let mut cursor = range.offset;
+        let mut push = |start: usize, end: usize| {
+            parts.push(PkeyRange {
+                offset: start,
+                len: end - start,
+                ..*range
+            })
+        };
+        let first = match self.ranges.range(..=range.offset).next_back() {
+            Some((offset, _)) => *offset,
+            None => range.offset,
+        };
+        for r in self.ranges.range(first..range.end()).map(|(_, r)| r) {
+            if r.end() <= cursor || r.prot != range.prot || r.pkey != range.pkey {
+                continue;
+            }
+            if r.offset > cursor {
+                push(cursor, r.offset);
+            }
+            cursor = r.end().min(range.end());
+        }
+        if cursor < range.end() {
+            push(cursor, range.end());
+        }
+        parts
+    }
+
+    /// The assigned ranges intersecting `offset..offset + len`, in address
+    /// order.
+    pub fn overlapping(&self, offset: usize, len: usize) -> impl Iterator<Item = &PkeyRange> + '_ {
+        let end = offset.saturating_add(len);
+        let first = match self.ranges.range(..=offset).next_back() {
+            Some((start, _)) => *start,
+            None => offset,
+        };
+        self.ranges
+            .range(first..end)
+            .map(|(_, r)| r)
+            .filter(move |r| r.end() > offset)
+    }
+
+    /// Iterate over the assigned ranges in address order.
+    pub fn iter(&self) -> impl Iterator<Item = &PkeyRange> + '_ {
+        self.ranges.values()
+    }
+
+    /// Number of distinct ranges.
+    pub fn len(&self) -> usize {
+        self.ranges.len()
+    }
+
+    /// Whether no range has been assigned.
+    pub fn is_empty(&self) -> bool {
+        self.ranges.is_empty()
+    }
+
+    /// Forget every assignment.
+    pub fn clear(&mut self) {
+        self.ranges.clear();
+    }
+}
+
+/// A protection command ring registered by the guest in its linear memory.
+///
+/// The ring starts with a `u32` head, advanced by the guest for each
+/// appended descriptor, and a `u32` tail, advanced by the host as it drains.
+/// Both count descriptors modulo 2^32 and the `capacity` descriptors follow
+/// the two counters. Appending needs no host transition; the host drains the
+/// ring at its next PKU hostcall, on `memory.grow`, or on an explicit flush.
+#[derive(Debug, Clone, Copy)]
+pub struct PkuQueue {
+    /// Offset of the ring header in linear memory.
+    pub offset: usize,
+    /// Number of descriptor slots.
+    pub capacity: u32,
+    /// Whether the slots hold the descriptors of a memory64 guest.
+    pub wide: bool,
+}
+
+impl PkuQueue {
+    const HEADER_SIZE: usize = 8;
+
+    /// Total bytes covered by the ring, or `None` on overflow.
+    pub fn size(capacity: u32, wide: bool) -> Option<usize> {
+        (capacity as usize)
+            .checked_mul(PkeyRange::descriptor_size(wide))?
+            .checked_add(Self::HEADER_SIZE)
+    }
+}
+
+/// Allocation and switch counters a guest keeps for one of its domains, read
+/// in place from the table it hands the host with `stats_register`.
+///
+/// Each entry is eight little-endian `u64`s in field order, and the table
+/// holds one entry per domain id, starting at the root domain.
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct PkuHeapStats {
+    /// Usable bytes of the domain's live allocations.
+    pub in_use: u64,
+    /// The most `in_use` has been.
+    pub peak: u64,
+    /// Allocations made in the domain.
+    pub allocations: u64,
+    /// Allocations of the domain freed again.
+    pub frees: u64,
+    /// Bytes the domain's heap and page runs hold.
+    pub footprint: u64,
+    /// Heap segments and page runs.
+    pub segments: u64,
+    /// Bytes tagged with the domain's key.
+    pub tagged: u64,
+    /// Times the guest entered the domain through its own call gate.
+    pub switches: u64,
+}
+
+impl PkuHeapStats {
+    /// Size of one entry of the guest's table.
+    pub const ENTRY_SIZE: usize = 64;
+
+    /// Decode one table entry.
+    pub fn from_entry(d: &[u8]) -> PkuHeapStats {
+        let word = |i: usize| u64::from_le_bytes(d[i * 8..i * 8 + 8].try_into().unwrap());
+        PkuHeapStats {
+            in_use: word(0),
+            peak: word(1),
+            allocations: word(2),
+            frees: word(3),
+            footprint: word(4),
+            segments: word(5),
+            tagged: word(6),
+            switches: word(7),
+        }
+    }
+}
+
+/// What isolation has cost the host since the process started, counted
+/// while a [`PkuCounters`] guard is alive.
+///
+/// Switches are PKRU writes made by the host, including those it makes on
+/// behalf of the guest's `wrpkru` hostcall, named by the domains whose
+/// words they leave and install. Switches compiled into wasm are not seen
+/// by the host; guests count their own, see [`PkuHeapStats::switches`].
+#[derive(Debug, Clone, Default, PartialEq, Eq)]
+pub struct PkuHostStats {
+    /// `pkey_mprotect` calls made.
+    pub mprotect_calls: u64,
+    /// Bytes those calls covered.
+    pub mprotect_bytes: u64,
+    /// Mappings made for guests through `mmap` and `map_huge`.
+    pub mmap_calls: u64,
+    /// Layouts tagged again because growing moved their memory.
+    pub retags: u64,
+    /// Switches from or to a word which is no domain's.
+    pub other_switches: u64,
+    /// Switches from domain `i` to domain `j` at `[i][j]`.
+    pub switches: [[u64; 16]; 16],
+}
+
+impl PkuHostStats {
+    /// Size of the record the `stats` hostcall copies to the guest: the
+    /// counters as little-endian `u64`s in field order, `switches` by row.
+    pub const SIZE: usize = (5 + 16 * 16) * 8;
+
+    /// Encode the record the `stats` hostcall copies to the guest.
+    pub fn encode(&self) -> Vec<u8> {
+        let words = [
+            self.mprotect_calls,
+            self.mprotect_bytes,
+            self.mmap_calls,
+            self.retags,
+            self.other_switches,
+        ];
+        words
+            .iter()
+            .chain(self.switches.iter().flatten())
+            .flat_map(|word| word.to_le_bytes())
+            .collect()
+    }
+}
+
+const MPROTECT_CALLS: usize = 0;
+const MPROTECT_BYTES: usize = 1;
+const MMAP_CALLS: usize = 2;
+const RETAGS: usize = 3;
+const OTHER_SWITCHES: usize = 4;
+const SWITCHES: usize = 5;
+
+const NEW_COUNTER: AtomicU64 = AtomicU64::new(0);
+
+/// The counters of [`PkuHostStats`], in the order of its record.
+static COUNTERS: [AtomicU64; SWITCHES + 16 * 16] = [NEW_COUNTER; SWITCHES + 16 * 16];
+
+/// Live [`PkuCounters`] guards.
+static COUNTING: AtomicU32 = AtomicU32::new(0);
+
+/// Keeps the process-wide [`PkuHostStats`] counting while alive.
+///
+/// Counting costs an atomic add per protection change or switch, so it is
+/// off unless some engine asks for it. Guards nest, and the counters keep
+/// their values when the last one is dropped.
+#[derive(Debug)]
+pub struct PkuCounters {
+    _private: (),
+}
+
+impl PkuCounters {
+    /// Start counting.
+    pub fn start() -> PkuCounters {
+        COUNTING.fetch_add(1, Ordering::Relaxed);
+        PkuCounters { _private: () }
+    }
+
+    /// Whether any guard is alive.
+    #[inline]
+    pub fn is_counting() -> bool {
+        COUNTING.load(Ordering::Relaxed) != 0
+    }
+
+    /// The counters as they are now.
+    pub fn read() -> PkuHostStats {
+        let word = |i: usize| COUNTERS[i].load(Ordering::Relaxed);
+        let mut stats = PkuHostStats {
+            mprotect_calls: word(MPROTECT_CALLS),
+            mprotect_bytes: word(MPROTECT_BYTES),
+            mmap_calls: word(MMAP_CALLS),
+            retags: word(RETAGS),
+            other_switches: word(OTHER_SWITCHES),
+            ..PkuHostStats::default()
+        };
+        for (i, count) in stats.switches.iter_mut().flatten().enumerate() {
+            *count = word(SWITCHES + i);
+        }
+        stats
+    }
+
+    #[inline]
+    fn bump(counter: usize, by: u64) {
+        if Self::is_counting() {
+            COUNTERS[counter].fetch_add(by, Ordering::Relaxed);
+        }
+    }
+
+    /// Count a mapping made for a guest.
+    pub fn record_mmap() {
+        Self::bump(MMAP_CALLS, 1);
+    }
+
+    fn record_mprotect(len: usize) {
+        Self::bump(MPROTECT_CALLS, 1);
+        Self::bump(MPROTECT_BYTES, len as u64);
+    }
+
+    /// Count a PKRU write from `from` to `to`.
+    #[cold]
+    fn record_switch(from: u32, to: u32) {
+        if from == to {
+            return;
+        }
+        let domain = |word: u32| (0..16).find(|d| Pku::domain_word(*d) == Some(word));
+        match (domain(from), domain(to)) {
+            (Some(from), Some(to)) => Self::bump(SWITCHES + (from * 16 + to) as usize, 1),
+            _ => Self::bump(OTHER_SWITCHES, 1),
+        }
+    }
+}
+
+impl Drop for PkuCounters {
+    fn drop(&mut self) {
+        COUNTING.fetch_sub(1, Ordering::Relaxed);
+    }
+}
+
+/// Index of [`DomainClock`]'s tallies for words which are no domain's.
+const OTHER_DOMAIN: usize = 16;
+
+/// Time a store's wasm runs in each domain, from the timestamp counter read
+/// at every switch the store is told of, and the slices that limit it.
+///
+/// A slice is a number of epoch ticks a domain may run for per call into
+/// wasm from the host. It is armed the first time the domain is entered in
+/// a call, and [`DomainClock::expired`] reports the domain once the engine's
+/// epoch passes the deadline, however often the domain was left since.
+#[derive(Debug)]
+pub struct DomainClock {
+    /// The domain running, or `OTHER_DOMAIN`.
+    current: usize,
+    /// Timestamp `current` was entered at.
+    since: u64,
+    /// Domains running when calls nested inside this one came in.
+    callers: Vec<usize>,
+    /// Whether wasm is running.
+    running: bool,
+    ticks: [u64; OTHER_DOMAIN + 1],
+    entries: [u64; OTHER_DOMAIN + 1],
+    slices: [Option<u64>; OTHER_DOMAIN],
+    deadlines: [Option<u64>; OTHER_DOMAIN],
+    /// When the clock was created, to convert ticks into time.
+    origin: (std::time::Instant, u64),
+}
+
+impl DomainClock {
+    /// A clock with nothing counted and no slices.
+    pub fn new() -> DomainClock {
+        let start = std::time::Instant::now();
+        DomainClock {
+            current: 0,
+            since: 0,
+            callers: Vec::new(),
+            running: false,
+            ticks: [0; OTHER_DOMAIN + 1],
+            entries: [0; OTHER_DOMAIN + 1],
+            slices: [None; OTHER_DOMAIN],
+            deadlines: [None; OTHER_DOMAIN],
+            origin: (start, Self::timestamp(start)),
+        }
+    }
+
+    /// The time stamp counter.
+    #[cfg(target_arch = "x86_64")]
+    #[inline]
+    fn timestamp(_origin: std::time::Instant) -> u64 {
+        unsafe { std::arch::x86_64::_rdtsc() }
+    }
+
+    /// The virtual counter, which runs at a fixed frequency.
+    #[cfg(target_arch = "aarch64")]
+    #[inline]
+    fn timestamp(_origin: std::time::Instant) -> u64 {
+        let count: u64;
+        unsafe {
+            asm!("mrs {}, cntvct_el0", out(reg) count);
+        }
+        count
+    }
+
+    /// Nanoseconds since `origin` where there is no counter to read.
+    #[cfg(not(any(target_arch = "x86_64", target_arch = "aarch64")))]
+    fn timestamp(origin: std::time::Instant) -> u64 {
+        origin.elapsed().as_nanos() as u64
+    }
+
+    fn domain_of(word: u32) -> usize {
+        (0..OTHER_DOMAIN as u32)
+            .find(|d| Pku::domain_word(*d) == Some(word))
+            .map_or(OTHER_DOMAIN, |d| d as usize)
+    }
+
+    /// Charge the time since the last switch to the running domain and make
+    /// `domain` the running one.
+    fn charge(&mut self, domain: usize) {
+        let now = Self::timestamp(self.origin.0);
+        self.ticks[self.current] += now.wrapping_sub(self.since);
+        self.since = now;
+        self.current = domain;
+    }
+
+    fn switch_to(&mut self, domain: usize, epoch: u64) {
+        self.charge(domain);
+        self.entries[domain] += 1;
+        if let Some(slice) = self.slices.get(domain).copied().flatten() {
+            self.deadlines[domain].get_or_insert(epoch.saturating_add(slice));
+        }
+    }
+
+    /// Wasm is about to run with `word` in PKRU at `epoch`. Calls nest, and
+    /// each is undone by [`DomainClock::exit`].
+    pub fn enter(&mut self, word: u32, epoch: u64) {
+        if self.running {
+            self.callers.push(self.current);
+        } else {
+            self.since = Self::timestamp(self.origin.0);
+            self.running = true;
+        }
+        let domain = Self::domain_of(word);
+        if domain != self.current || self.callers.is_empty() {
+            self.switch_to(domain, epoch);
+        }
+    }
+
+    /// The call into wasm matching the last [`DomainClock::enter`] returned.
+    /// Leaving the outermost call disarms every slice.
+    pub fn exit(&mut self) {
+        match self.callers.pop() {
+            Some(caller) => self.charge(caller),
+            None => {
+                self.charge(self.current);
+                self.running = false;
+                self.deadlines = [None; OTHER_DOMAIN];
+            }
+        }
+    }
+
+    /// Wasm wrote `word` to PKRU at `epoch`.
+    pub fn switch(&mut self, word: u32, epoch: u64) {
+        let domain = Self::domain_of(word);
+        if self.running && domain != self.current {
+            self.switch_to(domain, epoch);
+        }
+    }
+
+    /// The epoch at which the running domain exceeds its slice.
+    pub fn deadline(&self) -> Option<u64> {
+        self.deadlines.get(self.current).copied().flatten()
+    }
+
+    /// The running domain, if it exceeded its slice at `epoch`.
+    pub fn expired(&self, epoch: u64) -> Option<u32> {
+        match self.deadline() {
+            Some(deadline) if epoch >= deadline => Some(self.current as u32),
+            _ => None,
+        }
+    }
+
+    /// Limit `domain` to `slice` epoch ticks per call into wasm, or lift
+    /// its limit with `None`. Takes effect from the next call.
+    pub fn set_slice(&mut self, domain: u32, slice: Option<u64>) {
+        if let Some(entry) = self.slices.get_mut(domain as usize) {
+            *entry = slice;
+        }
+    }
+
+    /// Time domain `i` ran for and the times it was entered at `[i]`, with
+    /// words which are no domain's counted last. The running domain's time
+    /// is counted up to its last switch.
+    pub fn times(&self) -> Vec<(std::time::Duration, u64)> {
+        let ticks = Self::timestamp(self.origin.0).wrapping_sub(self.origin.1);
+        let nanos = self.origin.0.elapsed().as_nanos() as f64;
+        let rate = if ticks == 0 {
+            0.0
+        } else {
+            nanos / ticks as f64
+        };
+        self.ticks
+            .iter()
+            .zip(self.entries.iter())
+            .map(|(ticks, entries)| {
+                let nanos = (*ticks as f64 * rate) as u64;
+                (std::time::Duration::from_nanos(nanos), *entries)
+            })
+            .collect()
+    }
+}
+
+/// Per-instance PKU state kept by the runtime.
+#[derive(Debug, Default)]
+pub struct PkuState {
+    /// The guest's protection command ring, if it registered one.
+    pub queue: Option<PkuQueue>,
+    /// Offset and entry count of the guest's allocation counters, if it
+    /// registered them.
+    stats: Option<(usize, u32)>,
+    /// Every key assignment applied to the instance's first memory, kept so
+    /// the layout can be restored when growing moves the memory.
+    domains: DomainMap,
+    /// Tags left on the pages by the previous user of a pooled memory slot
+    /// that this instance has not asserted itself yet.
+    stale: DomainMap,
+    /// Base address the layout was last applied at.
+    base: usize,
+    /// Keys the guest leased through `lease`, returned with the instance.
+    leases: Vec<PkeyLease>,
+    /// Keys leased ahead of the guest's `lease` calls, see `prelease`.
+    pool: Vec<PkeyLease>,
+    /// Whether keys given back through `release` go to `pool`.
+    pooled: bool,
+    /// Ranges of retired keys the scrubber has not reset yet.
+    retired: Vec<Retired>,
+    /// Keys handed out by `lease_unbacked`, one bit each.
+    unbacked: u16,
+}
+
+/// Ranges of a retired key, by offset, and the scrub resetting them.
+#[derive(Debug)]
+struct Retired {
+    pkey: u32,
+    ranges: Vec<PkeyRange>,
+    scrub: Arc<Scrub>,
+}
+
+impl PkuState {
+    /// Size of the huge pages [`PkuState::map_huge`] backs regions with.
+    pub const HUGE_PAGE_SIZE: usize = 2 << 20;
+
+    /// The key layout applied so far.
+    pub fn domains(&self) -> &DomainMap {
+        &self.domains
+    }
+
+    /// Whether the instance has used protection keys at all.
+    pub fn is_active(&self) -> bool {
+        self.queue.is_some()
+            || !self.domains.is_empty()
+            || !self.stale.is_empty()
+            || !self.retired.is_empty()
+    }
+
+    /// Whether no inherited tags are left waiting for `settle`.
+    pub fn is_settled(&self) -> bool {
+        self.stale.is_empty()
+    }
+
+    /// Tag `range` of `vm` and record it in the layout.
+    /// Returns 0, or the negated errno of `pkey_mprotect`.
+    ///
+    /// Parts of `range` that still carry the requested tag from the slot's
+    /// previous user are not re-tagged. The first range that differs from
+    /// what the previous user left means the layouts diverge, so the rest of
+    /// the inherited tags are settled along with it.
+    pub unsafe fn protect(&mut self, vm: &VMMemoryDefinition, range: PkeyRange) -> i32 {
+        self.await_retired(range.offset, range.len);
+        let apply =
+            |r: &PkeyRange| Pku::pkey_mprotect_raw(vm.base.add(r.offset), r.len, r.prot, r.pkey);
+        let ret = if self.stale.is_empty() {
+            apply(&range)
+        } else {
+            let uncovered = self.stale.uncovered(&range);
+            let ret = uncovered
+                .iter()
+                .map(apply)
+                .find(|ret| *ret != 0)
+                .unwrap_or(0);
+            if ret == 0 {
+                self.stale.remove(range.offset, range.len);
+                if !uncovered.is_empty() {
+                    self.settle(vm);
+                }
+            }
+            ret
+        };
+        if ret == 0 {
+            self.domains.insert(range);
+            self.base = vm.base as usize;
+        }
+        ret
+    }
+
+    /// Take over `layout`, the tags a pooled slot's previous instance left on
+    /// the pages of `vm`. Ranges this instance requests again cost nothing,
+    /// and the rest are reset by `settle`.
+    pub fn inherit(&mut self, vm: &VMMemoryDefinition, layout: DomainMap) {
+        self.stale = layout;
+        self.base = vm.base as usize;
+    }
+
+    /// Reset every inherited tag this instance has not asserted back to the
+    /// default key, keeping pages past the current length inaccessible.
+    /// Deferred until the guest first switches domains through the host or
+    /// protects a range differently, so that a guest laying out its domains
+    /// as the previous instance did pays nothing for them.
+    pub unsafe fn settle(&mut self, vm: &VMMemoryDefinition) -> i32 {
+        let length = vm.current_length();
+        let rw = (libc::PROT_READ | libc::PROT_WRITE) as u32;
+        let mut ret = 0;
+        for r in std::mem::take(&mut self.stale).iter() {
+            let split = r.end().min(length).max(r.offset);
+            let parts = [
+                (r.offset, split, rw),
+                (split, r.end(), libc::PROT_NONE as u32),
+            ];
+            for (start, end, prot) in parts {
+                if start == end {
+                    continue;
+                }
+                let err = Pku::pkey_mprotect_raw(vm.base.add(start), end - start, prot, 0);
+                if ret == 0 {
+                    ret = err;
+                }
+            }
+        }
+        ret
+    }
+
+    /// The tags currently on the pages, for the pooling allocator to hand to
+    /// the slot's next instance. Leaves this state empty.
+    pub fn take_layout(&mut self) -> DomainMap {
+        self.await_retired(0, usize::MAX);
+        let mut layout = std::mem::take(&mut self.stale);
+        for r in std::mem::take(&mut self.domains).iter() {
+            if !r.is_default() {
+                layout.insert(*r);
+            }
+        }
+        layout
+    }
+
+    /// Tag every range of `ranges`, in order, and record them in the layout.
+    /// Returns 0, or the negated errno of the first failing `pkey_mprotect`.
+    pub unsafe fn protect_ranges(&mut self, vm: &VMMemoryDefinition, ranges: &[PkeyRange]) -> i32 {
+        for range in ranges {
+            let ret = self.protect(vm, *range);
+            if ret != 0 {
+                return ret;
+            }
+        }
+        0
+    }
+
+    /// Lease `count` keys for the instance up front, so that `lease` hands
+    /// them out without going to the broker or the kernel, and `release`
+    /// puts them back. Returns 0, or the negated errno of the first lease
+    /// that could not be made.
+    pub fn prelease(&mut self, count: u32) -> i32 {
+        self.pooled = true;
+        while self.pool.len() < count as usize {
+            match PkeyLease::new(self.held_keys()) {
+                Ok(lease) => self.pool.push(lease),
+                Err(err) => return err,
+            }
+        }
+        0
+    }
+
+    /// The mask of keys the instance holds or is still scrubbing.
+    fn held_keys(&self) -> u16 {
+        self.leases
+            .iter()
+            .chain(&self.pool)
+            .fold(self.retired_keys(), |m, l| m | 1 << l.pkey())
+    }
+
+    /// Lease a key for the instance, from its pool if `prelease` filled one
+    /// and else from the process-wide broker, skipping keys it holds
+    /// already. Returns the key, or a negated errno.
+    pub fn lease(&mut self) -> i32 {
+        if let Some(lease) = self.pool.pop() {
+            let pkey = lease.pkey();
+            self.leases.push(lease);
+            return pkey as i32;
+        }
+        match PkeyLease::new(self.held_keys()) {
+            Ok(lease) => {
+                let pkey = lease.pkey();
+                self.leases.push(lease);
+                pkey as i32
+            }
+            Err(err) => err,
+        }
+    }
+
+    /// Give back a key from `lease`, to the instance's pool if it has one.
+    /// Returns 0, or `-EINVAL` if the instance does not hold `pkey`.
+    pub fn release(&mut self, pkey: u32) -> i32 {
+        match self.leases.iter().position(|l| l.pkey() == pkey) {
+            Some(pos) => {
+                let lease = self.leases.swap_remove(pos);
+                if self.pooled {
+                    self.pool.push(lease);
+                }
+                0
+            }
+            None => -libc::EINVAL,
+        }
+    }
+
+    /// Hand out the lowest key from 1 to 15 the instance doesn't hold yet,
+    /// with no hardware key behind it, for engines without isolation where
+    /// keys only name domains. Returns the key, or `-ENOSPC`.
+    pub fn lease_unbacked(&mut self) -> i32 {
+        let free = !self.unbacked & !1;
+        if free == 0 {
+            return -libc::ENOSPC;
+        }
+        let pkey = free.trailing_zeros();
+        self.unbacked |= 1 << pkey;
+        pkey as i32
+    }
+
+    /// Give back a key from `lease_unbacked`. Returns 0, or `-EINVAL` if
+    /// the instance does not hold `pkey`.
+    pub fn release_unbacked(&mut self, pkey: u32) -> i32 {
+        if pkey >= 16 || self.unbacked & 1 << pkey == 0 {
+            return -libc::EINVAL;
+        }
+        self.unbacked &= !(1 << pkey);
+        0
+    }
+
+    /// Give back a key from `lease` along with the memory tagged with it,
+    /// see [`PkuState::retire`]. Returns 0, or `-EINVAL` if the instance
+    /// does not hold `pkey`.
+    pub unsafe fn retire_lease(&mut self, vm: &VMMemoryDefinition, pkey: u32) -> i32 {
+        match self.leases.iter().position(|l| l.pkey() == pkey) {
+            Some(pos) => {
+                let lease = self.leases.swap_remove(pos);
+                self.retire(vm, pkey, Some(Arc::new(lease)));
+                0
+            }
+            None => -libc::EINVAL,
+        }
+    }
+
+    /// Retire key `pkey` from `vm` without waiting for its pages: they are
+    /// dropped from the layout now, and a background thread hands them back
+    /// to the kernel and tags them with the default key, readable as zeros
+    /// again, or inaccessible past the current length. `lease` is held
+    /// until then, so the key only returns to the pool once no page carries
+    /// it. Later protections, grows and slot reuse touching the pages wait
+    /// for the scrub first.
+    pub unsafe fn retire(
+        &mut self,
+        vm: &VMMemoryDefinition,
+        pkey: u32,
+        lease: Option<Arc<PkeyLease>>,
+    ) {
+        let ranges: Vec<PkeyRange> = self
+            .domains
+            .iter()
+            .filter(|r| r.pkey == pkey && pkey != 0)
+            .copied()
+            .collect();
+        if ranges.is_empty() {
+            return;
+        }
+        let length = vm.current_length();
+        let rw = (libc::PROT_READ | libc::PROT_WRITE) as u32;
+        let mut host = Vec::with_capacity(ranges.len());
+        for r in &ranges {
+            self.domains.remove(r.offset, r.len);
+            let split = r.end().min(length).max(r.offset);
+            let parts = [
+                (r.offset, split, rw),
+                (split, r.end(), libc::PROT_NONE as u32),
+            ];
+            for (start, end, prot) in parts {
+                if start != end {
+                    host.push((vm.base as usize + start, end - start, prot));
+                }
+            }
+        }
+        let scrub = Arc::new(Scrub::default());
+        self.retired.retain(|r| !r.scrub.is_done());
+        self.retired.push(Retired {
+            pkey,
+            ranges,
+            scrub: scrub.clone(),
+        });
+        scrub_later(ScrubJob {
+            ranges: host,
+            lease,
+            scrub,
+        });
+    }
+
+    /// Wait for the scrubber to reset every retired range overlapping
+    /// `offset..offset + len`.
+    pub fn await_retired(&mut self, offset: usize, len: usize) {
+        let end = offset.saturating_add(len);
+        self.retired.retain(|r| {
+            if r.ranges
+                .iter()
+                .any(|range| range.offset < end && offset < range.end())
+            {
+                r.scrub.wait();
+            }
+            !r.scrub.is_done()
+        });
+    }
+
+    /// The mask of keys whose pages are still being scrubbed.
+    pub fn retired_keys(&self) -> u16 {
+        self.retired
+            .iter()
+            .filter(|r| !r.scrub.is_done())
+            .fold(0, |m, r| m | 1 << r.pkey)
+    }
+
+    /// Re-tag every range carrying key `old` with `new`, after the lease
+    /// behind them moved. Returns 0, or the negated errno of the first
+    /// failure.
+    pub unsafe fn rekey(&mut self, old: u32, new: u32) -> i32 {
+        let moved: Vec<PkeyRange> = self
+            .domains
+            .iter()
+            .filter(|r| r.pkey == old)
+            .copied()
+            .collect();
+        for mut r in moved {
+            r.pkey = new;
+            let ret =
+                Pku::pkey_mprotect_raw((self.base as *mut u8).add(r.offset), r.len, r.prot, new);
+            if ret != 0 {
+                return ret;
+            }
+            self.domains.insert(r);
+        }
+        0
+    }
+
+    /// Record `range` as already applied, e.g. by a tagged grow.
+    pub fn record(&mut self, range: PkeyRange) {
+        self.domains.insert(range);
+    }
+
+    /// Re-apply the layout to `vm` in one pass, after its pages were replaced
+    /// by a moving grow. Nothing is done if the layout is already in place at
+    /// this base, and ranges that match a fresh mapping are skipped, so only
+    /// the minimal set of merged non-default ranges is re-tagged. Returns 0,
+    /// or the negated errno of the first failure.
+    pub unsafe fn reapply(&mut self, vm: &VMMemoryDefinition) -> i32 {
+        if self.base == vm.base as usize {
+            return 0;
+        }
+        self.base = vm.base as usize;
+        self.stale.clear();
+        PkuCounters::bump(RETAGS, 1);
+        let mut ret = 0;
+        for r in self.domains.iter().filter(|r| !r.is_default()) {
+            let err = Pku::pkey_mprotect_raw(vm.base.add(r.offset), r.len, r.prot, r.pkey);
+            if ret == 0 {
+                ret = err;
+            }
+        }
+        ret
+    }
+
+    /// Hand the whole host pages within `offset..offset + len` of `vm` back
+    /// to the kernel and tag them with the default key again, so that any
+    /// domain can reuse them. They read back as zeros, or as the initial
+    /// image of a copy-on-write memory. Returns 0, or a negated errno.
+    pub unsafe fn decommit(&mut self, vm: &VMMemoryDefinition, offset: usize, len: usize) -> i32 {
+        let page = crate::page_size();
+        let start = match offset.checked_add(page - 1) {
+            Some(start) => start & !(page - 1),
+            None => return -libc::EINVAL,
+        };
+        let end = match offset.checked_add(len) {
+            Some(end) if end <= vm.current_length() => end & !(page - 1),
+            _ => return -libc::EINVAL,
+        };
+        if start >= end {
+            return 0;
+        }
+        if libc::madvise(vm.base.add(start).cast(), end - start, libc::MADV_DONTNEED) != 0 {
+            return -errno();
+        }
+        let range = PkeyRange {
+            offset: start,
+            len: end - start,
+            prot: (libc::PROT_READ | libc::PROT_WRITE) as u32,
+            pkey: 0,
+        };
+        self.protect(vm, range)
+    }
+
+    /// The first offset in `vm` whose host address is aligned to
+    /// [`PkuState::HUGE_PAGE_SIZE`]; huge regions start there or a multiple
+    /// of the huge page size further on.
+    pub fn huge_page_offset(vm: &VMMemoryDefinition) -> usize {
+        let misalignment = vm.base as usize & (Self::HUGE_PAGE_SIZE - 1);
+        (Self::HUGE_PAGE_SIZE - misalignment) & (Self::HUGE_PAGE_SIZE - 1)
+    }
+
+    /// Back `offset..offset + len` of `vm` with huge pages and tag it with
+    /// `pkey` in a single `pkey_mprotect`, so that a domain's heap is
+    /// covered by a few TLB entries. The range has to be aligned to
+    /// [`PkuState::HUGE_PAGE_SIZE`] in the host's address space and a
+    /// multiple of it long.
+    ///
+    /// Transparent huge pages are requested with `madvise(MADV_HUGEPAGE)`
+    /// and keep the contents. With `explicit` the range is mapped afresh
+    /// from the hugetlb pool instead and reads as zeros; it stays huge only
+    /// as long as the memory doesn't move. Returns 0, or a negated errno.
+    pub unsafe fn map_huge(
+        &mut self,
+        vm: &VMMemoryDefinition,
+        offset: usize,
+        len: usize,
+        pkey: u32,
+        explicit: bool,
+    ) -> i32 {
+        let mask = Self::HUGE_PAGE_SIZE - 1;
+        match offset.checked_add(len) {
+            Some(end)
+                if len != 0
+                    && end <= vm.current_length()
+                    && (vm.base as usize + offset) & mask == 0
+                    && len & mask == 0 => {}
+            _ => return -libc::EINVAL,
+        }
+        self.await_retired(offset, len);
+        let addr = vm.base.add(offset).cast();
+        if explicit {
+            let mapped = libc::mmap(
+                addr,
+                len,
+                libc::PROT_READ | libc::PROT_WRITE,
+                libc::MAP_PRIVATE | libc::MAP_ANONYMOUS | libc::MAP_FIXED | libc::MAP_HUGETLB,
+                -1,
+                0,
+            );
+            if mapped == libc::MAP_FAILED {
+                return -errno();
+            }
+            PkuCounters::record_mmap();
+            // The fresh mapping carries the default key, whatever was
+            // recorded for the pages it replaced.
+            self.domains.remove(offset, len);
+            self.stale.remove(offset, len);
+        } else if libc::madvise(addr, len, libc::MADV_HUGEPAGE) != 0 {
+            return -errno();
+        }
+        let range = PkeyRange {
+            offset,
+            len,
+            prot: (libc::PROT_READ | libc::PROT_WRITE) as u32,
+            pkey,
+        };
+        self.protect(vm, range)
+    }
+
+    /// Register a ring of `capacity` descriptors at `offset` in `vm`, those
+    /// of a memory64 guest if `wide`.
+    /// Returns 0, or a negated errno if it does not fit in the memory.
+    pub fn register_queue(
+        &mut self,
+        vm: &VMMemoryDefinition,
+        offset: usize,
+        capacity: u32,
+        wide: bool,
+    ) -> i32 {
+        match PkuQueue::size(capacity, wide).and_then(|size| size.checked_add(offset)) {
+            Some(end) if capacity != 0 && end <= vm.current_length() => {
+                self.queue = Some(PkuQueue {
+                    offset,
+                    capacity,
+                    wide,
+                });
+                0
+            }
+            _ => -libc::EINVAL,
+        }
+    }
+
+    /// Register a table of `count` `PkuHeapStats` entries at `offset` in `vm`.
+    /// Returns 0, or a negated errno if it does not fit in the memory.
+    pub fn register_stats(&mut self, vm: &VMMemoryDefinition, offset: usize, count: u32) -> i32 {
+        let end = (count as usize)
+            .checked_mul(PkuHeapStats::ENTRY_SIZE)
+            .and_then(|size| size.checked_add(offset));
+        match end {
+            Some(end) if count != 0 && end <= vm.current_length() => {
+                self.stats = Some((offset, count));
+                0
+            }
+            _ => -libc::EINVAL,
+        }
+    }
+
+    /// The guest's counters for each of its domains, indexed by domain id,
+    /// or nothing if it registered no table.
+    pub unsafe fn heap_stats(&self, vm: &VMMemoryDefinition) -> Vec<PkuHeapStats> {
+        let (offset, count) = match self.stats {
+            Some(stats) => stats,
+            None => return Vec::new(),
+        };
+        let size = count as usize * PkuHeapStats::ENTRY_SIZE;
+        if offset + size > vm.current_length() {
+            return Vec::new();
+        }
+        std::slice::from_raw_parts(vm.base.add(offset), size)
+            .chunks_exact(PkuHeapStats::ENTRY_SIZE)
+            .map(PkuHeapStats::from_entry)
+            .collect()
+    }
+
+    /// Apply every command pending in the guest's ring, in submission order.
+    /// Returns 0, or the negated errno of the first failing `pkey_mprotect`.
+    pub unsafe fn drain_queue(&mut self, vm: &VMMemoryDefinition) -> i32 {
+        let queue = match self.queue {
+            Some(queue) => queue,
+            None => return 0,
+        };
+        let ring = vm.base.add(queue.offset);
+        let head = (ring as *const u32).read_unaligned();
+        let tail = (ring.add(4) as *const u32).read_unaligned();
+        let pending = head.wrapping_sub(tail);
+        if pending == 0 {
+            return 0;
+        }
+        (ring.add(4) as *mut u32).write_unaligned(head);
+        if pending > queue.capacity {
+            return -libc::EINVAL;
+        }
+
+        let mut map = DomainMap::new();
+        let mut ret = 0;
+        let size = PkeyRange::descriptor_size(queue.wide);
+        for i in 0..pending {
+            let slot = (tail.wrapping_add(i) % queue.capacity) as usize;
+            let d = std::slice::from_raw_parts(ring.add(PkuQueue::HEADER_SIZE + slot * size), size);
+            match PkeyRange::from_guest(d, queue.wide) {
+                Some(range)
+                    if range
+                        .offset
+                        .checked_add(range.len)
+                        .map_or(false, |end| end <= vm.current_length()) =>
+                {
+                    map.insert(range)
+                }
+                _ => ret = -libc::EINVAL,
+            }
+        }
+        for r in map.iter() {
+            let err = self.protect(vm, *r);
+            if ret == 0 {
+                ret = err;
+            }
+        }
+        ret
+    }
+}
+
 const PKEY_DISABLE_ACCESS: i32 = 1;
 const PKEY_DISABLE_WRITE: i32 = 2;
 
@@ -19,6 +1439,7 @@ impl Pku {
 
     /// Change memory protection key protection permission on the specified page.
     pub fn pkey_mprotect(vm: &VMMemoryDefinition, start: usize, len: usize, prot: i64, pkey: i64) {
+        PkuCounters::record_mprotect(len);
         unsafe {
             if libc::syscall(SYS_pkey_mprotect, vm.base.add(start), len, prot, pkey) == -1 {
                 println!("error in libc::syscall SYS_pkey_mprotect");
@@ -38,7 +1459,144 @@ impl Pku {
         }
     }
 
+    /// Allocate a protection key, returning the key or a negated errno.
+    pub fn pkey_alloc(flags: u32, access_rights: u32) -> i32 {
+        let pkey = unsafe { libc::syscall(SYS_pkey_alloc, flags, access_rights) };
+        if pkey < 0 {
+            return -errno();
+        }
+        pkey as i32
+    }
+
+    /// Make sure protection key `pkey` is allocated to this process, for
+    /// statically laid out domains whose compiled code assumes that key.
+    /// Keys allocated on the way to `pkey` are given back. Returns 0, or a
+    /// negated errno; `EBUSY` means something else already owns `pkey`, or
+    /// a [`PkeyLease`] holds it.
+    pub fn reserve_pkey(pkey: u32) -> i32 {
+        if pkey == 0 {
+            return 0;
+        }
+        let mut broker = BROKER.lock().unwrap();
+        let bit = 1 << pkey;
+        if broker.reserved & bit != 0 {
+            return 0;
+        }
+        if broker.owned & bit != 0 {
+            return -libc::EBUSY;
+        }
+        let mut skipped = 0u16;
+        let ret = loop {
+            let key = Self::pkey_alloc(0, 0);
+            if key < 0 {
+                break key;
+            }
+            if key as u32 == pkey {
+                broker.reserved |= bit;
+                break 0;
+            }
+            skipped |= 1 << key;
+            // The kernel hands out the lowest free key first.
+            if key as u32 > pkey {
+                break -libc::EBUSY;
+            }
+        };
+        for key in (0..16).filter(|k| skipped & (1 << k) != 0) {
+            Self::pkey_free(key);
+        }
+        ret
+    }
+
+    /// Free a protection key, returning 0 or a negated errno.
+    pub fn pkey_free(pkey: u32) -> i32 {
+        if unsafe { libc::syscall(SYS_pkey_free, pkey) } == -1 {
+            return -errno();
+        }
+        0
+    }
+
+    /// Tag `len` bytes at host address `addr` with `pkey`, returning 0 or a
+    /// negated errno.
+    pub unsafe fn pkey_mprotect_raw(addr: *mut u8, len: usize, prot: u32, pkey: u32) -> i32 {
+        PkuCounters::record_mprotect(len);
+        if libc::syscall(SYS_pkey_mprotect, addr, len, prot, pkey) == -1 {
+            return -errno();
+        }
+        0
+    }
+
+    /// Tag a whole memory reservation at `base` with `pkey`: the first `len`
+    /// bytes read-write and the rest up to `reserved` inaccessible, so that
+    /// growing the memory in place opens pages which already carry the key.
+    /// Returns 0, or a negated errno.
+    pub unsafe fn pkey_mprotect_reservation(
+        base: *mut u8,
+        len: usize,
+        reserved: usize,
+        pkey: u32,
+    ) -> i32 {
+        let rw = (libc::PROT_READ | libc::PROT_WRITE) as u32;
+        if len != 0 {
+            let ret = Self::pkey_mprotect_raw(base, len, rw, pkey);
+            if ret != 0 {
+                return ret;
+            }
+        }
+        if reserved <= len {
+            return 0;
+        }
+        Self::pkey_mprotect_raw(base.add(len), reserved - len, libc::PROT_NONE as u32, pkey)
+    }
+
+    /// Sort `ranges` by offset and merge neighbours that touch and carry the
+    /// same protection and key, so each merged run costs one syscall.
+    pub fn coalesce(ranges: &mut Vec<PkeyRange>) {
+        ranges.retain(|r| r.len != 0);
+        ranges.sort_by_key(|r| r.offset);
+        let mut merged: Vec<PkeyRange> = Vec::with_capacity(ranges.len());
+        for r in ranges.drain(..) {
+            match merged.last_mut() {
+                Some(last)
+                    if last.end() == r.offset && last.prot == r.prot && last.pkey == r.pkey =>
+                {
+                    last.len += r.len;
+                }
+                _ => merged.push(r),
+            }
+        }
+        *ranges = merged;
+    }
+
+    /// Tag every range, relative to `base`, with its key. Stops at the first
+    /// failure and returns its negated errno, or 0 once all are applied.
+    pub unsafe fn pkey_mprotect_ranges(base: *mut u8, ranges: &[PkeyRange]) -> i32 {
+        for r in ranges {
+            let ret = Self::pkey_mprotect_raw(base.add(r.offset), r.len, r.prot, r.pkey);
+            if ret != 0 {
+                return ret;
+            }
+        }
+        0
+    }
+
+    /// Whether the OS has enabled protection keys on this host, without
+    /// which `rdpkru` and `wrpkru` fault. Probed once and cached.
+    pub fn supported() -> bool {
+        probe::supported()
+    }
+
+    /// The current PKRU, or `None` on hosts without protection keys.
+    #[inline]
+    pub fn try_rdpkru() -> Option<i32> {
+        if Self::supported() {
+            Some(Self::rdpkru())
+        } else {
+            None
+        }
+    }
+
     /// Read pkru value.
+    #[cfg(target_arch = "x86_64")]
     pub fn rdpkru() -> i32 {
         let ecx = 0;
         let mut pkru: i32;
@@ -52,8 +1610,29 @@ impl Pku {
         return pkru;
     }
 
+    /// Read POR_EL0, which takes PKRU's place on AArch64. Linux only hands
+    /// out 8 keys there, whose permissions fit in the low 32 bits.
+    #[cfg(target_arch = "aarch64")]
+    pub fn rdpkru() -> i32 {
+        let por: u64;
+        unsafe {
+            asm!("mrs {}, S3_3_C10_C2_4", out(reg) por);
+        }
+        por as i32
+    }
+
+    /// Without protection keys every key is always accessible.
+    #[cfg(not(any(target_arch = "x86_64", target_arch = "aarch64")))]
+    pub fn rdpkru() -> i32 {
+        0
+    }
+
     /// Write pkru value.
+    #[cfg(target_arch = "x86_64")]
     pub fn wrpkru(pkru: i32) {
+        if PkuCounters::is_counting() {
+            PkuCounters::record_switch(Self::rdpkru() as u32, pkru as u32);
+        }
         let ecx = 0;
         let edx = 0;
 
@@ -65,26 +1644,493 @@ impl Pku {
         }
     }
 
+    /// Write POR_EL0 and synchronize, so the next access sees the change.
+    #[cfg(target_arch = "aarch64")]
+    pub fn wrpkru(pkru: i32) {
+        if PkuCounters::is_counting() {
+            PkuCounters::record_switch(Self::rdpkru() as u32, pkru as u32);
+        }
+        unsafe {
+            asm!("msr S3_3_C10_C2_4, {}", "isb", in(reg) pkru as u32 as u64);
+        }
+    }
+
+    /// Without protection keys there is nothing to write.
+    #[cfg(not(any(target_arch = "x86_64", target_arch = "aarch64")))]
+    pub fn wrpkru(_pkru: i32) {}
+
+    /// The word `domain` runs with in this host's PKRU format, as compiled
+    /// code computes it for its prologues.
+    pub fn domain_word(domain: u32) -> Option<u32> {
+        if cfg!(target_arch = "aarch64") {
+            wasmtime_environ::domain_por(domain)
+        } else {
+            wasmtime_environ::domain_pkru(domain)
+        }
+    }
+
     /// This will go out and modify PKRU register to set the access rights.
     pub fn set_pkey(pkey: i64, prot: i32) {
-        let pkey_shift = pkey * 2;
-        let mut new_pkru_bits = 0;
+        let (shift, mask, bits) = Self::key_bits(pkey, prot);
 
-        if prot & PKEY_DISABLE_ACCESS != 0 {
-            new_pkru_bits |= PKEY_DISABLE_ACCESS;
+        /* Get old PKRU and mask off any old bits in place: */
+        let pkru = Pku::rdpkru();
+        let new_pkru = (pkru & !(mask << shift)) | (bits << shift);
+
+        /* Write old part along with new part, unless nothing changes: */
+        if new_pkru != pkru {
+            Pku::wrpkru(new_pkru);
         }
-        if prot & PKEY_DISABLE_WRITE != 0 {
-            new_pkru_bits |= PKEY_DISABLE_WRITE;
+    }
+
+    /// `word` with `pkey` readable and writable, in this host's PKRU format.
+    /// Keys the format has no field for are left alone.
+    pub fn open_key(word: u32, pkey: u32) -> u32 {
+        let (shift, mask, bits) = Self::key_bits(i64::from(pkey), 0);
+        if shift >= 32 {
+            return word;
         }
+        (word & !((mask as u32) << shift)) | ((bits as u32) << shift)
+    }
 
-        /* Shift the bits in to the correct place in PKRU for pkey: */
-        new_pkru_bits <<= pkey_shift;
+    /// The position, mask and value of `pkey`'s field in PKRU for `prot`.
+    #[cfg(not(target_arch = "aarch64"))]
+    fn key_bits(pkey: i64, prot: i32) -> (i64, i32, i32) {
+        let bits = prot & (PKEY_DISABLE_ACCESS | PKEY_DISABLE_WRITE);
+        (pkey * 2, PKEY_DISABLE_ACCESS | PKEY_DISABLE_WRITE, bits)
+    }
 
-        /* Get old PKRU and mask off any old bits in place: */
-        let mut old_pkru = Pku::rdpkru();
-        old_pkru &= !((PKEY_DISABLE_ACCESS | PKEY_DISABLE_WRITE) << pkey_shift);
+    /// On AArch64 each key has a 4-bit field granting, rather than denying,
+    /// read, execute and write.
+    #[cfg(target_arch = "aarch64")]
+    fn key_bits(pkey: i64, prot: i32) -> (i64, i32, i32) {
+        const R: i32 = 0b0001;
+        const X: i32 = 0b0010;
+        const W: i32 = 0b0100;
+        let bits = if prot & PKEY_DISABLE_ACCESS != 0 {
+            0
+        } else if prot & PKEY_DISABLE_WRITE != 0 {
+            R | X
+        } else {
+            R | X | W
+        };
+        (pkey * 4, 0b1111, bits)
+    }
+}
+
+fn errno() -> i32 {
+    std::io::Error::last_os_error()
+        .raw_os_error()
+        .unwrap_or(libc::EINVAL)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    fn range(offset: usize, len: usize, pkey: u32) -> PkeyRange {
+        PkeyRange {
+            offset,
+            len,
+            prot: 3,
+            pkey,
+        }
+    }
+
+    #[test]
+    fn domain_map_later_insert_wins() {
+        let mut map = DomainMap::new();
+        map.insert(range(0x0000, 0x4000, 1));
+        map.insert(range(0x1000, 0x1000, 2));
+        map.insert(range(0x3000, 0x2000, 1));
+        assert_eq!(
+            map.iter().copied().collect::<Vec<_>>(),
+            [
+                range(0x0000, 0x1000, 1),
+                range(0x1000, 0x1000, 2),
+                range(0x2000, 0x3000, 1),
+            ]
+        );
+        map.insert(range(0x1000, 0x1000, 1));
+        assert_eq!(
+            map.iter().copied().collect::<Vec<_>>(),
+            [range(0x0000, 0x5000, 1)]
+        );
+    }
+
+    #[test]
+    fn domain_map_uncovered_parts() {
+        let mut map = DomainMap::new();
+        map.insert(range(0x1000, 0x1000, 1));
+        map.insert(range(0x2000, 0x1000, 2));
+        map.insert(range(0x3000, 0x1000, 1));
+        assert_eq!(map.uncovered(&range(0x1000, 0x1000, 1)), []);
+        assert_eq!(
+            map.uncovered(&range(0x0000, 0x5000, 1)),
+            [
+                range(0x0000, 0x1000, 1),
+                range(0x2000, 0x1000, 1),
+                range(0x4000, 0x1000, 1),
+            ]
+        );
+        map.remove(0x1800, 0x2000);
+        assert_eq!(
+            map.iter().copied().collect::<Vec<_>>(),
+            [range(0x1000, 0x800, 1), range(0x3800, 0x800, 1)]
+        );
+    }
+
+    #[test]
+    fn domain_map_overlapping_ranges() {
+        let mut map = DomainMap::new();
+        map.insert(range(0, 4, 1));
+        map.insert(range(8, 4, 2));
+        map.insert(range(16, 4, 3));
+        let keys = |offset, len| {
+            map.overlapping(offset, len)
+                .map(|r| r.pkey)
+                .collect::<Vec<_>>()
+        };
+        assert_eq!(keys(2, 8), vec![1, 2]);
+        assert_eq!(keys(4, 4), vec![]);
+        assert_eq!(keys(11, 6), vec![2, 3]);
+        assert_eq!(keys(0, 0), vec![]);
+    }
+
+    #[test]
+    fn coalesce_merges_adjacent_same_key() {
+        let mut ranges = vec![
+            range(0x2000, 0x1000, 1),
+            range(0x0000, 0x1000, 1),
+            range(0x1000, 0x1000, 1),
+            range(0x3000, 0x1000, 2),
+            range(0x5000, 0x1000, 2),
+            range(0x6000, 0, 2),
+        ];
+        Pku::coalesce(&mut ranges);
+        assert_eq!(
+            ranges,
+            [
+                range(0x0000, 0x3000, 1),
+                range(0x3000, 0x1000, 2),
+                range(0x5000, 0x1000, 2),
+            ]
+        );
+    }
+
+    #[test]
+    fn layout_is_recorded_per_state() {
+        let mut a = PkuState::default();
+        let b = PkuState::default();
+        a.record(range(0x0000, 0x2000, 1));
+        a.record(range(0x1000, 0x1000, 0));
+        assert!(a.is_active());
+        assert!(!b.is_active());
+        assert_eq!(
+            a.domains().iter().copied().collect::<Vec<_>>(),
+            [range(0x0000, 0x1000, 1), range(0x1000, 0x1000, 0)]
+        );
+        assert!(!a.domains().iter().next().unwrap().is_default());
+        assert!(a.domains().iter().nth(1).unwrap().is_default());
+    }
+
+    #[test]
+    fn inherited_layout_is_not_reapplied() {
+        let mut memory = vec![0u8; 0x4000];
+        let vm = VMMemoryDefinition {
+            base: memory.as_mut_ptr(),
+            current_length: memory.len().into(),
+        };
+        let mut layout = DomainMap::new();
+        layout.insert(range(0x1000, 0x2000, 1));
+        let mut state = PkuState::default();
+        state.inherit(&vm, layout);
+
+        // Neither is the buffer page aligned nor key 1 allocated, so this
+        // only succeeds if no `pkey_mprotect` is issued.
+        assert_eq!(unsafe { state.protect(&vm, range(0x1000, 0x1000, 1)) }, 0);
+        assert_eq!(
+            state.take_layout().iter().copied().collect::<Vec<_>>(),
+            [range(0x1000, 0x2000, 1)]
+        );
+        assert!(!state.is_active());
+    }
+
+    #[test]
+    fn decommit_releases_whole_pages() {
+        let page = crate::page_size();
+        let len = 3 * page;
+        let base = unsafe {
+            libc::mmap(
+                std::ptr::null_mut(),
+                len,
+                libc::PROT_READ | libc::PROT_WRITE,
+                libc::MAP_PRIVATE | libc::MAP_ANONYMOUS,
+                -1,
+                0,
+            )
+        };
+        assert_ne!(base, libc::MAP_FAILED);
+        let memory = unsafe { std::slice::from_raw_parts_mut(base as *mut u8, len) };
+        memory.fill(0xaa);
+        let vm = VMMemoryDefinition {
+            base: memory.as_mut_ptr(),
+            current_length: len.into(),
+        };
+        let mut state = PkuState::default();
+
+        // Only the page wholly inside the range is released.
+        assert_eq!(unsafe { state.decommit(&vm, page / 2, 2 * page) }, 0);
+        assert_eq!(memory[page - 1], 0xaa);
+        assert!(memory[page..2 * page].iter().all(|b| *b == 0));
+        assert_eq!(memory[2 * page], 0xaa);
+        assert_eq!(
+            state.domains().iter().copied().collect::<Vec<_>>(),
+            [range(page, page, 0)]
+        );
+        assert_eq!(unsafe { state.decommit(&vm, 0, len + 1) }, -libc::EINVAL);
+        unsafe { libc::munmap(base, len) };
+    }
+
+    #[test]
+    fn open_key_grants_one_field() {
+        let closed = Pku::domain_word(1).unwrap();
+        let open = Pku::open_key(closed, 2);
+        assert_ne!(open, closed);
+        assert_eq!(Pku::open_key(open, 2), open);
+        assert_eq!(Pku::open_key(closed, 1), closed);
+        assert_eq!(Pku::open_key(closed, 0), closed);
+        assert_eq!(Pku::open_key(closed, 32), closed);
+        if cfg!(target_arch = "aarch64") {
+            assert_eq!(open, closed | 0x700);
+        } else {
+            assert_eq!(open, closed & !0x30);
+        }
+    }
 
-        /* Write old part along with new part: */
-        Pku::wrpkru(old_pkru | new_pkru_bits);
+    #[test]
+    fn preleased_keys_are_reused() {
+        let mut state = PkuState::default();
+        // Hosts without protection keys can't lease any.
+        if state.prelease(2) != 0 {
+            return;
+        }
+        let first = state.lease();
+        let second = state.lease();
+        assert!(first > 0 && second > 0 && first != second);
+        assert!(state.pool.is_empty());
+        assert_eq!(state.release(first as u32), 0);
+        assert_eq!(state.lease(), first);
+        assert_eq!(state.release(0), -libc::EINVAL);
+    }
+
+    #[test]
+    fn dropped_lease_gives_its_key_back() {
+        // Hosts without protection keys can't lease any.
+        let lease = match PkeyLease::new(0) {
+            Ok(lease) => lease,
+            Err(_) => return,
+        };
+        let pkey = lease.pkey();
+        assert_eq!(BROKER.lock().unwrap().owned & 1 << pkey, 1 << pkey);
+        drop(lease);
+        // Unless another test leased it meanwhile, the kernel has it again.
+        let broker = BROKER.lock().unwrap();
+        if broker.owned & 1 << pkey == 0 {
+            assert_eq!(Pku::pkey_free(pkey), -libc::EINVAL);
+        }
+    }
+
+    #[test]
+    fn retire_scrubs_in_background() {
+        let page = crate::page_size();
+        let len = 3 * page;
+        let base = unsafe {
+            libc::mmap(
+                std::ptr::null_mut(),
+                len,
+                libc::PROT_READ | libc::PROT_WRITE,
+                libc::MAP_PRIVATE | libc::MAP_ANONYMOUS,
+                -1,
+                0,
+            )
+        };
+        assert_ne!(base, libc::MAP_FAILED);
+        let memory = unsafe { std::slice::from_raw_parts_mut(base as *mut u8, len) };
+        memory.fill(0xaa);
+        let vm = VMMemoryDefinition {
+            base: memory.as_mut_ptr(),
+            current_length: len.into(),
+        };
+        let mut state = PkuState::default();
+        state.record(range(0, page, 5));
+        state.record(range(page, page, 6));
+
+        // The layout forgets the key at once, the pages follow later.
+        unsafe { state.retire(&vm, 5, None) };
+        assert_eq!(
+            state.domains().iter().copied().collect::<Vec<_>>(),
+            [range(page, page, 6)]
+        );
+        state.await_retired(0, page);
+        assert_eq!(state.retired_keys(), 0);
+        assert!(memory[..page].iter().all(|b| *b == 0));
+        assert_eq!(memory[page], 0xaa);
+
+        // Nothing is queued for a key without pages.
+        unsafe { state.retire(&vm, 7, None) };
+        assert_eq!(state.retired_keys(), 0);
+        unsafe { libc::munmap(base, len) };
+    }
+
+    #[test]
+    fn map_huge_checks_alignment() {
+        let huge = PkuState::HUGE_PAGE_SIZE;
+        let len = 3 * huge;
+        let base = unsafe {
+            libc::mmap(
+                std::ptr::null_mut(),
+                len,
+                libc::PROT_READ | libc::PROT_WRITE,
+                libc::MAP_PRIVATE | libc::MAP_ANONYMOUS,
+                -1,
+                0,
+            )
+        };
+        assert_ne!(base, libc::MAP_FAILED);
+        let vm = VMMemoryDefinition {
+            base: base.cast(),
+            current_length: len.into(),
+        };
+        let offset = PkuState::huge_page_offset(&vm);
+        assert_eq!((base as usize + offset) % huge, 0);
+        let mut state = PkuState::default();
+        assert_eq!(
+            unsafe { state.map_huge(&vm, offset + 0x1000, huge, 0, false) },
+            -libc::EINVAL
+        );
+        assert_eq!(
+            unsafe { state.map_huge(&vm, offset, huge / 2, 0, false) },
+            -libc::EINVAL
+        );
+        assert_eq!(
+            unsafe { state.map_huge(&vm, offset, len + huge, 0, false) },
+            -libc::EINVAL
+        );
+        // Transparent huge pages may be disabled, but never misreported.
+        let ret = unsafe { state.map_huge(&vm, offset, huge, 0, false) };
+        assert!(ret == 0 || ret == -libc::EINVAL, "{}", ret);
+        unsafe { libc::munmap(base, len) };
+    }
+
+    #[test]
+    fn heap_stats_read_in_place() {
+        let mut memory = vec![0u8; 0x1000];
+        let vm = VMMemoryDefinition {
+            base: memory.as_mut_ptr(),
+            current_length: memory.len().into(),
+        };
+        let mut state = PkuState::default();
+        assert!(unsafe { state.heap_stats(&vm) }.is_empty());
+        assert_eq!(state.register_stats(&vm, 0xfc0, 2), -libc::EINVAL);
+        assert_eq!(state.register_stats(&vm, 0x100, 0), -libc::EINVAL);
+        assert_eq!(state.register_stats(&vm, 0x100, 2), 0);
+
+        // The guest bumps its counters without telling the host.
+        let entry = 0x100 + PkuHeapStats::ENTRY_SIZE;
+        memory[entry..entry + 8].copy_from_slice(&48u64.to_le_bytes());
+        memory[entry + 16..entry + 24].copy_from_slice(&3u64.to_le_bytes());
+        let stats = unsafe { state.heap_stats(&vm) };
+        assert_eq!(stats.len(), 2);
+        assert_eq!(stats[0], PkuHeapStats::default());
+        assert_eq!(stats[1].in_use, 48);
+        assert_eq!(stats[1].allocations, 3);
+    }
+
+    #[test]
+    fn host_counters_count_while_started() {
+        let page = crate::page_size();
+        let base = unsafe {
+            libc::mmap(
+                std::ptr::null_mut(),
+                page,
+                libc::PROT_READ | libc::PROT_WRITE,
+                libc::MAP_PRIVATE | libc::MAP_ANONYMOUS,
+                -1,
+                0,
+            )
+        };
+        assert_ne!(base, libc::MAP_FAILED);
+        let rw = (libc::PROT_READ | libc::PROT_WRITE) as u32;
+
+        // Other tests may count at the same time, so only growth is checked.
+        let before = PkuCounters::read();
+        let counters = PkuCounters::start();
+        unsafe { Pku::pkey_mprotect_raw(base.cast(), page, rw, 0) };
+        let after = PkuCounters::read();
+        drop(counters);
+        assert!(after.mprotect_calls > before.mprotect_calls);
+        assert!(after.mprotect_bytes >= before.mprotect_bytes + page as u64);
+        assert_eq!(after.encode().len(), PkuHostStats::SIZE);
+        unsafe { libc::munmap(base, page) };
+    }
+
+    #[test]
+    fn queue_register_and_drain_bounds() {
+        let mut memory = vec![0u8; 0x1000];
+        let vm = VMMemoryDefinition {
+            base: memory.as_mut_ptr(),
+            current_length: memory.len().into(),
+        };
+        let mut state = PkuState::default();
+        assert_eq!(state.register_queue(&vm, 0x800, 0, false), -libc::EINVAL);
+        assert_eq!(state.register_queue(&vm, 0xff0, 4, false), -libc::EINVAL);
+        assert_eq!(state.register_queue(&vm, 0x100, 4, false), 0);
+
+        // An empty ring drains without touching any page.
+        assert_eq!(unsafe { state.drain_queue(&vm) }, 0);
+
+        // A head more than `capacity` ahead of the tail is rejected, and the
+        // ring is reset so the guest can recover.
+        memory[0x100..0x104].copy_from_slice(&5u32.to_le_bytes());
+        assert_eq!(unsafe { state.drain_queue(&vm) }, -libc::EINVAL);
+        assert_eq!(memory[0x104..0x108], 5u32.to_le_bytes());
+    }
+
+    #[test]
+    fn descriptor64_decodes_past_4gib() {
+        let mut d = [0u8; PkeyRange::DESCRIPTOR64_SIZE];
+        d[0..8].copy_from_slice(&0x3_0000_1000u64.to_le_bytes());
+        d[8..16].copy_from_slice(&0x1_0000_0000u64.to_le_bytes());
+        d[16..20].copy_from_slice(&7u32.to_le_bytes());
+        let range = PkeyRange::from_guest(&d, true).unwrap();
+        assert_eq!(range.offset, 0x3_0000_1000);
+        assert_eq!(range.len, 0x1_0000_0000);
+        assert_eq!(range.pkey, 7);
+        assert_eq!(PkuQueue::size(4, true), Some(8 + 4 * 24));
+
+        // A wide ring at the end of memory doesn't fit where a narrow one would.
+        let mut memory = vec![0u8; 0x1000];
+        let vm = VMMemoryDefinition {
+            base: memory.as_mut_ptr(),
+            current_length: memory.len().into(),
+        };
+        let mut state = PkuState::default();
+        assert_eq!(state.register_queue(&vm, 0xfc0, 4, false), 0);
+        assert_eq!(state.register_queue(&vm, 0xfc0, 4, true), -libc::EINVAL);
+    }
+
+    #[test]
+    fn unbacked_keys_run_out_and_come_back() {
+        let mut state = PkuState::default();
+        for pkey in 1..16 {
+            assert_eq!(state.lease_unbacked(), pkey);
+        }
+        assert_eq!(state.lease_unbacked(), -libc::ENOSPC);
+        assert_eq!(state.release_unbacked(7), 0);
+        assert_eq!(state.release_unbacked(7), -libc::EINVAL);
+        assert_eq!(state.release_unbacked(0), -libc::EINVAL);
+        assert_eq!(state.release_unbacked(16), -libc::EINVAL);
+        assert_eq!(state.lease_unbacked(), 7);
     }
 }
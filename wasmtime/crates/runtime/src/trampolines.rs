@@ -1,7 +1,9 @@
 //! Trampolines for calling into Wasm from the host and calling the host from
 //! Wasm.
 
-use crate::VMContext;
+use crate::pku::Pku;
+use crate::traphandlers::PkuProfiler;
+use crate::{VMContext, VMOpaqueContext};
 use std::mem;
 
 /// Given a Wasm function pointer and a `vmctx`, prepare the `vmctx` for calling
@@ -36,6 +38,57 @@ pub unsafe fn prepare_host_to_wasm_trampoline<T>(vmctx: *mut VMContext, func: T)
     mem::transmute_copy(&(host_to_wasm_trampoline as usize))
 }
 
+/// The host side of a call into a function that belongs to a protection
+/// domain.
+///
+/// Entering writes the callee's precomputed PKRU word and dropping the guard
+/// writes back the caller's, one `wrpkru` each way. The compiled prologue of
+/// the callee then finds its domain already active and skips its own
+/// switch. Unlike that prologue's epilogue, the guard also restores the
+/// caller's PKRU when the call traps, so it must be created outside of
+/// `catch_traps`.
+#[derive(Debug)]
+pub struct DomainEntry {
+    caller: i32,
+}
+
+impl DomainEntry {
+    /// Switch to `pkru`, the callee's word from
+    /// [`ExportFunction::pkru`](crate::ExportFunction::pkru), for as long as
+    /// the returned guard lives. Returns `None` for functions without a
+    /// domain and when `pkru` is already active, as nothing has to be
+    /// restored then.
+    ///
+    /// Tags the callee's instance inherited with a pooled slot are settled
+    /// first, as they could otherwise expose its pages to the domain.
+    ///
+    /// # Unsafety
+    ///
+    /// `vmctx` must be the callee's, a valid `VMContext` whenever `pkru` is
+    /// some.
+    #[inline]
+    pub unsafe fn enter(pkru: Option<u32>, vmctx: *mut VMOpaqueContext) -> Option<DomainEntry> {
+        let pkru = pkru? as i32;
+        (*VMContext::from_opaque(vmctx))
+            .instance_mut()
+            .settle_domains();
+        let caller = Pku::rdpkru();
+        if caller == pkru {
+            return None;
+        }
+        Pku::wrpkru(pkru);
+        PkuProfiler::record_switch(0, caller as u32, pkru as u32);
+        Some(DomainEntry { caller })
+    }
+}
+
+impl Drop for DomainEntry {
+    #[inline]
+    fn drop(&mut self) {
+        Pku::wrpkru(self.caller);
+    }
+}
+
 extern "C" {
     fn host_to_wasm_trampoline();
     pub(crate) fn wasm_to_host_trampoline();
@@ -2,7 +2,9 @@
 //! signalhandling mechanisms.
 
 mod backtrace;
+mod pku_profile;
 
+use crate::pku::Pku;
 use crate::{VMContext, VMRuntimeLimits};
 use anyhow::Error;
 use std::any::Any;
@@ -13,6 +15,7 @@ use std::sync::Once;
 use wasmtime_environ::TrapCode;
 
 pub use self::backtrace::Backtrace;
+pub use self::pku_profile::{PkuProfiler, PkuSample, PkuSwitch};
 pub use self::tls::{tls_eager_initialize, TlsRestore};
 
 #[link(name = "wasmtime-helpers")]
@@ -224,6 +227,12 @@ mod call_thread_state {
 
         pub(crate) limits: *const VMRuntimeLimits,
 
+        // PKRU when wasm was entered, written back when a trap unwinds past
+        // this state. Neither the domain the trap was taken in nor the
+        // kernel's signal frame, which the `longjmp` skips, restore it.
+        // `None` on hosts without protection keys.
+        entry_pkru: Option<i32>,
+
         prev: Cell<tls::Ptr>,
 
         // The values of `VMRuntimeLimits::last_wasm_{exit_{pc,fp},entry_sp}` for
@@ -252,6 +261,7 @@ mod call_thread_state {
                 signal_handler,
                 capture_backtrace,
                 limits,
+                entry_pkru: Pku::try_rdpkru(),
                 prev: Cell::new(ptr::null()),
                 old_last_wasm_exit_fp: Cell::new(0),
                 old_last_wasm_exit_pc: Cell::new(0),
@@ -274,6 +284,17 @@ mod call_thread_state {
             self.old_last_wasm_entry_sp.get()
         }
 
+        /// Put PKRU back to its value on entry, after a trap or panic left
+        /// it at the mask of whatever domain was running.
+        #[cold]
+        pub(super) fn restore_pkru(&self) {
+            if let Some(pkru) = self.entry_pkru {
+                if Pku::rdpkru() != pkru {
+                    Pku::wrpkru(pkru);
+                }
+            }
+        }
+
         /// Get the previous `CallThreadState`.
         pub fn prev(&self) -> tls::Ptr {
             self.prev.get()
@@ -375,6 +396,7 @@ impl CallThreadState {
         if ret != 0 {
             Ok(())
         } else {
+            self.restore_pkru();
             Err(unsafe { self.read_unwind() })
         }
     }
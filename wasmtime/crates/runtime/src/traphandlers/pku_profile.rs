@@ -0,0 +1,390 @@
+//! Sampling profiler of accesses across protection domains.
+//!
+//! While a profiler is running, a `SIGPROF` timer periodically closes every
+//! key but 0 that the interrupted wasm thread has open, by editing the PKRU
+//! saved in its signal frame. The thread's next access to one of those keys
+//! raises `SEGV_PKUERR`; the trap handler then records the faulting pc,
+//! address and key, writes the saved PKRU back and resumes the access.
+//! Switches made through the host are counted per call edge alongside.
+//!
+//! Only Linux on x86_64 is supported. While sampling, a thread that writes
+//! the very word a sample closed its keys with gets them back on its first
+//! fault, so profiling weakens isolation and is not meant for production.
+
+use std::collections::HashMap;
+use std::sync::atomic::{AtomicU32, AtomicU64, AtomicUsize, Ordering};
+use std::sync::Mutex;
+use std::time::Duration;
+
+/// One access the profiler caught on a closed key.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct PkuSample {
+    /// Program counter of the access.
+    pub pc: usize,
+    /// Host address accessed.
+    pub addr: usize,
+    /// Key of the page accessed.
+    pub pkey: u32,
+    /// PKRU the thread ran with before the sample closed its keys.
+    pub pkru: u32,
+}
+
+/// A switch made through the host, from `from` to `to`, both PKRU words.
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
+pub struct PkuSwitch {
+    /// Return address into the wasm caller, or 0 for a call from the host.
+    pub pc: usize,
+    /// PKRU before the switch.
+    pub from: u32,
+    /// PKRU after the switch.
+    pub to: u32,
+}
+
+/// Samples the ring holds before the oldest are overwritten.
+const CAPACITY: usize = 1 << 12;
+
+/// A ring slot, published by storing its sequence number last so that the
+/// signal handler never has to take a lock.
+struct Slot {
+    seq: AtomicUsize,
+    pc: AtomicUsize,
+    addr: AtomicUsize,
+    key: AtomicU64,
+}
+
+const EMPTY_SLOT: Slot = Slot {
+    seq: AtomicUsize::new(0),
+    pc: AtomicUsize::new(0),
+    addr: AtomicUsize::new(0),
+    key: AtomicU64::new(0),
+};
+
+static SLOTS: [Slot; CAPACITY] = [EMPTY_SLOT; CAPACITY];
+static NEXT: AtomicUsize = AtomicUsize::new(0);
+/// The next sample `take_samples` reads and how many it found overwritten.
+static READ: Mutex<(usize, u64)> = Mutex::new((0, 0));
+/// Running profilers; the timer runs while this is not 0.
+static RUNNING: AtomicU32 = AtomicU32::new(0);
+static SWITCHES: Mutex<Option<HashMap<PkuSwitch, u64>>> = Mutex::new(None);
+
+fn push(sample: PkuSample) {
+    let seq = NEXT.fetch_add(1, Ordering::Relaxed);
+    let slot = &SLOTS[seq % CAPACITY];
+    slot.seq.store(0, Ordering::Relaxed);
+    slot.pc.store(sample.pc, Ordering::Relaxed);
+    slot.addr.store(sample.addr, Ordering::Relaxed);
+    slot.key.store(
+        u64::from(sample.pkey) << 32 | u64::from(sample.pkru),
+        Ordering::Relaxed,
+    );
+    slot.seq.store(seq + 1, Ordering::Release);
+}
+
+/// A running cross-domain access profiler, stopped when dropped.
+///
+/// Profilers are process-wide: while any is alive every thread running wasm
+/// is sampled, and [`PkuProfiler::take_samples`] returns what all of them
+/// caught.
+#[derive(Debug)]
+pub struct PkuProfiler {
+    _private: (),
+}
+
+impl PkuProfiler {
+    /// Start sampling every `interval` of CPU time, or join the profiler
+    /// already running at its interval. Returns a negated errno, `ENOTSUP`
+    /// on hosts without protection keys or outside Linux on x86_64.
+    pub fn start(interval: Duration) -> Result<PkuProfiler, i32> {
+        let mut switches = SWITCHES.lock().unwrap();
+        if RUNNING.load(Ordering::Relaxed) == 0 {
+            unsafe { sys::start(interval)? };
+            switches.get_or_insert_with(HashMap::new);
+        }
+        RUNNING.fetch_add(1, Ordering::Relaxed);
+        Ok(PkuProfiler { _private: () })
+    }
+
+    /// Whether any profiler is running, for callers deciding whether to
+    /// record a switch at all.
+    #[inline]
+    pub fn is_running() -> bool {
+        RUNNING.load(Ordering::Relaxed) != 0
+    }
+
+    /// Count a switch from `from` to `to` made by the caller at `pc`.
+    pub fn record_switch(pc: usize, from: u32, to: u32) {
+        if from == to || !Self::is_running() {
+            return;
+        }
+        if let Some(switches) = SWITCHES.lock().unwrap().as_mut() {
+            *switches.entry(PkuSwitch { pc, from, to }).or_insert(0) += 1;
+        }
+    }
+
+    /// The samples caught since the last call, oldest first, and how many
+    /// were overwritten before they could be read.
+    pub fn take_samples() -> (Vec<PkuSample>, u64) {
+        let mut read = READ.lock().unwrap();
+        let end = NEXT.load(Ordering::Acquire);
+        let mut samples = Vec::with_capacity(end.saturating_sub(read.0).min(CAPACITY));
+        let mut lost = std::mem::take(&mut read.1);
+        if end - read.0 > CAPACITY {
+            lost += (end - read.0 - CAPACITY) as u64;
+            read.0 = end - CAPACITY;
+        }
+        for seq in read.0..end {
+            let slot = &SLOTS[seq % CAPACITY];
+            if slot.seq.load(Ordering::Acquire) != seq + 1 {
+                lost += 1;
+                continue;
+            }
+            let key = slot.key.load(Ordering::Relaxed);
+            samples.push(PkuSample {
+                pc: slot.pc.load(Ordering::Relaxed),
+                addr: slot.addr.load(Ordering::Relaxed),
+                pkey: (key >> 32) as u32,
+                pkru: key as u32,
+            });
+        }
+        read.0 = end;
+        (samples, lost)
+    }
+
+    /// The switches counted since the last call, with their counts.
+    pub fn take_switches() -> Vec<(PkuSwitch, u64)> {
+        match SWITCHES.lock().unwrap().as_mut() {
+            Some(switches) => switches.drain().collect(),
+            None => Vec::new(),
+        }
+    }
+}
+
+impl Drop for PkuProfiler {
+    fn drop(&mut self) {
+        let _switches = SWITCHES.lock().unwrap();
+        if RUNNING.fetch_sub(1, Ordering::Relaxed) == 1 {
+            unsafe { sys::stop() };
+        }
+    }
+}
+
+/// Called by the trap handler for every `SIGSEGV`. Returns whether the fault
+/// was a sampled access, which has been recorded and may now be retried.
+#[cfg(unix)]
+pub(super) unsafe fn regrant(siginfo: *const libc::siginfo_t, context: *mut libc::c_void) -> bool {
+    sys::regrant(siginfo, context)
+}
+
+#[cfg(all(target_os = "linux", target_arch = "x86_64"))]
+mod sys {
+    use super::{push, PkuSample, RUNNING};
+    use crate::pku::Pku;
+    use crate::traphandlers::tls;
+    use std::cell::Cell;
+    use std::mem::{self, MaybeUninit};
+    use std::ptr;
+    use std::sync::atomic::{AtomicU32, AtomicUsize, Ordering};
+    use std::time::Duration;
+
+    /// `si_code` of a fault on a page whose key PKRU denies.
+    const SEGV_PKUERR: i32 = 4;
+    /// `FP_XSTATE_MAGIC1`, marking a signal frame with an XSAVE area.
+    const FP_XSTATE_MAGIC1: u32 = 0x4650_5853;
+    /// XSAVE component 9 is PKRU.
+    const XFEATURE_PKRU: u64 = 1 << 9;
+
+    /// Offset of PKRU in the standard-format XSAVE area, from CPUID.
+    static PKRU_OFFSET: AtomicUsize = AtomicUsize::new(0);
+    static mut PREV_SIGPROF: MaybeUninit<libc::sigaction> = MaybeUninit::uninit();
+    /// The host's own `ITIMER_PROF`, put back once profiling stops.
+    static mut PREV_ITIMER: MaybeUninit<libc::itimerval> = MaybeUninit::uninit();
+    /// Bumped by every `start`, so that records a thread kept from an
+    /// earlier profiling run are never honoured.
+    static SESSION: AtomicU32 = AtomicU32::new(0);
+
+    thread_local! {
+        /// The PKRU the last sample on this thread found, the word it
+        /// closed the keys with, and the session it was taken in. Cleared
+        /// by the next fault.
+        static REVOKED: Cell<Option<(u32, u32, u32)>> = const { Cell::new(None) };
+    }
+
+    /// Offset of `si_pkey` in `siginfo_t`, past `si_addr`, `si_addr_lsb`
+    /// and the alignment of the union it shares with `si_addr_bnd`.
+    const SI_PKEY_OFFSET: usize = 32;
+
+    /// PKRU as saved in a signal frame, restored by `sigreturn`.
+    struct FramePkru {
+        slot: *mut u32,
+        present: *mut u64,
+    }
+
+    impl FramePkru {
+        unsafe fn of(context: *mut libc::c_void) -> Option<FramePkru> {
+            let offset = PKRU_OFFSET.load(Ordering::Relaxed);
+            let cx = &mut *(context as *mut libc::ucontext_t);
+            let fx = cx.uc_mcontext.fpregs as *mut u8;
+            if offset == 0 || fx.is_null() {
+                return None;
+            }
+            // `struct _fpx_sw_bytes` sits in the software-reserved tail of
+            // the legacy area and says which components the frame holds.
+            let sw = fx.add(464);
+            let xfeatures = (sw.add(8) as *const u64).read_unaligned();
+            if (sw as *const u32).read_unaligned() != FP_XSTATE_MAGIC1
+                || xfeatures & XFEATURE_PKRU == 0
+            {
+                return None;
+            }
+            Some(FramePkru {
+                slot: fx.add(offset) as *mut u32,
+                present: fx.add(512) as *mut u64,
+            })
+        }
+
+        unsafe fn get(&self) -> u32 {
+            // A component outside `XSTATE_BV` is in its initial state.
+            if self.present.read_unaligned() & XFEATURE_PKRU == 0 {
+                return 0;
+            }
+            self.slot.read_unaligned()
+        }
+
+        unsafe fn set(&self, pkru: u32) {
+            self.slot.write_unaligned(pkru);
+            self.present
+                .write_unaligned(self.present.read_unaligned() | XFEATURE_PKRU);
+        }
+    }
+
+    pub unsafe fn start(interval: Duration) -> Result<(), i32> {
+        if !Pku::supported() {
+            return Err(-libc::ENOTSUP);
+        }
+        // CPUID.(EAX=0DH,ECX=9):EBX
+        let offset = std::arch::x86_64::__cpuid_count(0xd, 9).ebx as usize;
+        if offset == 0 {
+            return Err(-libc::ENOTSUP);
+        }
+        PKRU_OFFSET.store(offset, Ordering::Relaxed);
+        SESSION.fetch_add(1, Ordering::Relaxed);
+
+        let mut handler: libc::sigaction = mem::zeroed();
+        handler.sa_flags = libc::SA_SIGINFO | libc::SA_RESTART | libc::SA_ONSTACK;
+        handler.sa_sigaction = sample_handler as usize;
+        libc::sigemptyset(&mut handler.sa_mask);
+        if libc::sigaction(libc::SIGPROF, &handler, PREV_SIGPROF.as_mut_ptr()) != 0 {
+            return Err(-errno());
+        }
+        let period = libc::timeval {
+            tv_sec: interval.as_secs() as libc::time_t,
+            tv_usec: interval.subsec_micros().max(1) as libc::suseconds_t,
+        };
+        let timer = libc::itimerval {
+            it_interval: period,
+            it_value: period,
+        };
+        if libc::setitimer(libc::ITIMER_PROF, &timer, PREV_ITIMER.as_mut_ptr()) != 0 {
+            let err = -errno();
+            libc::sigaction(libc::SIGPROF, PREV_SIGPROF.as_ptr(), ptr::null_mut());
+            return Err(err);
+        }
+        Ok(())
+    }
+
+    fn errno() -> i32 {
+        std::io::Error::last_os_error()
+            .raw_os_error()
+            .unwrap_or(libc::EINVAL)
+    }
+
+    pub unsafe fn stop() {
+        libc::setitimer(libc::ITIMER_PROF, PREV_ITIMER.as_ptr(), ptr::null_mut());
+        libc::sigaction(libc::SIGPROF, PREV_SIGPROF.as_ptr(), ptr::null_mut());
+        REVOKED.with(|r| r.set(None));
+    }
+
+    /// Close the keys of a thread interrupted in wasm, unless its last
+    /// sample is still waiting for an access.
+    unsafe extern "C" fn sample_handler(
+        _signum: libc::c_int,
+        _siginfo: *mut libc::siginfo_t,
+        context: *mut libc::c_void,
+    ) {
+        if !tls::with(|info| info.is_some()) {
+            return;
+        }
+        let frame = match FramePkru::of(context) {
+            Some(frame) => frame,
+            None => return,
+        };
+        let pkru = frame.get();
+        let session = SESSION.load(Ordering::Relaxed);
+        if let Some((_, revoked, taken)) = REVOKED.with(|r| r.get()) {
+            if revoked == pkru && taken == session {
+                return;
+            }
+        }
+        // Access-disable every key but 0 the thread can still access.
+        let open = (1..16)
+            .filter(|k| pkru & (1 << (2 * k)) == 0)
+            .fold(0, |m, k| m | 1 << (2 * k));
+        if open == 0 {
+            return;
+        }
+        frame.set(pkru | open);
+        REVOKED.with(|r| r.set(Some((pkru, pkru | open, session))));
+    }
+
+    pub unsafe fn regrant(siginfo: *const libc::siginfo_t, context: *mut libc::c_void) -> bool {
+        // A sample is good for one fault, and none once profiling stopped.
+        let (pkru, revoked) = match REVOKED.with(|r| r.take()) {
+            Some((pkru, revoked, taken))
+                if RUNNING.load(Ordering::Relaxed) != 0
+                    && taken == SESSION.load(Ordering::Relaxed) =>
+            {
+                (pkru, revoked)
+            }
+            _ => return false,
+        };
+        let pkey = ((siginfo as *const u8).add(SI_PKEY_OFFSET) as *const u32).read();
+        if (*siginfo).si_code != SEGV_PKUERR || pkey >= 16 {
+            return false;
+        }
+        // Only keys the sample closed are given back, anything else is a
+        // real violation.
+        let bit = 1 << (2 * pkey);
+        if revoked & bit == 0 || pkru & bit != 0 {
+            return false;
+        }
+        let frame = match FramePkru::of(context) {
+            Some(frame) if frame.get() == revoked => frame,
+            _ => return false,
+        };
+        let cx = &*(context as *const libc::ucontext_t);
+        push(PkuSample {
+            pc: cx.uc_mcontext.gregs[libc::REG_RIP as usize] as usize,
+            addr: (*siginfo).si_addr() as usize,
+            pkey,
+            pkru,
+        });
+        frame.set(pkru);
+        true
+    }
+}
+
+#[cfg(not(all(target_os = "linux", target_arch = "x86_64")))]
+mod sys {
+    use std::time::Duration;
+
+    pub unsafe fn start(_interval: Duration) -> Result<(), i32> {
+        Err(-libc::ENOTSUP)
+    }
+
+    pub unsafe fn stop() {}
+
+    #[cfg(unix)]
+    pub unsafe fn regrant(_siginfo: *const libc::siginfo_t, _context: *mut libc::c_void) -> bool {
+        false
+    }
+}
@@ -71,6 +71,11 @@ unsafe extern "C" fn trap_handler(
         libc::SIGILL => &PREV_SIGILL,
         _ => panic!("unknown signal: {}", signum),
     };
+    // An access the cross-domain profiler closed the key of is recorded
+    // and retried with the key open again, wherever it happened.
+    if signum == libc::SIGSEGV && super::pku_profile::regrant(siginfo, context) {
+        return;
+    }
     let handled = tls::with(|info| {
         // If no wasm code is executing, we don't handle this as a wasm
         // trap.
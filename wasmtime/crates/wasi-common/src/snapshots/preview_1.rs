@@ -1244,6 +1244,8 @@ impl wasi_snapshot_preview1::WasiSnapshotPreview1 for WasiCtx {
         buf_len: types::Size,
     ) -> Result<(), Error> {
         let mut buf = buf.as_array(buf_len).as_slice_mut()?;
+        // Legacy PKU protocol of modules built before the typed `pku` host
+        // module (see `wasmtime::IsolatedMomery::add_to_linker`).
         if buf_len == 12 {
             buf.new_wasi_func();
         } else {
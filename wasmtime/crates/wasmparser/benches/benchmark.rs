@@ -911,4 +911,5 @@ impl<'a> VisitOperator<'a> for NopVisit {
 
     fn visit_memory_read_pkru(&mut self, offset: usize) {}
     fn visit_memory_write_pkru(&mut self, offset: usize) {}
+    fn visit_memory_switch_domain(&mut self, offset: usize, domain: u32) {}
 }
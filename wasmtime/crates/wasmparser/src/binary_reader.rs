@@ -2084,6 +2084,7 @@ impl<'a> BinaryReader<'a> {
         Ok(match code {
             0xee => visitor.visit_memory_read_pkru(pos),
             0xef => visitor.visit_memory_write_pkru(pos),
+            0xf0 => visitor.visit_memory_switch_domain(pos, self.read_var_u32()?),
 
             _ => {
                 return Err(BinaryReaderError::new(
@@ -2844,4 +2845,5 @@ impl<'a> VisitOperator<'a> for OperatorFactory<'a> {
 
     fn visit_memory_read_pkru(&mut self, _offset: usize) -> Self::Output { Operator::Rdpkru }
     fn visit_memory_write_pkru(&mut self, _offset: usize) -> Self::Output { Operator::Wrpkru }
+    fn visit_memory_switch_domain(&mut self, _offset: usize, domain: u32) -> Self::Output { Operator::SwitchDomain { domain } }
 }
@@ -412,6 +412,7 @@ pub enum Operator<'a> {
     // memory protection key
     Rdpkru,
     Wrpkru,
+    SwitchDomain { domain: u32 },
 
     // 0xFC operators
     // Non-trapping Float-to-int Conversions
@@ -1742,6 +1743,7 @@ pub trait VisitOperator<'a> {
 
             Operator::Rdpkru => self.visit_memory_read_pkru(offset),
             Operator::Wrpkru => self.visit_memory_write_pkru(offset),
+            Operator::SwitchDomain { domain } => self.visit_memory_switch_domain(offset, domain),
         }
     }
 
@@ -2493,4 +2495,5 @@ pub trait VisitOperator<'a> {
 
     fn visit_memory_read_pkru(&mut self, offset: usize) -> Self::Output;
     fn visit_memory_write_pkru(&mut self, offset: usize) -> Self::Output;
+    fn visit_memory_switch_domain(&mut self, offset: usize, domain: u32) -> Self::Output;
 }
@@ -757,4 +757,5 @@ where
 
     fn visit_memory_read_pkru(&mut self, offset: usize) -> Self::Output { forward!(self.visit_memory_read_pkru(offset)) }
     fn visit_memory_write_pkru(&mut self, offset: usize) -> Self::Output { forward!(self.visit_memory_read_pkru(offset)) }
+    fn visit_memory_switch_domain(&mut self, offset: usize, domain: u32) -> Self::Output { forward!(self.visit_memory_switch_domain(offset, domain)) }
 }
@@ -23,9 +23,9 @@
 // the various methods here.
 
 use crate::{
-    limits::MAX_WASM_FUNCTION_LOCALS, BinaryReaderError, BlockType, BrTable, Ieee32, Ieee64,
-    MemoryImmediate, Result, SIMDLaneIndex, ValType, VisitOperator, WasmFeatures, WasmFuncType,
-    WasmModuleResources, V128,
+    limits::{MAX_WASM_DOMAINS, MAX_WASM_FUNCTION_LOCALS},
+    BinaryReaderError, BlockType, BrTable, Ieee32, Ieee64, MemoryImmediate, Result, SIMDLaneIndex,
+    ValType, VisitOperator, WasmFeatures, WasmFuncType, WasmModuleResources, V128,
 };
 use std::ops::{Deref, DerefMut};
 
@@ -3345,6 +3345,16 @@ where
     fn visit_memory_write_pkru(&mut self, offset: usize) -> Self::Output {
         self.check_binary_op(offset, ValType::I32)
     }
+    fn visit_memory_switch_domain(&mut self, offset: usize, domain: u32) -> Self::Output {
+        if domain >= MAX_WASM_DOMAINS {
+            bail_op_err!(
+                offset,
+                "unknown domain {}: domain index out of bounds",
+                domain
+            );
+        }
+        Ok(())
+    }
 }
 
 enum Either<A, B> {
@@ -124,7 +124,13 @@ impl Func {
         let post_return = options.post_return.map(|i| {
             let anyfunc = data.instance().runtime_post_return(i);
             let trampoline = store.lookup_trampoline(unsafe { anyfunc.as_ref() });
-            (ExportFunction { anyfunc }, trampoline)
+            (
+                ExportFunction {
+                    anyfunc,
+                    pkru: None,
+                },
+                trampoline,
+            )
         });
         let component_instance = options.instance;
         let options = unsafe { Options::new(store.id(), memory, realloc, options.string_encoding) };
@@ -428,12 +434,7 @@ impl Func {
             // wasm function we're calling. Note that this latter point relies
             // on the correctness of this module and `ComponentType`
             // implementations, hence `ComponentType` being an `unsafe` trait.
-            crate::Func::call_unchecked_raw(
-                store,
-                export.anyfunc,
-                trampoline,
-                space.as_mut_ptr().cast(),
-            )?;
+            crate::Func::call_unchecked_raw(store, export, trampoline, space.as_mut_ptr().cast())?;
 
             // Note that `.assume_init_ref()` here is unsafe but we're relying
             // on the correctness of the structure of `LowerReturn` and the
@@ -542,7 +543,7 @@ impl Func {
             if let Some((func, trampoline)) = post_return {
                 crate::Func::call_unchecked_raw(
                     &mut store,
-                    func.anyfunc,
+                    func,
                     trampoline,
                     &post_return_arg as *const ValRaw as *mut ValRaw,
                 )?;
@@ -125,11 +125,13 @@ impl InstanceData {
             CoreDef::Lowered(idx) => {
                 wasmtime_runtime::Export::Function(wasmtime_runtime::ExportFunction {
                     anyfunc: self.state.lowering_anyfunc(*idx),
+                    pkru: None,
                 })
             }
             CoreDef::AlwaysTrap(idx) => {
                 wasmtime_runtime::Export::Function(wasmtime_runtime::ExportFunction {
                     anyfunc: self.state.always_trap_anyfunc(*idx),
+                    pkru: None,
                 })
             }
             CoreDef::InstanceFlags(idx) => {
@@ -145,6 +147,7 @@ impl InstanceData {
             CoreDef::Transcoder(idx) => {
                 wasmtime_runtime::Export::Function(wasmtime_runtime::ExportFunction {
                     anyfunc: self.state.transcoder_anyfunc(*idx),
+                    pkru: None,
                 })
             }
         }
@@ -7,12 +7,13 @@ use std::fmt;
 #[cfg(feature = "cache")]
 use std::path::Path;
 use std::sync::Arc;
+use std::time::Duration;
 use wasmparser::WasmFeatures;
 #[cfg(feature = "cache")]
 use wasmtime_cache::CacheConfig;
 use wasmtime_environ::Tunables;
 use wasmtime_jit::{JitDumpAgent, NullProfilerAgent, ProfilingAgent, VTuneAgent};
-use wasmtime_runtime::{InstanceAllocator, OnDemandInstanceAllocator, RuntimeMemoryCreator};
+use wasmtime_runtime::{InstanceAllocator, OnDemandInstanceAllocator, Pku, RuntimeMemoryCreator};
 
 pub use wasmtime_environ::CacheStore;
 
@@ -110,6 +111,10 @@ pub struct Config {
     pub(crate) memory_guaranteed_dense_image_size: u64,
     pub(crate) force_memory_init_memfd: bool,
     pub(crate) async_stack_zeroing: bool,
+    pub(crate) pku_pkey_quota: u32,
+    pub(crate) pku_profile: Option<Duration>,
+    pub(crate) pku_stats: bool,
+    pub(crate) pku_mode: PkuMode,
 }
 
 /// User-provided configuration for the compiler.
@@ -198,6 +203,10 @@ impl Config {
             memory_guaranteed_dense_image_size: 16 << 20,
             force_memory_init_memfd: false,
             async_stack_zeroing: false,
+            pku_pkey_quota: 0,
+            pku_profile: None,
+            pku_stats: false,
+            pku_mode: PkuMode::Auto,
         };
         #[cfg(compiler)]
         {
@@ -1106,6 +1115,103 @@ impl Config {
         self
     }
 
+    /// Indicates that memories should never move when they grow, so that
+    /// their protection-key tags stay in place.
+    ///
+    /// Moving a memory hands out fresh pages under the default key, and every
+    /// domain must then be re-tagged before the guest resumes. With this
+    /// option any memory whose maximum fits in 4GiB is made "static" with a
+    /// reservation of that maximum, even if it exceeds
+    /// [`Config::static_memory_maximum_size`]. Memories that are still
+    /// dynamic re-apply only their recorded non-default key ranges on a move.
+    ///
+    /// This is disabled by default.
+    pub fn pku_non_moving_memories(&mut self, enable: bool) -> &mut Self {
+        self.tunables.pku_non_moving_memories = enable;
+        self
+    }
+
+    /// Compiles modules to report every PKRU write they make to the store,
+    /// which accounts the time each domain runs for, see
+    /// [`Store::pku_domain_times`](crate::Store::pku_domain_times), and can
+    /// limit it, see [`Store::pku_domain_slice`](crate::Store::pku_domain_slice).
+    ///
+    /// Each switch compiled into wasm then makes a call into the host,
+    /// which costs far more than the switch itself. Modules compiled with
+    /// and without this option can't be loaded into each other's engines.
+    ///
+    /// This is disabled by default.
+    pub fn pku_domain_time(&mut self, enable: bool) -> &mut Self {
+        self.tunables.pku_domain_time = enable;
+        self
+    }
+
+    /// Sets how many protection keys each instance leases when it is
+    /// created, so that the guest's `pkey_alloc` calls are served from them
+    /// without a lock or a syscall, and keys it frees are kept for it.
+    ///
+    /// Keys are held as long as the instance lives, leaving fewer for other
+    /// instances to have to themselves. The keys of domains laid out
+    /// statically by the `pkuwa.layout` and `pkuwa.memories` sections are
+    /// claimed at instantiation anyway and don't count towards the quota.
+    /// Instantiation fails if the quota can't be met; at most 15 keys are
+    /// usable.
+    ///
+    /// This is 0 by default, leasing keys as the guest asks for them.
+    pub fn pku_pkey_quota(&mut self, keys: u32) -> &mut Self {
+        self.pku_pkey_quota = keys;
+        self
+    }
+
+    /// Samples which code accesses which domain's memory every `interval`
+    /// of CPU time while the engine is alive, or never with `None`.
+    ///
+    /// Each sample closes the keys the running wasm thread has open and
+    /// records the first access that faults on one of them, before opening
+    /// it again. Switches made through the host are counted per call edge
+    /// as well. The results are read with
+    /// [`Store::pku_profile`](crate::Store::pku_profile).
+    ///
+    /// Sampling is process-wide and needs Linux on x86_64 with protection
+    /// keys, creating the engine fails elsewhere. It weakens isolation and
+    /// is only meant for choosing domain boundaries.
+    ///
+    /// This is `None` by default.
+    pub fn pku_profile(&mut self, interval: Option<Duration>) -> &mut Self {
+        self.pku_profile = interval;
+        self
+    }
+
+    /// Counts the host's domain switches, `pkey_mprotect` calls and bytes,
+    /// guest mappings, and layouts tagged again after a moving grow while
+    /// the engine is alive. The counters are process-wide and read with
+    /// [`Store::pku_stats`](crate::Store::pku_stats), or by guests with the
+    /// `stats` hostcall.
+    ///
+    /// This is `false` by default, which leaves the counters where they
+    /// are.
+    pub fn pku_stats(&mut self, enable: bool) -> &mut Self {
+        self.pku_stats = enable;
+        self
+    }
+
+    /// Selects whether protection-key isolation is compiled in and carried
+    /// out, see [`PkuMode`].
+    ///
+    /// With isolation off the `pkuwa` sections of modules are validated but
+    /// ignored, Cranelift compiles `rdmemkey` to a constant 0 and `wrmemkey`
+    /// and domain switches to nothing, and the `pku` host modules defined by
+    /// [`IsolatedMomery::add_to_linker`](crate::IsolatedMomery::add_to_linker)
+    /// return immediately. Modules then run unchanged, and without any cost
+    /// of isolation, on hosts without protection keys. Modules compiled with
+    /// and without isolation can't be loaded into each other's engines.
+    ///
+    /// This is [`PkuMode::Auto`] by default.
+    pub fn pku_mode(&mut self, mode: PkuMode) -> &mut Self {
+        self.pku_mode = mode;
+        self
+    }
+
     /// Configures the size, in bytes, of the guard region used at the end of a
     /// static memory's address space reservation.
     ///
@@ -1438,10 +1544,30 @@ impl Config {
         {
             bail!("static memory guard size cannot be smaller than dynamic memory guard size");
         }
+        #[cfg(compiler)]
+        let cross_compiling = self.compiler_config.target.is_some();
+        #[cfg(not(compiler))]
+        let cross_compiling = false;
+        if self.pku_mode == PkuMode::On && !cross_compiling && !Pku::supported() {
+            bail!("PKU isolation is on but the host has no protection keys");
+        }
 
         Ok(())
     }
 
+    /// Whether protection-key isolation is on, with [`PkuMode::Auto`]
+    /// resolved against the host. A cross-compilation target can't be
+    /// probed, so `Auto` compiles isolation in for it.
+    pub(crate) fn pku_enabled(&self) -> bool {
+        match self.pku_mode {
+            PkuMode::On => true,
+            PkuMode::Off => false,
+            #[cfg(compiler)]
+            PkuMode::Auto if self.compiler_config.target.is_some() => true,
+            PkuMode::Auto => Pku::supported(),
+        }
+    }
+
     pub(crate) fn build_allocator(&self) -> Result<Box<dyn InstanceAllocator>> {
         #[cfg(feature = "async")]
         let stack_size = self.async_stack_size;
@@ -1528,6 +1654,34 @@ impl Config {
             }
         }
 
+        // Without isolation the PKU operators are compiled away, which the
+        // backends do when the key register is not available.
+        if !self.tunables.pku_isolation {
+            let arch = self
+                .compiler_config
+                .target
+                .as_ref()
+                .map_or(target_lexicon::Triple::host().architecture, |target| {
+                    target.architecture
+                });
+            let flag = match arch {
+                target_lexicon::Architecture::X86_64 => Some("has_pkru"),
+                target_lexicon::Architecture::Aarch64(_) => Some("has_poe"),
+                _ => None,
+            };
+            if let Some(flag) = flag {
+                if !self
+                    .compiler_config
+                    .ensure_setting_unset_or_given(flag, "false")
+                {
+                    bail!(
+                        "compiler option '{}' must be disabled when PKU is off",
+                        flag
+                    );
+                }
+            }
+        }
+
         // Apply compiler settings and flags
         for (k, v) in self.compiler_config.settings.iter() {
             compiler.set(k, v)?;
@@ -1594,7 +1748,11 @@ impl fmt::Debug for Config {
                 "guard_before_linear_memory",
                 &self.tunables.guard_before_linear_memory,
             )
-            .field("parallel_compilation", &self.parallel_compilation);
+            .field("parallel_compilation", &self.parallel_compilation)
+            .field("pku_pkey_quota", &self.pku_pkey_quota)
+            .field("pku_profile", &self.pku_profile)
+            .field("pku_stats", &self.pku_stats)
+            .field("pku_mode", &self.pku_mode);
         #[cfg(compiler)]
         {
             f.field("compiler_config", &self.compiler_config);
@@ -1668,3 +1826,20 @@ pub enum WasmBacktraceDetails {
     /// `WASMTIME_BACKTRACE_DETAILS` environment variable.
     Environment,
 }
+
+/// Whether protection-key isolation is carried out, see [`Config::pku_mode`].
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum PkuMode {
+    /// Isolation is compiled away: modules run as if they had no domains,
+    /// and the PKU hostcalls return immediately.
+    Off,
+
+    /// Isolation is always carried out. Creating an engine for the host
+    /// fails where it has no protection keys.
+    On,
+
+    /// Isolation is on where the host has protection keys enabled, checked
+    /// with CPUID on x86_64 and the hardware capabilities on AArch64, and
+    /// off elsewhere.
+    Auto,
+}
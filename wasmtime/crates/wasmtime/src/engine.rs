@@ -1,6 +1,6 @@
 use crate::signatures::SignatureRegistry;
 use crate::Config;
-use anyhow::Result;
+use anyhow::{bail, Result};
 use once_cell::sync::OnceCell;
 #[cfg(feature = "parallel-compilation")]
 use rayon::prelude::*;
@@ -10,7 +10,9 @@ use std::sync::Arc;
 use wasmtime_cache::CacheConfig;
 use wasmtime_environ::FlagValue;
 use wasmtime_jit::ProfilingAgent;
-use wasmtime_runtime::{debug_builtins, CompiledModuleIdAllocator, InstanceAllocator};
+use wasmtime_runtime::{
+    debug_builtins, CompiledModuleIdAllocator, InstanceAllocator, PkuCounters, PkuProfiler,
+};
 
 /// An `Engine` which is a global context for compilation and management of wasm
 /// modules.
@@ -48,6 +50,11 @@ struct EngineInner {
     signatures: SignatureRegistry,
     epoch: AtomicU64,
     unique_id_allocator: CompiledModuleIdAllocator,
+    // Keeps the cross-domain access profiler sampling, see
+    // `Config::pku_profile`.
+    _pku_profile: Option<PkuProfiler>,
+    // Keeps the isolation counters counting, see `Config::pku_stats`.
+    _pku_counters: Option<PkuCounters>,
 
     // One-time check of whether the compiler's settings, if present, are
     // compatible with the native host.
@@ -77,6 +84,7 @@ impl Engine {
         let registry = SignatureRegistry::new();
         let mut config = config.clone();
         config.validate()?;
+        config.tunables.pku_isolation = config.pku_enabled();
 
         #[cfg(compiler)]
         let compiler = config.build_compiler()?;
@@ -84,6 +92,16 @@ impl Engine {
         let allocator = config.build_allocator()?;
         allocator.adjust_tunables(&mut config.tunables);
         let profiler = config.build_profiler()?;
+        let pku_profile = match config.pku_profile {
+            Some(interval) => match PkuProfiler::start(interval) {
+                Ok(profiler) => Some(profiler),
+                Err(err) => bail!(
+                    "failed to start the cross-domain access profiler: {}",
+                    std::io::Error::from_raw_os_error(-err)
+                ),
+            },
+            None => None,
+        };
 
         Ok(Engine {
             inner: Arc::new(EngineInner {
@@ -95,6 +113,8 @@ impl Engine {
                 signatures: registry,
                 epoch: AtomicU64::new(0),
                 unique_id_allocator: CompiledModuleIdAllocator::new(),
+                _pku_profile: pku_profile,
+                _pku_counters: config.pku_stats.then(PkuCounters::start),
                 compatible_with_native_host: OnceCell::new(),
             }),
         })
@@ -465,6 +485,11 @@ impl Engine {
                 // The `BTI` instruction acts as a `NOP` when unsupported, so it
                 // is safe to enable it.
                 "use_bti" => Some(true),
+                #[cfg(target_os = "linux")]
+                "has_poe" => {
+                    const HWCAP2_POE: libc::c_ulong = 1 << 63;
+                    Some(unsafe { libc::getauxval(libc::AT_HWCAP2) } & HWCAP2_POE != 0)
+                }
                 // fall through to the very bottom to indicate that support is
                 // not enabled to test whether this feature is enabled on the
                 // host.
@@ -509,7 +534,7 @@ impl Engine {
                 "has_avx512vl" => Some(std::is_x86_feature_detected!("avx512vl")),
                 "has_avx512vbmi" => Some(std::is_x86_feature_detected!("avx512vbmi")),
                 "has_lzcnt" => Some(std::is_x86_feature_detected!("lzcnt")),
-                "has_pkru" => Some(std::is_x86_feature_detected!("xsaves")),
+                "has_pkru" => Some(wasmtime_runtime::Pku::supported()),
 
                 // fall through to the very bottom to indicate that support is
                 // not enabled to test whether this feature is enabled on the
@@ -10,10 +10,11 @@ use std::panic::{self, AssertUnwindSafe};
 use std::pin::Pin;
 use std::ptr::NonNull;
 use std::sync::Arc;
+use wasmtime_environ::{EntityRef, MemoryIndex};
 use wasmtime_runtime::{
-    raise_user_trap, ExportFunction, InstanceHandle, VMCallerCheckedAnyfunc, VMContext,
-    VMFunctionBody, VMFunctionImport, VMHostFuncContext, VMOpaqueContext, VMSharedSignatureIndex,
-    VMTrampoline,
+    raise_user_trap, DomainEntry, ExportFunction, InstanceHandle, VMCallerCheckedAnyfunc,
+    VMContext, VMFunctionBody, VMFunctionImport, VMHostFuncContext, VMMemoryDefinition,
+    VMOpaqueContext, VMSharedSignatureIndex, VMTrampoline,
 };
 
 /// A WebAssembly function which can be called.
@@ -476,7 +477,10 @@ impl Func {
     ) -> Option<Func> {
         let anyfunc = NonNull::new(raw)?;
         debug_assert!(anyfunc.as_ref().type_index != VMSharedSignatureIndex::default());
-        let export = ExportFunction { anyfunc };
+        let export = ExportFunction {
+            anyfunc,
+            pkru: None,
+        };
         Some(Func::from_wasmtime_function(export, store))
     }
 
@@ -814,18 +818,22 @@ impl Func {
     ) -> Result<(), Trap> {
         let mut store = store.as_context_mut();
         let data = &store.0.store_data()[self.0];
-        let anyfunc = data.export().anyfunc;
+        let export = data.export();
         let trampoline = data.trampoline();
-        Self::call_unchecked_raw(&mut store, anyfunc, trampoline, params_and_returns)
+        Self::call_unchecked_raw(&mut store, export, trampoline, params_and_returns)
     }
 
     pub(crate) unsafe fn call_unchecked_raw<T>(
         store: &mut StoreContextMut<'_, T>,
-        anyfunc: NonNull<VMCallerCheckedAnyfunc>,
+        export: ExportFunction,
         trampoline: VMTrampoline,
         params_and_returns: *mut ValRaw,
     ) -> Result<(), Trap> {
+        let anyfunc = export.anyfunc;
         // println!("in call_unchecked_raw");
+        // Switch outside of `catch_traps` so a trap still restores the
+        // caller's PKRU.
+        let _domain = DomainEntry::enter(export.pkru, anyfunc.as_ref().vmctx);
         invoke_wasm_and_catch_traps(store, |caller| {
             // println!("call_unchecked_raw invoke_wasm_and_catch_traps wasmtime_runtime::prepare_host_to_wasm_trampoline");
             let trampoline = wasmtime_runtime::prepare_host_to_wasm_trampoline(caller, trampoline);
@@ -999,6 +1007,12 @@ impl Func {
         store.store_data()[self.0].export().anyfunc
     }
 
+    /// The PKRU word of the domain this function belongs to, if any.
+    #[inline]
+    pub(crate) fn domain_pkru(&self, store: &StoreOpaque) -> Option<u32> {
+        store.store_data()[self.0].export().pkru
+    }
+
     pub(crate) unsafe fn from_wasmtime_function(
         export: ExportFunction,
         store: &mut StoreOpaque,
@@ -1240,12 +1254,18 @@ pub(crate) fn invoke_wasm_and_catch_traps<T>(
             exit_wasm(store, exit);
             return Err(trap);
         }
+        if let Err(err) = store.0.enter_pku_domains() {
+            exit_wasm(store, exit);
+            store.0.call_hook(CallHook::ReturningFromWasm)?;
+            return Err(Trap::from(err));
+        }
         let result = wasmtime_runtime::catch_traps(
             store.0.signal_handler(),
             store.0.engine().config().wasm_backtrace,
             store.0.default_caller(),
             closure,
         );
+        store.0.exit_pku_domains();
         exit_wasm(store, exit);
         store.0.call_hook(CallHook::ReturningFromWasm)?;
         // println!("after invoke_wasm_and_catch_traps");
@@ -1703,6 +1723,22 @@ impl<T> Caller<'_, T> {
             .get_export(&mut self.store, name)
     }
 
+    /// Returns a handle to the calling instance, for host functions of this
+    /// crate which need its runtime state.
+    pub(crate) fn instance_handle(&self) -> InstanceHandle {
+        unsafe { self.caller.clone() }
+    }
+
+    /// Returns the definition of the caller's first linear memory, if it has
+    /// one, without going through the export name lookup of `get_export`.
+    pub(crate) fn memory_definition(&self) -> Option<*mut VMMemoryDefinition> {
+        if self.caller.module().memory_plans.is_empty() {
+            return None;
+        }
+        let mut handle = self.instance_handle();
+        Some(handle.get_exported_memory(MemoryIndex::new(0)).definition)
+    }
+
     /// Access the underlying data owned by this `Store`.
     ///
     /// Same as [`Store::data`](crate::Store::data)
@@ -2120,6 +2156,7 @@ impl HostFunc {
     fn export_func(&self) -> ExportFunction {
         ExportFunction {
             anyfunc: self.ctx.wasm_to_host_trampoline(),
+            pkru: None,
         }
     }
 }
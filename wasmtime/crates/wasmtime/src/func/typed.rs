@@ -6,7 +6,8 @@ use std::marker;
 use std::mem::{self, MaybeUninit};
 use std::ptr;
 use wasmtime_runtime::{
-    VMCallerCheckedAnyfunc, VMContext, VMFunctionBody, VMOpaqueContext, VMSharedSignatureIndex,
+    DomainEntry, VMCallerCheckedAnyfunc, VMContext, VMFunctionBody, VMOpaqueContext,
+    VMSharedSignatureIndex,
 };
 
 /// A statically typed WebAssembly function.
@@ -79,7 +80,10 @@ where
             "must use `call_async` with async stores"
         );
         let func = self.func.caller_checked_anyfunc(store.0);
-        unsafe { Self::call_raw(&mut store, func, params) }
+        unsafe {
+            let _domain = DomainEntry::enter(self.func.domain_pkru(store.0), func.as_ref().vmctx);
+            Self::call_raw(&mut store, func, params)
+        }
     }
 
     /// Invokes this WebAssembly function with the specified parameters.
@@ -111,7 +115,11 @@ where
         store
             .on_fiber(|store| {
                 let func = self.func.caller_checked_anyfunc(store.0);
-                unsafe { Self::call_raw(store, func, params) }
+                unsafe {
+                    let _domain =
+                        DomainEntry::enter(self.func.domain_pkru(store.0), func.as_ref().vmctx);
+                    Self::call_raw(store, func, params)
+                }
             })
             .await?
     }
@@ -8,10 +8,14 @@ use crate::{
 use anyhow::{anyhow, bail, Context, Error, Result};
 use std::mem;
 use std::sync::Arc;
-use wasmtime_environ::{EntityType, FuncIndex, GlobalIndex, MemoryIndex, PrimaryMap, TableIndex};
+use wasmtime_environ::{
+    domain_pkru, encode_domain_layout, DomainRange, EntityType, FuncIndex, GlobalIndex,
+    MemoryIndex, PrimaryMap, TableIndex,
+};
 use wasmtime_runtime::{
-    Imports, InstanceAllocationRequest, InstantiationError, StorePtr, VMContext, VMFunctionBody,
-    VMFunctionImport, VMGlobalImport, VMMemoryImport, VMOpaqueContext, VMTableImport,
+    DomainEntry, Imports, InstanceAllocationRequest, InstantiationError, StorePtr, VMContext,
+    VMFunctionBody, VMFunctionImport, VMGlobalImport, VMMemoryImport, VMOpaqueContext,
+    VMTableImport,
 };
 
 /// An instantiated WebAssembly module.
@@ -280,6 +284,22 @@ impl Instance {
         // code here anyway.
         let id = store.add_instance(instance_handle.clone(), false);
 
+        // Lease the configured keys now, so that creating domains later
+        // never waits on the broker or the kernel. Without isolation the
+        // guest's keys are unbacked and nothing is leased.
+        let config = store.engine().config();
+        let quota = config.pku_pkey_quota;
+        if quota != 0 && config.tunables.pku_isolation {
+            let ret = instance_handle.pku_state().prelease(quota);
+            if ret != 0 {
+                bail!(
+                    "failed to lease {} protection keys: {}",
+                    quota,
+                    std::io::Error::from_raw_os_error(-ret)
+                );
+            }
+        }
+
         // Additionally, before we start doing fallible instantiation, we
         // do one more step which is to insert an `InstanceData`
         // corresponding to this instance. This `InstanceData` can be used
@@ -341,6 +361,7 @@ impl Instance {
         let instance = store.0.instance_mut(id);
         let f = instance.get_exported_func(start);
         let vmctx = instance.vmctx_ptr();
+        let _domain = unsafe { DomainEntry::enter(f.pkru, f.anyfunc.as_ref().vmctx) };
         unsafe {
             super::func::invoke_wasm_and_catch_traps(store, |_default_caller| {
                 let trampoline = mem::transmute::<
@@ -526,6 +547,67 @@ impl Instance {
         self.get_export(store, name)?.into_global()
     }
 
+    /// Returns the protection-key layout of this instance's first memory,
+    /// as the guest has set it up so far, encoded as a `pkuwa.layout`
+    /// custom section.
+    ///
+    /// This is meant for snapshotting an initialized module, in the style of
+    /// Wizer: a module built from the snapshot of this instance's memory
+    /// with this section appended has its domains tagged on instantiation,
+    /// in one pass merged with the rest of its layout, and together with a
+    /// copy-on-write memory image the guest's domain setup is skipped
+    /// entirely. Only the ranges are recorded; keys are claimed as those of
+    /// domains `pkuwa.layout` declares.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if the guest's queued protection changes can't be
+    /// applied, or a range carries a key or protection the section can't
+    /// describe, such as a key leased beyond the 15 domains.
+    ///
+    /// # Panics
+    ///
+    /// Panics if `store` does not own this instance.
+    pub fn domain_layout(&self, mut store: impl AsContextMut) -> Result<Vec<u8>> {
+        let store = store.as_context_mut().0;
+        let id = store[self.0].id;
+        let handle = store.instance_mut(id);
+        if handle.module().memory_plans.is_empty() {
+            return Ok(encode_domain_layout(&[]));
+        }
+        let vm = handle.get_exported_memory(MemoryIndex::new(0)).definition;
+        let state = handle.pku_state();
+        let ret = unsafe { state.drain_queue(&*vm) };
+        if ret != 0 {
+            bail!(
+                "failed to apply queued protection changes: {}",
+                std::io::Error::from_raw_os_error(-ret)
+            );
+        }
+        let rw = (libc::PROT_READ | libc::PROT_WRITE) as u32;
+        let mut layout = Vec::new();
+        for range in state.domains().iter().filter(|r| !r.is_default()) {
+            match (
+                domain_pkru(range.pkey),
+                u32::try_from(range.offset),
+                u32::try_from(range.len),
+            ) {
+                (Some(_), Ok(offset), Ok(len)) if range.prot == rw && range.pkey != 0 => layout
+                    .push(DomainRange {
+                        domain: range.pkey,
+                        offset,
+                        len,
+                    }),
+                _ => bail!(
+                    "range at {:#x} with key {} cannot be described by pkuwa.layout",
+                    range.offset,
+                    range.pkey
+                ),
+            }
+        }
+        Ok(encode_domain_layout(&layout))
+    }
+
     #[cfg(feature = "component-model")]
     pub(crate) fn id(&self, store: &StoreOpaque) -> InstanceId {
         store[self.0].id
@@ -1,14 +1,30 @@
 //! Memory isolation
 
-use std::cell::RefCell;
-use wasmtime_runtime::Pku;
+use crate::{Caller, Linker, Trap};
+use anyhow::Result;
+use std::ptr;
+use std::sync::atomic::{AtomicU32, Ordering};
+use std::time::Duration;
+use wasmtime_environ::{EntityRef, MemoryIndex, WASM_PAGE_SIZE};
 use wasmtime_runtime::VMMemoryDefinition;
+use wasmtime_runtime::{
+    DomainMap, PkeyRange, Pku, PkuCounters, PkuHeapStats, PkuHostStats, PkuProfiler, PkuState,
+};
 
 /// A simple struct of isolated memory
 #[derive(Debug)]
 pub struct IsolatedMomery {}
 
-thread_local!(static MOMERY: RefCell<Vec<MomeryMap>> = RefCell::new(Vec::new()));
+/// Name of the host module which provides the PKU operations to guests.
+pub const PKU_MODULE: &str = "pku";
+
+/// Name of the host module which provides the PKU operations to memory64
+/// guests, with 64-bit addresses and lengths.
+pub const PKU64_MODULE: &str = "pku64";
+
+/// Name of the module whose `rdpkru` and `wrpkru` imports Cranelift compiles
+/// to the instructions themselves.
+pub const PKRU_INTRINSIC_MODULE: &str = "pkuwa";
 
 impl IsolatedMomery {
     /// Construct a new init instance of 'IsolatedMomery'.
@@ -16,22 +32,472 @@ impl IsolatedMomery {
         Self {}
     }
 
-    /// Crate memory domain.
-    pub fn hook_domain(vm: &VMMemoryDefinition, start: usize, len: usize, prot: i64) {
-        let pkey = Pku::pkey_isolated(vm, start, len, prot);
-        MOMERY.with(|m| {
-            m.borrow_mut().push(MomeryMap::new(start, len, prot, pkey));
-        });
+    /// Define the typed `pku` and `pku64` host modules in `linker`.
+    ///
+    /// Every function returns its result directly or a negated errno, so the
+    /// guest never has to pack requests into a byte buffer:
+    ///
+    /// * `rdpkru() -> i32`
+    /// * `wrpkru(pkru: i32)`
+    /// * `pkey_alloc(flags: i32, access_rights: i32) -> i32`
+    /// * `pkey_free(pkey: i32) -> i32`
+    /// * `pkey_retire(pkey: i32) -> i32`
+    /// * `pkey_mprotect(addr: i32, len: i32, prot: i32, pkey: i32) -> i32`
+    /// * `pkey_mprotect_ranges(ranges: i32, count: i32) -> i32`
+    /// * `queue_register(ring: i32, capacity: i32) -> i32`
+    /// * `queue_flush() -> i32`
+    /// * `memory_grow_tagged(pages: i32, pkey: i32) -> i32`
+    /// * `decommit(addr: i32, len: i32) -> i32`
+    /// * `stats_register(table: i32, count: i32) -> i32`
+    /// * `huge_page_offset() -> i32`
+    /// * `map_huge(addr: i32, len: i32, pkey: i32, flags: i32) -> i32`
+    /// * `mmap(addr: i32, len: i32, prot: i32, flags: i32) -> i32`
+    /// * `stats(buf: i32, len: i32) -> i32`
+    ///
+    /// `pkey_mprotect_ranges` reads `count` descriptors of three little-endian
+    /// `u32`s (`addr`, `len`, `pkey`), merges adjacent ranges with the same
+    /// key and tags them read-write in a single transition.
+    ///
+    /// `pkey_alloc` leases a key from the process-wide broker (see
+    /// `wasmtime_runtime::PkeyLease`) rather than taking one from the kernel,
+    /// so the key may be shared with other instances that are not active on
+    /// this thread. Only flags 0 is accepted, and the key starts accessible
+    /// whatever `access_rights` asks; the guest restricts it with `wrpkru`.
+    /// With [`Config::pku_pkey_quota`](crate::Config::pku_pkey_quota) the
+    /// keys are leased at instantiation and handed out from there.
+    /// `pkey_free` only takes keys the instance leased, and every lease is
+    /// returned with the instance. `pkey_retire` gives a leased key back too,
+    /// but also the memory tagged with it, without waiting: the pages are
+    /// zeroed and reset to key 0 by a background thread, and the key only
+    /// returns to the pool after that, see `PkuState::retire`.
+    ///
+    /// `queue_register` hands the host a ring of such descriptors (laid out
+    /// as described by `wasmtime_runtime::PkuQueue`) which the guest fills
+    /// without any transition. The ring is
+    /// drained by `queue_flush`, by `wrpkru` and the `pkey_mprotect` calls
+    /// (so queued commands always take effect before a switch or a later
+    /// direct protect), and by `memory.grow`.
+    ///
+    /// An instance reusing a pooled memory slot inherits the keys its
+    /// previous instance left there; requesting them again costs nothing,
+    /// and the rest are reset by the first `wrpkru`.
+    ///
+    /// `memory_grow_tagged` behaves like `memory.grow` on the caller's first
+    /// memory, returning the previous size in pages or -1, but also tags the
+    /// new pages read-write with `pkey` before the guest resumes. Failing to
+    /// tag them traps.
+    ///
+    /// `decommit` returns the whole pages within a range to the kernel with
+    /// `madvise(MADV_DONTNEED)` and tags them with key 0 again, so memory a
+    /// domain has freed can be reused by any other one.
+    ///
+    /// `stats_register` points the host at the guest's allocation counters,
+    /// `count` entries laid out as described by
+    /// `wasmtime_runtime::PkuHeapStats`. The guest keeps them current
+    /// itself, and [`DomainStats::heaps`] reads them in place.
+    ///
+    /// `stats` copies the host's counters, as described by
+    /// `wasmtime_runtime::PkuHostStats`, to the `len` bytes at `buf`,
+    /// truncating them if they do not fit, and returns the size of the whole
+    /// record. They only count while an engine configured with
+    /// [`Config::pku_stats`](crate::Config::pku_stats) is alive.
+    ///
+    /// `map_huge` backs a region of linear memory with 2 MiB pages and tags
+    /// it with `pkey` in one go, see `PkuState::map_huge`. The region has to
+    /// start at `huge_page_offset()` or a multiple of 2 MiB past it, and
+    /// flag 1 asks for explicit hugetlb pages instead of transparent ones.
+    ///
+    /// Addresses are offsets into the caller's first linear memory. Every
+    /// key assignment is recorded in the calling instance's `PkuState`, and
+    /// the layout is restored automatically if growing moves that memory.
+    ///
+    /// The `pku64` module provides the same functions to memory64 guests,
+    /// with every address, length and descriptor count an `i64`, as are the
+    /// results of `mmap` and `memory_grow_tagged`. Its descriptors are
+    /// `PKURange` as laid out on wasm64: little-endian `u64` `addr` and
+    /// `len`, then the `u32` `pkey` and four bytes of padding, in
+    /// `pkey_mprotect_ranges` and in the ring alike.
+    ///
+    /// The `pkuwa` module's `rdpkru() -> i32` and `wrpkru(pkru: i32) -> i32`
+    /// are defined too. Direct calls to them are compiled inline and never
+    /// reach these definitions, which only serve `call_indirect`. Unlike
+    /// `pku::wrpkru` they neither drain the queue nor settle inherited tags.
+    ///
+    /// With [`PkuMode::Off`](crate::PkuMode::Off) the same functions are
+    /// defined but return at once: `rdpkru` reads 0, `wrpkru` and the
+    /// `pkey_mprotect` calls change nothing, `pkey_alloc` hands out keys
+    /// with no hardware key behind them, `queue_register` fails with
+    /// `-ENOSYS` so the guest protects directly, and `memory_grow_tagged`
+    /// and `map_huge` leave the pages with key 0.
+    pub fn add_to_linker<T>(linker: &mut Linker<T>) -> Result<()> {
+        if !linker.engine().config().tunables.pku_isolation {
+            return Self::add_unisolated_to_linker(linker);
+        }
+        for module in [PKU_MODULE, PKU64_MODULE] {
+            linker.func_wrap(module, "rdpkru", || Pku::rdpkru())?;
+            linker.func_wrap(module, "wrpkru", |mut caller: Caller<'_, T>, pkru: i32| {
+                if PkuProfiler::is_running() {
+                    let pc = unsafe { *caller.store.0.runtime_limits().last_wasm_exit_pc.get() };
+                    PkuProfiler::record_switch(pc, Pku::rdpkru() as u32, pkru as u32);
+                }
+                if let Some(vm) = caller.memory_definition() {
+                    let vm = unsafe { &*vm };
+                    let mut handle = caller.instance_handle();
+                    let state = handle.pku_state();
+                    unsafe {
+                        state.drain_queue(vm);
+                        state.settle(vm);
+                    }
+                }
+                Pku::wrpkru(pkru);
+                caller.store.0.pku_domain_switch(pkru as u32);
+            })?;
+            linker.func_wrap(
+                module,
+                "pkey_alloc",
+                |caller: Caller<'_, T>, flags: u32, _rights: u32| {
+                    if flags != 0 {
+                        return -libc::EINVAL;
+                    }
+                    let mut handle = caller.instance_handle();
+                    handle.pku_state().lease()
+                },
+            )?;
+            linker.func_wrap(module, "pkey_free", |caller: Caller<'_, T>, pkey: u32| {
+                let mut handle = caller.instance_handle();
+                handle.pku_state().release(pkey)
+            })?;
+            linker.func_wrap(module, "pkey_retire", |caller: Caller<'_, T>, pkey: u32| {
+                let mut handle = caller.instance_handle();
+                match caller.memory_definition() {
+                    Some(vm) => unsafe {
+                        let vm = &*vm;
+                        let state = handle.pku_state();
+                        state.drain_queue(vm);
+                        state.retire_lease(vm, pkey)
+                    },
+                    None => handle.pku_state().release(pkey),
+                }
+            })?;
+            linker.func_wrap(module, "queue_flush", |caller: Caller<'_, T>| -> i32 {
+                match caller.memory_definition() {
+                    Some(vm) => drain_queue(&caller, unsafe { &*vm }),
+                    None => -libc::EINVAL,
+                }
+            })?;
+            linker.func_wrap(module, "huge_page_offset", |caller: Caller<'_, T>| -> i32 {
+                match caller.memory_definition() {
+                    Some(vm) => PkuState::huge_page_offset(unsafe { &*vm }) as i32,
+                    None => -libc::EINVAL,
+                }
+            })?;
+        }
+
+        linker.func_wrap(
+            PKU_MODULE,
+            "pkey_mprotect",
+            |caller: Caller<'_, T>, addr: u32, len: u32, prot: u32, pkey: u32| {
+                pkey_mprotect(&caller, addr.into(), len.into(), prot, pkey)
+            },
+        )?;
+        linker.func_wrap(
+            PKU_MODULE,
+            "pkey_mprotect_ranges",
+            |caller: Caller<'_, T>, ptr: u32, count: u32| {
+                pkey_mprotect_ranges(&caller, ptr.into(), count.into(), false)
+            },
+        )?;
+        linker.func_wrap(
+            PKU_MODULE,
+            "queue_register",
+            |caller: Caller<'_, T>, ring: u32, capacity: u32| {
+                queue_register(&caller, ring.into(), capacity, false)
+            },
+        )?;
+        linker.func_wrap(
+            PKU_MODULE,
+            "stats_register",
+            |caller: Caller<'_, T>, table: u32, count: u32| {
+                stats_register(&caller, table.into(), count)
+            },
+        )?;
+        linker.func_wrap(
+            PKU_MODULE,
+            "map_huge",
+            |caller: Caller<'_, T>, addr: u32, len: u32, pkey: u32, flags: u32| {
+                map_huge(&caller, addr.into(), len.into(), pkey, flags)
+            },
+        )?;
+        linker.func_wrap(
+            PKU_MODULE,
+            "memory_grow_tagged",
+            |caller: Caller<'_, T>, pages: u32, pkey: u32| -> Result<i32, Trap> {
+                Ok(memory_grow_tagged(caller, pages.into(), pkey)? as i32)
+            },
+        )?;
+        linker.func_wrap(
+            PKU_MODULE,
+            "decommit",
+            |caller: Caller<'_, T>, addr: u32, len: u32| decommit(&caller, addr.into(), len.into()),
+        )?;
+        linker.func_wrap(
+            PKU_MODULE,
+            "mmap",
+            |caller: Caller<'_, T>, addr: u32, len: u32, prot: i32, flags: i32| {
+                mmap(&caller, addr.into(), len.into(), prot, flags) as i32
+            },
+        )?;
+        linker.func_wrap(
+            PKU_MODULE,
+            "stats",
+            |caller: Caller<'_, T>, buf: u32, len: u32| stats(&caller, buf.into(), len.into()),
+        )?;
+
+        linker.func_wrap(
+            PKU64_MODULE,
+            "pkey_mprotect",
+            |caller: Caller<'_, T>, addr: u64, len: u64, prot: u32, pkey: u32| {
+                pkey_mprotect(&caller, addr, len, prot, pkey)
+            },
+        )?;
+        linker.func_wrap(
+            PKU64_MODULE,
+            "pkey_mprotect_ranges",
+            |caller: Caller<'_, T>, ptr: u64, count: u64| {
+                pkey_mprotect_ranges(&caller, ptr, count, true)
+            },
+        )?;
+        linker.func_wrap(
+            PKU64_MODULE,
+            "queue_register",
+            |caller: Caller<'_, T>, ring: u64, capacity: u32| {
+                queue_register(&caller, ring, capacity, true)
+            },
+        )?;
+        linker.func_wrap(
+            PKU64_MODULE,
+            "stats_register",
+            |caller: Caller<'_, T>, table: u64, count: u32| stats_register(&caller, table, count),
+        )?;
+        linker.func_wrap(
+            PKU64_MODULE,
+            "map_huge",
+            |caller: Caller<'_, T>, addr: u64, len: u64, pkey: u32, flags: u32| {
+                map_huge(&caller, addr, len, pkey, flags)
+            },
+        )?;
+        linker.func_wrap(
+            PKU64_MODULE,
+            "memory_grow_tagged",
+            |caller: Caller<'_, T>, pages: u64, pkey: u32| memory_grow_tagged(caller, pages, pkey),
+        )?;
+        linker.func_wrap(
+            PKU64_MODULE,
+            "decommit",
+            |caller: Caller<'_, T>, addr: u64, len: u64| decommit(&caller, addr, len),
+        )?;
+        linker.func_wrap(
+            PKU64_MODULE,
+            "mmap",
+            |caller: Caller<'_, T>, addr: u64, len: u64, prot: i32, flags: i32| {
+                mmap(&caller, addr, len, prot, flags)
+            },
+        )?;
+        linker.func_wrap(
+            PKU64_MODULE,
+            "stats",
+            |caller: Caller<'_, T>, buf: u64, len: u64| stats(&caller, buf, len),
+        )?;
+
+        linker.func_wrap(PKRU_INTRINSIC_MODULE, "rdpkru", || Pku::rdpkru())?;
+        linker.func_wrap(
+            PKRU_INTRINSIC_MODULE,
+            "wrpkru",
+            |mut caller: Caller<'_, T>, pkru: i32| {
+                Pku::wrpkru(pkru);
+                caller.store.0.pku_domain_switch(pkru as u32);
+                pkru
+            },
+        )?;
+        Ok(())
     }
 
-    /// Redo memory isolation, becouse wasmtime grow function mmap wasm memory in new virtual memory range.
-    pub fn hook_memory(vm: &VMMemoryDefinition) {
-        MOMERY.with(|m| {
-            for iter in m.take() {
-                let mmap = iter.get();
-                Pku::pkey_mprotect(vm, mmap.0, mmap.1, mmap.2, mmap.3);
+    /// The `add_to_linker` functions of an engine without isolation, with
+    /// the same signatures so the same guests link.
+    fn add_unisolated_to_linker<T>(linker: &mut Linker<T>) -> Result<()> {
+        for module in [PKU_MODULE, PKU64_MODULE] {
+            linker.func_wrap(module, "rdpkru", || 0i32)?;
+            linker.func_wrap(module, "wrpkru", |_pkru: i32| {})?;
+            linker.func_wrap(
+                module,
+                "pkey_alloc",
+                |caller: Caller<'_, T>, flags: u32, _rights: u32| {
+                    if flags != 0 {
+                        return -libc::EINVAL;
+                    }
+                    let mut handle = caller.instance_handle();
+                    handle.pku_state().lease_unbacked()
+                },
+            )?;
+            for name in ["pkey_free", "pkey_retire"] {
+                linker.func_wrap(module, name, |caller: Caller<'_, T>, pkey: u32| {
+                    let mut handle = caller.instance_handle();
+                    handle.pku_state().release_unbacked(pkey)
+                })?;
             }
-        });
+            linker.func_wrap(module, "queue_flush", || 0i32)?;
+            linker.func_wrap(module, "huge_page_offset", |caller: Caller<'_, T>| -> i32 {
+                match caller.memory_definition() {
+                    Some(vm) => PkuState::huge_page_offset(unsafe { &*vm }) as i32,
+                    None => -libc::EINVAL,
+                }
+            })?;
+        }
+
+        linker.func_wrap(
+            PKU_MODULE,
+            "pkey_mprotect",
+            |_addr: u32, _len: u32, _prot: u32, _pkey: u32| 0i32,
+        )?;
+        linker.func_wrap(
+            PKU_MODULE,
+            "pkey_mprotect_ranges",
+            |_ptr: u32, _count: u32| 0i32,
+        )?;
+        linker.func_wrap(
+            PKU_MODULE,
+            "queue_register",
+            |_ring: u32, _capacity: u32| -libc::ENOSYS,
+        )?;
+        linker.func_wrap(
+            PKU_MODULE,
+            "stats_register",
+            |caller: Caller<'_, T>, table: u32, count: u32| {
+                stats_register(&caller, table.into(), count)
+            },
+        )?;
+        linker.func_wrap(
+            PKU_MODULE,
+            "map_huge",
+            |caller: Caller<'_, T>, addr: u32, len: u32, _pkey: u32, flags: u32| {
+                map_huge(&caller, addr.into(), len.into(), 0, flags)
+            },
+        )?;
+        linker.func_wrap(
+            PKU_MODULE,
+            "memory_grow_tagged",
+            |caller: Caller<'_, T>, pages: u32, _pkey: u32| -> Result<i32, Trap> {
+                Ok(memory_grow(caller, pages.into())? as i32)
+            },
+        )?;
+        linker.func_wrap(
+            PKU_MODULE,
+            "decommit",
+            |caller: Caller<'_, T>, addr: u32, len: u32| decommit(&caller, addr.into(), len.into()),
+        )?;
+        linker.func_wrap(
+            PKU_MODULE,
+            "mmap",
+            |caller: Caller<'_, T>, addr: u32, len: u32, prot: i32, flags: i32| {
+                mmap(&caller, addr.into(), len.into(), prot, flags) as i32
+            },
+        )?;
+        linker.func_wrap(
+            PKU_MODULE,
+            "stats",
+            |caller: Caller<'_, T>, buf: u32, len: u32| stats(&caller, buf.into(), len.into()),
+        )?;
+
+        linker.func_wrap(
+            PKU64_MODULE,
+            "pkey_mprotect",
+            |_addr: u64, _len: u64, _prot: u32, _pkey: u32| 0i32,
+        )?;
+        linker.func_wrap(
+            PKU64_MODULE,
+            "pkey_mprotect_ranges",
+            |_ptr: u64, _count: u64| 0i32,
+        )?;
+        linker.func_wrap(
+            PKU64_MODULE,
+            "queue_register",
+            |_ring: u64, _capacity: u32| -libc::ENOSYS,
+        )?;
+        linker.func_wrap(
+            PKU64_MODULE,
+            "stats_register",
+            |caller: Caller<'_, T>, table: u64, count: u32| stats_register(&caller, table, count),
+        )?;
+        linker.func_wrap(
+            PKU64_MODULE,
+            "map_huge",
+            |caller: Caller<'_, T>, addr: u64, len: u64, _pkey: u32, flags: u32| {
+                map_huge(&caller, addr, len, 0, flags)
+            },
+        )?;
+        linker.func_wrap(
+            PKU64_MODULE,
+            "memory_grow_tagged",
+            |caller: Caller<'_, T>, pages: u64, _pkey: u32| memory_grow(caller, pages),
+        )?;
+        linker.func_wrap(
+            PKU64_MODULE,
+            "decommit",
+            |caller: Caller<'_, T>, addr: u64, len: u64| decommit(&caller, addr, len),
+        )?;
+        linker.func_wrap(
+            PKU64_MODULE,
+            "mmap",
+            |caller: Caller<'_, T>, addr: u64, len: u64, prot: i32, flags: i32| {
+                mmap(&caller, addr, len, prot, flags)
+            },
+        )?;
+        linker.func_wrap(
+            PKU64_MODULE,
+            "stats",
+            |caller: Caller<'_, T>, buf: u64, len: u64| stats(&caller, buf, len),
+        )?;
+
+        linker.func_wrap(PKRU_INTRINSIC_MODULE, "rdpkru", || 0i32)?;
+        linker.func_wrap(PKRU_INTRINSIC_MODULE, "wrpkru", |pkru: i32| pkru)?;
+        Ok(())
+    }
+
+    /// Crate memory domain over `start..start + len` of `vm` and record it
+    /// in the instance's layout `state`. The key is leased for the instance,
+    /// see [`PkuState::lease`]. Returns the new key, or a negated errno.
+    pub fn hook_domain(
+        state: &mut PkuState,
+        vm: &VMMemoryDefinition,
+        start: usize,
+        len: usize,
+        prot: i64,
+    ) -> i64 {
+        let pkey = state.lease();
+        if pkey < 0 {
+            return pkey as i64;
+        }
+        let range = PkeyRange {
+            offset: start,
+            len,
+            prot: prot as u32,
+            pkey: pkey as u32,
+        };
+        match unsafe { state.protect(vm, range) } {
+            0 => pkey as i64,
+            err => {
+                state.release(pkey as u32);
+                err as i64
+            }
+        }
+    }
+
+    /// Redo memory isolation from the recorded layout, becouse wasmtime grow
+    /// function mmap wasm memory in new virtual memory range. The runtime
+    /// already does this on a moving `memory.grow`; this is for memories
+    /// replaced behind its back.
+    pub fn hook_memory(state: &mut PkuState, vm: &VMMemoryDefinition) -> i32 {
+        unsafe { state.reapply(vm) }
     }
 
     /// Transition to isolated domain.
@@ -45,31 +511,555 @@ impl IsolatedMomery {
         Pku::set_pkey(pkey, prot);
     }
 
-    /// Trampline to transition domain.
+    /// Enter a domain with a single write of its word from
+    /// [`Domain::pkru`], skipped when the thread already runs with it.
+    /// Returns the previous PKRU, to pass back here when leaving.
+    pub fn hook_enter_domain(pkru: u32) -> u32 {
+        let current = Pku::rdpkru() as u32;
+        if current != pkru {
+            Pku::wrpkru(pkru as i32);
+        }
+        current
+    }
+
+    /// Trampline to transition domain. Calls to exports the module assigns
+    /// to a domain already switch to it, and back once they return or trap.
     pub fn hook_transition(pkey: i64, prot: i32) {
         Pku::set_pkey(pkey, prot);
     }
 }
 
-#[derive(Debug)]
-pub struct MomeryMap {
-    offset: usize,
-    len: usize,
-    prot: i64,
-    pkey: i64,
+/// A protection-key domain created by
+/// [`Store::create_domain`](crate::Store::create_domain).
+///
+/// Memory tagged with a domain through
+/// [`Memory::protect_domain`](crate::Memory::protect_domain) is only
+/// accessible while the PKRU grants the domain's key.
+#[derive(Debug, Clone, Copy, PartialEq, Eq, Hash)]
+pub struct Domain(u32);
+
+impl Domain {
+    /// The default domain, which all memory belongs to until tagged otherwise.
+    pub const ROOT: Domain = Domain(0);
+
+    /// The domain backed by protection key `pkey`.
+    ///
+    /// This is meant for embedders that pass domains through other layers.
+    ///
+    /// # Unsafety
+    ///
+    /// `pkey` must be the [`Domain::pkey`] of a domain the store it is used
+    /// with created and has not freed, or the number of a domain the store's
+    /// modules lay out. Keys are shared between stores, so any other key
+    /// may be another store's, whose memory the domain would then open or
+    /// tag.
+    pub unsafe fn from_pkey(pkey: u32) -> Domain {
+        Domain(pkey)
+    }
+
+    /// The protection key backing this domain when it was created. Keys are
+    /// shared between stores, and a store may move its domain to another
+    /// key, see [`Store::domain_pkey`](crate::Store::domain_pkey).
+    pub fn pkey(&self) -> u32 {
+        self.0
+    }
+    /// The full PKRU word code inside this domain runs with: key 0 and the
+    /// domain's own key are accessible and every other key is closed, while
+    /// [`Domain::ROOT`] may access every key. Returns `None` for keys beyond
+    /// what this host's PKRU covers. Like [`Domain::pkey`] this is the word
+    /// for the key the domain was created with.
+    pub fn pkru(&self) -> Option<u32> {
+        Pku::domain_word(self.0)
+    }
 }
 
-impl MomeryMap {
-    pub fn new(offset: usize, len: usize, prot: i64, pkey: i64) -> Self {
-        Self {
-            offset,
-            len,
-            prot,
-            pkey,
+/// Protection-key usage of a store, see
+/// [`Store::domain_stats`](crate::Store::domain_stats).
+#[derive(Debug, Clone, Default, PartialEq, Eq)]
+pub struct DomainStats {
+    /// Domains created by the store which are still alive.
+    pub domains: usize,
+    /// Tagged ranges across the store's memories, after merging neighbours.
+    pub ranges: usize,
+    /// Bytes tagged with anything but the default key and protection.
+    pub tagged_bytes: usize,
+    /// The allocation counters guests registered with `stats_register`,
+    /// indexed by domain id and summed across the store's instances.
+    pub heaps: Vec<PkuHeapStats>,
+}
+
+/// What isolation costs the host and a store's guests, see
+/// [`Store::pku_stats`](crate::Store::pku_stats).
+#[derive(Debug, Clone, Default, PartialEq, Eq)]
+pub struct PkuStats {
+    /// The host's counters, process-wide.
+    pub host: PkuHostStats,
+    /// The store's protection-key usage, and the counters its guests
+    /// registered.
+    pub domains: DomainStats,
+}
+
+impl std::fmt::Display for PkuStats {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        let host = &self.host;
+        writeln!(f, "host:")?;
+        writeln!(
+            f,
+            "  {:>10}  pkey_mprotect calls, {} bytes",
+            host.mprotect_calls, host.mprotect_bytes
+        )?;
+        writeln!(f, "  {:>10}  mmap calls", host.mmap_calls)?;
+        writeln!(f, "  {:>10}  re-tags after grow", host.retags)?;
+        for (from, row) in host.switches.iter().enumerate() {
+            for (to, count) in row.iter().enumerate() {
+                if *count != 0 {
+                    writeln!(
+                        f,
+                        "  {:>10}  switches domain {} -> domain {}",
+                        count, from, to
+                    )?;
+                }
+            }
+        }
+        if host.other_switches != 0 {
+            writeln!(f, "  {:>10}  other switches", host.other_switches)?;
+        }
+        writeln!(
+            f,
+            "store: {} domains, {} tagged ranges, {} bytes tagged",
+            self.domains.domains, self.domains.ranges, self.domains.tagged_bytes
+        )?;
+        for (id, heap) in self.domains.heaps.iter().enumerate() {
+            if *heap == PkuHeapStats::default() {
+                continue;
+            }
+            writeln!(
+                f,
+                "  domain {:>3}  {} switches, {} allocations, {} bytes in use, {} bytes tagged",
+                id, heap.switches, heap.allocations, heap.in_use, heap.tagged
+            )?;
+        }
+        Ok(())
+    }
+}
+
+/// Cross-domain accesses and switches caught by the sampling profiler, see
+/// [`Store::pku_profile`](crate::Store::pku_profile).
+#[derive(Debug, Clone, Default, PartialEq, Eq)]
+pub struct PkuProfile {
+    /// Sampled accesses, most frequent first.
+    pub accesses: Vec<PkuHotSpot>,
+    /// Switches made through the host, most frequent first.
+    pub switches: Vec<PkuSwitchEdge>,
+    /// Samples overwritten before they could be read.
+    pub lost: u64,
+}
+
+/// Sampled accesses of one function to one key and wasm page.
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct PkuHotSpot {
+    /// The function accessing the page, `<host>` outside of wasm.
+    pub function: String,
+    /// Key of the page accessed, the domain in statically laid out modules.
+    pub pkey: u32,
+    /// Wasm page of the first memory of one of the store's instances the
+    /// access fell in, if any.
+    pub page: Option<u64>,
+    /// Accesses sampled.
+    pub samples: u64,
+}
+
+/// Switches across one call edge between two domains.
+#[derive(Debug, Clone, PartialEq, Eq)]
+pub struct PkuSwitchEdge {
+    /// The function that switched, `<host>` for calls into a domain made
+    /// by the embedder.
+    pub caller: String,
+    /// PKRU before the switch.
+    pub from: u32,
+    /// PKRU after the switch.
+    pub to: u32,
+    /// Switches counted.
+    pub count: u64,
+}
+
+impl PkuProfile {
+    /// Name `pkru` by its domain if it is the word of one.
+    fn domain(pkru: u32) -> String {
+        match (0..16).find(|d| Pku::domain_word(*d) == Some(pkru)) {
+            Some(domain) => format!("domain {}", domain),
+            None => format!("pkru {:#010x}", pkru),
+        }
+    }
+}
+
+impl std::fmt::Display for PkuProfile {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        writeln!(f, "cross-domain accesses:")?;
+        for spot in &self.accesses {
+            let page = match spot.page {
+                Some(page) => format!("page {}", page),
+                None => "outside linear memory".to_string(),
+            };
+            writeln!(
+                f,
+                "  {:>8}  {}  key {}  {}",
+                spot.samples, spot.function, spot.pkey, page
+            )?;
+        }
+        writeln!(f, "switches:")?;
+        for edge in &self.switches {
+            writeln!(
+                f,
+                "  {:>8}  {}  {} -> {}",
+                edge.count,
+                edge.caller,
+                Self::domain(edge.from),
+                Self::domain(edge.to)
+            )?;
         }
+        if self.lost != 0 {
+            writeln!(f, "{} samples lost", self.lost)?;
+        }
+        Ok(())
     }
+}
+
+/// Time a store's wasm ran in one domain, see
+/// [`Store::pku_domain_times`](crate::Store::pku_domain_times).
+#[derive(Debug, Clone, Copy, Default, PartialEq, Eq)]
+pub struct DomainTime {
+    /// Time spent in the domain, including host functions it called.
+    pub time: Duration,
+    /// Times the domain was switched to.
+    pub entries: u64,
+}
+
+/// Time a store's wasm ran in each domain, see
+/// [`Store::pku_domain_times`](crate::Store::pku_domain_times).
+#[derive(Debug, Clone, Default, PartialEq, Eq)]
+pub struct DomainTimes {
+    /// Domain `i`'s time at `[i]`, by the domain numbers compiled code
+    /// switches with.
+    pub domains: Vec<DomainTime>,
+    /// Time with a PKRU which is no domain's word.
+    pub other: DomainTime,
+}
+
+impl std::fmt::Display for DomainTimes {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        writeln!(f, "time per domain:")?;
+        let named = self.domains.iter().enumerate().map(|(id, time)| {
+            let name = format!("domain {}", id);
+            (name, time)
+        });
+        for (name, time) in named.chain(Some(("other".to_string(), &self.other))) {
+            if time.entries != 0 {
+                writeln!(
+                    f,
+                    "  {:>12.3?}  {}, {} entries",
+                    time.time, name, time.entries
+                )?;
+            }
+        }
+        Ok(())
+    }
+}
+
+/// Error a call into wasm fails with when a domain runs past the slice
+/// given to it with
+/// [`Store::pku_domain_slice`](crate::Store::pku_domain_slice).
+///
+/// The call unwinds to the host, which finds its own PKRU restored.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct DomainBudgetExceeded {
+    /// The domain which was running.
+    pub domain: u32,
+}
+
+impl std::fmt::Display for DomainBudgetExceeded {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        write!(f, "domain {} exceeded its epoch budget", self.domain)
+    }
+}
+
+impl std::error::Error for DomainBudgetExceeded {}
+
+/// Grants a host function access to the caller's domains while it runs.
+///
+/// A guest running inside a domain leaves its PKRU in place across a
+/// hostcall, so host code copying into guest buffers may fault. The scope
+/// remembers that PKRU and [`PkruScope::open`] grants just the keys tagging
+/// a region before the host touches it; the guest's PKRU is restored when
+/// the scope is dropped. Callers which never used protection keys pay
+/// nothing beyond a check of their layout.
+pub struct PkruScope {
+    saved: u32,
+    current: AtomicU32,
+    domains: *const DomainMap,
+}
+
+// The layout is owned by the calling instance, which outlives the hostcall,
+// and only read through the scope.
+unsafe impl Send for PkruScope {}
+unsafe impl Sync for PkruScope {}
+
+impl PkruScope {
+    /// Start a scope for the hostcall `caller` is making.
+    pub fn new<T>(caller: &Caller<'_, T>) -> PkruScope {
+        let mut handle = caller.instance_handle();
+        let state = handle.pku_state();
+        if !state.is_active() {
+            return PkruScope::inactive();
+        }
+        let vm = match caller.memory_definition() {
+            Some(vm) => unsafe { &*vm },
+            None => return PkruScope::inactive(),
+        };
+        // Queued commands may tag what the host is about to touch.
+        unsafe { state.drain_queue(vm) };
+        let saved = Pku::rdpkru() as u32;
+        PkruScope {
+            saved,
+            current: AtomicU32::new(saved),
+            domains: state.domains(),
+        }
+    }
+
+    fn inactive() -> PkruScope {
+        PkruScope {
+            saved: 0,
+            current: AtomicU32::new(0),
+            domains: ptr::null(),
+        }
+    }
+
+    /// Grant access to `len` bytes at `offset` of the caller's first memory.
+    pub fn open(&self, offset: usize, len: usize) {
+        if self.domains.is_null() {
+            return;
+        }
+        let current = self.current.load(Ordering::Relaxed);
+        // Key 0 covers every byte the layout doesn't.
+        let mut pkru = Pku::open_key(current, 0);
+        for range in unsafe { (*self.domains).overlapping(offset, len) } {
+            pkru = Pku::open_key(pkru, range.pkey);
+        }
+        if pkru != current {
+            Pku::wrpkru(pkru as i32);
+            self.current.store(pkru, Ordering::Relaxed);
+        }
+    }
+}
+
+impl Drop for PkruScope {
+    fn drop(&mut self) {
+        if *self.current.get_mut() != self.saved {
+            Pku::wrpkru(self.saved as i32);
+        }
+    }
+}
+
+/// Apply the protection commands the caller has queued in its ring.
+fn drain_queue<T>(caller: &Caller<'_, T>, vm: &VMMemoryDefinition) -> i32 {
+    let mut handle = caller.instance_handle();
+    unsafe { handle.pku_state().drain_queue(vm) }
+}
+
+/// Decode `count` range descriptors at `ptr`, those of a memory64 guest if
+/// `wide`, rejecting any that fall outside of `data`.
+fn decode_ranges(data: &[u8], ptr: u64, count: u64, wide: bool) -> Option<Vec<PkeyRange>> {
+    let start = usize::try_from(ptr).ok()?;
+    let size = usize::try_from(count)
+        .ok()?
+        .checked_mul(PkeyRange::descriptor_size(wide))?;
+    let descriptors = data.get(start..start.checked_add(size)?)?;
+    descriptors
+        .chunks_exact(PkeyRange::descriptor_size(wide))
+        .map(|d| {
+            let range = PkeyRange::from_guest(d, wide)?;
+            if range.offset.checked_add(range.len)? > data.len() {
+                return None;
+            }
+            Some(range)
+        })
+        .collect()
+}
+
+/// `addr..addr + len` of `vm` as host offsets, if it lies within the memory.
+fn guest_range(vm: &VMMemoryDefinition, addr: u64, len: u64) -> Option<(usize, usize)> {
+    let (addr, len) = (usize::try_from(addr).ok()?, usize::try_from(len).ok()?);
+    match addr.checked_add(len) {
+        Some(end) if end <= vm.current_length() => Some((addr, len)),
+        _ => None,
+    }
+}
+
+// The hostcalls taking addresses, shared by `pku` and `pku64`, which widen
+// their arguments to `u64`.
+
+fn pkey_mprotect<T>(caller: &Caller<'_, T>, addr: u64, len: u64, prot: u32, pkey: u32) -> i32 {
+    let vm = match caller.memory_definition() {
+        Some(vm) => unsafe { &*vm },
+        None => return -libc::EINVAL,
+    };
+    let (offset, len) = match guest_range(vm, addr, len) {
+        Some(range) => range,
+        None => return -libc::EINVAL,
+    };
+    drain_queue(caller, vm);
+    let range = PkeyRange {
+        offset,
+        len,
+        prot,
+        pkey,
+    };
+    let mut handle = caller.instance_handle();
+    unsafe { handle.pku_state().protect(vm, range) }
+}
+
+fn pkey_mprotect_ranges<T>(caller: &Caller<'_, T>, ptr: u64, count: u64, wide: bool) -> i32 {
+    let vm = match caller.memory_definition() {
+        Some(vm) => unsafe { &*vm },
+        None => return -libc::EINVAL,
+    };
+    let data = unsafe { std::slice::from_raw_parts(vm.base, vm.current_length()) };
+    let mut ranges = match decode_ranges(data, ptr, count, wide) {
+        Some(ranges) => ranges,
+        None => return -libc::EINVAL,
+    };
+    drain_queue(caller, vm);
+    Pku::coalesce(&mut ranges);
+    let mut handle = caller.instance_handle();
+    unsafe { handle.pku_state().protect_ranges(vm, &ranges) }
+}
+
+fn queue_register<T>(caller: &Caller<'_, T>, ring: u64, capacity: u32, wide: bool) -> i32 {
+    let vm = match caller.memory_definition() {
+        Some(vm) => unsafe { &*vm },
+        None => return -libc::EINVAL,
+    };
+    let ring = match usize::try_from(ring) {
+        Ok(ring) => ring,
+        Err(_) => return -libc::EINVAL,
+    };
+    let mut handle = caller.instance_handle();
+    let state = handle.pku_state();
+    let ret = unsafe { state.drain_queue(vm) };
+    match state.register_queue(vm, ring, capacity, wide) {
+        0 => ret,
+        err => err,
+    }
+}
+
+fn stats_register<T>(caller: &Caller<'_, T>, table: u64, count: u32) -> i32 {
+    match (caller.memory_definition(), usize::try_from(table)) {
+        (Some(vm), Ok(table)) => {
+            caller
+                .instance_handle()
+                .pku_state()
+                .register_stats(unsafe { &*vm }, table, count)
+        }
+        _ => -libc::EINVAL,
+    }
+}
+
+fn map_huge<T>(caller: &Caller<'_, T>, addr: u64, len: u64, pkey: u32, flags: u32) -> i32 {
+    let vm = match caller.memory_definition() {
+        Some(vm) => unsafe { &*vm },
+        None => return -libc::EINVAL,
+    };
+    let (addr, len) = match guest_range(vm, addr, len) {
+        Some(range) => range,
+        None => return -libc::EINVAL,
+    };
+    let mut handle = caller.instance_handle();
+    let state = handle.pku_state();
+    unsafe {
+        state.drain_queue(vm);
+        state.map_huge(vm, addr, len, pkey, flags & 1 != 0)
+    }
+}
+
+/// The previous size of the caller's first memory in pages, or -1.
+fn memory_grow_tagged<T>(caller: Caller<'_, T>, pages: u64, pkey: u32) -> Result<i64, Trap> {
+    if caller.memory_definition().is_none() {
+        return Ok(-1);
+    }
+    // The grow reaches the store's limiter through the instance, so
+    // release the caller's borrow of the store first.
+    let mut handle = caller.instance_handle();
+    drop(caller);
+    let prot = (libc::PROT_READ | libc::PROT_WRITE) as u32;
+    match handle.memory_grow_tagged(MemoryIndex::new(0), pages, prot, pkey)? {
+        Some(old) => Ok((old / WASM_PAGE_SIZE as usize) as i64),
+        None => Ok(-1),
+    }
+}
+
+/// `memory_grow_tagged` without tagging, the previous size or -1.
+fn memory_grow<T>(caller: Caller<'_, T>, pages: u64) -> Result<i64, Trap> {
+    if caller.memory_definition().is_none() {
+        return Ok(-1);
+    }
+    let mut handle = caller.instance_handle();
+    drop(caller);
+    match handle.memory_grow(MemoryIndex::new(0), pages)? {
+        Some(old) => Ok((old / WASM_PAGE_SIZE as usize) as i64),
+        None => Ok(-1),
+    }
+}
+
+fn decommit<T>(caller: &Caller<'_, T>, addr: u64, len: u64) -> i32 {
+    let vm = match caller.memory_definition() {
+        Some(vm) => unsafe { &*vm },
+        None => return -libc::EINVAL,
+    };
+    let (addr, len) = match (usize::try_from(addr), usize::try_from(len)) {
+        (Ok(addr), Ok(len)) => (addr, len),
+        _ => return -libc::EINVAL,
+    };
+    drain_queue(caller, vm);
+    let mut handle = caller.instance_handle();
+    unsafe { handle.pku_state().decommit(vm, addr, len) }
+}
+
+/// The offset of the new mapping from the caller's first memory, or -1.
+fn mmap<T>(caller: &Caller<'_, T>, addr: u64, len: u64, prot: i32, flags: i32) -> i64 {
+    let vm = match caller.memory_definition() {
+        Some(vm) => unsafe { &*vm },
+        None => return -1,
+    };
+    let (addr, len) = match (usize::try_from(addr), usize::try_from(len)) {
+        (Ok(addr), Ok(len)) => (addr, len),
+        _ => return -1,
+    };
+    let map_addr = unsafe { libc::mmap(addr as *mut _, len, prot, flags, -1, 0) };
+    if map_addr == libc::MAP_FAILED {
+        return -1;
+    }
+    PkuCounters::record_mmap();
+    (map_addr as usize).wrapping_sub(vm.base as usize) as i64
+}
 
-    pub fn get(&self) -> (usize, usize, i64, i64) {
-        (self.offset, self.len, self.prot, self.pkey)
+/// Copy the host's counters to the caller, returning the size of the whole
+/// record.
+fn stats<T>(caller: &Caller<'_, T>, buf: u64, len: u64) -> i32 {
+    let vm = match caller.memory_definition() {
+        Some(vm) => unsafe { &*vm },
+        None => return -libc::EINVAL,
+    };
+    let (offset, len) = match guest_range(vm, buf, len) {
+        Some(range) => range,
+        None => return -libc::EINVAL,
+    };
+    let record = PkuCounters::read().encode();
+    unsafe {
+        ptr::copy_nonoverlapping(
+            record.as_ptr(),
+            vm.base.add(offset),
+            len.min(PkuHostStats::SIZE),
+        );
     }
+    PkuHostStats::SIZE as i32
 }
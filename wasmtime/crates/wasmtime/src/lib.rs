@@ -422,7 +422,10 @@ pub use crate::store::{AsContext, AsContextMut, CallHook, Store, StoreContext, S
 pub use crate::trap::*;
 pub use crate::types::*;
 pub use crate::values::*;
-pub use crate::isolated_memory::IsolatedMomery;
+pub use crate::isolated_memory::{
+    Domain, DomainBudgetExceeded, DomainStats, DomainTime, DomainTimes, IsolatedMomery, PkruScope,
+    PkuHotSpot, PkuProfile, PkuStats, PkuSwitchEdge,
+};
 
 #[cfg(feature = "component-model")]
 pub mod component;
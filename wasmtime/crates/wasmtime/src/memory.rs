@@ -1,11 +1,12 @@
 use crate::store::{StoreData, StoreOpaque, Stored};
 use crate::trampoline::generate_memory_export;
-use crate::{AsContext, AsContextMut, Engine, MemoryType, StoreContext, StoreContextMut};
+use crate::{AsContext, AsContextMut, Domain, Engine, MemoryType, StoreContext, StoreContextMut};
 use anyhow::{bail, Result};
 use std::convert::TryFrom;
+use std::ops::Range;
 use std::slice;
-use wasmtime_environ::MemoryPlan;
-use wasmtime_runtime::{RuntimeLinearMemory, VMMemoryImport};
+use wasmtime_environ::{EntityRef, MemoryPlan};
+use wasmtime_runtime::{InstanceHandle, PkeyRange, RuntimeLinearMemory, VMMemoryImport};
 
 /// Error for out of bounds [`Memory`] access.
 #[derive(Debug)]
@@ -503,7 +504,12 @@ impl Memory {
         let store = store.as_context_mut().0;
         let mem = self.wasmtime_memory(store);
         unsafe {
-            match (*mem).grow(delta, Some(store))? {
+            // Grow through the instance so a protection-key layout survives
+            // the memory moving.
+            let export = &store[self.0];
+            let mut handle = InstanceHandle::from_vmctx(export.vmctx);
+            let index = handle.module().memory_index(export.index);
+            match handle.memory_grow(index, delta)? {
                 Some(size) => {
                     let vm = (*mem).vmmemory();
                     *store[self.0].definition = vm;
@@ -539,6 +545,69 @@ impl Memory {
         store.on_fiber(|store| self.grow(store, delta)).await?
     }
 
+    /// Tags `range` of this memory with `domain`.
+    ///
+    /// The range is made accessible only while the PKRU grants the domain's
+    /// key, and is recorded in the layout of the instance defining this
+    /// memory, so it is restored if growing moves the memory. Tagging with
+    /// [`Domain::ROOT`] returns the range to the default domain.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if `range` is out of bounds or not aligned to host
+    /// pages, if this isn't the first memory of its instance, or if the host
+    /// fails to tag the pages.
+    ///
+    /// # Panics
+    ///
+    /// Panics if this memory doesn't belong to `store`.
+    pub fn protect_domain(
+        &self,
+        mut store: impl AsContextMut,
+        range: Range<usize>,
+        domain: Domain,
+    ) -> Result<()> {
+        let store = store.as_context_mut().0;
+        let pkey = store.domain_pkey(domain);
+        let export = &store[self.0];
+        let vm = unsafe { &*export.definition };
+        if range.start > range.end || range.end > vm.current_length() {
+            bail!(
+                "range {:?} is out of bounds of a memory of {} bytes",
+                range,
+                vm.current_length()
+            );
+        }
+        let page_size = wasmtime_runtime::page_size();
+        if range.start % page_size != 0 || range.end % page_size != 0 {
+            bail!("range {:?} is not aligned to host pages", range);
+        }
+        let mut handle = unsafe { InstanceHandle::from_vmctx(export.vmctx) };
+        if handle.module().memory_index(export.index).index() != 0 {
+            bail!("protection domains are only supported on an instance's first memory");
+        }
+        let range = PkeyRange {
+            offset: range.start,
+            len: range.end - range.start,
+            prot: (libc::PROT_READ | libc::PROT_WRITE) as u32,
+            pkey,
+        };
+        // Commands the guest queued earlier must not override this one.
+        let state = handle.pku_state();
+        let ret = match unsafe { state.drain_queue(vm) } {
+            0 => unsafe { state.protect(vm, range) },
+            err => err,
+        };
+        match ret {
+            0 => Ok(()),
+            err => bail!(
+                "failed to tag memory with protection key {}: {}",
+                pkey,
+                std::io::Error::from_raw_os_error(-err)
+            ),
+        }
+    }
+
     fn wasmtime_memory(&self, store: &mut StoreOpaque) -> *mut wasmtime_runtime::Memory {
         unsafe {
             let export = &store[self.0];
@@ -417,6 +417,9 @@ impl<'a> SerializedModule<'a> {
             consume_fuel,
             epoch_interruption,
             static_memory_bound_is_maximum,
+            pku_non_moving_memories,
+            pku_domain_time,
+            pku_isolation,
             guard_before_linear_memory,
 
             // This doesn't affect compilation, it's just a runtime setting.
@@ -468,6 +471,17 @@ impl<'a> SerializedModule<'a> {
             other.static_memory_bound_is_maximum,
             "pooling allocation support",
         )?;
+        Self::check_bool(
+            pku_non_moving_memories,
+            other.pku_non_moving_memories,
+            "non-moving PKU memories",
+        )?;
+        Self::check_bool(
+            pku_domain_time,
+            other.pku_domain_time,
+            "PKU domain time accounting",
+        )?;
+        Self::check_bool(pku_isolation, other.pku_isolation, "PKU isolation")?;
         Self::check_bool(
             guard_before_linear_memory,
             other.guard_before_linear_memory,
@@ -76,6 +76,10 @@
 //! contents of `StoreOpaque`. This is an invariant that we, as the authors of
 //! `wasmtime`, must uphold for the public interface to be safe.
 
+use crate::isolated_memory::{
+    Domain, DomainBudgetExceeded, DomainStats, DomainTime, DomainTimes, PkuHotSpot, PkuProfile,
+    PkuStats, PkuSwitchEdge,
+};
 use crate::linker::Definition;
 use crate::module::BareModuleInfo;
 use crate::{module::ModuleRegistry, Engine, Module, Trap, Val, ValRaw};
@@ -93,11 +97,12 @@ use std::ptr;
 use std::sync::atomic::AtomicU64;
 use std::sync::Arc;
 use std::task::{Context, Poll};
+use wasmtime_environ::{EntityRef, MemoryIndex, WASM_PAGE_SIZE};
 use wasmtime_runtime::{
-    InstanceAllocationRequest, InstanceAllocator, InstanceHandle, ModuleInfo,
-    OnDemandInstanceAllocator, SignalHandler, StorePtr, VMCallerCheckedAnyfunc, VMContext,
-    VMExternRef, VMExternRefActivationsTable, VMRuntimeLimits, VMSharedSignatureIndex,
-    VMTrampoline,
+    DomainClock, InstanceAllocationRequest, InstanceAllocator, InstanceHandle, ModuleInfo,
+    OnDemandInstanceAllocator, PkeyLease, Pku, PkuCounters, PkuHeapStats, PkuProfiler,
+    SignalHandler, StorePtr, VMCallerCheckedAnyfunc, VMContext, VMExternRef,
+    VMExternRefActivationsTable, VMRuntimeLimits, VMSharedSignatureIndex, VMTrampoline,
 };
 
 mod context;
@@ -291,6 +296,16 @@ pub struct StoreOpaque {
     memory_limit: usize,
     table_count: usize,
     table_limit: usize,
+    /// Domains created by `create_domain`, each with the key it was created
+    /// with and the lease of the key it is on now. Leases go back to the
+    /// broker with the store.
+    pku_domains: Vec<(Domain, PkeyLease)>,
+    /// Time spent in each domain, kept when modules are compiled with
+    /// `Config::pku_domain_time`.
+    pku_clock: Option<DomainClock>,
+    /// The epoch deadline set with `set_epoch_deadline`, which the running
+    /// domain's slice may bring forward.
+    epoch_deadline: u64,
     /// An adjustment to add to the fuel consumed value in `runtime_limits` above
     /// to get the true amount of fuel consumed.
     fuel_adj: i64,
@@ -485,6 +500,13 @@ impl<T> Store<T> {
                 memory_limit: crate::DEFAULT_MEMORY_LIMIT,
                 table_count: 0,
                 table_limit: crate::DEFAULT_TABLE_LIMIT,
+                pku_domains: Vec::new(),
+                pku_clock: engine
+                    .config()
+                    .tunables
+                    .pku_domain_time
+                    .then(DomainClock::new),
+                epoch_deadline: 0,
                 fuel_adj: 0,
                 #[cfg(feature = "async")]
                 async_state: AsyncState {
@@ -743,6 +765,109 @@ impl<T> Store<T> {
         self.inner.gc()
     }
 
+    /// Allocates a new protection-key domain owned by this store.
+    ///
+    /// Memory of this store's instances can be tagged with the domain using
+    /// [`Memory::protect_domain`](crate::Memory::protect_domain). The key is
+    /// leased from a pool shared by every store in the process and goes back
+    /// to it when the store is dropped. Once the host runs out of keys,
+    /// stores share them; a store entering wasm on a thread where another
+    /// store holding its key is active moves the domain to a free key and
+    /// re-tags its memory, see [`Store::domain_pkey`].
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if the host doesn't support protection keys, or if
+    /// this store already holds every usable key.
+    pub fn create_domain(&mut self) -> Result<Domain> {
+        self.inner.create_domain()
+    }
+
+    /// Returns the protection key `domain` is on now. This is
+    /// [`Domain::pkey`] unless the store had to move the domain, and only
+    /// changes when this store starts running wasm.
+    pub fn domain_pkey(&self, domain: Domain) -> u32 {
+        self.inner.domain_pkey(domain)
+    }
+
+    /// Frees a domain created by [`Store::create_domain`].
+    ///
+    /// Returns without touching the domain's memory: a background thread
+    /// hands its pages back to the kernel and returns them to
+    /// [`Domain::ROOT`], reading as zeros, and only then gives the key back
+    /// to the pool. Protecting, growing or freeing a memory waits for the
+    /// pages it covers.
+    ///
+    /// # Errors
+    ///
+    /// Returns an error if `domain` wasn't created by this store or was
+    /// already freed.
+    pub fn free_domain(&mut self, domain: Domain) -> Result<()> {
+        self.inner.free_domain(domain)
+    }
+
+    /// Returns the protection-key usage of this store's memories.
+    pub fn domain_stats(&self) -> DomainStats {
+        self.inner.domain_stats()
+    }
+
+    /// Returns what isolation has cost so far: the host's counters, kept
+    /// while an engine configured with
+    /// [`Config::pku_stats`](crate::Config::pku_stats) is alive, and
+    /// [`Store::domain_stats`], whose heaps carry the switches guests
+    /// counted themselves.
+    ///
+    /// The host's counters are process-wide, so they include the work of
+    /// other stores.
+    pub fn pku_stats(&self) -> PkuStats {
+        PkuStats {
+            host: PkuCounters::read(),
+            domains: self.inner.domain_stats(),
+        }
+    }
+
+    /// Returns the cross-domain accesses and switches sampled since the
+    /// last call, with functions named after this store's modules.
+    ///
+    /// Sampling only happens while an engine configured with
+    /// [`Config::pku_profile`](crate::Config::pku_profile) is alive. The
+    /// profiler is process-wide, so samples of other stores running at the
+    /// same time are taken too; their functions are reported as `<host>`.
+    pub fn pku_profile(&self) -> PkuProfile {
+        self.inner.pku_profile()
+    }
+
+    /// Returns the time this store's wasm ran in each domain, and how often
+    /// it switched to each.
+    ///
+    /// Time is read from the CPU's timestamp counter at every switch, and
+    /// time spent in host functions counts towards the domain that called
+    /// them. Only kept for modules compiled with
+    /// [`Config::pku_domain_time`](crate::Config::pku_domain_time), returns
+    /// no domains otherwise.
+    pub fn pku_domain_times(&self) -> DomainTimes {
+        self.inner.pku_domain_times()
+    }
+
+    /// Limits `domain` to `ticks` epoch ticks per call into wasm, or lifts
+    /// the limit with `None`.
+    ///
+    /// The budget starts when the domain is first entered in a call from
+    /// the host and keeps running while the domain calls out of it. Once
+    /// the [engine's epoch](crate::Engine::increment_epoch) reaches it, the
+    /// next epoch check in the domain fails the call with
+    /// [`DomainBudgetExceeded`], which returns to the host with its own
+    /// PKRU. Switches made through the `pku` hostcalls apply their domain's
+    /// budget from the next function call.
+    ///
+    /// Needs [`Config::epoch_interruption`](crate::Config::epoch_interruption)
+    /// and [`Config::pku_domain_time`](crate::Config::pku_domain_time);
+    /// without them budgets are never checked. A domain laid out by the
+    /// module is named by its number, see [`Domain::from_pkey`].
+    pub fn pku_domain_slice(&mut self, domain: Domain, ticks: Option<u64>) {
+        self.inner.pku_domain_slice(domain, ticks)
+    }
+
     /// Returns the amount of fuel consumed by this store's execution so far.
     ///
     /// If fuel consumption is not enabled via
@@ -993,6 +1118,13 @@ impl<'a, T> StoreContext<'a, T> {
     pub fn fuel_consumed(&self) -> Option<u64> {
         self.0.fuel_consumed()
     }
+
+    /// Returns the protection-key usage of this store's memories.
+    ///
+    /// Same as [`Store::domain_stats`].
+    pub fn domain_stats(&self) -> DomainStats {
+        self.0.domain_stats()
+    }
 }
 
 impl<'a, T> StoreContextMut<'a, T> {
@@ -1022,6 +1154,34 @@ impl<'a, T> StoreContextMut<'a, T> {
         self.0.gc()
     }
 
+    /// Allocates a new protection-key domain owned by this store.
+    ///
+    /// Same as [`Store::create_domain`].
+    pub fn create_domain(&mut self) -> Result<Domain> {
+        self.0.create_domain()
+    }
+
+    /// Returns the protection key `domain` is on now.
+    ///
+    /// Same as [`Store::domain_pkey`].
+    pub fn domain_pkey(&self, domain: Domain) -> u32 {
+        self.0.domain_pkey(domain)
+    }
+
+    /// Frees a domain created by this store.
+    ///
+    /// Same as [`Store::free_domain`].
+    pub fn free_domain(&mut self, domain: Domain) -> Result<()> {
+        self.0.free_domain(domain)
+    }
+
+    /// Returns the protection-key usage of this store's memories.
+    ///
+    /// Same as [`Store::domain_stats`].
+    pub fn domain_stats(&self) -> DomainStats {
+        self.0.domain_stats()
+    }
+
     /// Returns the fuel consumed by this store.
     ///
     /// For more information see [`Store::fuel_consumed`].
@@ -1218,6 +1378,289 @@ impl StoreOpaque {
         unsafe { wasmtime_runtime::gc(&self.modules, &mut self.externref_activations_table) }
     }
 
+    /// Keys the store's domains were created with or are on now, none of
+    /// which a new domain or a moved one may take.
+    fn pku_domain_keys(&self) -> u16 {
+        self.pku_domains
+            .iter()
+            .fold(0, |m, (d, l)| m | 1 << d.pkey() | 1 << l.pkey())
+    }
+
+    /// Keys of freed domains whose pages are still being scrubbed in one of
+    /// the store's instances.
+    fn pku_retired_keys(&self) -> u16 {
+        self.instances.iter().fold(0, |m, instance| {
+            let mut handle = unsafe { instance.handle.clone() };
+            m | handle.pku_state().retired_keys()
+        })
+    }
+
+    pub fn create_domain(&mut self) -> Result<Domain> {
+        let exclude = self.pku_domain_keys() | self.pku_retired_keys();
+        let lease = match PkeyLease::new(exclude) {
+            Ok(lease) => lease,
+            Err(err) => bail!(
+                "failed to allocate a protection key: {}",
+                std::io::Error::from_raw_os_error(-err)
+            ),
+        };
+        // The lease makes the key this store's until the domain is freed.
+        let domain = unsafe { Domain::from_pkey(lease.pkey()) };
+        self.pku_domains.push((domain, lease));
+        Ok(domain)
+    }
+
+    pub fn domain_pkey(&self, domain: Domain) -> u32 {
+        match self.pku_domains.iter().find(|(d, _)| *d == domain) {
+            Some((_, lease)) => lease.pkey(),
+            None => domain.pkey(),
+        }
+    }
+
+    pub fn free_domain(&mut self, domain: Domain) -> Result<()> {
+        let pos = match self.pku_domains.iter().position(|(d, _)| *d == domain) {
+            Some(pos) => pos,
+            None => bail!(
+                "protection key {} is not a domain of this store",
+                domain.pkey()
+            ),
+        };
+        // Each instance drops the domain's pages from its layout and leaves
+        // resetting them to the scrubber, which returns the key to the pool
+        // after the last of them.
+        let lease = Arc::new(self.pku_domains.swap_remove(pos).1);
+        for instance in self.instances.iter() {
+            let mut handle = unsafe { instance.handle.clone() };
+            if handle.module().memory_plans.is_empty() {
+                continue;
+            }
+            let vm = handle.get_exported_memory(MemoryIndex::new(0)).definition;
+            unsafe {
+                handle
+                    .pku_state()
+                    .retire(&*vm, lease.pkey(), Some(lease.clone()))
+            };
+        }
+        Ok(())
+    }
+
+    /// Mark the store's domains active on this thread before running wasm.
+    ///
+    /// A domain whose key another store is active with on this thread is
+    /// moved to a key free here first, and the store's memories are
+    /// re-tagged to match. Undone by `exit_pku_domains`.
+    pub(crate) fn enter_pku_domains(&mut self) -> Result<()> {
+        for i in 0..self.pku_domains.len() {
+            if self.pku_domains[i].1.enter() {
+                continue;
+            }
+            if let Err(err) = self.move_pku_domain(i) {
+                for (_, lease) in &self.pku_domains[..i] {
+                    lease.exit();
+                }
+                return Err(err);
+            }
+        }
+        let epoch = self.engine.current_epoch();
+        if let Some(clock) = &mut self.pku_clock {
+            clock.enter(Pku::try_rdpkru().unwrap_or(0) as u32, epoch);
+            self.install_epoch_deadline();
+        }
+        Ok(())
+    }
+
+    pub(crate) fn exit_pku_domains(&mut self) {
+        for (_, lease) in &self.pku_domains {
+            lease.exit();
+        }
+        if let Some(clock) = &mut self.pku_clock {
+            clock.exit();
+            self.install_epoch_deadline();
+        }
+    }
+
+    /// Account a PKRU write made by wasm, directly or through a hostcall.
+    pub(crate) fn pku_domain_switch(&mut self, pkru: u32) {
+        let epoch = self.engine.current_epoch();
+        if let Some(clock) = &mut self.pku_clock {
+            clock.switch(pkru, epoch);
+            self.install_epoch_deadline();
+        }
+    }
+
+    pub fn pku_domain_times(&self) -> DomainTimes {
+        let mut domains: Vec<DomainTime> = self
+            .pku_clock
+            .iter()
+            .flat_map(|clock| clock.times())
+            .map(|(time, entries)| DomainTime { time, entries })
+            .collect();
+        let other = domains.pop().unwrap_or_default();
+        DomainTimes { domains, other }
+    }
+
+    pub fn pku_domain_slice(&mut self, domain: Domain, ticks: Option<u64>) {
+        if let Some(clock) = &mut self.pku_clock {
+            clock.set_slice(domain.pkey(), ticks);
+        }
+    }
+
+    /// Write the epoch deadline compiled code checks against: the one set
+    /// with `set_epoch_deadline`, or the running domain's if that is
+    /// earlier.
+    fn install_epoch_deadline(&mut self) {
+        let slice = self.pku_clock.as_ref().and_then(|clock| clock.deadline());
+        let deadline = slice.map_or(self.epoch_deadline, |d| d.min(self.epoch_deadline));
+        // Safety: this is safe because the epoch deadline in the
+        // `VMRuntimeLimits` is accessed only here and by Wasm guest code
+        // running in this store, and we have a `&mut self` here.
+        //
+        // Also, note that when this update is performed while Wasm is
+        // on the stack, the Wasm will reload the new value once we
+        // return into it.
+        unsafe { *(*self.vmruntime_limits()).epoch_deadline.get_mut() = deadline };
+    }
+
+    fn move_pku_domain(&mut self, i: usize) -> Result<()> {
+        let exclude = self.pku_domain_keys();
+        let lease = &mut self.pku_domains[i].1;
+        let old = match lease.rekey(exclude) {
+            Ok(old) => old,
+            Err(err) => bail!(
+                "no protection key is free on this thread to move key {} to: {}",
+                lease.pkey(),
+                std::io::Error::from_raw_os_error(-err)
+            ),
+        };
+        let new = lease.pkey();
+        let entered = lease.enter();
+        debug_assert!(entered);
+        for instance in self.instances.iter() {
+            let mut handle = unsafe { instance.handle.clone() };
+            let ret = unsafe { handle.pku_state().rekey(old, new) };
+            if ret != 0 {
+                self.pku_domains[i].1.exit();
+                bail!(
+                    "failed to move memory from protection key {} to {}: {}",
+                    old,
+                    new,
+                    std::io::Error::from_raw_os_error(-ret)
+                );
+            }
+        }
+        Ok(())
+    }
+
+    pub fn domain_stats(&self) -> DomainStats {
+        let mut stats = DomainStats {
+            domains: self.pku_domains.len(),
+            ..DomainStats::default()
+        };
+        for instance in self.instances.iter() {
+            // The layout is only read here; the clone just lends us the
+            // instance for `pku_state`.
+            let mut handle = unsafe { instance.handle.clone() };
+            for range in handle.pku_state().domains().iter() {
+                if range.is_default() {
+                    continue;
+                }
+                stats.ranges += 1;
+                stats.tagged_bytes += range.len;
+            }
+            if handle.module().memory_plans.is_empty() {
+                continue;
+            }
+            let vm = handle.get_exported_memory(MemoryIndex::new(0)).definition;
+            let heaps = unsafe { handle.pku_state().heap_stats(&*vm) };
+            if stats.heaps.len() < heaps.len() {
+                stats.heaps.resize(heaps.len(), PkuHeapStats::default());
+            }
+            for (sum, heap) in stats.heaps.iter_mut().zip(heaps) {
+                sum.in_use += heap.in_use;
+                sum.peak += heap.peak;
+                sum.allocations += heap.allocations;
+                sum.frees += heap.frees;
+                sum.footprint += heap.footprint;
+                sum.segments += heap.segments;
+                sum.tagged += heap.tagged;
+                sum.switches += heap.switches;
+            }
+        }
+        stats
+    }
+
+    pub fn pku_profile(&self) -> PkuProfile {
+        let name = |pc: usize| match self.modules.lookup_frame_info(pc) {
+            Some((info, _)) => {
+                let module = info.module_name().unwrap_or("<module>");
+                match info.func_name() {
+                    Some(func) => format!("{}!{}", module, func),
+                    None => format!("{}!<wasm function {}>", module, info.func_index()),
+                }
+            }
+            None => "<host>".to_string(),
+        };
+        let memories: Vec<(usize, usize)> = self
+            .instances
+            .iter()
+            .filter_map(|instance| {
+                let mut handle = unsafe { instance.handle.clone() };
+                if handle.module().memory_plans.is_empty() {
+                    return None;
+                }
+                let vm = handle.get_exported_memory(MemoryIndex::new(0)).definition;
+                unsafe { Some(((*vm).base as usize, (*vm).current_length())) }
+            })
+            .collect();
+
+        let (samples, lost) = PkuProfiler::take_samples();
+        let mut accesses = HashMap::new();
+        for sample in samples {
+            let page = memories
+                .iter()
+                .find(|(base, len)| sample.addr >= *base && sample.addr - base < *len)
+                .map(|(base, _)| ((sample.addr - base) as u64) / u64::from(WASM_PAGE_SIZE));
+            *accesses
+                .entry((name(sample.pc), sample.pkey, page))
+                .or_insert(0) += 1;
+        }
+        let mut switches = HashMap::new();
+        for (switch, count) in PkuProfiler::take_switches() {
+            let caller = match switch.pc {
+                0 => "<host>".to_string(),
+                pc => name(pc),
+            };
+            *switches
+                .entry((caller, switch.from, switch.to))
+                .or_insert(0) += count;
+        }
+
+        let mut profile = PkuProfile {
+            accesses: accesses
+                .into_iter()
+                .map(|((function, pkey, page), samples)| PkuHotSpot {
+                    function,
+                    pkey,
+                    page,
+                    samples,
+                })
+                .collect(),
+            switches: switches
+                .into_iter()
+                .map(|((caller, from, to), count)| PkuSwitchEdge {
+                    caller,
+                    from,
+                    to,
+                    count,
+                })
+                .collect(),
+            lost,
+        };
+        profile.accesses.sort_by(|a, b| b.samples.cmp(&a.samples));
+        profile.switches.sort_by(|a, b| b.count.cmp(&a.count));
+        profile
+    }
+
     /// Looks up the corresponding `VMTrampoline` which can be used to enter
     /// wasm given an anyfunc function pointer.
     ///
@@ -1933,6 +2376,12 @@ unsafe impl<T> wasmtime_runtime::Store for StoreInner<T> {
     }
 
     fn new_epoch(&mut self) -> Result<u64, anyhow::Error> {
+        // A domain past its slice goes back to the host whatever the
+        // store's own deadline says.
+        let epoch = self.engine().current_epoch();
+        if let Some(domain) = self.pku_clock.as_ref().and_then(|c| c.expired(epoch)) {
+            return Err(anyhow::Error::new(DomainBudgetExceeded { domain }));
+        }
         return match &mut self.epoch_deadline_behavior {
             EpochDeadline::Trap => {
                 let trap = Trap::new_wasm(wasmtime_environ::TrapCode::Interrupt, None);
@@ -1960,21 +2409,17 @@ unsafe impl<T> wasmtime_runtime::Store for StoreInner<T> {
             }
         };
     }
+
+    fn pku_domain_switch(&mut self, pkru: u32) {
+        <StoreOpaque>::pku_domain_switch(self, pkru)
+    }
 }
 
 impl<T> StoreInner<T> {
     pub(crate) fn set_epoch_deadline(&mut self, delta: u64) {
         // Set a new deadline based on the "epoch deadline delta".
-        //
-        // Safety: this is safe because the epoch deadline in the
-        // `VMRuntimeLimits` is accessed only here and by Wasm guest code
-        // running in this store, and we have a `&mut self` here.
-        //
-        // Also, note that when this update is performed while Wasm is
-        // on the stack, the Wasm will reload the new value once we
-        // return into it.
-        let epoch_deadline = unsafe { (*self.vmruntime_limits()).epoch_deadline.get_mut() };
-        *epoch_deadline = self.engine().current_epoch() + delta;
+        self.epoch_deadline = self.engine().current_epoch() + delta;
+        self.install_epoch_deadline();
     }
 
     fn epoch_deadline_trap(&mut self) {
@@ -2052,6 +2497,9 @@ impl Drop for StoreOpaque {
             }
             ondemand.deallocate(&self.default_caller);
 
+            // Only once no memory of this store uses them any more.
+            self.pku_domains.clear();
+
             // See documentation for these fields on `StoreOpaque` for why they
             // must be dropped in this order.
             ManuallyDrop::drop(&mut self.store_data);
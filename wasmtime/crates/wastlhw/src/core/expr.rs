@@ -781,6 +781,7 @@ instructions! {
         // pkru
         Rdpkru : [0xf1, 0xee] : "rdpkru",
         Wrpkru : [0xf1, 0xef] : "wrpkru",
+        SwitchDomain(u32) : [0xf1, 0xf0] : "switch_domain",
 
         // non-trapping float to int
         I32TruncSatF32S : [0xfc, 0x00] : "i32.trunc_sat_f32_s" | "i32.trunc_s:sat/f32",
@@ -112,6 +112,7 @@ fn generate_func(
     };
 
     let body = quote! {
+        let pkru = #rt::wasmtime_crate::PkruScope::new(&caller);
         let mem = match caller.get_export("memory") {
             Some(#rt::wasmtime_crate::Extern::Memory(m)) => m,
             _ => {
@@ -120,7 +121,7 @@ fn generate_func(
         };
         let (mem , ctx) = mem.data_and_store_mut(&mut caller);
         let ctx = get_cx(ctx);
-        let mem = #rt::wasmtime::WasmtimeGuestMemory::new(mem);
+        let mem = #rt::wasmtime::WasmtimeGuestMemory::with_pkru(mem, &pkru);
         match #abi_func(ctx, &mem #(, #arg_names)*) #await_ {
             Ok(r) => Ok(<#ret_ty>::from(r)),
             Err(#rt::Trap::String(err)) => Err(#rt::wasmtime_crate::Trap::new(err)),
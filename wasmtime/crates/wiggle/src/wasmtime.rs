@@ -1,4 +1,5 @@
 use crate::borrow::BorrowChecker;
+use crate::wasmtime_crate::PkruScope;
 use crate::{BorrowHandle, GuestError, GuestMemory, Region};
 
 /// Lightweight `wasmtime::Memory` wrapper so we can implement the
@@ -6,6 +7,7 @@ use crate::{BorrowHandle, GuestError, GuestMemory, Region};
 pub struct WasmtimeGuestMemory<'a> {
     mem: &'a mut [u8],
     bc: BorrowChecker,
+    pkru: Option<&'a PkruScope>,
 }
 
 impl<'a> WasmtimeGuestMemory<'a> {
@@ -22,6 +24,22 @@ impl<'a> WasmtimeGuestMemory<'a> {
             // integrated fully with wasmtime:
             // https://github.com/bytecodealliance/wasmtime/issues/1917
             bc: BorrowChecker::new(),
+            pkru: None,
+        }
+    }
+
+    /// Like `new`, but grants the host access to the protection domains
+    /// covering each region before it is touched.
+    pub fn with_pkru(mem: &'a mut [u8], pkru: &'a PkruScope) -> Self {
+        Self {
+            pkru: Some(pkru),
+            ..Self::new(mem)
+        }
+    }
+
+    fn open(&self, r: Region) {
+        if let Some(pkru) = self.pkru {
+            pkru.open(r.start as usize, r.len as usize);
         }
     }
 }
@@ -34,15 +52,19 @@ unsafe impl GuestMemory for WasmtimeGuestMemory<'_> {
         self.bc.has_outstanding_borrows()
     }
     fn is_shared_borrowed(&self, r: Region) -> bool {
+        self.open(r);
         self.bc.is_shared_borrowed(r)
     }
     fn is_mut_borrowed(&self, r: Region) -> bool {
+        self.open(r);
         self.bc.is_mut_borrowed(r)
     }
     fn shared_borrow(&self, r: Region) -> Result<BorrowHandle, GuestError> {
+        self.open(r);
         self.bc.shared_borrow(r)
     }
     fn mut_borrow(&self, r: Region) -> Result<BorrowHandle, GuestError> {
+        self.open(r);
         self.bc.mut_borrow(r)
     }
     fn shared_unborrow(&self, h: BorrowHandle) {
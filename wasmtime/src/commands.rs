@@ -2,8 +2,12 @@
 
 mod compile;
 mod config;
+mod pku_bench;
+mod pku_partition;
 mod run;
 mod settings;
 mod wast;
 
-pub use self::{compile::*, config::*, run::*, settings::*, wast::*};
+pub use self::{
+    compile::*, config::*, pku_bench::*, pku_partition::*, run::*, settings::*, wast::*,
+};
@@ -0,0 +1,1040 @@
+//! The module that implements the `wasmtime pku-bench` command.
+
+use anyhow::{anyhow, bail, Context, Result};
+use clap::Parser;
+use once_cell::sync::Lazy;
+use std::fmt::Write as _;
+use std::fs;
+use std::path::{Path, PathBuf};
+use std::sync::{Arc, Barrier};
+use std::thread;
+use std::time::{Duration, Instant};
+use wasmparser::{BinaryReader, CustomSectionReader};
+use wasmtime::{
+    Config, Engine, Instance, InstanceAllocationStrategy, InstancePre, Linker, Module, Store,
+};
+use wasmtime_cli_flags::CommonOptions;
+use wasmtime_wasi::sync::{ambient_authority, file::File, Dir, WasiCtxBuilder};
+use wasmtime_wasi::WasiCtx;
+
+static AFTER_HELP: Lazy<String> = Lazy::new(|| {
+    "Each benchmark of the suite is compiled once per variant, run untimed \
+    for the warm-up and then timed for every iteration. A timed iteration \
+    instantiates the module in a fresh store and runs `_start` to \
+    completion. The variants are:\n\
+    \n  \
+    stock       the module without `pkuwa.*` sections, no PKU host modules\n  \
+    no-domains  the same module with the PKU host modules and non-moving\n              \
+    memories\n  \
+    domains     NAME.domains.wasm from `wasmtime pku-partition`, or the\n              \
+    module itself if it has `pkuwa.*` sections\n\
+    \n\
+    With `--memory`, each benchmark and variant runs once more after the \
+    timed runs, measuring the process's peak RSS, its VMAs in \
+    /proc/self/maps and the final size of linear memory, and the footprint \
+    of each domain's heap as the guest's allocator counts it. The peak \
+    starts from the RSS the run began with, which is reported as well. \
+    These need Linux; elsewhere they are null. `memory_overhead` gives \
+    the peak RSS of each variant against stock's.\n\
+    \n\
+    With `--threads`, each benchmark is instead run by that many threads \
+    at once, every thread instantiating and running it in its own store, to \
+    see how runs per second scale. The benchmark runs as its domains \
+    variant, or as no-domains if it has none, in each setup:\n\
+    \n  \
+    on-demand         instances allocated on demand, keys leased as the\n                    \
+    guest asks\n  \
+    pooling           instances from the pooling allocator, a slot keeping\n                    \
+    its tags for the next instance of the module\n  \
+    prelease          keys leased at instantiation, see `--pkey-quota`\n  \
+    pooling+prelease  both\n\
+    \n\
+    Every point reports the `pkey_mprotect` and `mmap` calls per run, which \
+    contend on the process's mmap lock, and fails alone if the keys run \
+    out.\n\
+    \n\
+    The JSON report is written to stdout, progress to stderr. Guests see the \
+    suite's directory preopened as `.` and write their output to \
+    `output_wasmtime` there.\n\
+    \n\
+    Usage examples:\n\
+    \n\
+    Timing the whole suite and keeping the report:\n\
+    \n  \
+    wasmtime pku-bench -o before.json benches/suite.txt\n\
+    \n\
+    Timing bzip2 alone with domains and without:\n\
+    \n  \
+    wasmtime pku-bench --bench bzip2 --variant stock --variant domains \\\n      \
+    --iterations 30 benches/suite.txt\n\
+    \n\
+    Comparing the memory of the suite's runs with and without PKU:\n\
+    \n  \
+    wasmtime pku-bench --memory --iterations 1 benches/suite.txt\n\
+    \n\
+    Scaling whitedb from 1 to 8 threads with and without pooling:\n\
+    \n  \
+    wasmtime pku-bench --bench whitedb --threads 1,2,4,8 \\\n      \
+    --setup on-demand --setup pooling benches/suite.txt\n"
+        .to_string()
+});
+
+/// Times a benchmark suite with and without protection domains
+#[derive(Parser)]
+#[structopt(
+    name = "pku-bench",
+    version,
+    after_help = AFTER_HELP.as_str()
+)]
+pub struct PkuBenchCommand {
+    #[clap(flatten)]
+    common: CommonOptions,
+
+    /// Untimed runs of each benchmark and variant before the timed ones
+    #[clap(long, value_name = "N", default_value = "2")]
+    warmup: u32,
+
+    /// Timed runs of each benchmark and variant
+    #[clap(long, value_name = "N", default_value = "10")]
+    iterations: u32,
+
+    /// Also measure the memory of a run of each benchmark and variant
+    #[clap(long)]
+    memory: bool,
+
+    /// Only run the named benchmark
+    #[clap(long, value_name = "NAME", number_of_values = 1)]
+    bench: Vec<String>,
+
+    /// Only run the variant: stock, no-domains or domains
+    #[clap(
+        long,
+        value_name = "VARIANT",
+        number_of_values = 1,
+        parse(try_from_str = Variant::parse)
+    )]
+    variant: Vec<Variant>,
+
+    /// Instead of comparing variants, run each benchmark on this many
+    /// threads at once, for every count of the list, e.g. `1,2,4,8`
+    #[clap(long, value_name = "N,...", value_delimiter = ',')]
+    threads: Vec<usize>,
+
+    /// With `--threads`, only run the setup: on-demand, pooling, prelease
+    /// or pooling+prelease
+    #[clap(
+        long,
+        value_name = "SETUP",
+        number_of_values = 1,
+        parse(try_from_str = Setup::parse)
+    )]
+    setup: Vec<Setup>,
+
+    /// Keys each instance leases at instantiation in the prelease setups
+    #[clap(long, value_name = "N", default_value = "1")]
+    pkey_quota: u32,
+
+    /// Write the report to this file instead of stdout
+    #[clap(short = 'o', long, value_name = "OUTPUT", parse(from_os_str))]
+    output: Option<PathBuf>,
+
+    /// The suite file listing the benchmarks
+    #[clap(index = 1, value_name = "SUITE", parse(from_os_str))]
+    suite: PathBuf,
+}
+
+impl PkuBenchCommand {
+    /// Executes the command.
+    pub fn execute(self) -> Result<()> {
+        self.common.init_logging();
+        if self.iterations == 0 {
+            bail!("at least one iteration is needed");
+        }
+
+        let text = fs::read_to_string(&self.suite)
+            .with_context(|| format!("failed to read `{}`", self.suite.display()))?;
+        let dir = match self.suite.parent() {
+            Some(dir) if !dir.as_os_str().is_empty() => dir.to_path_buf(),
+            _ => PathBuf::from("."),
+        };
+        let mut suite = parse_suite(&text, &dir)
+            .with_context(|| format!("failed to parse `{}`", self.suite.display()))?;
+        for name in &self.bench {
+            if !suite.iter().any(|bench| bench.name == *name) {
+                bail!("no benchmark named `{}` in the suite", name);
+            }
+        }
+        if !self.bench.is_empty() {
+            suite.retain(|bench| self.bench.contains(&bench.name));
+        }
+        if !self.threads.is_empty() {
+            return self.scale(&suite);
+        }
+        let variants = if self.variant.is_empty() {
+            Variant::ALL.to_vec()
+        } else {
+            Variant::ALL
+                .iter()
+                .copied()
+                .filter(|variant| self.variant.contains(variant))
+                .collect()
+        };
+
+        let mut engines = Vec::new();
+        for variant in &variants {
+            let mut config = self.common.config(None)?;
+            if *variant != Variant::Stock {
+                config.pku_non_moving_memories(true);
+            }
+            engines.push((*variant, Engine::new(&config)?));
+        }
+
+        let mut results = Vec::new();
+        for (i, bench) in suite.iter().enumerate() {
+            eprintln!("[{}/{}] {}", i + 1, suite.len(), bench.name);
+            let mut measured = Vec::new();
+            for (variant, engine) in &engines {
+                let result = self
+                    .measure(engine, *variant, bench)
+                    .with_context(|| format!("`{}` failed as {}", bench.name, variant.name()))?;
+                match &result {
+                    Some(m) => eprintln!(
+                        "  {:<11} median {:>10.3} ms  p95 {:>10.3} ms  stddev {:>8.3} ms",
+                        variant.name(),
+                        ms(m.median()),
+                        ms(m.percentile(95)),
+                        ms(m.stddev()),
+                    ),
+                    None => eprintln!("  {:<11} skipped, no module", variant.name()),
+                }
+                if let Some(memory) = result.as_ref().and_then(|m| m.memory.as_ref()) {
+                    eprintln!(
+                        "  {:<11} peak rss {:>8.1} MiB  linear {:>8.1} MiB  {:>6} VMAs",
+                        "",
+                        mib(memory.peak_rss),
+                        mib(memory.linear_memory),
+                        memory.vmas.map_or("-".to_string(), |n| n.to_string()),
+                    );
+                }
+                measured.push((*variant, result));
+            }
+            results.push((bench, measured));
+        }
+
+        let report = self.report(&results);
+        self.write_report(report)
+    }
+
+    fn write_report(&self, report: String) -> Result<()> {
+        match &self.output {
+            Some(path) => fs::write(path, report)
+                .with_context(|| format!("failed to write `{}`", path.display())),
+            None => {
+                print!("{}", report);
+                Ok(())
+            }
+        }
+    }
+
+    /// Runs every benchmark in every setup on each count of `--threads`.
+    fn scale(&self, suite: &[Bench]) -> Result<()> {
+        if self.threads.contains(&0) {
+            bail!("thread counts have to be at least 1");
+        }
+        let setups = if self.setup.is_empty() {
+            Setup::ALL.to_vec()
+        } else {
+            Setup::ALL
+                .iter()
+                .copied()
+                .filter(|setup| self.setup.contains(setup))
+                .collect()
+        };
+
+        let mut results = Vec::new();
+        for (i, bench) in suite.iter().enumerate() {
+            eprintln!("[{}/{}] {}", i + 1, suite.len(), bench.name);
+            let mut variant = Variant::Domains;
+            let mut wasm = variant.wasm(&bench.module)?;
+            if wasm.is_none() {
+                variant = Variant::NoDomains;
+                wasm = variant.wasm(&bench.module)?;
+            }
+            let wasm = match wasm {
+                Some(wasm) => wasm,
+                None => {
+                    eprintln!("  skipped, no module");
+                    results.push((bench, None, Vec::new()));
+                    continue;
+                }
+            };
+
+            let mut measured = Vec::new();
+            for setup in &setups {
+                let engine = Engine::new(&self.setup_config(*setup)?)?;
+                let pre = instantiate_pre(&engine, &wasm)
+                    .with_context(|| format!("`{}` failed to compile", bench.name))?;
+                let mut points = Vec::new();
+                for threads in &self.threads {
+                    let point = self.run_threads(&engine, &pre, bench, *threads);
+                    match &point {
+                        Ok(p) => eprintln!(
+                            "  {:<16} {:>3} threads {:>10.1} runs/s  {:>8.1} mprotect/run  \
+                             {:>6.1} mmap/run",
+                            setup.name(),
+                            threads,
+                            p.runs_per_sec(),
+                            p.per_run(p.stats.mprotect_calls),
+                            p.per_run(p.stats.mmap_calls),
+                        ),
+                        Err(e) => eprintln!(
+                            "  {:<16} {:>3} threads failed: {:#}",
+                            setup.name(),
+                            threads,
+                            e
+                        ),
+                    }
+                    points.push((*threads, point));
+                }
+                measured.push((*setup, points));
+            }
+            results.push((bench, Some(variant), measured));
+        }
+
+        let report = self.scaling_report(&results);
+        self.write_report(report)
+    }
+
+    /// The engine configuration of `setup`, with host counters on.
+    fn setup_config(&self, setup: Setup) -> Result<Config> {
+        let mut config = self.common.config(None)?;
+        config.pku_non_moving_memories(true).pku_stats(true);
+        if setup.prelease() {
+            config.pku_pkey_quota(self.pkey_quota);
+        }
+        if setup.pooling() {
+            #[cfg(feature = "pooling-allocator")]
+            {
+                // A thread has one instance at a time, but its slot is not
+                // free until the store is dropped.
+                let count = self.threads.iter().max().copied().unwrap_or(1) * 2;
+                config.allocation_strategy(InstanceAllocationStrategy::Pooling {
+                    strategy: wasmtime::PoolingAllocationStrategy::NextAvailable,
+                    instance_limits: wasmtime::InstanceLimits {
+                        count: u32::try_from(count)?,
+                        memory_pages: 0x10000,
+                        ..Default::default()
+                    },
+                });
+            }
+            #[cfg(not(feature = "pooling-allocator"))]
+            bail!("the pooling setups need the `pooling-allocator` feature");
+        } else {
+            config.allocation_strategy(InstanceAllocationStrategy::OnDemand);
+        }
+        Ok(config)
+    }
+
+    /// Runs `bench` on `threads` threads, each warming up and then doing
+    /// the timed iterations, and times from when all are warm until all are
+    /// done.
+    fn run_threads(
+        &self,
+        engine: &Engine,
+        pre: &InstancePre<WasiCtx>,
+        bench: &Bench,
+        threads: usize,
+    ) -> Result<Point> {
+        let barrier = Arc::new(Barrier::new(threads + 1));
+        let workers = (0..threads)
+            .map(|_| {
+                let (engine, pre, bench) = (engine.clone(), pre.clone(), bench.clone());
+                let barrier = barrier.clone();
+                let (warmup, iterations) = (self.warmup, self.iterations);
+                thread::spawn(move || -> Result<()> {
+                    // Every thread reaches the barrier, so that a failed
+                    // warm-up doesn't leave the others waiting.
+                    let warm =
+                        (0..warmup).try_for_each(|_| run_once(&engine, &pre, &bench).map(drop));
+                    barrier.wait();
+                    warm?;
+                    for _ in 0..iterations {
+                        run_once(&engine, &pre, &bench)?;
+                    }
+                    Ok(())
+                })
+            })
+            .collect::<Vec<_>>();
+
+        barrier.wait();
+        let before = host_counters(engine);
+        let start = Instant::now();
+        let mut result = Ok(());
+        for worker in workers {
+            let done = worker
+                .join()
+                .unwrap_or_else(|_| Err(anyhow!("a benchmark thread panicked")));
+            if result.is_ok() {
+                result = done;
+            }
+        }
+        let elapsed = start.elapsed();
+        result?;
+        Ok(Point {
+            runs: threads as u64 * u64::from(self.iterations),
+            elapsed,
+            stats: host_counters(engine).since(&before),
+        })
+    }
+
+    /// Renders the scaling results as JSON. Efficiency is the runs per
+    /// second and thread against those of the first thread count.
+    fn scaling_report(&self, results: &[Scaling]) -> String {
+        let mut out = String::new();
+        let _ = writeln!(out, "{{");
+        let _ = writeln!(
+            out,
+            "  \"wasmtime\": {},",
+            json_string(env!("CARGO_PKG_VERSION"))
+        );
+        let _ = writeln!(out, "  \"warmup\": {},", self.warmup);
+        let _ = writeln!(out, "  \"iterations\": {},", self.iterations);
+        let _ = writeln!(out, "  \"pkey_quota\": {},", self.pkey_quota);
+        let _ = writeln!(out, "  \"scaling\": [");
+        for (i, (bench, variant, measured)) in results.iter().enumerate() {
+            let _ = writeln!(out, "    {{");
+            let _ = writeln!(out, "      \"name\": {},", json_string(&bench.name));
+            let _ = writeln!(
+                out,
+                "      \"variant\": {},",
+                variant.map_or("null".to_string(), |v| json_string(v.name()))
+            );
+            let _ = writeln!(out, "      \"setups\": {{");
+            for (j, (setup, points)) in measured.iter().enumerate() {
+                let _ = writeln!(out, "        {}: [", json_string(setup.name()));
+                let base = points.first().and_then(|(threads, point)| {
+                    let point = point.as_ref().ok()?;
+                    Some(point.runs_per_sec() / *threads as f64)
+                });
+                for (k, (threads, point)) in points.iter().enumerate() {
+                    let _ = write!(out, "          {{\"threads\": {}, ", threads);
+                    match point {
+                        Ok(p) => {
+                            let efficiency = match base {
+                                Some(base) if base > 0.0 => {
+                                    format!("{:.4}", p.runs_per_sec() / *threads as f64 / base)
+                                }
+                                _ => "null".to_string(),
+                            };
+                            let _ = write!(
+                                out,
+                                "\"runs_per_s\": {:.3}, \"efficiency\": {}, \
+                                 \"mprotect_calls\": {}, \"mprotect_bytes\": {}, \
+                                 \"mmap_calls\": {}, \"retags\": {}}}",
+                                p.runs_per_sec(),
+                                efficiency,
+                                p.stats.mprotect_calls,
+                                p.stats.mprotect_bytes,
+                                p.stats.mmap_calls,
+                                p.stats.retags
+                            );
+                        }
+                        Err(e) => {
+                            let _ =
+                                write!(out, "\"failed\": {}}}", json_string(&format!("{:#}", e)));
+                        }
+                    }
+                    out.push_str(if k + 1 < points.len() { ",\n" } else { "\n" });
+                }
+                let sep = if j + 1 < measured.len() { "," } else { "" };
+                let _ = writeln!(out, "        ]{}", sep);
+            }
+            let _ = writeln!(out, "      }}");
+            let sep = if i + 1 < results.len() { "," } else { "" };
+            let _ = writeln!(out, "    }}{}", sep);
+        }
+        let _ = writeln!(out, "  ]");
+        let _ = writeln!(out, "}}");
+        out
+    }
+
+    /// Compiles and times `bench` as `variant`, or returns `None` if the
+    /// suite has no module for it.
+    fn measure(
+        &self,
+        engine: &Engine,
+        variant: Variant,
+        bench: &Bench,
+    ) -> Result<Option<Measurement>> {
+        let wasm = match variant.wasm(&bench.module)? {
+            Some(wasm) => wasm,
+            None => return Ok(None),
+        };
+
+        let start = Instant::now();
+        let module = Module::new(engine, &wasm)?;
+        let compile = start.elapsed();
+        let pre = link(engine, &module, variant != Variant::Stock)?;
+
+        for _ in 0..self.warmup {
+            run_once(engine, &pre, bench)?;
+        }
+        let mut samples = Vec::with_capacity(self.iterations as usize);
+        for _ in 0..self.iterations {
+            samples.push(run_once(engine, &pre, bench)?);
+        }
+        samples.sort();
+        let memory = if self.memory {
+            Some(measure_memory(engine, &pre, bench)?)
+        } else {
+            None
+        };
+        Ok(Some(Measurement {
+            compile,
+            samples,
+            memory,
+        }))
+    }
+
+    /// Renders the results as JSON. Only what is measured goes in, so that
+    /// reports of two commits diff cleanly.
+    fn report(&self, results: &[(&Bench, Vec<(Variant, Option<Measurement>)>)]) -> String {
+        let mut out = String::new();
+        let _ = writeln!(out, "{{");
+        let _ = writeln!(
+            out,
+            "  \"wasmtime\": {},",
+            json_string(env!("CARGO_PKG_VERSION"))
+        );
+        let _ = writeln!(out, "  \"warmup\": {},", self.warmup);
+        let _ = writeln!(out, "  \"iterations\": {},", self.iterations);
+        let _ = writeln!(out, "  \"benchmarks\": [");
+        for (i, (bench, measured)) in results.iter().enumerate() {
+            let _ = writeln!(out, "    {{");
+            let _ = writeln!(out, "      \"name\": {},", json_string(&bench.name));
+            let _ = writeln!(out, "      \"variants\": {{");
+            for (j, (variant, result)) in measured.iter().enumerate() {
+                let _ = write!(out, "        {}: ", json_string(variant.name()));
+                match result {
+                    Some(m) => m.write_json(&mut out),
+                    None => out.push_str("null"),
+                }
+                out.push_str(if j + 1 < measured.len() { ",\n" } else { "\n" });
+            }
+            let _ = writeln!(out, "      }},");
+
+            // Overheads are median ratios against `stock` when both ran,
+            // and peak RSS ratios for memory.
+            write_overhead(&mut out, "overhead", measured, |m| {
+                Some(m.median().as_secs_f64())
+            });
+            if self.memory {
+                out.push_str(",\n");
+                write_overhead(&mut out, "memory_overhead", measured, |m| {
+                    m.memory.as_ref()?.peak_rss.map(|rss| rss as f64)
+                });
+            }
+            out.push('\n');
+            let sep = if i + 1 < results.len() { "," } else { "" };
+            let _ = writeln!(out, "    }}{}", sep);
+        }
+        let _ = writeln!(out, "  ]");
+        let _ = writeln!(out, "}}");
+        out
+    }
+}
+
+/// Links `module` against WASI and, with `pku`, the PKU host modules.
+fn link(engine: &Engine, module: &Module, pku: bool) -> Result<InstancePre<WasiCtx>> {
+    let mut linker = Linker::new(engine);
+    wasmtime_wasi::add_to_linker(&mut linker, |cx| cx)?;
+    if pku {
+        wasmtime::IsolatedMomery::add_to_linker(&mut linker)?;
+    }
+    let mut store = Store::new(engine, WasiCtxBuilder::new().build());
+    linker.instantiate_pre(&mut store, module)
+}
+
+fn instantiate_pre(engine: &Engine, wasm: &[u8]) -> Result<InstancePre<WasiCtx>> {
+    link(engine, &Module::new(engine, wasm)?, true)
+}
+
+/// The host's process-wide PKU counters, read through a throwaway store.
+fn host_counters(engine: &Engine) -> Counters {
+    let host = Store::new(engine, ()).pku_stats().host;
+    Counters {
+        mprotect_calls: host.mprotect_calls,
+        mprotect_bytes: host.mprotect_bytes,
+        mmap_calls: host.mmap_calls,
+        retags: host.retags,
+    }
+}
+
+/// Writes `"key": {...}` with the ratio of `value` to that of `stock` for
+/// every other variant, null where either is missing.
+fn write_overhead(
+    out: &mut String,
+    key: &str,
+    measured: &[(Variant, Option<Measurement>)],
+    value: impl Fn(&Measurement) -> Option<f64>,
+) {
+    let stock = measured
+        .iter()
+        .find(|(variant, _)| *variant == Variant::Stock)
+        .and_then(|(_, m)| value(m.as_ref()?));
+    let _ = write!(out, "      {}: {{", json_string(key));
+    let mut first = true;
+    for (variant, result) in measured {
+        if *variant == Variant::Stock {
+            continue;
+        }
+        let ratio = match (stock, result.as_ref().and_then(&value)) {
+            (Some(stock), Some(v)) if stock > 0.0 => format!("{:.4}", v / stock),
+            _ => "null".to_string(),
+        };
+        let sep = if first { "" } else { ", " };
+        let _ = write!(out, "{}{}: {}", sep, json_string(variant.name()), ratio);
+        first = false;
+    }
+    out.push('}');
+}
+
+/// Instantiates `pre` in `store` and runs `_start` to completion.
+fn start(
+    store: &mut Store<WasiCtx>,
+    pre: &InstancePre<WasiCtx>,
+    bench: &Bench,
+) -> Result<Instance> {
+    let instance = pre.instantiate(&mut *store)?;
+    let func = instance.get_typed_func::<(), (), _>(&mut *store, "_start")?;
+    match func.call(&mut *store, ()) {
+        Ok(()) => Ok(instance),
+        Err(trap) if trap.i32_exit_status() == Some(0) => Ok(instance),
+        Err(trap) => Err(anyhow!(trap)).context(format!(
+            "see `{}` for its output",
+            bench.dir.join(OUTPUT).display()
+        )),
+    }
+}
+
+/// Instantiates `pre` in a fresh store and runs `_start`, returning how long
+/// both took.
+fn run_once(engine: &Engine, pre: &InstancePre<WasiCtx>, bench: &Bench) -> Result<Duration> {
+    let mut store = Store::new(engine, bench.wasi()?);
+    let begin = Instant::now();
+    start(&mut store, pre, bench)?;
+    Ok(begin.elapsed())
+}
+
+/// Runs `bench` once and measures memory while its instance is still
+/// alive, from a peak RSS reset to the RSS before the run.
+fn measure_memory(
+    engine: &Engine,
+    pre: &InstancePre<WasiCtx>,
+    bench: &Bench,
+) -> Result<MemoryUsage> {
+    let mut store = Store::new(engine, bench.wasi()?);
+    // Writing 5 to clear_refs resets VmHWM to the current RSS.
+    let reset = fs::write("/proc/self/clear_refs", "5").is_ok();
+    let start_rss = proc_status_bytes("VmRSS:");
+    let instance = start(&mut store, pre, bench)?;
+    let linear_memory = instance
+        .get_memory(&mut store, "memory")
+        .map_or(0, |memory| memory.data_size(&store) as u64);
+    let domains = store.domain_stats();
+    Ok(MemoryUsage {
+        start_rss,
+        peak_rss: if reset {
+            proc_status_bytes("VmHWM:")
+        } else {
+            None
+        },
+        vmas: fs::read_to_string("/proc/self/maps")
+            .ok()
+            .map(|maps| maps.lines().count()),
+        linear_memory,
+        tagged_bytes: domains.tagged_bytes,
+        footprints: domains.heaps.iter().map(|heap| heap.footprint).collect(),
+    })
+}
+
+/// A `kB` field of /proc/self/status, in bytes.
+fn proc_status_bytes(field: &str) -> Option<u64> {
+    let status = fs::read_to_string("/proc/self/status").ok()?;
+    let line = status.lines().find(|line| line.starts_with(field))?;
+    let kb = line[field.len()..].trim().trim_end_matches("kB").trim();
+    Some(kb.parse::<u64>().ok()? * 1024)
+}
+
+/// The file in the suite's directory that guests' stdout and stderr go to.
+const OUTPUT: &str = "output_wasmtime";
+
+/// A benchmark listed in the suite.
+#[derive(Clone)]
+struct Bench {
+    name: String,
+    dir: PathBuf,
+    module: PathBuf,
+    stdin: Option<String>,
+    args: Vec<String>,
+}
+
+impl Bench {
+    /// A WASI context running the benchmark in its directory.
+    fn wasi(&self) -> Result<WasiCtx> {
+        let dir = Dir::open_ambient_dir(&self.dir, ambient_authority())
+            .with_context(|| format!("failed to open `{}`", self.dir.display()))?;
+        let output = dir
+            .create(OUTPUT)
+            .with_context(|| format!("failed to create `{}`", OUTPUT))?;
+
+        let mut argv = vec![self
+            .module
+            .file_name()
+            .and_then(|name| name.to_str())
+            .unwrap_or("")
+            .to_string()];
+        argv.extend(self.args.iter().cloned());
+        let mut builder = WasiCtxBuilder::new()
+            .args(&argv)?
+            .stdout(Box::new(File::from_cap_std(output.try_clone()?)))
+            .stderr(Box::new(File::from_cap_std(output)));
+        if let Some(stdin) = &self.stdin {
+            let stdin = dir
+                .open(stdin)
+                .with_context(|| format!("failed to open `{}`", stdin))?;
+            builder = builder.stdin(Box::new(File::from_cap_std(stdin)));
+        }
+        Ok(builder.preopened_dir(dir, ".")?.build())
+    }
+}
+
+/// Parses a suite file: one `NAME MODULE STDIN ARGS...` line per benchmark,
+/// with `-` for no stdin, blank lines and `#` comments skipped. Arguments
+/// are split on whitespace.
+fn parse_suite(text: &str, dir: &Path) -> Result<Vec<Bench>> {
+    let mut suite = Vec::new();
+    for (i, line) in text.lines().enumerate() {
+        let line = line.split('#').next().unwrap().trim();
+        if line.is_empty() {
+            continue;
+        }
+        let mut fields = line.split_whitespace();
+        let (name, module, stdin) = match (fields.next(), fields.next(), fields.next()) {
+            (Some(name), Some(module), Some(stdin)) => (name, module, stdin),
+            _ => bail!("line {}: expected `NAME MODULE STDIN ARGS...`", i + 1),
+        };
+        if suite.iter().any(|bench: &Bench| bench.name == name) {
+            bail!("line {}: benchmark `{}` is listed twice", i + 1, name);
+        }
+        suite.push(Bench {
+            name: name.to_string(),
+            dir: dir.to_path_buf(),
+            module: dir.join(module),
+            stdin: (stdin != "-").then(|| stdin.to_string()),
+            args: fields.map(str::to_string).collect(),
+        });
+    }
+    Ok(suite)
+}
+
+/// The configurations every benchmark is compared in.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+enum Variant {
+    Stock,
+    NoDomains,
+    Domains,
+}
+
+impl Variant {
+    const ALL: [Variant; 3] = [Variant::Stock, Variant::NoDomains, Variant::Domains];
+
+    fn name(self) -> &'static str {
+        match self {
+            Variant::Stock => "stock",
+            Variant::NoDomains => "no-domains",
+            Variant::Domains => "domains",
+        }
+    }
+
+    fn parse(s: &str) -> Result<Variant> {
+        Variant::ALL
+            .iter()
+            .copied()
+            .find(|variant| variant.name() == s)
+            .ok_or_else(|| anyhow!("unknown variant `{}`", s))
+    }
+
+    /// The module this variant runs for `module`, if there is one.
+    fn wasm(self, module: &Path) -> Result<Option<Vec<u8>>> {
+        if self == Variant::Domains {
+            let partitioned = module.with_extension("domains.wasm");
+            if partitioned.exists() {
+                return Ok(Some(read_module(&partitioned)?));
+            }
+        }
+        if !module.exists() {
+            return Ok(None);
+        }
+        let wasm = read_module(module)?;
+        match self {
+            Variant::Stock | Variant::NoDomains => Ok(Some(strip_pkuwa_sections(&wasm)?)),
+            Variant::Domains if strip_pkuwa_sections(&wasm)?.len() < wasm.len() => Ok(Some(wasm)),
+            Variant::Domains => Ok(None),
+        }
+    }
+}
+
+/// The engine setups scaling is compared in.
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+enum Setup {
+    OnDemand,
+    Pooling,
+    Prelease,
+    PoolingPrelease,
+}
+
+impl Setup {
+    const ALL: [Setup; 4] = [
+        Setup::OnDemand,
+        Setup::Pooling,
+        Setup::Prelease,
+        Setup::PoolingPrelease,
+    ];
+
+    fn name(self) -> &'static str {
+        match self {
+            Setup::OnDemand => "on-demand",
+            Setup::Pooling => "pooling",
+            Setup::Prelease => "prelease",
+            Setup::PoolingPrelease => "pooling+prelease",
+        }
+    }
+
+    fn parse(s: &str) -> Result<Setup> {
+        Setup::ALL
+            .iter()
+            .copied()
+            .find(|setup| setup.name() == s)
+            .ok_or_else(|| anyhow!("unknown setup `{}`", s))
+    }
+
+    fn pooling(self) -> bool {
+        matches!(self, Setup::Pooling | Setup::PoolingPrelease)
+    }
+
+    fn prelease(self) -> bool {
+        matches!(self, Setup::Prelease | Setup::PoolingPrelease)
+    }
+}
+
+fn read_module(path: &Path) -> Result<Vec<u8>> {
+    wat::parse_file(path).with_context(|| format!("failed to read `{}`", path.display()))
+}
+
+/// Drops the `pkuwa.*` custom sections which place functions and data in
+/// domains, leaving a module that runs entirely in domain 0.
+fn strip_pkuwa_sections(wasm: &[u8]) -> Result<Vec<u8>> {
+    let mut reader = BinaryReader::new(wasm);
+    let mut out = reader.read_bytes(8)?.to_vec();
+    while !reader.eof() {
+        let start = reader.current_position();
+        let id = reader.read_u8()?;
+        let len = reader.read_var_u32()?;
+        let body = reader.read_bytes(len as usize)?;
+        if id == 0 && is_pkuwa_section(CustomSectionReader::new(body, start)?) {
+            continue;
+        }
+        out.extend_from_slice(&wasm[start..reader.current_position()]);
+    }
+    Ok(out)
+}
+
+fn is_pkuwa_section(section: CustomSectionReader) -> bool {
+    section.name().starts_with("pkuwa.")
+}
+
+/// The timings of one benchmark and variant.
+struct Measurement {
+    compile: Duration,
+    /// Timed iterations, sorted.
+    samples: Vec<Duration>,
+    /// The memory of one more run, with `--memory`.
+    memory: Option<MemoryUsage>,
+}
+
+/// Memory of the process at the end of a run, and of the run's store.
+struct MemoryUsage {
+    /// RSS when the run started.
+    start_rss: Option<u64>,
+    /// The most RSS was during the run, `None` where it can't be reset.
+    peak_rss: Option<u64>,
+    /// Lines of /proc/self/maps.
+    vmas: Option<usize>,
+    /// Bytes of the `memory` export.
+    linear_memory: u64,
+    /// Bytes tagged with anything but the default key.
+    tagged_bytes: usize,
+    /// Bytes each domain's heap holds, by domain id, if the guest
+    /// registered its allocator's counters.
+    footprints: Vec<u64>,
+}
+
+impl MemoryUsage {
+    fn write_json(&self, out: &mut String) {
+        let opt = |v: Option<u64>| v.map_or("null".to_string(), |v| v.to_string());
+        let footprints = self
+            .footprints
+            .iter()
+            .map(|f| f.to_string())
+            .collect::<Vec<_>>()
+            .join(", ");
+        let _ = write!(
+            out,
+            "{{\"start_rss\": {}, \"peak_rss\": {}, \"vmas\": {}, \
+             \"linear_memory\": {}, \"tagged_bytes\": {}, \
+             \"domain_footprints\": [{}]}}",
+            opt(self.start_rss),
+            opt(self.peak_rss),
+            opt(self.vmas.map(|n| n as u64)),
+            self.linear_memory,
+            self.tagged_bytes,
+            footprints
+        );
+    }
+}
+
+impl Measurement {
+    fn median(&self) -> Duration {
+        let n = self.samples.len();
+        if n % 2 == 1 {
+            self.samples[n / 2]
+        } else {
+            (self.samples[n / 2 - 1] + self.samples[n / 2]) / 2
+        }
+    }
+
+    /// The nearest-rank `p`th percentile.
+    fn percentile(&self, p: usize) -> Duration {
+        let rank = (p * self.samples.len() + 99) / 100;
+        self.samples[rank.max(1) - 1]
+    }
+
+    fn mean(&self) -> Duration {
+        self.samples.iter().sum::<Duration>() / self.samples.len() as u32
+    }
+
+    /// The sample standard deviation, zero for a single sample.
+    fn stddev(&self) -> Duration {
+        let n = self.samples.len();
+        if n < 2 {
+            return Duration::ZERO;
+        }
+        let mean = self.mean().as_secs_f64();
+        let variance = self
+            .samples
+            .iter()
+            .map(|s| (s.as_secs_f64() - mean).powi(2))
+            .sum::<f64>()
+            / (n - 1) as f64;
+        Duration::from_secs_f64(variance.sqrt())
+    }
+
+    fn write_json(&self, out: &mut String) {
+        let samples = self
+            .samples
+            .iter()
+            .map(|s| format!("{:.3}", ms(*s)))
+            .collect::<Vec<_>>()
+            .join(", ");
+        let _ = write!(
+            out,
+            "{{\"compile_ms\": {:.3}, \"median_ms\": {:.3}, \"p95_ms\": {:.3}, \
+             \"stddev_ms\": {:.3}, \"mean_ms\": {:.3}, \"min_ms\": {:.3}, \
+             \"max_ms\": {:.3}, \"samples_ms\": [{}]",
+            ms(self.compile),
+            ms(self.median()),
+            ms(self.percentile(95)),
+            ms(self.stddev()),
+            ms(self.mean()),
+            ms(self.samples[0]),
+            ms(self.samples[self.samples.len() - 1]),
+            samples
+        );
+        if let Some(memory) = &self.memory {
+            out.push_str(", \"memory\": ");
+            memory.write_json(out);
+        }
+        out.push('}');
+    }
+}
+
+/// A benchmark's scaling runs: the variant it ran as, if it has a module,
+/// and the point of each thread count in each setup.
+type Scaling<'a> = (
+    &'a Bench,
+    Option<Variant>,
+    Vec<(Setup, Vec<(usize, Result<Point>)>)>,
+);
+
+/// One thread count of a scaling run.
+struct Point {
+    /// Timed runs, of all threads together.
+    runs: u64,
+    elapsed: Duration,
+    /// What the host did during the timed runs.
+    stats: Counters,
+}
+
+/// Deltas of the host counters which cost a syscall.
+struct Counters {
+    mprotect_calls: u64,
+    mprotect_bytes: u64,
+    mmap_calls: u64,
+    retags: u64,
+}
+
+impl Counters {
+    fn since(&self, before: &Counters) -> Counters {
+        Counters {
+            mprotect_calls: self.mprotect_calls - before.mprotect_calls,
+            mprotect_bytes: self.mprotect_bytes - before.mprotect_bytes,
+            mmap_calls: self.mmap_calls - before.mmap_calls,
+            retags: self.retags - before.retags,
+        }
+    }
+}
+
+impl Point {
+    fn runs_per_sec(&self) -> f64 {
+        self.runs as f64 / self.elapsed.as_secs_f64()
+    }
+
+    fn per_run(&self, count: u64) -> f64 {
+        count as f64 / self.runs.max(1) as f64
+    }
+}
+
+fn ms(d: Duration) -> f64 {
+    d.as_secs_f64() * 1000.0
+}
+
+fn mib(bytes: impl Into<Option<u64>>) -> f64 {
+    bytes.into().unwrap_or(0) as f64 / (1 << 20) as f64
+}
+
+fn json_string(s: &str) -> String {
+    let mut out = String::from("\"");
+    for c in s.chars() {
+        match c {
+            '"' => out.push_str("\\\""),
+            '\\' => out.push_str("\\\\"),
+            c if (c as u32) < 0x20 => {
+                let _ = write!(out, "\\u{:04x}", c as u32);
+            }
+            c => out.push(c),
+        }
+    }
+    out.push('"');
+    out
+}
@@ -0,0 +1,493 @@
+//! The module that implements the `wasmtime pku-partition` command.
+
+use anyhow::{anyhow, bail, Context, Result};
+use clap::Parser;
+use once_cell::sync::Lazy;
+use std::collections::{BTreeMap, BTreeSet, HashMap};
+use std::fs;
+use std::path::{Path, PathBuf};
+use wasmparser::{
+    BinaryReader, CustomSectionReader, Name, NameSectionReader, Operator, Payload, TypeRef,
+};
+use wasmtime_environ::{domain_pkru, encode_function_domains, FuncIndex};
+
+static AFTER_HELP: Lazy<String> = Lazy::new(|| {
+    "The partitioner assigns every function which already runs in a domain, \
+    is constrained on the command line or shows up in the profile to one of \
+    the domains, so that as few calls as possible cross a domain boundary \
+    and functions run in the domains of the data they access. Other \
+    functions stay unassigned and keep running in their caller's domain.\n\
+    \n\
+    The profile is the report printed by `wasmtime run --pku-profile`.\n\
+    \n\
+    Usage examples:\n\
+    \n\
+    Profiling a module and partitioning it, keeping `parse` on its own:\n\
+    \n  \
+    wasmtime run --pku-profile 1ms app.wasm 2> app.profile\n  \
+    wasmtime pku-partition --profile app.profile --isolate parse app.wasm\n\
+    \n\
+    Pinning a function to a domain and choosing the output:\n\
+    \n  \
+    wasmtime pku-partition --pin alloc=1 -o out.wasm app.wasm\n"
+        .to_string()
+});
+
+/// Assigns a module's functions to protection domains.
+#[derive(Parser)]
+#[structopt(
+    name = "pku-partition",
+    version,
+    after_help = AFTER_HELP.as_str()
+)]
+pub struct PkuPartitionCommand {
+    /// A cross-domain access profile to weigh calls and accesses with
+    #[clap(long, value_name = "PROFILE", parse(from_os_str))]
+    profile: Option<PathBuf>,
+
+    /// Keep a function, by name or index, alone in a domain of its own
+    #[clap(long, value_name = "FUNC", number_of_values = 1)]
+    isolate: Vec<String>,
+
+    /// Keep a function, by name or index, in the given domain
+    #[clap(
+        long,
+        value_name = "FUNC=DOMAIN",
+        number_of_values = 1,
+        parse(try_from_str = parse_pin)
+    )]
+    pin: Vec<(String, u32)>,
+
+    /// The path of the output module; defaults to <MODULE>.domains.wasm
+    #[clap(short = 'o', long, value_name = "OUTPUT", parse(from_os_str))]
+    output: Option<PathBuf>,
+
+    /// The path of the WebAssembly module to partition
+    #[clap(index = 1, value_name = "MODULE", parse(from_os_str))]
+    module: PathBuf,
+}
+
+fn parse_pin(s: &str) -> Result<(String, u32)> {
+    let (func, domain) = s
+        .rsplit_once('=')
+        .ok_or_else(|| anyhow!("must be of the form `func=domain`"))?;
+    let domain = domain.parse()?;
+    if domain_pkru(domain).is_none() {
+        bail!("protection domain {} out of range", domain);
+    }
+    Ok((func.to_string(), domain))
+}
+
+impl PkuPartitionCommand {
+    /// Executes the command.
+    pub fn execute(self) -> Result<()> {
+        let wasm = wat::parse_file(&self.module)?;
+        let module = ModuleInfo::parse(&wasm)
+            .with_context(|| format!("failed to parse `{}`", self.module.display()))?;
+        let mut graph = Graph::default();
+        if let Some(path) = &self.profile {
+            let profile = fs::read_to_string(path)
+                .with_context(|| format!("failed to read `{}`", path.display()))?;
+            graph.add_profile(&module, &profile);
+        }
+
+        let mut fixed = module.layout.clone();
+        for (func, domain) in &self.pin {
+            let index = module.resolve(func)?;
+            if fixed.get(&index).map_or(false, |d| d != domain) {
+                bail!("function `{}` is already placed in another domain", func);
+            }
+            fixed.insert(index, *domain);
+        }
+        let mut isolated = BTreeMap::new();
+        for func in &self.isolate {
+            let index = module.resolve(func)?;
+            isolated.insert(index, fixed.get(&index).copied());
+        }
+
+        let partition = graph.partition(&module, &fixed, &isolated)?;
+        println!(
+            "{} functions in {} domains, crossing cost {} -> {}",
+            partition.assignment.len(),
+            partition.assignment.values().collect::<BTreeSet<_>>().len(),
+            partition.initial_cost,
+            partition.cost
+        );
+        for (index, domain) in &partition.assignment {
+            println!("  domain {:>2}  {}", domain, module.name(*index));
+        }
+
+        // Functions placed by `pkuwa.layout` are already assigned there.
+        let assignment = partition
+            .assignment
+            .iter()
+            .filter(|(index, _)| !module.layout.contains_key(*index))
+            .map(|(index, domain)| (FuncIndex::from_u32(*index), *domain))
+            .collect();
+        let output = self.output.clone().unwrap_or_else(|| {
+            let mut output = self.module.clone();
+            output.set_extension("domains.wasm");
+            output
+        });
+        write_module(&output, &wasm, &encode_function_domains(&assignment))
+    }
+}
+
+/// What the partitioner needs to know about a module.
+#[derive(Default)]
+struct ModuleInfo {
+    imported_funcs: u32,
+    defined_funcs: u32,
+    names: HashMap<u32, String>,
+    /// Direct callees of each defined function, with how often they are
+    /// called from its body.
+    calls: HashMap<u32, BTreeMap<u32, u64>>,
+    /// Functions assigned by `pkuwa.domains`.
+    domains: BTreeMap<u32, u32>,
+    /// Functions assigned by `pkuwa.layout`, which cannot be moved.
+    layout: BTreeMap<u32, u32>,
+}
+
+impl ModuleInfo {
+    fn parse(wasm: &[u8]) -> Result<ModuleInfo> {
+        let mut info = ModuleInfo::default();
+        let mut next_body = None;
+        for payload in wasmparser::Parser::new(0).parse_all(wasm) {
+            match payload? {
+                Payload::ImportSection(imports) => {
+                    for import in imports {
+                        if let TypeRef::Func(_) = import?.ty {
+                            info.imported_funcs += 1;
+                        }
+                    }
+                }
+                Payload::FunctionSection(funcs) => info.defined_funcs = funcs.get_count(),
+                Payload::CodeSectionStart { .. } => next_body = Some(info.imported_funcs),
+                Payload::CodeSectionEntry(body) => {
+                    let index = next_body.expect("code section entry outside code section");
+                    next_body = Some(index + 1);
+                    let calls = info.calls.entry(index).or_default();
+                    let mut reader = body.get_operators_reader()?;
+                    while !reader.eof() {
+                        match reader.read()? {
+                            Operator::Call { function_index }
+                            | Operator::ReturnCall { function_index } => {
+                                *calls.entry(function_index).or_default() += 1;
+                            }
+                            _ => {}
+                        }
+                    }
+                }
+                Payload::CustomSection(s) if s.name() == "name" => {
+                    for name in NameSectionReader::new(s.data(), s.data_offset())? {
+                        if let Name::Function(map) = name? {
+                            let mut map = map.get_map()?;
+                            for _ in 0..map.get_count() {
+                                let naming = map.read()?;
+                                info.names.insert(naming.index, naming.name.to_string());
+                            }
+                        }
+                    }
+                }
+                Payload::CustomSection(s) if s.name() == "pkuwa.domains" => {
+                    let mut reader = BinaryReader::new_with_offset(s.data(), s.data_offset());
+                    for _ in 0..reader.read_var_u32()? {
+                        let index = reader.read_var_u32()?;
+                        info.domains.insert(index, reader.read_var_u32()?);
+                    }
+                }
+                Payload::CustomSection(s) if s.name() == "pkuwa.layout" => {
+                    let mut reader = BinaryReader::new_with_offset(s.data(), s.data_offset());
+                    for _ in 0..reader.read_var_u32()? {
+                        let domain = reader.read_var_u32()?;
+                        for _ in 0..reader.read_var_u32()? {
+                            reader.read_var_u32()?;
+                            reader.read_var_u32()?;
+                        }
+                        for _ in 0..reader.read_var_u32()? {
+                            info.layout.insert(reader.read_var_u32()?, domain);
+                        }
+                    }
+                }
+                _ => {}
+            }
+        }
+        Ok(info)
+    }
+
+    fn is_defined(&self, index: u32) -> bool {
+        index >= self.imported_funcs && index - self.imported_funcs < self.defined_funcs
+    }
+
+    fn name(&self, index: u32) -> String {
+        match self.names.get(&index) {
+            Some(name) => name.clone(),
+            None => format!("<wasm function {}>", index),
+        }
+    }
+
+    /// Find a defined function by its name, the `<wasm function N>` frames
+    /// are printed with, or its index.
+    fn lookup(&self, func: &str) -> Option<u32> {
+        let index = func
+            .strip_prefix("<wasm function ")
+            .and_then(|s| s.strip_suffix('>'))
+            .unwrap_or(func);
+        let index = match index.parse::<u32>() {
+            Ok(index) => Some(index),
+            Err(_) => self
+                .names
+                .iter()
+                .find(|(_, name)| *name == func)
+                .map(|(index, _)| *index),
+        };
+        index.filter(|index| self.is_defined(*index))
+    }
+
+    fn resolve(&self, func: &str) -> Result<u32> {
+        self.lookup(func)
+            .ok_or_else(|| anyhow!("no defined function `{}` in the module", func))
+    }
+}
+
+/// Weights of the calls between functions and of the functions' accesses to
+/// the domains' data, as counted by the profile.
+#[derive(Default)]
+struct Graph {
+    /// Switches a function made into a domain and accesses it made to the
+    /// domain's key.
+    affinity: BTreeMap<u32, BTreeMap<u32, u64>>,
+}
+
+struct Partition {
+    assignment: BTreeMap<u32, u32>,
+    initial_cost: u64,
+    cost: u64,
+}
+
+impl Graph {
+    /// Add up the accesses and switches in a `wasmtime run --pku-profile`
+    /// report. Entries of the host and of other modules are skipped.
+    fn add_profile(&mut self, module: &ModuleInfo, profile: &str) {
+        let mut switches = false;
+        for line in profile.lines() {
+            match line {
+                "cross-domain accesses:" => switches = false,
+                "switches:" => switches = true,
+                _ => {}
+            }
+            let (count, rest) = match line.trim().split_once("  ") {
+                Some((count, rest)) => match count.parse::<u64>() {
+                    Ok(count) => (count, rest),
+                    Err(_) => continue,
+                },
+                None => continue,
+            };
+            let entry = if switches {
+                // `  <count>  <function>  domain <from> -> domain <to>`
+                rest.rsplit_once("  ").and_then(|(func, edge)| {
+                    let (_, to) = edge.split_once(" -> ")?;
+                    Some((func, to.strip_prefix("domain ")?.parse::<u32>().ok()?))
+                })
+            } else {
+                // `  <count>  <function>  key <pkey>  <page>`
+                rest.rsplit_once("  key ").and_then(|(func, key)| {
+                    let (key, _) = key.split_once("  ")?;
+                    Some((func, key.parse::<u32>().ok()?))
+                })
+            };
+            let (func, domain) = match entry {
+                Some((func, domain)) if domain != 0 => (func, domain),
+                _ => continue,
+            };
+            let func = func.split_once('!').map_or(func, |(_, func)| func);
+            if let Some(index) = module.lookup(func) {
+                *self
+                    .affinity
+                    .entry(index)
+                    .or_default()
+                    .entry(domain)
+                    .or_default() += count;
+            }
+        }
+    }
+
+    /// Assign every function which is already placed, constrained or
+    /// profiled to a domain, minimizing the calls between functions in
+    /// different domains and the accesses of functions to other domains.
+    ///
+    /// Functions left unassigned run in their caller's domain, so a call
+    /// through them counts as a call to each placed function they reach.
+    /// Starting from the module's current assignment, functions move to the
+    /// domain which lowers the cost most until none does; this finds a
+    /// local minimum of what is in general a multiway cut problem.
+    fn partition(
+        &self,
+        module: &ModuleInfo,
+        fixed: &BTreeMap<u32, u32>,
+        isolated: &BTreeMap<u32, Option<u32>>,
+    ) -> Result<Partition> {
+        let mut assignment = module.domains.clone();
+        assignment.extend(fixed.iter().map(|(index, domain)| (*index, *domain)));
+        for index in isolated.keys().chain(self.affinity.keys()) {
+            assignment.entry(*index).or_insert(0);
+        }
+        let placed = assignment.keys().copied().collect::<BTreeSet<_>>();
+
+        // Give every isolated function a domain no other function needs.
+        let mut reserved = BTreeSet::new();
+        for (index, pin) in isolated {
+            let shared = |domain: u32| {
+                reserved.contains(&domain)
+                    || fixed
+                        .iter()
+                        .any(|(other, d)| *d == domain && other != index)
+            };
+            let current = pin.unwrap_or(assignment[index]);
+            let domain = if current != 0 && !shared(current) {
+                current
+            } else if pin.is_some() {
+                bail!(
+                    "function `{}` cannot be isolated in domain {}",
+                    module.name(*index),
+                    current
+                );
+            } else {
+                let used = assignment
+                    .values()
+                    .chain(self.affinity.values().flat_map(|domains| domains.keys()))
+                    .copied()
+                    .collect::<BTreeSet<_>>();
+                (1..)
+                    .take_while(|domain| domain_pkru(*domain).is_some())
+                    .find(|domain| !used.contains(domain) && !reserved.contains(domain))
+                    .ok_or_else(|| anyhow!("no protection domain left to isolate functions in"))?
+            };
+            reserved.insert(domain);
+            assignment.insert(*index, domain);
+        }
+
+        let edges = self.edges(module, &placed);
+        let initial_cost = self.cost(&edges, &assignment);
+        let movable = placed
+            .iter()
+            .filter(|index| !fixed.contains_key(*index) && !isolated.contains_key(*index))
+            .copied()
+            .collect::<Vec<_>>();
+        for index in &movable {
+            if reserved.contains(&assignment[index]) {
+                assignment.insert(*index, 0);
+            }
+        }
+        let mut candidates = assignment
+            .values()
+            .chain(self.affinity.values().flat_map(|domains| domains.keys()))
+            .copied()
+            .filter(|domain| !reserved.contains(domain))
+            .collect::<BTreeSet<_>>();
+        candidates.insert(0);
+
+        loop {
+            let mut moved = false;
+            for index in &movable {
+                let current = assignment[index];
+                let crossing = |domain: u32| -> u64 {
+                    let calls = edges.get(index).into_iter().flatten();
+                    let calls = calls
+                        .filter(|(other, _)| assignment[other] != domain)
+                        .map(|(_, weight)| weight);
+                    let accesses = self.affinity.get(index).into_iter().flatten();
+                    let accesses = accesses
+                        .filter(|(d, _)| **d != domain)
+                        .map(|(_, weight)| weight);
+                    calls.chain(accesses).sum()
+                };
+                let mut best = (crossing(current), current);
+                for domain in &candidates {
+                    let cost = crossing(*domain);
+                    if cost < best.0 {
+                        best = (cost, *domain);
+                    }
+                }
+                if best.1 != current {
+                    assignment.insert(*index, best.1);
+                    moved = true;
+                }
+            }
+            if !moved {
+                break;
+            }
+        }
+
+        let cost = self.cost(&edges, &assignment);
+        Ok(Partition {
+            assignment,
+            initial_cost,
+            cost,
+        })
+    }
+
+    /// The calls between placed functions, in both directions, including
+    /// those made through unassigned functions.
+    fn edges(&self, module: &ModuleInfo, placed: &BTreeSet<u32>) -> HashMap<u32, Vec<(u32, u64)>> {
+        let mut weights = BTreeMap::<(u32, u32), u64>::new();
+        for caller in placed {
+            let mut stack = vec![(*caller, 1u64)];
+            let mut visited = BTreeSet::new();
+            while let Some((func, count)) = stack.pop() {
+                for (callee, calls) in module.calls.get(&func).into_iter().flatten() {
+                    if callee == caller || !module.is_defined(*callee) {
+                        continue;
+                    }
+                    let count = count.saturating_mul(*calls);
+                    if placed.contains(callee) {
+                        let key = (*caller.min(callee), *caller.max(callee));
+                        *weights.entry(key).or_default() += count;
+                    } else if visited.insert(*callee) {
+                        stack.push((*callee, count));
+                    }
+                }
+            }
+        }
+        let mut edges = HashMap::<u32, Vec<(u32, u64)>>::new();
+        for ((a, b), weight) in weights {
+            edges.entry(a).or_default().push((b, weight));
+            edges.entry(b).or_default().push((a, weight));
+        }
+        edges
+    }
+
+    fn cost(&self, edges: &HashMap<u32, Vec<(u32, u64)>>, assignment: &BTreeMap<u32, u32>) -> u64 {
+        let calls = edges
+            .iter()
+            .flat_map(|(a, calls)| calls.iter().map(move |(b, weight)| (a, b, weight)))
+            .filter(|(a, b, _)| a < b && assignment[*a] != assignment[*b])
+            .map(|(_, _, weight)| weight);
+        let accesses = self
+            .affinity
+            .iter()
+            .flat_map(|(index, domains)| domains.iter().map(move |d| (index, d)))
+            .filter(|(index, (domain, _))| assignment[*index] != **domain)
+            .map(|(_, (_, weight))| weight);
+        calls.chain(accesses).sum()
+    }
+}
+
+/// Write `wasm` to `output` with its `pkuwa.domains` sections replaced by
+/// `section`.
+fn write_module(output: &Path, wasm: &[u8], section: &[u8]) -> Result<()> {
+    let mut reader = BinaryReader::new(wasm);
+    let mut out = reader.read_bytes(8)?.to_vec();
+    while !reader.eof() {
+        let start = reader.current_position();
+        let id = reader.read_u8()?;
+        let len = reader.read_var_u32()?;
+        let body = reader.read_bytes(len as usize)?;
+        if id == 0 && CustomSectionReader::new(body, start)?.name() == "pkuwa.domains" {
+            continue;
+        }
+        out.extend_from_slice(&wasm[start..reader.current_position()]);
+    }
+    out.extend_from_slice(section);
+    fs::write(output, out).with_context(|| format!("failed to write `{}`", output.display()))
+}
@@ -25,7 +25,13 @@ use wasmtime_wasi_crypto::WasiCryptoCtx;
 fn parse_module(s: &OsStr) -> anyhow::Result<PathBuf> {
     // Do not accept wasmtime subcommand names as the module name
     match s.to_str() {
-        Some("help") | Some("config") | Some("run") | Some("wast") | Some("compile") => {
+        Some("help")
+        | Some("config")
+        | Some("run")
+        | Some("wast")
+        | Some("compile")
+        | Some("pku-bench")
+        | Some("pku-partition") => {
             bail!("module name cannot be the same as a subcommand")
         }
         _ => Ok(s.into()),
@@ -139,6 +145,21 @@ pub struct RunCommand {
     )]
     preloads: Vec<(String, PathBuf)>,
 
+    /// Sample which functions access which domain's memory every TIME of
+    /// CPU time (1ms, 100us, etc), and print the hot spots and switches
+    /// per call edge at exit
+    #[clap(
+        long = "pku-profile",
+        value_name = "TIME",
+        parse(try_from_str = parse_dur),
+    )]
+    pku_profile: Option<Duration>,
+
+    /// Count domain switches, protection changes and mappings, and print
+    /// a summary at exit
+    #[clap(long = "pku-stats")]
+    pku_stats: bool,
+
     /// Maximum execution time of wasm code before timing out (1, 2s, 100ms, etc)
     #[clap(
         long = "wasm-timeout",
@@ -162,6 +183,8 @@ impl RunCommand {
         if self.wasm_timeout.is_some() {
             config.epoch_interruption(true);
         }
+        config.pku_profile(self.pku_profile);
+        config.pku_stats(self.pku_stats);
         let engine = Engine::new(&config)?;
         let mut store = Store::new(&engine, Host::default());
 
@@ -205,10 +228,19 @@ impl RunCommand {
         }
 
         // Load the main wasm module.
-        match self
+        let result = self
             .load_main_module(&mut store, &mut linker)
-            .with_context(|| format!("failed to run main module `{}`", self.module.display()))
-        {
+            .with_context(|| format!("failed to run main module `{}`", self.module.display()));
+        if self.pku_profile.is_some() {
+            eprint!("{}", store.pku_profile());
+        }
+        if self.pku_stats {
+            eprint!("{}", store.pku_stats());
+        }
+        if self.common.pku_domain_time {
+            eprint!("{}", store.pku_domain_times());
+        }
+        match result {
             Ok(()) => (),
             Err(e) => {
                 // If the program exited because of a non-zero exit status, print
@@ -464,6 +496,7 @@ fn populate_with_wasi(
 ) -> Result<()> {
     if wasi_modules.wasi_common {
         wasmtime_wasi::add_to_linker(linker, |host| host.wasi.as_mut().unwrap())?;
+        wasmtime::IsolatedMomery::add_to_linker(linker)?;
 
         let mut builder = WasiCtxBuilder::new();
         builder = builder.inherit_stdio().args(argv)?.envs(vars)?;
@@ -397,3 +397,166 @@ fn run_cwasm() -> Result<()> {
     assert_eq!(stdout, "");
     Ok(())
 }
+
+#[test]
+fn pku_partition() -> Result<()> {
+    let td = TempDir::new()?;
+    let output = td.path().join("out.wasm");
+    let stdout = run_wasmtime(&[
+        "pku-partition",
+        "--pin",
+        "alloc=1",
+        "--isolate",
+        "parse",
+        "-o",
+        output.to_str().unwrap(),
+        "tests/all/cli_tests/pku-partition.wat",
+    ])?;
+    assert_eq!(
+        stdout,
+        "2 functions in 2 domains, crossing cost 2 -> 2\n  \
+         domain  1  alloc\n  \
+         domain  2  parse\n"
+    );
+
+    // `helper` mostly touches domain 1's data, so it should follow `alloc`.
+    let mut profile = NamedTempFile::new()?;
+    writeln!(profile, "cross-domain accesses:")?;
+    writeln!(profile, "         5  main!helper  key 1  page 3")?;
+    writeln!(profile, "switches:")?;
+    let stdout = run_wasmtime(&[
+        "pku-partition",
+        "--profile",
+        profile.path().to_str().unwrap(),
+        "--pin",
+        "alloc=1",
+        "--isolate",
+        "parse",
+        "-o",
+        output.to_str().unwrap(),
+        "tests/all/cli_tests/pku-partition.wat",
+    ])?;
+    assert_eq!(
+        stdout,
+        "3 functions in 2 domains, crossing cost 8 -> 1\n  \
+         domain  1  alloc\n  \
+         domain  2  parse\n  \
+         domain  1  helper\n"
+    );
+    wasmtime::Module::from_file(&wasmtime::Engine::default(), &output)?;
+    Ok(())
+}
+
+#[test]
+fn pku_bench() -> Result<()> {
+    let td = TempDir::new()?;
+    let suite = td.path().join("suite.txt");
+    let module = std::env::current_dir()?.join("tests/all/cli_tests/hello_wasi_snapshot1.wat");
+    std::fs::write(
+        &suite,
+        format!("# a single benchmark\nhello  {}  -\n", module.display()),
+    )?;
+    let stdout = run_wasmtime(&[
+        "pku-bench",
+        "--warmup",
+        "1",
+        "--iterations",
+        "3",
+        suite.to_str().unwrap(),
+    ])?;
+    assert!(stdout.contains("\"name\": \"hello\""), "{}", stdout);
+    assert!(stdout.contains("\"stock\": {\"compile_ms\""), "{}", stdout);
+    assert!(
+        stdout.contains("\"no-domains\": {\"compile_ms\""),
+        "{}",
+        stdout
+    );
+    assert!(stdout.contains("\"domains\": null"), "{}", stdout);
+    assert_eq!(
+        std::fs::read_to_string(td.path().join("output_wasmtime"))?,
+        "Hello, world!\n"
+    );
+    Ok(())
+}
+
+#[test]
+fn pku_bench_memory() -> Result<()> {
+    let td = TempDir::new()?;
+    let suite = td.path().join("suite.txt");
+    let module = std::env::current_dir()?.join("tests/all/cli_tests/hello_wasi_snapshot1.wat");
+    std::fs::write(&suite, format!("hello  {}  -\n", module.display()))?;
+    let stdout = run_wasmtime(&[
+        "pku-bench",
+        "--warmup",
+        "0",
+        "--iterations",
+        "1",
+        "--variant",
+        "stock",
+        "--variant",
+        "no-domains",
+        "--memory",
+        suite.to_str().unwrap(),
+    ])?;
+    assert!(
+        stdout.contains("\"memory\": {\"start_rss\": "),
+        "{}",
+        stdout
+    );
+    assert!(stdout.contains("\"linear_memory\": 65536"), "{}", stdout);
+    assert!(
+        stdout.contains("\"memory_overhead\": {\"no-domains\": "),
+        "{}",
+        stdout
+    );
+    Ok(())
+}
+
+#[test]
+fn pku_bench_threads() -> Result<()> {
+    let td = TempDir::new()?;
+    let suite = td.path().join("suite.txt");
+    let module = std::env::current_dir()?.join("tests/all/cli_tests/hello_wasi_snapshot1.wat");
+    std::fs::write(&suite, format!("hello  {}  -\n", module.display()))?;
+    let stdout = run_wasmtime(&[
+        "pku-bench",
+        "--warmup",
+        "0",
+        "--iterations",
+        "2",
+        "--threads",
+        "1,2",
+        "--setup",
+        "on-demand",
+        "--setup",
+        "pooling",
+        suite.to_str().unwrap(),
+    ])?;
+    assert!(stdout.contains("\"variant\": \"no-domains\""), "{}", stdout);
+    assert!(stdout.contains("\"on-demand\": ["), "{}", stdout);
+    assert!(stdout.contains("\"pooling\": ["), "{}", stdout);
+    assert!(!stdout.contains("\"prelease\""), "{}", stdout);
+    assert!(
+        stdout.contains("{\"threads\": 2, \"runs_per_s\": "),
+        "{}",
+        stdout
+    );
+    Ok(())
+}
+
+#[test]
+fn pku_domain_time() -> Result<()> {
+    let output = run_wasmtime_for_output(&[
+        "run",
+        "--disable-cache",
+        "--pku-domain-time",
+        "tests/all/cli_tests/hello_wasi_snapshot1.wat",
+    ])?;
+    assert!(output.status.success());
+    assert_eq!(output.stdout, b"Hello, world!\n");
+    // `_start` is called once and never switches on its own.
+    let stderr = String::from_utf8_lossy(&output.stderr);
+    assert!(stderr.starts_with("time per domain:\n"), "{}", stderr);
+    assert_eq!(stderr.matches(", 1 entries").count(), 1, "{}", stderr);
+    Ok(())
+}
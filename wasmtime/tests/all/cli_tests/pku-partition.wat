@@ -0,0 +1,6 @@
+(module
+    (func $alloc)
+    (func $parse (call $helper))
+    (func $helper (call $alloc) (call $alloc))
+    (func $main (export "main") (call $parse) (call $helper))
+)
@@ -66,3 +66,14 @@ pub(crate) fn skip_pooling_allocator_tests() -> bool {
     // - https://github.com/bytecodealliance/wasmtime/pull/2518#issuecomment-747280133
     std::env::var("WASMTIME_TEST_NO_HOG_MEMORY").is_ok()
 }
+
+/// A helper determining whether the protection key tests should be skipped,
+/// on hosts without protection keys. Skipped tests would pass without
+/// checking anything, so say so.
+pub(crate) fn skip_pku_tests() -> bool {
+    if wasmtime_runtime::Pku::supported() {
+        return false;
+    }
+    eprintln!("skipping: the host has no protection keys");
+    true
+}
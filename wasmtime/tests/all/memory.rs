@@ -1,3 +1,4 @@
+use super::skip_pku_tests;
 use anyhow::Result;
 use rayon::prelude::*;
 use wasmtime::*;
@@ -425,6 +426,65 @@ fn dynamic_extra_growth_unchanged_pointer() -> Result<()> {
     Ok(())
 }
 
+#[test]
+fn pku_non_moving_memories_unchanged_pointer() -> Result<()> {
+    let mut config = Config::new();
+    config.static_memory_maximum_size(0);
+    config.dynamic_memory_reserved_for_growth(0);
+    config.pku_non_moving_memories(true);
+    let engine = Engine::new(&config)?;
+    let mut store = Store::new(&engine, ());
+
+    let module = Module::new(&engine, r#"(module (memory (export "mem") 1 100))"#)?;
+    let instance = Instance::new(&mut store, &module, &[])?;
+    let mem = instance.get_memory(&mut store, "mem").unwrap();
+    let ptr = mem.data_ptr(&store);
+    for _ in 0..99 {
+        mem.grow(&mut store, 1)?;
+        assert_eq!(ptr, mem.data_ptr(&store));
+    }
+    assert!(mem.grow(&mut store, 1).is_err());
+
+    let mem = Memory::new(&mut store, MemoryType::new(1, None))?;
+    let ptr = mem.data_ptr(&store);
+    mem.grow(&mut store, 1000)?;
+    assert_eq!(ptr, mem.data_ptr(&store));
+    Ok(())
+}
+
+#[test]
+fn pku_protect_domain_survives_grow() -> Result<()> {
+    if skip_pku_tests() {
+        return Ok(());
+    }
+    let mut config = Config::new();
+    config.static_memory_maximum_size(0);
+    config.dynamic_memory_reserved_for_growth(0);
+    let engine = Engine::new(&config)?;
+    let mut store = Store::new(&engine, ());
+    let domain = store.create_domain()?;
+
+    let module = Module::new(&engine, r#"(module (memory (export "mem") 1))"#)?;
+    let instance = Instance::new(&mut store, &module, &[])?;
+    let mem = instance.get_memory(&mut store, "mem").unwrap();
+    let page = 65536;
+    assert!(mem.protect_domain(&mut store, 0..2 * page, domain).is_err());
+    assert!(mem.protect_domain(&mut store, 1..page, domain).is_err());
+    mem.protect_domain(&mut store, 0..page, domain)?;
+
+    let ptr = mem.data_ptr(&store);
+    mem.grow(&mut store, 1)?;
+    assert_ne!(ptr, mem.data_ptr(&store));
+    let stats = store.domain_stats();
+    assert_eq!(stats.domains, 1);
+    assert_eq!(stats.ranges, 1);
+    assert_eq!(stats.tagged_bytes, page);
+
+    mem.protect_domain(&mut store, 0..page, Domain::ROOT)?;
+    assert_eq!(store.domain_stats().tagged_bytes, 0);
+    Ok(())
+}
+
 // This test exercises trying to create memories of the maximum 64-bit memory
 // size of `1 << 48` pages. This should always fail but in the process of
 // determining this failure we shouldn't hit any overflows or anything like that
@@ -467,3 +527,259 @@ fn memory64_maximum_minimum() -> Result<()> {
 
     Ok(())
 }
+
+#[test]
+fn pku_domains_outnumber_keys() -> Result<()> {
+    if skip_pku_tests() {
+        return Ok(());
+    }
+    let engine = Engine::default();
+    let module = Module::new(
+        &engine,
+        r#"(module
+            (memory (export "mem") 1)
+            (func (export "load") (result i32) i32.const 0 i32.load))"#,
+    )?;
+    // Far more domains than the host has keys, which stores share.
+    let mut stores = Vec::new();
+    for _ in 0..40 {
+        let mut store = Store::new(&engine, ());
+        let domain = store.create_domain()?;
+        let instance = Instance::new(&mut store, &module, &[])?;
+        let mem = instance.get_memory(&mut store, "mem").unwrap();
+        mem.protect_domain(&mut store, 0..65536, domain)?;
+        assert_eq!(store.domain_pkey(domain), domain.pkey());
+        stores.push((store, instance));
+    }
+    for (store, instance) in stores.iter_mut() {
+        let load = instance.get_typed_func::<(), i32, _>(&mut *store, "load")?;
+        assert_eq!(load.call(&mut *store, ())?, 0);
+    }
+    Ok(())
+}
+
+#[test]
+fn pku_memories_section_dedicates_memory() -> Result<()> {
+    if skip_pku_tests() {
+        return Ok(());
+    }
+    let mut config = Config::new();
+    config.wasm_multi_memory(true);
+    let engine = Engine::new(&config)?;
+    let mut store = Store::new(&engine, ());
+    // Memory 1 belongs to domain 13 as a whole, including pages it grows.
+    let module = Module::new(
+        &engine,
+        r#"(module
+            (memory 1)
+            (memory $d 1 4)
+            (func (export "grow") (result i32) i32.const 1 memory.grow $d)
+            (func (export "poke") (param i32) (result i32)
+                local.get 0 i32.const 7 i32.store $d
+                local.get 0 i32.load $d)
+            (@custom "pkuwa.memories" "\01\01\0d"))"#,
+    )?;
+    let instance = Instance::new(&mut store, &module, &[])?;
+    let grow = instance.get_typed_func::<(), i32, _>(&mut store, "grow")?;
+    let poke = instance.get_typed_func::<i32, i32, _>(&mut store, "poke")?;
+    assert_eq!(grow.call(&mut store, ())?, 1);
+    assert_eq!(poke.call(&mut store, 65536)?, 7);
+    Ok(())
+}
+
+#[test]
+fn pku_layout_section_tags_on_instantiation() -> Result<()> {
+    if skip_pku_tests() {
+        return Ok(());
+    }
+    let engine = Engine::default();
+    let mut store = Store::new(&engine, ());
+    // Domain 15 owns two adjacent pages, which are tagged as one range.
+    let module = Module::new(
+        &engine,
+        r#"(module
+            (memory 1)
+            (@custom "pkuwa.layout" "\01\0f\02\00\80\20\80\20\80\20\00"))"#,
+    )?;
+    Instance::new(&mut store, &module, &[])?;
+    let stats = store.domain_stats();
+    assert_eq!(stats.ranges, 1);
+    assert_eq!(stats.tagged_bytes, 8192);
+
+    // Ranges must lie within the initial memory.
+    let module = Module::new(
+        &engine,
+        r#"(module
+            (memory 1)
+            (@custom "pkuwa.layout" "\01\0f\01\80\80\04\80\20\00"))"#,
+    )?;
+    assert!(Instance::new(&mut store, &module, &[]).is_err());
+    Ok(())
+}
+
+#[test]
+fn pku_data_segment_placed_in_domain() -> Result<()> {
+    if skip_pku_tests() {
+        return Ok(());
+    }
+    let engine = Engine::default();
+    let mut store = Store::new(&engine, ());
+    // What clang emits for `__attribute__((section(".pku.d14")))` data: a
+    // segment named after the section, which lands on pages of its own.
+    let module = Module::new(
+        &engine,
+        r#"(module
+            (memory 2)
+            (data $.pku.d14 (i32.const 65536) "secret"))"#,
+    )?;
+    Instance::new(&mut store, &module, &[])?;
+    let stats = store.domain_stats();
+    assert_eq!(stats.ranges, 1);
+    assert_eq!(stats.tagged_bytes, 4096);
+    Ok(())
+}
+
+#[test]
+fn pku_domain_layout_snapshot() -> Result<()> {
+    if skip_pku_tests() {
+        return Ok(());
+    }
+    let engine = Engine::default();
+    let mut store = Store::new(&engine, ());
+    let module = Module::new(
+        &engine,
+        r#"(module
+            (memory 2)
+            (data $.pku.d14 (i32.const 65536) "secret"))"#,
+    )?;
+    let instance = Instance::new(&mut store, &module, &[])?;
+    let section = instance.domain_layout(&mut store)?;
+    assert_eq!(
+        section,
+        b"\x00\x16\x0cpkuwa.layout\x01\x0e\x01\x80\x80\x04\x80\x20\x00"
+    );
+
+    // A snapshot without the named segment gets the same layout from the
+    // section alone.
+    let mut snapshot = wat::parse_str("(module (memory 2))")?;
+    snapshot.extend(section);
+    let mut store = Store::new(&engine, ());
+    Instance::new(&mut store, &Module::new(&engine, &snapshot)?, &[])?;
+    let stats = store.domain_stats();
+    assert_eq!(stats.ranges, 1);
+    assert_eq!(stats.tagged_bytes, 4096);
+    Ok(())
+}
+
+#[test]
+fn pku_domain_export_restores_pkru_after_trap() -> Result<()> {
+    if skip_pku_tests() {
+        return Ok(());
+    }
+    let engine = Engine::default();
+    let mut store = Store::new(&engine, ());
+    // `inside` and `trap` belong to domain 7. The `rdpkru` import compiles
+    // to an inline read, so its host definition is never called.
+    let module = Module::new(
+        &engine,
+        r#"(module
+            (import "pkuwa" "rdpkru" (func $rdpkru (result i32)))
+            (func (export "root") (result i32) call $rdpkru)
+            (func (export "trap") unreachable)
+            (func (export "inside") (result i32) call $rdpkru)
+            (@custom "pkuwa.domains" "\02\02\07\03\07"))"#,
+    )?;
+    let rdpkru = Func::wrap(&mut store, || 0i32);
+    let instance = Instance::new(&mut store, &module, &[rdpkru.into()])?;
+    let root = instance.get_typed_func::<(), i32, _>(&mut store, "root")?;
+    let inside = instance.get_typed_func::<(), i32, _>(&mut store, "inside")?;
+    let trap = instance.get_typed_func::<(), (), _>(&mut store, "trap")?;
+
+    let caller = root.call(&mut store, ())?;
+    assert_ne!(inside.call(&mut store, ())?, caller);
+    assert_eq!(root.call(&mut store, ())?, caller);
+
+    // The trap skips the callee's epilogue, so only the host restores PKRU.
+    assert!(trap.call(&mut store, ()).is_err());
+    assert_eq!(root.call(&mut store, ())?, caller);
+    let trap = instance.get_func(&mut store, "trap").unwrap();
+    assert!(trap.call(&mut store, &[], &mut []).is_err());
+    assert_eq!(root.call(&mut store, ())?, caller);
+    Ok(())
+}
+
+#[test]
+fn pku_trap_after_guest_switch_restores_pkru() -> Result<()> {
+    if skip_pku_tests() {
+        return Ok(());
+    }
+    let engine = Engine::default();
+    let mut store = Store::new(&engine, ());
+    // `switch` write-disables every key but 0 itself, which no default PKRU
+    // does, and traps before switching back, with no domain entered by the
+    // host to restore.
+    let module = Module::new(
+        &engine,
+        r#"(module
+            (import "pkuwa" "rdpkru" (func $rdpkru (result i32)))
+            (import "pkuwa" "wrpkru" (func $wrpkru (param i32) (result i32)))
+            (func (export "root") (result i32) call $rdpkru)
+            (func (export "switch")
+                (drop (call $wrpkru (i32.const 0xfffffffc)))
+                unreachable))"#,
+    )?;
+    let rdpkru = Func::wrap(&mut store, || 0i32);
+    let wrpkru = Func::wrap(&mut store, |_: i32| 0i32);
+    let instance = Instance::new(&mut store, &module, &[rdpkru.into(), wrpkru.into()])?;
+    let root = instance.get_typed_func::<(), i32, _>(&mut store, "root")?;
+    let switch = instance.get_typed_func::<(), (), _>(&mut store, "switch")?;
+
+    let caller = root.call(&mut store, ())?;
+    assert!(switch.call(&mut store, ()).is_err());
+    assert_eq!(root.call(&mut store, ())?, caller);
+    Ok(())
+}
+
+#[test]
+fn pku_fault_traps_after_profiler_stops() -> Result<()> {
+    // The profiler only samples on x86_64.
+    if !cfg!(target_arch = "x86_64") || skip_pku_tests() {
+        return Ok(());
+    }
+    // `spin` runs with every key open and makes no access, so the samples
+    // taken while it runs are never answered by a fault. `peek` then runs
+    // with exactly the word those samples closed the keys with and reads
+    // the page of domain 15.
+    let wat = r#"(module
+        (import "pkuwa" "wrpkru" (func $wrpkru (param i32) (result i32)))
+        (memory 1)
+        (func (export "spin") (param i32)
+            (drop (call $wrpkru (i32.const 0)))
+            (loop
+                (br_if 0 (local.tee 0 (i32.sub (local.get 0) (i32.const 1))))))
+        (func (export "peek") (result i32)
+            (drop (call $wrpkru (i32.const 0x55555554)))
+            (i32.load (i32.const 4096)))
+        (@custom "pkuwa.layout" "\01\0f\01\80\20\80\20\00"))"#;
+    {
+        let mut config = Config::new();
+        config.pku_profile(Some(std::time::Duration::from_micros(100)));
+        let engine = Engine::new(&config)?;
+        let mut store = Store::new(&engine, ());
+        let wrpkru = Func::wrap(&mut store, |_: i32| 0i32);
+        let module = Module::new(&engine, wat)?;
+        let instance = Instance::new(&mut store, &module, &[wrpkru.into()])?;
+        let spin = instance.get_typed_func::<i32, (), _>(&mut store, "spin")?;
+        spin.call(&mut store, 100_000_000)?;
+    }
+
+    // The profiler stopped with its engine, so the access is a violation.
+    let engine = Engine::default();
+    let mut store = Store::new(&engine, ());
+    let wrpkru = Func::wrap(&mut store, |_: i32| 0i32);
+    let module = Module::new(&engine, wat)?;
+    let instance = Instance::new(&mut store, &module, &[wrpkru.into()])?;
+    let peek = instance.get_typed_func::<(), i32, _>(&mut store, "peek")?;
+    assert!(peek.call(&mut store, ()).is_err());
+    Ok(())
+}
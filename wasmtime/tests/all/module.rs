@@ -168,3 +168,124 @@ fn serialize_not_overly_massive() -> Result<()> {
 
     Ok(())
 }
+
+#[test]
+fn rejects_malformed_pkuwa_domains() -> Result<()> {
+    let engine = Engine::default();
+    let bad = [
+        // Function 1 doesn't exist.
+        r#"(module (func) (@custom "pkuwa.domains" "\01\01\01"))"#,
+        // Function 0 is imported.
+        r#"(module (import "m" "f" (func)) (func)
+            (@custom "pkuwa.domains" "\01\00\01"))"#,
+        // Function 0 is assigned twice.
+        r#"(module (func) (@custom "pkuwa.domains" "\02\00\01\00\02"))"#,
+        // Truncated pair.
+        r#"(module (func) (@custom "pkuwa.domains" "\01\00"))"#,
+        // Trailing bytes.
+        r#"(module (func) (@custom "pkuwa.domains" "\00\00"))"#,
+        // Domain 16 has no protection key.
+        r#"(module (memory 1) (@custom "pkuwa.layout" "\01\10\00\00"))"#,
+        // A range starting inside a page.
+        r#"(module (memory 1) (@custom "pkuwa.layout" "\01\01\01\10\80\20\00"))"#,
+        // A range ending inside a page.
+        r#"(module (memory 1) (@custom "pkuwa.layout" "\01\01\01\00\10\00"))"#,
+        // Ranges without a memory.
+        r#"(module (@custom "pkuwa.layout" "\01\01\01\00\80\20\00"))"#,
+        // Domains 1 and 2 both claim the second page.
+        r#"(module (memory 1)
+            (@custom "pkuwa.layout" "\02\01\01\00\80\40\00\02\01\80\20\80\20\00"))"#,
+        // Function 0 in two domains across both sections.
+        r#"(module (func)
+            (@custom "pkuwa.domains" "\01\00\01")
+            (@custom "pkuwa.layout" "\01\02\00\01\00"))"#,
+        // The first memory stays in domain 0.
+        r#"(module (memory 1) (@custom "pkuwa.memories" "\01\00\01"))"#,
+        // Memory 1 doesn't exist.
+        r#"(module (memory 1) (@custom "pkuwa.memories" "\01\01\01"))"#,
+        // Data placed in a domain has to start on a page.
+        r#"(module (memory 1) (data $.pku.d2 (i32.const 16) "x"))"#,
+        // Its last page holds another segment.
+        r#"(module (memory 1)
+            (data $.pku.d2 (i32.const 4096) "x")
+            (data (i32.const 4112) "y"))"#,
+    ];
+    for wat in bad {
+        assert!(Module::new(&engine, wat).is_err(), "accepted {}", wat);
+    }
+    Ok(())
+}
+
+#[test]
+fn rejects_mistyped_pkru_intrinsics() -> Result<()> {
+    let engine = Engine::default();
+    let bad = [
+        r#"(module (import "pkuwa" "rdpkru" (func (param i32) (result i32))))"#,
+        r#"(module (import "pkuwa" "wrpkru" (func (param i32))))"#,
+    ];
+    for wat in bad {
+        assert!(Module::new(&engine, wat).is_err(), "accepted {}", wat);
+    }
+    // Other names in the module are ordinary imports.
+    Module::new(&engine, r#"(module (import "pkuwa" "other" (func)))"#)?;
+    Ok(())
+}
+
+#[test]
+fn rejects_switch_domain_without_a_key() -> Result<()> {
+    let engine = Engine::default();
+    // `(module (func switch_domain 16))`. Operators under the 0xf1 prefix
+    // are reported at their subopcode, 0xf0 at offset 0x18 here.
+    let wasm = [
+        0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00, 0x01, 0x04, 0x01, 0x60, 0x00, 0x00, 0x03,
+        0x02, 0x01, 0x00, 0x0a, 0x07, 0x01, 0x05, 0x00, 0xf1, 0xf0, 0x10, 0x0b,
+    ];
+    let err = Module::validate(&engine, &wasm).unwrap_err();
+    assert!(
+        format!("{:?}", err).contains("domain index out of bounds (at offset 0x18)"),
+        "bad error: {:?}",
+        err
+    );
+    assert!(Module::new(&engine, &wasm).is_err());
+    // Domain 15 is the last key. AArch64 has only 8, which compilation
+    // rejects rather than validation.
+    if cfg!(target_arch = "x86_64") {
+        Module::new(&engine, "(module (func switch_domain 15))")?;
+    }
+    Ok(())
+}
+
+#[test]
+fn pku_mode_off_compiles_isolation_away() -> Result<()> {
+    let mut config = Config::new();
+    config.pku_mode(PkuMode::Off);
+    let engine = Engine::new(&config)?;
+    let module = Module::new(
+        &engine,
+        r#"(module
+            (import "pkuwa" "rdpkru" (func $rdpkru (result i32)))
+            (import "pkuwa" "wrpkru" (func $wrpkru (param i32) (result i32)))
+            (memory 1)
+            (func (export "run") (result i32)
+                (drop (call $wrpkru (i32.const 12)))
+                (i32.store (i32.const 0x1000) (i32.const 1))
+                (call $rdpkru))
+            (@custom "pkuwa.domains" "\01\02\01")
+            (@custom "pkuwa.layout" "\01\02\01\80\20\80\20\00"))"#,
+    )?;
+    let mut linker = Linker::new(&engine);
+    IsolatedMomery::add_to_linker(&mut linker)?;
+    let mut store = Store::new(&engine, ());
+    let instance = linker.instantiate(&mut store, &module)?;
+    assert_eq!(store.domain_stats().ranges, 0);
+    let run = instance.get_typed_func::<(), i32, _>(&mut store, "run")?;
+    assert_eq!(run.call(&mut store, ())?, 0);
+
+    // Modules without isolation don't load where it is on, which needs
+    // protection keys.
+    match Engine::new(Config::new().pku_mode(PkuMode::On)) {
+        Ok(on) => assert!(unsafe { Module::deserialize(&on, module.serialize()?) }.is_err()),
+        Err(e) => assert!(e.to_string().contains("no protection keys"), "{}", e),
+    }
+    Ok(())
+}
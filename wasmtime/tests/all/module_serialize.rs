@@ -1,3 +1,4 @@
+use super::skip_pku_tests;
 use anyhow::{bail, Result};
 use std::fs;
 use wasmtime::*;
@@ -103,3 +104,23 @@ fn test_deserialize_from_file() -> Result<()> {
         Ok(())
     }
 }
+
+#[test]
+fn test_domain_layout_survives_serialization() -> Result<()> {
+    if skip_pku_tests() {
+        return Ok(());
+    }
+    let mut store = Store::<()>::default();
+    // Domain 15 owns two touching pages, merged at compile time.
+    let buffer = serialize(
+        store.engine(),
+        r#"(module
+            (memory 1)
+            (@custom "pkuwa.layout" "\01\0f\02\80\20\80\20\00\80\20\00"))"#,
+    )?;
+    unsafe { deserialize_and_instantiate(&mut store, &buffer)? };
+    let stats = store.domain_stats();
+    assert_eq!(stats.ranges, 1);
+    assert_eq!(stats.tagged_bytes, 8192);
+    Ok(())
+}
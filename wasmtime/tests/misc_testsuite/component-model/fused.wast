@@ -546,6 +546,63 @@
   (instance $c2 (instantiate $c2 (with "r" (func $c1 "r"))))
 )
 
+;; lists of plain numbers are copied in bulk
+(component
+  (component $c1
+    (core module $m
+      (memory (export "memory") 1)
+      (func (export "realloc") (param i32 i32 i32 i32) (result i32)
+        (if (i32.ne (local.get 0) (i32.const 0)) (unreachable))
+        (if (i32.ne (local.get 1) (i32.const 0)) (unreachable))
+        (if (i32.ne (local.get 2) (i32.const 4)) (unreachable))
+        (if (i32.ne (local.get 3) (i32.const 12)) (unreachable))
+        i32.const 1000
+      )
+      (func (export "sum") (param i32 i32) (result i32)
+        (if (i32.ne (local.get 0) (i32.const 1000)) (unreachable))
+        (if (i32.ne (local.get 1) (i32.const 3)) (unreachable))
+        (i32.add
+          (i32.add
+            (i32.load offset=0 (i32.const 1000))
+            (i32.load offset=4 (i32.const 1000)))
+          (i32.load offset=8 (i32.const 1000)))
+      )
+    )
+    (core instance $m (instantiate $m))
+    (func (export "sum") (param (list u32)) (result u32)
+      (canon lift (core func $m "sum") (memory $m "memory")
+        (realloc (func $m "realloc")))
+    )
+  )
+  (component $c2
+    (import "sum" (func $sum (param (list u32)) (result u32)))
+    (core module $libc (memory (export "memory") 1))
+    (core instance $libc (instantiate $libc))
+    (core func $sum (canon lower (func $sum) (memory $libc "memory")))
+
+    (core module $m
+      (import "" "sum" (func $sum (param i32 i32) (result i32)))
+      (import "libc" "memory" (memory 1))
+      (func $start
+        (i32.store offset=0 (i32.const 8) (i32.const 1))
+        (i32.store offset=4 (i32.const 8) (i32.const 20))
+        (i32.store offset=8 (i32.const 8) (i32.const 300))
+        (if (i32.ne (call $sum (i32.const 8) (i32.const 3)) (i32.const 321))
+          (unreachable))
+      )
+      (start $start)
+    )
+    (core instance (instantiate $m
+      (with "libc" (instance $libc))
+      (with "" (instance
+        (export "sum" (func $sum))
+      ))
+    ))
+  )
+  (instance $c1 (instantiate $c1))
+  (instance $c2 (instantiate $c2 (with "sum" (func $c1 "sum"))))
+)
+
 ;; callee retptr misaligned
 (assert_trap
   (component